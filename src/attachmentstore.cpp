@@ -0,0 +1,232 @@
+#include "attachmentstore.h"
+#include "database.h"
+#include "securememory.h"
+#include <QtEndian>
+#include <QDebug>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <sqlite3.h>
+
+namespace {
+const int NONCE_SIZE = 12;
+const char TABLE[] = "attachments";
+const char COLUMN[] = "data";
+
+// Keys are never reused across attachments, so the chunk index alone is a safe nonce
+QByteArray nonce(qint64 chunk)
+{
+    QByteArray iv(NONCE_SIZE, 0);
+    qToBigEndian<quint64>(quint64(chunk), iv.data() + NONCE_SIZE - 8);
+    return iv;
+}
+
+const unsigned char *bytes(const QByteArray &data)
+{
+    return reinterpret_cast<const unsigned char *>(data.constData());
+}
+
+sqlite3_blob *openBlob(sqlite3 *db, qint64 rowId, bool writable, qint64 expectedSize)
+{
+    sqlite3_blob *blob = nullptr;
+    if (sqlite3_blob_open(db, "main", TABLE, COLUMN, rowId, writable ? 1 : 0, &blob) != SQLITE_OK) {
+        qWarning() << "Failed to open attachment blob:" << sqlite3_errmsg(db);
+        sqlite3_blob_close(blob);
+        return nullptr;
+    }
+    
+    if (sqlite3_blob_bytes(blob) != expectedSize) {
+        qWarning() << "Attachment blob has" << sqlite3_blob_bytes(blob) << "bytes, expected" << expectedSize;
+        sqlite3_blob_close(blob);
+        return nullptr;
+    }
+    
+    return blob;
+}
+}
+
+qint64 AttachmentStore::chunkCount(qint64 size)
+{
+    return qMax<qint64>(1, (size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+}
+
+qint64 AttachmentStore::storedSize(qint64 size)
+{
+    return size + chunkCount(size) * TAG_SIZE;
+}
+
+QByteArray AttachmentStore::generateKey()
+{
+    QByteArray key(KEY_SIZE, 0);
+    if (RAND_bytes(reinterpret_cast<unsigned char*>(key.data()), KEY_SIZE) != 1) {
+        qWarning() << "Failed to generate attachment key";
+        return QByteArray();
+    }
+    return key;
+}
+
+bool AttachmentStore::write(sqlite3 *db, qint64 rowId, const QByteArray &key, QIODevice &input, qint64 size)
+{
+    if (size < 0 || size > MAX_ATTACHMENT_SIZE || key.size() != KEY_SIZE) {
+        return false;
+    }
+    
+    sqlite3_blob *blob = openBlob(db, rowId, true, storedSize(size));
+    if (!blob) {
+        return false;
+    }
+    
+    // The plaintext chunk lives in locked memory; only sealed bytes reach the page cache
+    SecretBuffer plaintext(CHUNK_SIZE);
+    QByteArray sealed(CHUNK_SIZE + TAG_SIZE, Qt::Uninitialized);
+    const qint64 chunks = chunkCount(size);
+    bool ok = !plaintext.isEmpty();
+    
+    for (qint64 chunk = 0; ok && chunk < chunks; ++chunk) {
+        const int length = int(qMin(qint64(CHUNK_SIZE), size - chunk * CHUNK_SIZE));
+        const int offset = int(chunk * (CHUNK_SIZE + TAG_SIZE));
+        
+        if (length > 0 && input.read(plaintext.data(), length) != length) {
+            qWarning() << "Attachment source ended early:" << input.errorString();
+            ok = false;
+        } else if (!sealChunk(key, chunk, chunk == chunks - 1, plaintext.constData(), length, sealed.data())) {
+            ok = false;
+        } else if (sqlite3_blob_write(blob, sealed.constData(), length + TAG_SIZE, offset) != SQLITE_OK) {
+            qWarning() << "Failed to write attachment chunk:" << sqlite3_errmsg(db);
+            ok = false;
+        }
+    }
+    
+    sqlite3_blob_close(blob);
+    return ok;
+}
+
+bool AttachmentStore::read(sqlite3 *db, qint64 rowId, const QByteArray &key, qint64 size, QIODevice &output)
+{
+    if (size < 0 || size > MAX_ATTACHMENT_SIZE || key.size() != KEY_SIZE) {
+        return false;
+    }
+    
+    sqlite3_blob *blob = openBlob(db, rowId, false, storedSize(size));
+    if (!blob) {
+        return false;
+    }
+    
+    SecretBuffer plaintext(CHUNK_SIZE);
+    QByteArray sealed(CHUNK_SIZE + TAG_SIZE, Qt::Uninitialized);
+    const qint64 chunks = chunkCount(size);
+    bool ok = !plaintext.isEmpty();
+    
+    for (qint64 chunk = 0; ok && chunk < chunks; ++chunk) {
+        const int length = int(qMin(qint64(CHUNK_SIZE), size - chunk * CHUNK_SIZE));
+        const int offset = int(chunk * (CHUNK_SIZE + TAG_SIZE));
+        
+        if (sqlite3_blob_read(blob, sealed.data(), length + TAG_SIZE, offset) != SQLITE_OK) {
+            qWarning() << "Failed to read attachment chunk:" << sqlite3_errmsg(db);
+            ok = false;
+        } else if (!openChunk(key, chunk, chunk == chunks - 1, sealed.constData(), length, plaintext.data())) {
+            qWarning() << "Attachment chunk" << chunk << "failed authentication";
+            ok = false;
+        } else if (length > 0 && output.write(plaintext.constData(), length) != length) {
+            qWarning() << "Failed to write attachment:" << output.errorString();
+            ok = false;
+        }
+    }
+    
+    sqlite3_blob_close(blob);
+    return ok;
+}
+
+bool AttachmentStore::copy(sqlite3 *sourceDb, qint64 sourceRowId, sqlite3 *db, qint64 rowId, qint64 size)
+{
+    if (size < 0 || size > MAX_ATTACHMENT_SIZE) {
+        return false;
+    }
+    
+    sqlite3_blob *source = openBlob(sourceDb, sourceRowId, false, storedSize(size));
+    if (!source) {
+        return false;
+    }
+    sqlite3_blob *target = openBlob(db, rowId, true, storedSize(size));
+    if (!target) {
+        sqlite3_blob_close(source);
+        return false;
+    }
+    
+    // Same layout on both sides, so the chunks are moved as they are
+    QByteArray sealed(CHUNK_SIZE + TAG_SIZE, Qt::Uninitialized);
+    const qint64 total = storedSize(size);
+    bool ok = true;
+    
+    for (qint64 offset = 0; ok && offset < total; offset += sealed.size()) {
+        const int length = int(qMin(qint64(sealed.size()), total - offset));
+        
+        if (sqlite3_blob_read(source, sealed.data(), length, int(offset)) != SQLITE_OK) {
+            qWarning() << "Failed to read attachment chunk:" << sqlite3_errmsg(sourceDb);
+            ok = false;
+        } else if (sqlite3_blob_write(target, sealed.constData(), length, int(offset)) != SQLITE_OK) {
+            qWarning() << "Failed to write attachment chunk:" << sqlite3_errmsg(db);
+            ok = false;
+        }
+    }
+    
+    sqlite3_blob_close(target);
+    sqlite3_blob_close(source);
+    return ok;
+}
+
+bool AttachmentStore::sealChunk(const QByteArray &key, qint64 chunk, bool final,
+                                const char *plaintext, int length, char *output)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        return false;
+    }
+    
+    const QByteArray iv = nonce(chunk);
+    const unsigned char aad = final ? 1 : 0;
+    unsigned char *out = reinterpret_cast<unsigned char *>(output);
+    int len = 0;
+    int finalLen = 0;
+    bool ok = EVP_EncryptInit_ex(ctx, Database::gcmCipher(), nullptr, nullptr, nullptr) == 1 &&
+              EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, NONCE_SIZE, nullptr) == 1 &&
+              EVP_EncryptInit_ex(ctx, nullptr, nullptr, bytes(key), bytes(iv)) == 1 &&
+              EVP_EncryptUpdate(ctx, nullptr, &len, &aad, 1) == 1 &&
+              EVP_EncryptUpdate(ctx, out, &len, reinterpret_cast<const unsigned char *>(plaintext), length) == 1 &&
+              EVP_EncryptFinal_ex(ctx, out + len, &finalLen) == 1 &&
+              EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TAG_SIZE, out + len + finalLen) == 1;
+    
+    EVP_CIPHER_CTX_free(ctx);
+    return ok;
+}
+
+bool AttachmentStore::openChunk(const QByteArray &key, qint64 chunk, bool final,
+                                const char *sealed, int length, char *plaintext)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        return false;
+    }
+    
+    const QByteArray iv = nonce(chunk);
+    const unsigned char aad = final ? 1 : 0;
+    unsigned char *out = reinterpret_cast<unsigned char *>(plaintext);
+    void *tag = const_cast<char *>(sealed + length);
+    int len = 0;
+    int finalLen = 0;
+    bool ok = EVP_DecryptInit_ex(ctx, Database::gcmCipher(), nullptr, nullptr, nullptr) == 1 &&
+              EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, NONCE_SIZE, nullptr) == 1 &&
+              EVP_DecryptInit_ex(ctx, nullptr, nullptr, bytes(key), bytes(iv)) == 1 &&
+              EVP_DecryptUpdate(ctx, nullptr, &len, &aad, 1) == 1 &&
+              EVP_DecryptUpdate(ctx, out, &len, reinterpret_cast<const unsigned char *>(sealed), length) == 1 &&
+              EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_SIZE, tag) == 1 &&
+              EVP_DecryptFinal_ex(ctx, out + len, &finalLen) == 1;
+    
+    EVP_CIPHER_CTX_free(ctx);
+    
+    // Nothing from a forged chunk may leave this function
+    if (!ok) {
+        OPENSSL_cleanse(plaintext, size_t(length));
+    }
+    return ok;
+}
@@ -0,0 +1,57 @@
+#ifndef ATTACHMENTSTORE_H
+#define ATTACHMENTSTORE_H
+
+#include <QString>
+#include <QByteArray>
+#include <QIODevice>
+
+struct sqlite3;
+
+// Decrypted listing row of one attachment; the content is only ever streamed
+struct AttachmentInfo
+{
+    qint64 id = -1;
+    int passwordId = -1;
+    QString name;
+    qint64 size = 0;
+};
+
+// Chunked encryption of attachment content, read and written in place through
+// SQLite's incremental blob I/O. The data column is created as a zeroblob of
+// storedSize() bytes and filled one CHUNK_SIZE chunk at a time, so memory stays
+// at one chunk whatever the file size. Every attachment has its own random key;
+// chunk n is sealed with AES-256-GCM under nonce n and a final-chunk flag, so
+// chunks cannot be reordered, and a truncated blob fails on its last chunk.
+class AttachmentStore
+{
+public:
+    static const int CHUNK_SIZE = 64 * 1024;
+    static const int TAG_SIZE = 16;
+    static const int KEY_SIZE = 32;
+    static const qint64 MAX_ATTACHMENT_SIZE = 512LL * 1024 * 1024; // keeps blobs under SQLITE_MAX_LENGTH
+    
+    // An empty file still has one (empty) chunk carrying the final flag
+    static qint64 chunkCount(qint64 size);
+    static qint64 storedSize(qint64 size);
+    static QByteArray generateKey();
+    
+    // Encrypts size bytes of input into the data column of row rowId, which must
+    // already hold storedSize(size) bytes; call inside the write transaction
+    static bool write(sqlite3 *db, qint64 rowId, const QByteArray &key, QIODevice &input, qint64 size);
+    
+    // Decrypts row rowId into output; false as soon as a chunk fails to authenticate,
+    // so callers must discard what was written
+    static bool read(sqlite3 *db, qint64 rowId, const QByteArray &key, qint64 size, QIODevice &output);
+    
+    // Copies the sealed content of sourceRowId in sourceDb into row rowId of db, which
+    // must already hold storedSize(size) bytes; nothing is decrypted on the way
+    static bool copy(sqlite3 *sourceDb, qint64 sourceRowId, sqlite3 *db, qint64 rowId, qint64 size);
+
+private:
+    static bool sealChunk(const QByteArray &key, qint64 chunk, bool final,
+                          const char *plaintext, int length, char *output);
+    static bool openChunk(const QByteArray &key, qint64 chunk, bool final,
+                          const char *sealed, int length, char *plaintext);
+};
+
+#endif // ATTACHMENTSTORE_H
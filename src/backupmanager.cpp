@@ -0,0 +1,233 @@
+#include "backupmanager.h"
+#include "connectionpool.h"
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QSettings>
+#include <QFileInfo>
+#include <QFile>
+#include <QDir>
+#include <QThread>
+#include <QtConcurrent>
+#include <QDebug>
+#include <atomic>
+#include <sqlite3.h>
+
+namespace {
+const char *ENABLED_SETTING = "backup/enabled";
+const char *INTERVAL_SETTING = "backup/intervalHours";
+const char *KEEP_SETTING = "backup/keep";
+
+const QString BACKUP_PREFIX = QStringLiteral("passwords-");
+const QString BACKUP_SUFFIX = QStringLiteral(".db");
+const QString PARTIAL_SUFFIX = QStringLiteral(".part");
+
+std::atomic<int> snapshotCounter(0);
+}
+
+BackupManager::BackupManager(const QString &databasePath, QObject *parent)
+    : QObject(parent)
+    , path(databasePath)
+    , watcher(new QFutureWatcher<QString>(this))
+    , scheduleTimer(new QTimer(this))
+{
+    // Snapshots are sequential and keep their connection on one thread
+    backupThread.setMaxThreadCount(1);
+    
+    scheduleTimer->setInterval(CHECK_INTERVAL_MS);
+    connect(scheduleTimer, &QTimer::timeout, this, &BackupManager::checkSchedule);
+    connect(watcher, &QFutureWatcher<QString>::finished, this, &BackupManager::snapshotFinished);
+}
+
+BackupManager::~BackupManager()
+{
+    // A snapshot in progress finishes; the vault is never left half-copied under its final name
+    backupThread.waitForDone();
+}
+
+bool BackupManager::isEnabled()
+{
+    return QSettings().value(ENABLED_SETTING, true).toBool();
+}
+
+void BackupManager::setEnabled(bool enabled)
+{
+    QSettings().setValue(ENABLED_SETTING, enabled);
+}
+
+int BackupManager::intervalHours()
+{
+    int hours = QSettings().value(INTERVAL_SETTING, DEFAULT_INTERVAL_HOURS).toInt();
+    return hours > 0 ? hours : DEFAULT_INTERVAL_HOURS;
+}
+
+int BackupManager::keepCount()
+{
+    int keep = QSettings().value(KEEP_SETTING, DEFAULT_KEEP_COUNT).toInt();
+    return keep > 0 ? keep : DEFAULT_KEEP_COUNT;
+}
+
+QString BackupManager::backupDirectory() const
+{
+    return QFileInfo(path).absolutePath() + "/backups";
+}
+
+QDateTime BackupManager::lastBackupTime() const
+{
+    QDir dir(backupDirectory());
+    const QStringList backups = dir.entryList({BACKUP_PREFIX + "*" + BACKUP_SUFFIX}, QDir::Files, QDir::Name);
+    if (backups.isEmpty()) {
+        return QDateTime();
+    }
+    
+    return QFileInfo(dir.filePath(backups.last())).lastModified();
+}
+
+void BackupManager::start()
+{
+    scheduleTimer->start();
+    checkSchedule();
+}
+
+bool BackupManager::backupNow()
+{
+    if (watcher->isRunning()) {
+        return false;
+    }
+    
+    QString databasePath = path;
+    QString directory = backupDirectory();
+    watcher->setFuture(QtConcurrent::run(&backupThread, [databasePath, directory]() {
+        return createSnapshot(databasePath, directory);
+    }));
+    return true;
+}
+
+void BackupManager::checkSchedule()
+{
+    if (!isEnabled() || watcher->isRunning()) {
+        return;
+    }
+    
+    QDateTime last = lastBackupTime();
+    if (!last.isValid() || last.secsTo(QDateTime::currentDateTime()) >= qint64(intervalHours()) * 3600) {
+        backupNow();
+    }
+}
+
+void BackupManager::snapshotFinished()
+{
+    QString snapshot = watcher->result();
+    if (snapshot.isEmpty()) {
+        emit backupFinished(false, QString());
+        return;
+    }
+    
+    prune(backupDirectory(), keepCount());
+    emit backupFinished(true, snapshot);
+}
+
+QString BackupManager::createSnapshot(const QString &databasePath, const QString &directory)
+{
+    if (!QDir().mkpath(directory)) {
+        qWarning() << "Failed to create backup directory:" << directory;
+        return QString();
+    }
+    
+    // UTC timestamps sort by name and do not collide across DST changes
+    QString target = QDir(directory).filePath(BACKUP_PREFIX +
+        QDateTime::currentDateTimeUtc().toString("yyyyMMdd-HHmmss") + BACKUP_SUFFIX);
+    QString partial = target + PARTIAL_SUFFIX;
+    QFile::remove(partial);
+    
+    QString connectionName = QStringLiteral("PasswordManager-backup-%1").arg(snapshotCounter.fetch_add(1));
+    bool success = false;
+    {
+        QSqlDatabase source = QSqlDatabase::addDatabase("QSQLITE", connectionName);
+        source.setDatabaseName(databasePath);
+        source.setConnectOptions("QSQLITE_OPEN_READONLY;QSQLITE_BUSY_TIMEOUT=5000");
+        
+        sqlite3 *sourceHandle = nullptr;
+        if (!source.open()) {
+            qWarning() << "Failed to open database for backup:" << source.lastError().text();
+        } else {
+            sourceHandle = ConnectionPool::nativeHandle(source);
+            if (!sourceHandle) {
+                qWarning() << "Online backup unavailable";
+            }
+        }
+        
+        // An open read transaction pins one WAL snapshot: commits made while the
+        // copy runs neither block on it nor force the backup to start over
+        if (sourceHandle && source.transaction()) {
+            QSqlQuery pin(source);
+            pin.exec("SELECT count(*) FROM sqlite_master");
+            pin.finish();
+            
+            sqlite3 *destination = nullptr;
+            if (sqlite3_open_v2(partial.toUtf8().constData(), &destination,
+                                SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK) {
+                qWarning() << "Failed to create backup file:" << sqlite3_errmsg(destination);
+            } else if (sqlite3_backup *backup = sqlite3_backup_init(destination, "main", sourceHandle, "main")) {
+                int rc;
+                do {
+                    rc = sqlite3_backup_step(backup, PAGES_PER_STEP);
+                    if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+                        sqlite3_sleep(BUSY_RETRY_MS);
+                    }
+                } while (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED);
+                
+                int pages = sqlite3_backup_pagecount(backup);
+                sqlite3_backup_finish(backup);
+                
+                if (rc == SQLITE_DONE) {
+                    success = true;
+                    qDebug() << "Backup copied" << pages << "pages to" << target;
+                } else {
+                    qWarning() << "Backup failed:" << sqlite3_errstr(rc);
+                }
+            } else {
+                qWarning() << "Failed to start backup:" << sqlite3_errmsg(destination);
+            }
+            
+            // The snapshot carries the WAL header flag; store it as a self-contained file
+            if (success && sqlite3_exec(destination, "PRAGMA journal_mode=DELETE", nullptr, nullptr, nullptr) != SQLITE_OK) {
+                qWarning() << "Failed to finalize backup:" << sqlite3_errmsg(destination);
+                success = false;
+            }
+            sqlite3_close(destination);
+            source.rollback();
+        }
+        source.close();
+    }
+    QSqlDatabase::removeDatabase(connectionName);
+    
+    if (!success) {
+        QFile::remove(partial);
+        return QString();
+    }
+    
+    // Entries are encrypted, but names and metadata are not for everyone to read
+    QFile::setPermissions(partial, QFile::ReadOwner | QFile::WriteOwner);
+    if (!QFile::rename(partial, target)) {
+        qWarning() << "Failed to move backup into place:" << target;
+        QFile::remove(partial);
+        return QString();
+    }
+    
+    return target;
+}
+
+void BackupManager::prune(const QString &directory, int keep)
+{
+    QDir dir(directory);
+    QStringList backups = dir.entryList({BACKUP_PREFIX + "*" + BACKUP_SUFFIX}, QDir::Files, QDir::Name);
+    
+    // Oldest first, since names carry the timestamp
+    while (backups.size() > keep) {
+        QString oldest = backups.takeFirst();
+        if (!dir.remove(oldest)) {
+            qWarning() << "Failed to remove old backup:" << oldest;
+        }
+    }
+}
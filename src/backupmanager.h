@@ -0,0 +1,65 @@
+#ifndef BACKUPMANAGER_H
+#define BACKUPMANAGER_H
+
+#include <QObject>
+#include <QString>
+#include <QDateTime>
+#include <QThreadPool>
+#include <QFutureWatcher>
+#include <QTimer>
+
+// Consistent snapshots of the vault taken with the SQLite online backup API.
+// Pages are copied in small batches on a dedicated thread from a read-only
+// connection that pins one WAL snapshot, so writers are never blocked and the
+// copy never restarts. Snapshots are written next to the vault in backups/,
+// renamed into place only when complete, and pruned to a retention count.
+class BackupManager : public QObject
+{
+    Q_OBJECT
+
+public:
+    static const int DEFAULT_INTERVAL_HOURS = 24;
+    static const int DEFAULT_KEEP_COUNT = 7;
+    
+    explicit BackupManager(const QString &databasePath, QObject *parent = nullptr);
+    ~BackupManager();
+    
+    // Scheduled snapshots, persisted in QSettings
+    static bool isEnabled();
+    static void setEnabled(bool enabled);
+    static int intervalHours();
+    static int keepCount();
+    
+    QString backupDirectory() const;
+    QDateTime lastBackupTime() const;
+    bool isRunning() const { return watcher->isRunning(); }
+    
+    // Starts the schedule; a snapshot is taken right away if the last one is overdue
+    void start();
+
+public slots:
+    // Returns false if a snapshot is already being written
+    bool backupNow();
+
+signals:
+    void backupFinished(bool success, const QString &path);
+
+private slots:
+    void checkSchedule();
+    void snapshotFinished();
+
+private:
+    static QString createSnapshot(const QString &databasePath, const QString &directory);
+    static void prune(const QString &directory, int keep);
+    
+    static const int PAGES_PER_STEP = 256;      // 1 MiB with the default 4 KiB pages
+    static const int BUSY_RETRY_MS = 50;
+    static const int CHECK_INTERVAL_MS = 60 * 60 * 1000;
+    
+    QString path;
+    QThreadPool backupThread;
+    QFutureWatcher<QString> *watcher;
+    QTimer *scheduleTimer;
+};
+
+#endif // BACKUPMANAGER_H
@@ -0,0 +1,136 @@
+#include "blindindex.h"
+#include <QMessageAuthenticationCode>
+#include <QRegularExpression>
+#include <QSet>
+
+namespace {
+const char EXACT_TOKEN = 'E';
+const char PREFIX_TOKEN = 'P';
+const char TRIGRAM_TOKEN = 'T';
+
+QStringList words(const QString &normalized)
+{
+    static const QRegularExpression separators(QStringLiteral("[^\\w]+"));
+    return normalized.split(separators, Qt::SkipEmptyParts);
+}
+}
+
+QByteArray BlindIndex::deriveKey(const QByteArray &masterKey)
+{
+    // Separate key so index tokens never reuse the encryption key directly
+    return QMessageAuthenticationCode::hash(QByteArrayLiteral("PasswordManager blind index v1"),
+                                            masterKey, QCryptographicHash::Sha256);
+}
+
+QList<QByteArray> BlindIndex::entryTokens(const QByteArray &key, const QString &name, const QString &url, const QString &username)
+{
+    QList<QByteArray> tokens;
+    tokens.append(exactToken(key, NameField, name));
+    tokens.append(exactToken(key, UrlField, url));
+    tokens.append(exactToken(key, UsernameField, username));
+    
+    appendFieldTokens(key, name, tokens);
+    appendFieldTokens(key, url, tokens);
+    appendFieldTokens(key, username, tokens);
+    
+    // Fields often share trigrams (name is usually derived from url)
+    QList<QByteArray> unique;
+    QSet<QByteArray> seen;
+    for (const QByteArray &token : tokens) {
+        if (!seen.contains(token)) {
+            seen.insert(token);
+            unique.append(token);
+        }
+    }
+    return unique;
+}
+
+QList<QByteArray> BlindIndex::searchTokens(const QByteArray &key, const QString &search)
+{
+    QList<QByteArray> tokens;
+    QString normalized = normalize(search);
+    
+    if (normalized.isEmpty()) {
+        return tokens;
+    }
+    
+    if (normalized.size() <= MAX_PREFIX_LENGTH) {
+        tokens.append(token(key, PREFIX_TOKEN, normalized));
+        return tokens;
+    }
+    
+    // Only the part of the query that can overlap indexed text is tokenized
+    QString indexed = normalized.left(MAX_INDEXED_LENGTH);
+    QSet<QString> seen;
+    for (int i = 0; i + 3 <= indexed.size(); ++i) {
+        QString trigram = indexed.mid(i, 3);
+        if (!seen.contains(trigram)) {
+            seen.insert(trigram);
+            tokens.append(token(key, TRIGRAM_TOKEN, trigram));
+        }
+    }
+    return tokens;
+}
+
+QByteArray BlindIndex::exactToken(const QByteArray &key, Field field, const QString &value)
+{
+    return token(key, EXACT_TOKEN, QString::number(field) + QLatin1Char(':') + normalize(value));
+}
+
+bool BlindIndex::matches(const QString &search, const QString &name, const QString &url, const QString &username)
+{
+    QString normalized = normalize(search);
+    if (normalized.isEmpty()) {
+        return true;
+    }
+    
+    const QStringList fields = {normalize(name), normalize(url), normalize(username)};
+    
+    if (normalized.size() <= MAX_PREFIX_LENGTH) {
+        for (const QString &field : fields) {
+            for (const QString &word : words(field)) {
+                if (word.startsWith(normalized)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    
+    for (const QString &field : fields) {
+        if (field.contains(normalized)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+QString BlindIndex::normalize(const QString &text)
+{
+    return text.trimmed().toCaseFolded();
+}
+
+QByteArray BlindIndex::token(const QByteArray &key, char kind, const QString &value)
+{
+    QByteArray message;
+    message.append(kind);
+    message.append(value.toUtf8());
+    
+    return QMessageAuthenticationCode::hash(message, key, QCryptographicHash::Sha256).left(TOKEN_SIZE);
+}
+
+void BlindIndex::appendFieldTokens(const QByteArray &key, const QString &value, QList<QByteArray> &tokens)
+{
+    QString normalized = normalize(value);
+    
+    for (const QString &word : words(normalized)) {
+        for (int length = 1; length <= MAX_PREFIX_LENGTH && length <= word.size(); ++length) {
+            tokens.append(token(key, PREFIX_TOKEN, word.left(length)));
+        }
+    }
+    
+    QString indexed = normalized.left(MAX_INDEXED_LENGTH);
+    for (int i = 0; i + 3 <= indexed.size(); ++i) {
+        tokens.append(token(key, TRIGRAM_TOKEN, indexed.mid(i, 3)));
+    }
+}
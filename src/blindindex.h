@@ -0,0 +1,42 @@
+#ifndef BLINDINDEX_H
+#define BLINDINDEX_H
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QList>
+
+// Keyed search tokens for encrypted metadata. Tokens are truncated HMACs of
+// normalized text, so the database can match them without seeing plaintext.
+class BlindIndex
+{
+public:
+    enum Field {
+        NameField = 0,
+        UrlField = 1,
+        UsernameField = 2
+    };
+    
+    static const int TOKEN_SIZE = 16;
+    static const int MAX_PREFIX_LENGTH = 2;   // longer queries are matched by trigrams
+    static const int MAX_INDEXED_LENGTH = 64; // trigrams are only built from the start of long fields
+    
+    static QByteArray deriveKey(const QByteArray &masterKey);
+    
+    // Every token stored for an entry: exact per field, word prefixes and trigrams
+    static QList<QByteArray> entryTokens(const QByteArray &key, const QString &name, const QString &url, const QString &username);
+    
+    // Tokens that must all be present for an entry to match the search text
+    static QList<QByteArray> searchTokens(const QByteArray &key, const QString &search);
+    static QByteArray exactToken(const QByteArray &key, Field field, const QString &value);
+    
+    // Plaintext check applied after decryption, since trigrams can over-match
+    static bool matches(const QString &search, const QString &name, const QString &url, const QString &username);
+
+private:
+    static QString normalize(const QString &text);
+    static QByteArray token(const QByteArray &key, char kind, const QString &value);
+    static void appendFieldTokens(const QByteArray &key, const QString &value, QList<QByteArray> &tokens);
+};
+
+#endif // BLINDINDEX_H
@@ -0,0 +1,73 @@
+#include "changemonitor.h"
+#include <QFileInfo>
+#include <QFile>
+#include <QDebug>
+
+ChangeMonitor::ChangeMonitor(Database *db, QObject *parent)
+    : QObject(parent)
+    , db(db)
+    , watcher(new QFileSystemWatcher(this))
+    , debounceTimer(new QTimer(this))
+    , pollTimer(new QTimer(this))
+    , lastDataVersion(-1)
+{
+    // A commit touches the WAL, shared-memory and sometimes the main file; handle it once
+    debounceTimer->setSingleShot(true);
+    debounceTimer->setInterval(DEBOUNCE_MS);
+    pollTimer->setInterval(POLL_INTERVAL_MS);
+    
+    connect(watcher, &QFileSystemWatcher::fileChanged, this, &ChangeMonitor::fileChanged);
+    connect(watcher, &QFileSystemWatcher::directoryChanged, this, &ChangeMonitor::fileChanged);
+    connect(debounceTimer, &QTimer::timeout, this, &ChangeMonitor::check);
+    connect(pollTimer, &QTimer::timeout, this, &ChangeMonitor::check);
+}
+
+void ChangeMonitor::start()
+{
+    lastDataVersion = db->dataVersion();
+    watchFiles();
+    pollTimer->start();
+}
+
+void ChangeMonitor::stop()
+{
+    pollTimer->stop();
+    debounceTimer->stop();
+    
+    const QStringList paths = watcher->files() + watcher->directories();
+    if (!paths.isEmpty()) {
+        watcher->removePaths(paths);
+    }
+}
+
+void ChangeMonitor::check()
+{
+    qint64 version = db->dataVersion();
+    if (version < 0 || version == lastDataVersion) {
+        return;
+    }
+    
+    lastDataVersion = version;
+    emit changed();
+}
+
+void ChangeMonitor::fileChanged()
+{
+    // The WAL file is deleted and recreated by checkpoints, which drops it from the watcher
+    watchFiles();
+    debounceTimer->start();
+}
+
+void ChangeMonitor::watchFiles()
+{
+    const QString path = db->databasePath();
+    
+    // The directory reports the WAL file being created; the files report in-place writes
+    QStringList paths = {QFileInfo(path).absolutePath(), path, path + "-wal"};
+    for (const QString &candidate : paths) {
+        if (QFile::exists(candidate) && !watcher->files().contains(candidate) &&
+            !watcher->directories().contains(candidate)) {
+            watcher->addPath(candidate);
+        }
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef CHANGEMONITOR_H
+#define CHANGEMONITOR_H
+
+#include <QObject>
+#include <QFileSystemWatcher>
+#include <QTimer>
+#include "database.h"
+
+// Notices commits to the vault file from any connection, including other
+// processes. File events are only a hint; PRAGMA data_version on this thread's
+// connection decides whether something was actually committed. A slow poll
+// covers file systems that do not deliver change events.
+class ChangeMonitor : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit ChangeMonitor(Database *db, QObject *parent = nullptr);
+    
+    void start();
+    void stop();
+
+public slots:
+    void check();
+
+signals:
+    // Another connection committed; read the change journal to see what
+    void changed();
+
+private slots:
+    void fileChanged();
+
+private:
+    void watchFiles();
+    
+    static const int DEBOUNCE_MS = 100;
+    static const int POLL_INTERVAL_MS = 5000;
+    
+    Database *db;
+    QFileSystemWatcher *watcher;
+    QTimer *debounceTimer;
+    QTimer *pollTimer;
+    qint64 lastDataVersion;
+};
+
+#endif // CHANGEMONITOR_H
@@ -0,0 +1,231 @@
+#include "connectionpool.h"
+#include "vaultintegrity.h"
+#include <QSqlError>
+#include <QSqlDriver>
+#include <QMutexLocker>
+#include <QDebug>
+#include <utility>
+#include <sqlite3.h>
+
+namespace {
+std::atomic<int> poolCounter(0);
+}
+
+CachedStatement::CachedStatement(QSqlQuery *query, QSet<QSqlQuery*> *checkedOut)
+    : query(query)
+    , checkedOut(checkedOut)
+{
+    if (checkedOut) {
+        checkedOut->insert(query);
+    }
+}
+
+CachedStatement::~CachedStatement()
+{
+    if (!query) {
+        return;
+    }
+    
+    if (!checkedOut) {
+        delete query;
+    } else {
+        // Keeps the compiled statement, drops the result set and its read lock
+        query->finish();
+        checkedOut->remove(query);
+    }
+}
+
+CachedStatement::CachedStatement(CachedStatement &&other) noexcept
+    : query(std::exchange(other.query, nullptr))
+    , checkedOut(other.checkedOut)
+{
+}
+
+ConnectionPool::ConnectionPool(const QString &databasePath)
+    : path(databasePath)
+    , prefix(QStringLiteral("PasswordManager-%1-").arg(poolCounter.fetch_add(1)))
+    , registry(std::make_shared<Registry>())
+    , statementHits(0)
+    , statementMisses(0)
+{
+    // One writer thread for the lifetime of the pool, so the writer connection stays on it
+    writerThread.setObjectName(prefix + QStringLiteral("writer"));
+    writerContext.moveToThread(&writerThread);
+    writerThread.start();
+    readerThreads.setMaxThreadCount(MAX_READERS);
+}
+
+ConnectionPool::~ConnectionPool()
+{
+    // Queued behind every pending write: close the writer connection on the
+    // thread that owns it, then leave the event loop
+    QMetaObject::invokeMethod(&writerContext, [this]() {
+        release(registry, QThread::currentThread());
+        QThread::currentThread()->quit();
+    }, Qt::QueuedConnection);
+    writerThread.wait();
+    
+    // The reader threads exit here, each closing its own connection as it finishes
+    readerThreads.waitForDone();
+    
+    // Connections are never closed from another thread: this thread's goes now, and
+    // threads that outlive the pool (QtConcurrent's global pool, say) close theirs when
+    // they finish, through the registry they share
+    release(registry, QThread::currentThread());
+    
+    StatementStats stats = statementStats();
+    qDebug() << "Statement cache:" << stats.hits << "hits," << stats.misses << "misses";
+}
+
+QSqlDatabase ConnectionPool::connection()
+{
+    ThreadConnection *connection = threadConnection();
+    return connection->db;
+}
+
+CachedStatement ConnectionPool::statement(const QString &sql)
+{
+    ThreadConnection *connection = threadConnection();
+    
+    auto it = connection->statements.constFind(sql);
+    bool cached = it != connection->statements.constEnd();
+    if (cached && !connection->checkedOut.contains(it.value())) {
+        statementHits++;
+        return CachedStatement(it.value(), &connection->checkedOut);
+    }
+    
+    // Either not prepared yet, or still borrowed further up the stack; reusing
+    // it would reset the caller's bindings and result set under its feet
+    statementMisses++;
+    QSqlQuery *query = new QSqlQuery(connection->db);
+    if (!query->prepare(sql)) {
+        qWarning() << "Failed to prepare statement:" << query->lastError().text();
+        return CachedStatement(query, nullptr);
+    }
+    
+    if (cached) {
+        return CachedStatement(query, nullptr);
+    }
+    
+    connection->statements.insert(sql, query);
+    return CachedStatement(query, &connection->checkedOut);
+}
+
+ConnectionPool::StatementStats ConnectionPool::statementStats() const
+{
+    StatementStats stats;
+    stats.hits = statementHits.load();
+    stats.misses = statementMisses.load();
+    return stats;
+}
+
+sqlite3 *ConnectionPool::nativeHandle(const QSqlDatabase &db)
+{
+    QVariant handle = db.driver()->handle();
+    if (!handle.isValid() || qstrcmp(handle.typeName(), "sqlite3*") != 0) {
+        return nullptr;
+    }
+    
+    QSqlQuery query(db);
+    if (!query.exec("SELECT sqlite_version()") || !query.next() ||
+        query.value(0).toString() != QLatin1String(sqlite3_libversion())) {
+        qWarning() << "Qt SQLite driver does not use the system SQLite library";
+        return nullptr;
+    }
+    
+    return *static_cast<sqlite3 **>(handle.data());
+}
+
+ConnectionPool::ThreadConnection *ConnectionPool::threadConnection()
+{
+    QThread *thread = QThread::currentThread();
+    
+    QMutexLocker locker(&registry->mutex);
+    auto it = registry->connections.constFind(thread);
+    if (it != registry->connections.constEnd()) {
+        return it.value();
+    }
+    
+    bool writer = thread == &writerThread;
+    ThreadConnection *connection = new ThreadConnection;
+    connection->name = prefix + (writer ? QStringLiteral("writer")
+                                        : QStringLiteral("reader-") + QString::number(quintptr(thread), 16));
+    registry->connections.insert(thread, connection);
+    
+    // Connections cannot outlive or move between threads; close this one when its thread
+    // ends. finished is emitted on the thread itself, and the handler does not need the pool.
+    if (!writer) {
+        QObject::connect(thread, &QThread::finished, [registry = registry, thread]() {
+            release(registry, thread);
+        });
+    }
+    
+    locker.unlock();
+    connection->db = open(connection->name, writer);
+    return connection;
+}
+
+QSqlDatabase ConnectionPool::open(const QString &name, bool writer)
+{
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", name);
+    db.setDatabaseName(path);
+    db.setConnectOptions(QStringLiteral("QSQLITE_BUSY_TIMEOUT=%1").arg(BUSY_TIMEOUT_MS));
+    
+    if (!db.open()) {
+        qCritical() << "Failed to open database connection" << name << ":" << db.lastError().text();
+        return db;
+    }
+    
+    QSqlQuery query(db);
+    query.exec("PRAGMA foreign_keys = ON");
+    
+    if (writer) {
+        // Every write to an entry or note runs the integrity root triggers, which call it
+        if (!VaultIntegrity::installFunctions(db)) {
+            qCritical() << "Database connection" << name << "cannot maintain the integrity root";
+            db.close();
+            return db;
+        }
+        
+        // Lets maintenance return free pages in small steps; only applies to a new file,
+        // existing ones switch on their next VACUUM
+        query.exec("PRAGMA auto_vacuum = INCREMENTAL");
+        
+        // WAL lets readers keep their snapshot while the writer commits
+        if (!query.exec("PRAGMA journal_mode = WAL") || !query.next() ||
+            query.value(0).toString().compare("wal", Qt::CaseInsensitive) != 0) {
+            qWarning() << "Could not enable WAL journaling, readers may be blocked by writes";
+        }
+        query.exec("PRAGMA synchronous = NORMAL");
+    } else {
+        query.exec("PRAGMA query_only = ON");
+    }
+    
+    qDebug() << "Opened" << (writer ? "writer" : "reader") << "connection" << name;
+    return db;
+}
+
+void ConnectionPool::release(const std::shared_ptr<Registry> &registry, QThread *thread)
+{
+    QMutexLocker locker(&registry->mutex);
+    ThreadConnection *connection = registry->connections.take(thread);
+    locker.unlock();
+    
+    // Runs on the thread that owns the connection
+    if (connection) {
+        close(connection);
+    }
+}
+
+void ConnectionPool::close(ThreadConnection *connection)
+{
+    // Statements and handles must be gone before the connection can be removed
+    qDeleteAll(connection->statements);
+    connection->statements.clear();
+    connection->checkedOut.clear();
+    connection->db.close();
+    connection->db = QSqlDatabase();
+    
+    QSqlDatabase::removeDatabase(connection->name);
+    delete connection;
+}
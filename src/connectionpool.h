@@ -0,0 +1,148 @@
+#ifndef CONNECTIONPOOL_H
+#define CONNECTIONPOOL_H
+
+#include <QString>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QThreadPool>
+#include <QThread>
+#include <QMutex>
+#include <QHash>
+#include <QSet>
+#include <QFuture>
+#include <QPromise>
+#include <QtConcurrent>
+#include <atomic>
+#include <memory>
+#include <type_traits>
+
+struct sqlite3;
+
+// Prepared statement borrowed from a connection's cache. Resets the statement
+// when it goes out of scope so a finished SELECT does not pin a WAL snapshot,
+// and hands it back so the next statement() call for the same SQL can reuse it.
+class CachedStatement
+{
+public:
+    // checkedOut is the connection's set of borrowed statements; null for a
+    // statement that is not cached and is deleted with this object
+    CachedStatement(QSqlQuery *query, QSet<QSqlQuery*> *checkedOut);
+    ~CachedStatement();
+    
+    CachedStatement(CachedStatement &&other) noexcept;
+    CachedStatement(const CachedStatement &) = delete;
+    CachedStatement &operator=(const CachedStatement &) = delete;
+    CachedStatement &operator=(CachedStatement &&) = delete;
+    
+    QSqlQuery *operator->() const { return query; }
+    QSqlQuery &operator*() const { return *query; }
+
+private:
+    QSqlQuery *query;
+    QSet<QSqlQuery*> *checkedOut;
+};
+
+// SQLite connections for one database file in WAL mode. All writes run on a
+// single dedicated thread that owns the writer connection; every other thread
+// gets its own read-only connection, so readers never wait on the writer.
+// QSqlDatabase handles are bound to the thread that opened them, which is why
+// connections are looked up per thread instead of being handed out.
+class ConnectionPool
+{
+public:
+    struct StatementStats
+    {
+        quint64 hits = 0;
+        quint64 misses = 0;
+    };
+    
+    explicit ConnectionPool(const QString &databasePath);
+    ~ConnectionPool();
+    
+    QString databasePath() const { return path; }
+    
+    // The writer connection inside write() tasks, otherwise this thread's reader
+    QSqlDatabase connection();
+    bool isWriterThread() const { return QThread::currentThread() == &writerThread; }
+    
+    // Prepared once per connection and reused; bind fresh values before each exec().
+    // While the cached statement is borrowed, asking for the same SQL again (a
+    // nested loop over the same query) prepares a separate, uncached one.
+    CachedStatement statement(const QString &sql);
+    StatementStats statementStats() const;
+    
+    // Raw handle for the incremental blob and backup APIs; null when Qt's driver
+    // links a different SQLite library than this code does
+    static sqlite3 *nativeHandle(const QSqlDatabase &db);
+    
+    // Queues function on the writer thread; writes are applied in submission order.
+    // Tasks are posted to the writer's event loop rather than a thread pool, so a
+    // thread waiting on the returned future can never pick the task up and run it
+    // itself on its own connection.
+    template <typename Function>
+    auto write(Function function) -> QFuture<decltype(function())>
+    {
+        using Result = decltype(function());
+        auto promise = std::make_shared<QPromise<Result>>();
+        QFuture<Result> future = promise->future();
+        promise->start();
+        
+        QMetaObject::invokeMethod(&writerContext, [promise, function]() {
+            if constexpr (std::is_void_v<Result>) {
+                function();
+            } else {
+                promise->addResult(function());
+            }
+            promise->finish();
+        }, Qt::QueuedConnection);
+        return future;
+    }
+    
+    // Runs function on a pool thread with its own read connection
+    template <typename Function>
+    auto read(Function function) -> QFuture<decltype(function())>
+    {
+        return QtConcurrent::run(&readerThreads, function);
+    }
+
+private:
+    // Only the owning thread touches an entry once it is created
+    struct ThreadConnection
+    {
+        QString name;
+        QSqlDatabase db;
+        QHash<QString, QSqlQuery*> statements;
+        QSet<QSqlQuery*> checkedOut;
+    };
+    
+    // Connections by thread. Shared with the QThread::finished handlers that close them,
+    // since a thread that outlives the pool still has to close its own connection.
+    struct Registry
+    {
+        QMutex mutex;
+        QHash<QThread*, ThreadConnection*> connections;
+    };
+    
+    ThreadConnection *threadConnection();
+    QSqlDatabase open(const QString &name, bool writer);
+    // Closes the connection of thread; call on that thread
+    static void release(const std::shared_ptr<Registry> &registry, QThread *thread);
+    static void close(ThreadConnection *connection);
+    
+    static const int BUSY_TIMEOUT_MS = 5000;
+    static const int MAX_READERS = 4;
+    
+    QString path;
+    QString prefix;
+    
+    QThread writerThread;
+    QObject writerContext; // lives on writerThread, receives the queued write tasks
+    QThreadPool readerThreads;
+    
+    std::shared_ptr<Registry> registry;
+    
+    std::atomic<quint64> statementHits;
+    std::atomic<quint64> statementMisses;
+};
+
+#endif // CONNECTIONPOOL_H
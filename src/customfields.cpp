@@ -0,0 +1,140 @@
+#include "customfields.h"
+#include <QtEndian>
+#include <QDebug>
+#include <openssl/crypto.h>
+#include <cstring>
+
+namespace {
+const quint8 RECORD_VERSION = 1;
+const int HEADER_SIZE = 4;
+const int SLOT_SIZE = 12;
+}
+
+bool CustomFieldRecord::pack(const QList<CustomField> &fields, QByteArray &record)
+{
+    record.clear();
+    if (fields.isEmpty()) {
+        return true;
+    }
+    
+    if (fields.size() > MAX_FIELDS) {
+        qWarning() << "Too many custom fields:" << fields.size();
+        return false;
+    }
+    
+    QList<QByteArray> names;
+    QList<QByteArray> values;
+    auto wipeValues = [&values]() {
+        for (QByteArray &value : values) {
+            OPENSSL_cleanse(value.data(), value.size());
+        }
+    };
+    
+    qint64 size = HEADER_SIZE + qint64(fields.size()) * SLOT_SIZE;
+    for (const CustomField &field : fields) {
+        names.append(field.name.toUtf8());
+        if (names.last().size() > MAX_NAME_SIZE) {
+            qWarning() << "Custom field name is too long";
+            wipeValues();
+            return false;
+        }
+        
+        values.append(field.value.toUtf8());
+        size += names.last().size() + values.last().size();
+    }
+    
+    if (size > MAX_RECORD_SIZE) {
+        qWarning() << "Custom fields take" << size << "bytes, more than" << MAX_RECORD_SIZE;
+        wipeValues();
+        return false;
+    }
+    
+    record.resize(size);
+    char *out = record.data();
+    out[0] = char(RECORD_VERSION);
+    out[1] = 0;
+    qToBigEndian<quint16>(quint16(fields.size()), out + 2);
+    
+    quint32 offset = quint32(HEADER_SIZE + fields.size() * SLOT_SIZE);
+    for (int i = 0; i < fields.size(); ++i) {
+        char *slot = out + HEADER_SIZE + i * SLOT_SIZE;
+        slot[0] = char(fields[i].type);
+        slot[1] = 0;
+        qToBigEndian<quint16>(quint16(names[i].size()), slot + 2);
+        qToBigEndian<quint32>(offset, slot + 4);
+        qToBigEndian<quint32>(quint32(values[i].size()), slot + 8);
+        
+        memcpy(out + offset, names[i].constData(), size_t(names[i].size()));
+        offset += quint32(names[i].size());
+        memcpy(out + offset, values[i].constData(), size_t(values[i].size()));
+        offset += quint32(values[i].size());
+    }
+    
+    // Values are as secret as the password; only the packed copy survives
+    wipeValues();
+    return true;
+}
+
+bool CustomFieldRecord::unpack(const char *record, int size, QList<CustomField> &fields)
+{
+    fields.clear();
+    if (size == 0) {
+        return true;
+    }
+    
+    int count = fieldCount(record, size);
+    if (count < 0) {
+        qWarning() << "Malformed custom field record";
+        return false;
+    }
+    
+    fields.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        CustomField field;
+        if (!CustomFieldRecord::field(record, size, i, field)) {
+            qWarning() << "Malformed custom field" << i;
+            fields.clear();
+            return false;
+        }
+        fields.append(field);
+    }
+    return true;
+}
+
+int CustomFieldRecord::fieldCount(const char *record, int size)
+{
+    if (size < HEADER_SIZE || quint8(record[0]) != RECORD_VERSION) {
+        return -1;
+    }
+    
+    int count = qFromBigEndian<quint16>(record + 2);
+    if (count > MAX_FIELDS || HEADER_SIZE + qint64(count) * SLOT_SIZE > size) {
+        return -1;
+    }
+    return count;
+}
+
+bool CustomFieldRecord::field(const char *record, int size, int index, CustomField &field)
+{
+    int count = fieldCount(record, size);
+    if (index < 0 || index >= count) {
+        return false;
+    }
+    
+    const char *slot = record + HEADER_SIZE + index * SLOT_SIZE;
+    quint8 type = quint8(slot[0]);
+    quint16 nameSize = qFromBigEndian<quint16>(slot + 2);
+    quint32 offset = qFromBigEndian<quint32>(slot + 4);
+    quint32 valueSize = qFromBigEndian<quint32>(slot + 8);
+    
+    // 64-bit sums, so corrupt lengths cannot wrap around the bounds check
+    if (type > CustomField::Url || offset < quint32(HEADER_SIZE + count * SLOT_SIZE) ||
+        quint64(offset) + nameSize + valueSize > quint64(size)) {
+        return false;
+    }
+    
+    field.type = CustomField::Type(type);
+    field.name = QString::fromUtf8(record + offset, nameSize);
+    field.value = QString::fromUtf8(record + offset + nameSize, qsizetype(valueSize));
+    return true;
+}
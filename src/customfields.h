@@ -0,0 +1,45 @@
+#ifndef CUSTOMFIELDS_H
+#define CUSTOMFIELDS_H
+
+#include <QString>
+#include <QByteArray>
+#include <QList>
+
+// User-defined field of an entry, beyond the fixed name/url/username/password/note
+struct CustomField
+{
+    enum Type {
+        Text = 0,
+        Hidden = 1, // masked in the UI like the password
+        Url = 2
+    };
+    
+    Type type = Text;
+    QString name;
+    QString value;
+};
+
+// Packed binary layout for all custom fields of one entry, stored as a single
+// encrypted column so reading them costs one row read and one decrypt.
+//
+// Layout (big endian): version (1), reserved (1), field count (2), then one
+// 12-byte directory slot per field (type, reserved, name length (2), offset (4),
+// value length (4)), then the UTF-8 names and values. A slot's offset points at
+// the field's name, its value follows directly, so any field can be read without
+// walking the ones before it.
+class CustomFieldRecord
+{
+public:
+    static const int MAX_FIELDS = 64;
+    static const int MAX_NAME_SIZE = 1024;
+    static const int MAX_RECORD_SIZE = 256 * 1024;
+    
+    // record is left empty when there are no fields; false if the fields exceed the limits
+    static bool pack(const QList<CustomField> &fields, QByteArray &record);
+    static bool unpack(const char *record, int size, QList<CustomField> &fields);
+    
+    static int fieldCount(const char *record, int size);
+    static bool field(const char *record, int size, int index, CustomField &field);
+};
+
+#endif // CUSTOMFIELDS_H
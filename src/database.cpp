@@ -4,6 +4,190 @@
 #include <QStandardPaths>
 #include <QSqlDriver>
 #include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStringList>
+#include <QMutexLocker>
+#include <QElapsedTimer>
+#include <QThread>
+#include <QSet>
+#include <QtEndian>
+#include <openssl/crypto.h>
+#include <algorithm>
+#include <cstring>
+#include <sqlite3.h>
+#include "attachmentstore.h"
+#include "blindindex.h"
+#include "customfields.h"
+#include "entryhistory.h"
+#include "connectionpool.h"
+#include "notecodec.h"
+#include "schemamigrations.h"
+#include "startuptimer.h"
+#include "vaultsync.h"
+
+namespace {
+// Statements that go through the statement cache. Named here so the query-plan
+// check runs exactly the SQL that Database executes.
+const char SQL_INSERT_USER[] = "INSERT INTO users (username, password, salt, kdf, kdf_cost, kdf_block, kdf_parallel) "
+                               "VALUES (?, ?, ?, ?, ?, ?, ?)";
+const char SQL_FIND_USER[] = "SELECT id, password, salt, kdf, kdf_cost, kdf_block, kdf_parallel FROM users WHERE username = ?";
+const char SQL_SELECT_NEWEST_KDF[] = "SELECT kdf_cost, kdf_block, kdf_parallel FROM users WHERE kdf = 'scrypt' "
+                                    "ORDER BY id DESC LIMIT 1";
+const char SQL_UPDATE_USER_CREDENTIALS[] = "UPDATE users SET password = ?, salt = ?, kdf = ?, kdf_cost = ?, kdf_block = ?, kdf_parallel = ? "
+                                           "WHERE id = ?";
+const char SQL_INSERT_ENTRY[] = "INSERT INTO passwords (user_id, name, url, username, password, note_size, fields, "
+                                "encrypted_fields, uuid, sync_bucket, sync_hash) "
+                                "VALUES (?, ?, ?, ?, ?, ?, ?, 2, ?, ?, ?)";
+const char SQL_UPDATE_ENTRY[] = "UPDATE passwords SET name = ?, url = ?, username = ?, password = ?, note_size = ?, fields = ?, "
+                                "encrypted_fields = 2, updated_at = CURRENT_TIMESTAMP, sync_hash = ? "
+                                "WHERE id = ? AND user_id = ?";
+const char SQL_DELETE_ENTRY_TOKENS[] = "DELETE FROM search_tokens WHERE password_id = ? AND user_id = ?";
+const char SQL_DELETE_ENTRY[] = "DELETE FROM passwords WHERE id = ? AND user_id = ?";
+const char SQL_SELECT_ENTRY_UUID[] = "SELECT uuid, sync_bucket FROM passwords WHERE id = ? AND user_id = ?";
+const char SQL_INSERT_TOMBSTONE[] = "INSERT OR REPLACE INTO tombstones (uuid, user_id, sync_bucket, sync_hash) VALUES (?, ?, ?, ?)";
+const char SQL_CLEAR_ENTRY_TOKENS[] = "DELETE FROM search_tokens WHERE password_id = ?";
+const char SQL_INSERT_TOKEN[] = "INSERT INTO search_tokens (user_id, token, password_id) VALUES (?, ?, ?)";
+const char SQL_REWRITE_ENTRY[] = "UPDATE passwords SET name = ?, url = ?, username = ?, password = ?, note_size = ?, fields = ?, "
+                                 "encrypted_fields = 2, sync_hash = ? "
+                                 "WHERE id = ?";
+const char SQL_SELECT_ENTRY[] = "SELECT id, name, url, username, password, note_size, encrypted_fields, user_id, uuid "
+                                "FROM passwords WHERE id = ? AND user_id = ?";
+const char SQL_SELECT_ENTRY_PAGE[] = "SELECT id, name, url, username, password, note_size, encrypted_fields, user_id, uuid "
+                                     "FROM passwords WHERE user_id = ? AND id > ? ORDER BY id LIMIT ?";
+const char SQL_SELECT_ENTRY_PAGE_WITH_NOTES[] = "SELECT p.id, p.name, p.url, p.username, p.password, p.note_size, p.encrypted_fields, "
+                                                "p.user_id, p.uuid, n.note, n.dictionary_id, p.fields "
+                                                "FROM passwords p LEFT JOIN entry_notes n ON n.password_id = p.id "
+                                                "WHERE p.user_id = ? AND p.id > ? ORDER BY p.id LIMIT ?";
+const char SQL_SELECT_FIELDS[] = "SELECT fields, encrypted_fields, user_id, uuid FROM passwords WHERE id = ? AND user_id = ?";
+const char SQL_SELECT_NOTE[] = "SELECT p.encrypted_fields, n.dictionary_id, n.note, p.user_id, p.uuid "
+                               "FROM passwords p JOIN entry_notes n ON n.password_id = p.id "
+                               "WHERE p.id = ? AND p.user_id = ?";
+// An upsert rather than INSERT OR REPLACE, whose implicit delete would skip the integrity root trigger
+const char SQL_STORE_NOTE[] = "INSERT INTO entry_notes (password_id, dictionary_id, note) VALUES (?, ?, ?) "
+                              "ON CONFLICT(password_id) DO UPDATE SET dictionary_id = excluded.dictionary_id, note = excluded.note";
+const char SQL_DELETE_NOTE[] = "DELETE FROM entry_notes WHERE password_id = ?";
+const char SQL_SELECT_NOTE_SAMPLES[] = "SELECT p.encrypted_fields, n.dictionary_id, n.note, p.user_id, p.uuid "
+                                       "FROM passwords p JOIN entry_notes n ON n.password_id = p.id "
+                                       "WHERE p.user_id = ? AND p.note_size >= ? LIMIT ?";
+const char SQL_SELECT_UNCOMPRESSED_NOTES[] = "SELECT p.id, p.name, p.url, p.username, p.password, p.note_size, "
+                                             "p.encrypted_fields, p.user_id, p.uuid, n.note, n.dictionary_id, p.fields "
+                                             "FROM passwords p JOIN entry_notes n ON n.password_id = p.id "
+                                             "WHERE p.user_id = ? AND p.id > ? AND p.encrypted_fields > 0 "
+                                             "AND p.note_size >= ? AND n.dictionary_id IS NULL ORDER BY p.id LIMIT ?";
+const char SQL_UPDATE_ENTRY_HASH[] = "UPDATE passwords SET sync_hash = ? WHERE id = ?";
+const char SQL_SELECT_NOTE_DICTIONARY[] = "SELECT dictionary, user_id, bound FROM note_dictionaries WHERE id = ?";
+const char SQL_SELECT_NOTE_DICTIONARIES[] = "SELECT id, dictionary, bound FROM note_dictionaries WHERE user_id = ? ORDER BY id";
+const char SQL_STORE_NOTE_DICTIONARY[] = "INSERT OR REPLACE INTO note_dictionaries (id, user_id, dictionary, bound) "
+                                         "VALUES (?, ?, ?, 1)";
+const char SQL_SELECT_UNBOUND_DICTIONARIES[] = "SELECT id FROM note_dictionaries WHERE user_id = ? AND bound = 0";
+const char SQL_INSERT_ATTACHMENT[] = "INSERT INTO attachments (password_id, name, wrapped_key, size, chunk_size, data, bound) "
+                                     "SELECT id, ?, ?, ?, ?, zeroblob(?), 1 FROM passwords WHERE id = ? AND user_id = ?";
+const char SQL_SELECT_ATTACHMENTS[] = "SELECT a.id, a.name, a.size, a.bound, p.uuid FROM attachments a "
+                                      "JOIN passwords p ON p.id = a.password_id "
+                                      "WHERE a.password_id = ? AND p.user_id = ? ORDER BY a.id";
+const char SQL_SELECT_ATTACHMENT[] = "SELECT a.wrapped_key, a.size, a.chunk_size, a.bound, p.uuid FROM attachments a "
+                                     "JOIN passwords p ON p.id = a.password_id WHERE a.id = ? AND p.user_id = ?";
+const char SQL_DELETE_ATTACHMENT[] = "DELETE FROM attachments WHERE id = ? AND EXISTS "
+                                     "(SELECT 1 FROM passwords p WHERE p.id = attachments.password_id AND p.user_id = ?)";
+// bound <= ?: 0 for the rows still to be bound, 1 for all of them
+const char SQL_SELECT_USER_ATTACHMENT_KEYS[] = "SELECT a.id, a.name, a.wrapped_key, a.bound, p.uuid FROM passwords p "
+                                               "JOIN attachments a ON a.password_id = p.id "
+                                               "WHERE p.user_id = ? AND a.bound <= ?";
+const char SQL_UPDATE_ATTACHMENT_KEY[] = "UPDATE attachments SET name = ?, wrapped_key = ?, bound = 1 WHERE id = ?";
+const char SQL_SELECT_ENTRY_WITH_NOTE[] = "SELECT p.id, p.name, p.url, p.username, p.password, p.note_size, p.encrypted_fields, "
+                                          "p.user_id, p.uuid, n.note, n.dictionary_id, p.fields "
+                                          "FROM passwords p LEFT JOIN entry_notes n ON n.password_id = p.id "
+                                          "WHERE p.id = ? AND p.user_id = ?";
+const char SQL_SELECT_LATEST_HISTORY[] = "SELECT id, delta, version, bound FROM entry_history WHERE password_id = ? "
+                                        "ORDER BY id DESC LIMIT 1";
+const char SQL_INSERT_HISTORY[] = "INSERT INTO entry_history (password_id, changed_at, delta, version, bound) "
+                                  "VALUES (?, IFNULL(?, strftime('%s', 'now')), 0, ?, 1)";
+const char SQL_UPDATE_HISTORY[] = "UPDATE entry_history SET delta = ?, version = ?, bound = 1 WHERE id = ?";
+const char SQL_PRUNE_HISTORY[] = "DELETE FROM entry_history WHERE password_id = ? AND id <= "
+                                 "(SELECT id FROM entry_history WHERE password_id = ? ORDER BY id DESC LIMIT 1 OFFSET ?)";
+const char SQL_SELECT_HISTORY[] = "SELECT h.id, h.changed_at FROM entry_history h JOIN passwords p ON p.id = h.password_id "
+                                  "WHERE h.password_id = ? AND p.user_id = ? ORDER BY h.id DESC";
+const char SQL_SELECT_HISTORY_CHAIN[] = "SELECT h.id, h.changed_at, h.delta, h.version, h.bound, p.uuid FROM entry_history h "
+                                        "JOIN passwords p ON p.id = h.password_id "
+                                        "WHERE h.password_id = ? AND p.user_id = ? AND h.id >= ? ORDER BY h.id DESC";
+const char SQL_SELECT_USER_HISTORY[] = "SELECT h.id, h.delta, h.version, h.bound, p.uuid FROM passwords p "
+                                       "JOIN entry_history h ON h.password_id = p.id WHERE p.user_id = ? AND h.bound <= ?";
+// Ciphertext outside the entry rows that is not bound to its owner yet, for the integrity report
+const char SQL_SELECT_UNBOUND_EXTRAS[] = "SELECT a.password_id, 0 FROM passwords p JOIN attachments a ON a.password_id = p.id "
+                                         "WHERE p.user_id = ? AND a.bound = 0 "
+                                         "UNION ALL SELECT h.password_id, 1 FROM passwords p "
+                                         "JOIN entry_history h ON h.password_id = p.id WHERE p.user_id = ? AND h.bound = 0 "
+                                         "UNION ALL SELECT -1, 2 FROM note_dictionaries WHERE user_id = ? AND bound = 0";
+// Attachments of an entry moved to another vault, with the keys to re-wrap there
+const char SQL_SELECT_ENTRY_ATTACHMENT_KEYS[] = "SELECT a.id, a.name, a.wrapped_key, a.size, a.chunk_size, a.bound, p.uuid "
+                                                "FROM attachments a JOIN passwords p ON p.id = a.password_id "
+                                                "WHERE a.password_id = ? AND p.user_id = ? ORDER BY a.id";
+// Ids of a bulk operation, owned by the current user; statements join against the list
+// so each step is one statement for the whole selection
+const char SQL_CREATE_BULK_IDS[] = "CREATE TEMP TABLE IF NOT EXISTS bulk_ids (id INTEGER PRIMARY KEY)";
+const char SQL_CLEAR_BULK_IDS[] = "DELETE FROM temp.bulk_ids";
+const char SQL_INSERT_BULK_ID[] = "INSERT OR IGNORE INTO temp.bulk_ids (id) SELECT id FROM passwords WHERE id = ? AND user_id = ?";
+const char SQL_SELECT_BULK_UUIDS[] = "SELECT p.uuid, p.sync_bucket FROM temp.bulk_ids JOIN passwords p ON p.id = bulk_ids.id";
+const char SQL_DELETE_BULK_TOKENS[] = "DELETE FROM search_tokens WHERE password_id IN (SELECT id FROM temp.bulk_ids)";
+const char SQL_RECORD_BULK_CHANGES[] = "INSERT INTO changes (user_id, password_id, change_type) SELECT ?, id, ? FROM temp.bulk_ids";
+const char SQL_DELETE_BULK_ENTRIES[] = "DELETE FROM passwords WHERE id IN (SELECT id FROM temp.bulk_ids)";
+const char SQL_SELECT_BULK_ENTRIES[] = "SELECT p.id, p.name, p.url, p.username, p.password, p.note_size, p.encrypted_fields, "
+                                       "p.user_id, p.uuid, n.note, n.dictionary_id, p.fields "
+                                       "FROM temp.bulk_ids JOIN passwords p ON p.id = bulk_ids.id "
+                                       "LEFT JOIN entry_notes n ON n.password_id = p.id";
+// Name, url and username only; the password, note and custom fields keep their ciphertext
+const char SQL_UPDATE_ENTRY_METADATA[] = "UPDATE passwords SET name = ?, url = ?, username = ?, "
+                                         "updated_at = CURRENT_TIMESTAMP, sync_hash = ? WHERE id = ? AND user_id = ?";
+const char SQL_INSERT_CHANGE[] = "INSERT INTO changes (user_id, password_id, change_type) VALUES (?, ?, ?)";
+const char SQL_SELECT_CHANGES[] = "SELECT seq, password_id, change_type FROM changes "
+                                  "WHERE user_id = ? AND seq > ? ORDER BY seq LIMIT ?";
+const char SQL_LATEST_CHANGE[] = "SELECT MAX(seq) FROM changes WHERE user_id = ?";
+const char SQL_SELECT_INTEGRITY_PAGE[] = "SELECT p.id, p.name, p.url, p.username, p.password, p.note_size, p.encrypted_fields, "
+                                         "p.user_id, p.uuid, n.note, n.dictionary_id, p.fields, p.sync_hash, n.password_id "
+                                         "FROM passwords p LEFT JOIN entry_notes n ON n.password_id = p.id "
+                                         "WHERE p.user_id = ? AND p.id > ? ORDER BY p.id LIMIT ?";
+const char SQL_SELECT_INTEGRITY_ENTRY[] = "SELECT p.id, p.name, p.url, p.username, p.password, p.note_size, p.encrypted_fields, "
+                                          "p.user_id, p.uuid, n.note, n.dictionary_id, p.fields, p.sync_hash, n.password_id "
+                                          "FROM passwords p LEFT JOIN entry_notes n ON n.password_id = p.id "
+                                          "WHERE p.id = ? AND p.user_id = ?";
+const char SQL_SELECT_INTEGRITY_ROOT[] = "SELECT leaf_sum, leaf_count, seal FROM integrity_roots WHERE user_id = ?";
+const char SQL_ENSURE_INTEGRITY_ROOT[] = "INSERT OR IGNORE INTO integrity_roots (user_id) VALUES (?)";
+const char SQL_SEAL_INTEGRITY_ROOT[] = "UPDATE integrity_roots SET seal = ? WHERE user_id = ?";
+const char SQL_RESET_INTEGRITY_ROOT[] = "UPDATE integrity_roots SET leaf_sum = ?, leaf_count = ?, legacy_sum = NULL, "
+                                        "legacy_count = NULL WHERE user_id = ?";
+// Root over the sync hashes, kept by the upgrade to ciphertext leaves until the next login
+const char SQL_SELECT_LEGACY_ROOT[] = "SELECT r.legacy_sum, r.legacy_count, r.seal, "
+                                      "(SELECT IFNULL(SUM(sync_hash), 0) FROM passwords WHERE user_id = r.user_id), "
+                                      "(SELECT COUNT(*) FROM passwords WHERE user_id = r.user_id) "
+                                      "FROM integrity_roots r WHERE r.user_id = ? AND r.legacy_sum IS NOT NULL";
+const char SQL_CLEAR_LEGACY_ROOT[] = "UPDATE integrity_roots SET legacy_sum = NULL, legacy_count = NULL WHERE user_id = ?";
+// encrypted_fields < 2 is the predicate of idx_passwords_unbound, which only covers rows still to convert
+const char SQL_SELECT_UNBOUND_ENTRIES[] = "SELECT p.id, p.name, p.url, p.username, p.password, p.note_size, p.encrypted_fields, "
+                                          "p.user_id, p.uuid, n.note, n.dictionary_id, p.fields "
+                                          "FROM passwords p LEFT JOIN entry_notes n ON n.password_id = p.id "
+                                          "WHERE p.user_id = ? AND p.id > ? AND p.encrypted_fields < 2 "
+                                          "ORDER BY p.id LIMIT ?";
+
+// Entries of a user; with tokens, only those carrying every one of the tokenCount tokens.
+// The first token's key range drives the query and each further token is one primary
+// key probe per candidate, so no step needs a temporary B-tree to count matches.
+QString entrySearchSql(int tokenCount)
+{
+    if (tokenCount == 0) {
+        return "SELECT id, name, url, username, password, note_size, encrypted_fields, user_id, uuid FROM passwords "
+               "WHERE user_id = ?";
+    }
+    
+    QString sql = "SELECT p.id, p.name, p.url, p.username, p.password, p.note_size, p.encrypted_fields, p.user_id, p.uuid "
+                  "FROM search_tokens t JOIN passwords p ON p.id = t.password_id "
+                  "WHERE t.user_id = ? AND t.token = ? AND p.user_id = ?";
+    for (int i = 1; i < tokenCount; ++i) {
+        sql += " AND EXISTS (SELECT 1 FROM search_tokens WHERE user_id = ? AND token = ? AND password_id = p.id)";
+    }
+    return sql;
+}
+}
 
 // DEBUG_RESET_DB tanımını kaldırıyoruz
 // #define DEBUG_RESET_DB
@@ -11,14 +195,19 @@
 const QString Database::DATABASE_NAME = "passwords.db";
 
 Database::Database(QObject *parent)
+    : Database(defaultPath(), parent)
+{
+}
+
+Database::Database(const QString &fullDbPath, QObject *parent)
     : QObject(parent)
-    , currentUserId(-1)
+    , activeSession(std::make_shared<const Session>())
+    , prefetchedUserId(-1)
+    , prefetchGeneration(0)
+    , activeDictionaryId(0)
+    , transactionDepth(0)
+    , sealOnCommit(false)
 {
-    QString dbPath = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
-    QDir().mkpath(dbPath);
-    
-    QString fullDbPath = dbPath + "/" + DATABASE_NAME;
-    
     // Check if we need to delete the existing database due to schema changes
     bool needsReset = false;
     
@@ -35,273 +224,404 @@ Database::Database(QObject *parent)
     }
 #endif
     
-    db = QSqlDatabase::addDatabase("QSQLITE");
-    db.setDatabaseName(fullDbPath);
+    pool = std::make_unique<ConnectionPool>(fullDbPath);
     
-    if (!initialize()) {
-        qCritical() << "Failed to initialize database:" << db.lastError().text();
-    }
+    // Opening the file and checking the schema happen on the writer thread while the
+    // login dialog paints; writes queue behind it and reads wait in connection()
+    initialized = pool->write([this, fullDbPath]() {
+        bool ok = initialize();
+        if (!ok) {
+            qCritical() << "Failed to initialize database:" << fullDbPath;
+        }
+        StartupTimer::mark("database ready");
+        return ok;
+    });
 }
 
 Database::~Database()
 {
-    if (db.isOpen()) {
-        db.close();
-    }
+    // Waits for queued writes before the connections are closed
+    pool.reset();
+}
+
+QString Database::defaultPath()
+{
+    QString dbPath = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+    QDir().mkpath(dbPath);
+    
+    return dbPath + "/" + DATABASE_NAME;
+}
+
+QString Database::databasePath() const
+{
+    return pool->databasePath();
 }
 
 bool Database::initialize()
 {
-    if (!db.open()) {
+    // Schema changes go through the writer connection like every other write
+    if (!pool->isWriterThread()) {
+        return pool->write([this]() { return initialize(); }).result();
+    }
+    
+    // Opening the writer connection also switches the file to WAL and enables foreign keys
+    QSqlDatabase db = connection();
+    if (!db.isOpen()) {
         qCritical() << "Failed to open database:" << db.lastError().text();
         return false;
     }
     
-    // Enable foreign keys
-    QSqlQuery query;
-    query.exec("PRAGMA foreign_keys = ON");
-    
-    return upgradeDatabase() && createTables() && initializeEncryption();
+    // A single user_version read when the schema is current
+    return SchemaMigrations::migrate(db) && initializeEncryption();
+}
+
+bool Database::initializeEncryption()
+{
+    // OpenSSL 1.1+ initializes itself; only the cipher fetch is worth doing ahead of time
+    if (!gcmCipher()) {
+        qCritical() << "AES-256-GCM is not available from the OpenSSL providers";
+        return false;
+    }
+    return true;
+}
+
+const EVP_CIPHER *Database::gcmCipher()
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    // EVP_aes_256_gcm() makes OpenSSL 3 look the implementation up on every init;
+    // fetching once keeps provider resolution off the per-entry path
+    static EVP_CIPHER *cipher = EVP_CIPHER_fetch(nullptr, "AES-256-GCM", nullptr);
+    return cipher;
+#else
+    return EVP_aes_256_gcm();
+#endif
+}
+
+bool Database::createUser(const QString &username, const QString &password)
+{
+    CredentialSet credentials = prepareCredentials(password);
+    if (!credentials.isValid()) {
+        qWarning() << "Failed to derive credentials for new user";
+        return false;
+    }
+
+    return createUser(username, credentials);
 }
 
-bool Database::upgradeDatabase()
+bool Database::createUser(const QString &username, const CredentialSet &credentials)
 {
-    QSqlQuery query;
+    if (!pool->isWriterThread()) {
+        return pool->write([&]() { return createUser(username, credentials); }).result();
+    }
     
-    // Check if the passwords table exists
-    query.exec("SELECT sql FROM sqlite_master WHERE type='table' AND name='passwords'");
+    qDebug() << "Creating user:" << username;
     
-    if (query.next()) {
-        QString tableSchema = query.value(0).toString();
-        
-        // Check if the table has the name and note columns
-        if (!tableSchema.contains("name TEXT") || !tableSchema.contains("note TEXT")) {
-            qDebug() << "Upgrading database schema...";
-            
-            // Start a transaction
-            if (!db.transaction()) {
-                qWarning() << "Failed to start transaction for database upgrade:" << db.lastError().text();
-                return false;
-            }
-            
-            // Create a backup of the old table
-            if (!query.exec("CREATE TABLE passwords_backup AS SELECT * FROM passwords")) {
-                qWarning() << "Failed to create backup table:" << query.lastError().text();
-                db.rollback();
-                return false;
-            }
-            
-            // Drop the old table
-            if (!query.exec("DROP TABLE passwords")) {
-                qWarning() << "Failed to drop old table:" << query.lastError().text();
-                db.rollback();
-                return false;
-            }
-            
-            // Create the new table with updated schema
-            if (!query.exec("CREATE TABLE passwords ("
-                          "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-                          "user_id INTEGER NOT NULL,"
-                          "name TEXT NOT NULL,"
-                          "url TEXT NOT NULL,"
-                          "username TEXT NOT NULL,"
-                          "password BLOB NOT NULL,"
-                          "note TEXT,"
-                          "created_at DATETIME DEFAULT CURRENT_TIMESTAMP,"
-                          "updated_at DATETIME DEFAULT CURRENT_TIMESTAMP,"
-                          "FOREIGN KEY (user_id) REFERENCES users(id))")) {
-                qWarning() << "Failed to create new passwords table:" << query.lastError().text();
-                db.rollback();
-                return false;
-            }
-            
-            // Copy data from backup to new table
-            if (!query.exec("INSERT INTO passwords (id, user_id, name, url, username, password, created_at, updated_at) "
-                          "SELECT id, user_id, url, url, username, password, created_at, updated_at FROM passwords_backup")) {
-                qWarning() << "Failed to copy data from backup:" << query.lastError().text();
-                db.rollback();
-                return false;
-            }
-            
-            // Drop the backup table
-            if (!query.exec("DROP TABLE passwords_backup")) {
-                qWarning() << "Failed to drop backup table:" << query.lastError().text();
-                db.rollback();
-                return false;
-            }
-            
-            // Create index on user_id
-            if (!query.exec("CREATE INDEX IF NOT EXISTS idx_passwords_user_id ON passwords(user_id)")) {
-                qWarning() << "Failed to create index on user_id:" << query.lastError().text();
-                db.rollback();
-                return false;
-            }
-            
-            // Commit the transaction
-            if (!db.commit()) {
-                qWarning() << "Failed to commit transaction for database upgrade:" << db.lastError().text();
-                db.rollback();
-                return false;
-            }
-            
-            qDebug() << "Database schema upgrade completed successfully";
-        }
+    CachedStatement query = statement(SQL_INSERT_USER);
+    query->addBindValue(username);
+    query->addBindValue(credentials.keys.verifier);
+    query->addBindValue(credentials.salt);
+    query->addBindValue(credentials.kdf.algorithm);
+    query->addBindValue(credentials.kdf.cost);
+    query->addBindValue(credentials.kdf.blockSize);
+    query->addBindValue(credentials.kdf.parallelism);
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to create user:" << query->lastError().text();
+        return false;
     }
     
+    int userId = query->lastInsertId().toInt();
+    qDebug() << "User created with ID:" << userId;
+    
+    startSession(userId, username, credentials.keys.masterKey);
+    
+    qDebug() << "User creation complete, master key set";
     return true;
 }
 
-bool Database::initializeEncryption()
+bool Database::validateUser(const QString &username, const QString &password)
 {
-    // Initialize OpenSSL
-    OpenSSL_add_all_algorithms();
-    return true;
+    UserRecord user;
+    if (!findUser(username, user)) {
+        user = decoyUser(username);
+    }
+
+    return completeLogin(user, deriveLogin(user, password));
 }
 
-bool Database::createTables()
+bool Database::findUser(const QString &username, UserRecord &user)
 {
-    QSqlQuery query;
+    qDebug() << "Looking up user:" << username;
     
-    // Users table
-    if (!query.exec("CREATE TABLE IF NOT EXISTS users ("
-                   "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-                   "username TEXT UNIQUE NOT NULL,"
-                   "password TEXT NOT NULL,"
-                   "salt BLOB NOT NULL,"
-                   "created_at DATETIME DEFAULT CURRENT_TIMESTAMP)")) {
-        qCritical() << "Failed to create users table:" << query.lastError().text();
-        return false;
-    }
+    CachedStatement query = statement(SQL_FIND_USER);
+    query->addBindValue(username);
     
-    // Passwords table - simplified schema
-    if (!query.exec("CREATE TABLE IF NOT EXISTS passwords ("
-                   "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-                   "user_id INTEGER NOT NULL,"
-                   "name TEXT NOT NULL,"
-                   "url TEXT NOT NULL,"
-                   "username TEXT NOT NULL,"
-                   "password BLOB NOT NULL,"
-                   "note TEXT,"
-                   "created_at DATETIME DEFAULT CURRENT_TIMESTAMP,"
-                   "updated_at DATETIME DEFAULT CURRENT_TIMESTAMP,"
-                   "FOREIGN KEY (user_id) REFERENCES users(id))")) {
-        qCritical() << "Failed to create passwords table:" << query.lastError().text();
+    if (!query->exec()) {
+        qWarning() << "Failed to execute user validation query:" << query->lastError().text();
         return false;
     }
     
-    // Create index on user_id
-    if (!query.exec("CREATE INDEX IF NOT EXISTS idx_passwords_user_id ON passwords(user_id)")) {
-        qCritical() << "Failed to create index on user_id:" << query.lastError().text();
+    if (!query->next()) {
+        qWarning() << "User not found:" << username;
         return false;
     }
     
+    user.id = query->value(0).toInt();
+    user.username = username;
+    user.passwordHash = query->value(1).toString();
+    user.salt = query->value(2).toByteArray();
+    user.kdf.algorithm = query->value(3).toString();
+    user.kdf.cost = query->value(4).toInt();
+    user.kdf.blockSize = query->value(5).toInt();
+    user.kdf.parallelism = query->value(6).toInt();
+    
+    qDebug() << "Found user with ID:" << user.id << "KDF:" << user.kdf.algorithm;
     return true;
 }
 
-bool Database::createUser(const QString &username, const QString &password)
+UserRecord Database::decoyUser(const QString &username)
 {
-    qDebug() << "Creating user:" << username;
+    UserRecord user;
+    user.username = username;
+    user.salt = KeyDerivation::generateSalt(SALT_SIZE);
+    
+    // Legacy accounts are not copied; they are upgraded at their next login anyway
+    CachedStatement query = statement(SQL_SELECT_NEWEST_KDF);
+    if (query->exec() && query->next()) {
+        user.kdf.algorithm = QStringLiteral("scrypt");
+        user.kdf.cost = query->value(0).toInt();
+        user.kdf.blockSize = query->value(1).toInt();
+        user.kdf.parallelism = query->value(2).toInt();
+    }
     
-    // Generate a random salt
-    QByteArray salt = QByteArray(SALT_SIZE, 0);
-    if (RAND_bytes(reinterpret_cast<unsigned char*>(salt.data()), SALT_SIZE) != 1) {
-        qWarning() << "Failed to generate salt";
-        return false;
+    return user;
+}
+
+CredentialSet Database::prepareCredentials(const QString &password)
+{
+    CredentialSet credentials;
+    credentials.kdf = KeyDerivation::calibrate();
+    credentials.salt = KeyDerivation::generateSalt(SALT_SIZE);
+    if (credentials.salt.isEmpty()) {
+        return credentials;
     }
     
-    qDebug() << "Generated salt of size:" << salt.size();
+    credentials.keys = KeyDerivation::derive(password, credentials.salt, credentials.kdf);
+    return credentials;
+}
+
+LoginResult Database::deriveLogin(const UserRecord &user, const QString &password)
+{
+    LoginResult result;
+    
+    // A decoy without an account to copy costs what registering would
+    if (user.id < 0) {
+        KdfParams kdf = user.kdf.algorithm.isEmpty() ? KeyDerivation::calibrate() : user.kdf;
+        DerivedKeys keys = KeyDerivation::derive(password, user.salt, kdf);
+        OPENSSL_cleanse(keys.masterKey.data(), keys.masterKey.size());
+        return result;
+    }
     
-    // Calculate password hash
-    QString passwordHash = hashPassword(password + salt.toHex());
-    qDebug() << "Generated password hash:" << passwordHash.left(10) + "...";
+    result.keys = KeyDerivation::derive(password, user.salt, user.kdf);
+    result.verified = KeyDerivation::verify(result.keys, user.passwordHash);
     
-    QSqlQuery query;
-    query.prepare("INSERT INTO users (username, password, salt) VALUES (?, ?, ?)");
-    query.addBindValue(username);
-    query.addBindValue(passwordHash);
-    query.addBindValue(salt);
+    // Legacy accounts are re-keyed with a calibrated KDF once the password is known to be right
+    if (result.verified && user.kdf.isLegacy()) {
+        result.upgrade = prepareCredentials(password);
+    }
     
-    if (!query.exec()) {
-        qWarning() << "Failed to create user:" << query.lastError().text();
+    return result;
+}
+
+bool Database::resumeLogin(const QString &username, const DerivedKeys &keys)
+{
+    UserRecord user;
+    if (!findUser(username, user)) {
         return false;
     }
     
-    // Set the current user ID
-    currentUserId = query.lastInsertId().toInt();
-    currentUsername = username;
-    
-    qDebug() << "User created with ID:" << currentUserId;
-    
-    // Set the master key
-    if (!setMasterKey(password)) {
-        qWarning() << "Failed to set master key for new user";
+    // Legacy accounts still need the password for their KDF upgrade
+    if (user.kdf.isLegacy()) {
         return false;
     }
     
-    qDebug() << "User creation complete, master key set";
-    return true;
+    LoginResult result;
+    result.keys = keys;
+    result.verified = KeyDerivation::verify(keys, user.passwordHash);
+    return completeLogin(user, result);
 }
 
-bool Database::validateUser(const QString &username, const QString &password)
+bool Database::completeLogin(const UserRecord &user, const LoginResult &result)
 {
-    qDebug() << "Validating user:" << username;
-    
-    QSqlQuery query;
-    query.prepare("SELECT id, password, salt FROM users WHERE username = ?");
-    query.addBindValue(username);
+    // Credential upgrades and metadata conversion write, so the whole step runs on the writer
+    if (!pool->isWriterThread()) {
+        return pool->write([&]() { return completeLogin(user, result); }).result();
+    }
     
-    if (!query.exec()) {
-        qWarning() << "Failed to execute user validation query:" << query.lastError().text();
+    if (!result.verified) {
+        qWarning() << "Password validation failed for user:" << user.username;
         return false;
     }
     
-    if (!query.next()) {
-        qWarning() << "User not found:" << username;
-        return false;
+    qDebug() << "User validation successful";
+    
+    QByteArray key = result.keys.masterKey;
+    
+    // Vaults migrated from the root over sync hashes carry their seal over, under the key it was made with
+    if (!upgradeIntegrityRoot(user.id, VaultIntegrity::deriveKey(key))) {
+        qWarning() << "Failed to upgrade the integrity root for user:" << user.username;
+    }
+    
+    if (result.upgrade.isValid()) {
+        if (upgradeUserCredentials(user, key, result.upgrade)) {
+            key = result.upgrade.keys.masterKey;
+            // Prefetched ciphertext was encrypted with the old key
+            clearPrefetchedEntries();
+        } else {
+            // The old credentials are still intact, so the login itself can proceed
+            qWarning() << "Failed to upgrade credentials for user:" << user.username;
+        }
     }
     
-    int userId = query.value(0).toInt();
-    QString storedHash = query.value(1).toString();
-    QByteArray salt = query.value(2).toByteArray();
+    startSession(user.id, user.username, key);
+    const SessionRef session = currentSession();
+    loadNoteDictionaries(session->userId, session->masterKey);
     
-    qDebug() << "Found user with ID:" << userId;
-    qDebug() << "Salt size:" << salt.size();
+    // Rows written before metadata encryption or field binding can only be converted once the key is known
+    if (!convertLegacyEntries()) {
+        qWarning() << "Some entries are still stored in an older format";
+    }
+    if (!bindLegacyExtras()) {
+        qWarning() << "Some attachments, history versions or note dictionaries are not bound yet";
+    }
+    
+    // First login of a new account or after the upgrade to integrity roots: trust the current
+    // rows. From then on only commits that found the seal intact reseal it.
+    if (integrityRootStatus(session->userId, session->integrityKey) == IntegrityReport::RootUnsealed) {
+        if (!beginWrite() || !endWrite(sealIntegrityRoot(session->userId, session->integrityKey))) {
+            qWarning() << "Failed to seal the integrity root";
+        }
+    }
+    
+    return true;
+}
+
+bool Database::upgradeUserCredentials(const UserRecord &user, const QByteArray &oldKey, const CredentialSet &credentials)
+{
+    qDebug() << "Upgrading KDF for user:" << user.username;
     
-    // Calculate hash with the same method as when creating the user
-    QString calculatedHash = hashPassword(password + salt.toHex());
+    if (!beginWrite()) {
+        return false;
+    }
     
-    qDebug() << "Stored hash:" << storedHash.left(10) + "...";
-    qDebug() << "Calculated hash:" << calculatedHash.left(10) + "...";
+    // A root that no longer matches stays unsealed under the new key too
+    bool rootIntact = integrityRootStatus(user.id, VaultIntegrity::deriveKey(oldKey)) == IntegrityReport::RootIntact;
     
-    bool valid = (storedHash == calculatedHash);
+    // Note dictionaries are needed in plaintext while the notes move to the new key
+    const QList<qint64> dictionaryIds = loadNoteDictionaries(user.id, oldKey);
     
-    if (valid) {
-        qDebug() << "User validation successful";
-        currentUserId = userId;
-        currentUsername = username;
+    // The vault key changes with the KDF, so every stored entry is re-encrypted and re-indexed
+    int afterId = 0;
+    while (true) {
+        QList<StoredEntry> rows;
+        if (!fetchStoredPage(user.id, afterId, INTEGRITY_BATCH_SIZE, true, rows)) {
+            return endWrite(false);
+        }
         
-        // Set the master key
-        if (!setMasterKey(password)) {
-            qWarning() << "Failed to set master key";
-            return false;
+        if (rows.isEmpty()) {
+            break;
         }
-    } else {
-        qWarning() << "Password validation failed for user:" << username;
+        
+        for (const StoredEntry &row : std::as_const(rows)) {
+            if (!rewriteStoredEntry(row, user.id, oldKey, credentials.keys.masterKey)) {
+                return endWrite(false);
+            }
+        }
+        afterId = rows.last().id;
+    }
+    
+    for (qint64 id : dictionaryIds) {
+        if (!storeNoteDictionary(user.id, id, credentials.keys.masterKey)) {
+            return endWrite(false);
+        }
+    }
+    
+    // Only the per-attachment keys are rewrapped; the chunks themselves stay as they are
+    if (!rewrapAttachmentKeys(user.id, oldKey, credentials.keys.masterKey) ||
+        !rewrapHistory(user.id, oldKey, credentials.keys.masterKey)) {
+        return endWrite(false);
+    }
+    
+    CachedStatement query = statement(SQL_UPDATE_USER_CREDENTIALS);
+    query->addBindValue(credentials.keys.verifier);
+    query->addBindValue(credentials.salt);
+    query->addBindValue(credentials.kdf.algorithm);
+    query->addBindValue(credentials.kdf.cost);
+    query->addBindValue(credentials.kdf.blockSize);
+    query->addBindValue(credentials.kdf.parallelism);
+    query->addBindValue(user.id);
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to update user credentials:" << query->lastError().text();
+        return endWrite(false);
+    }
+    
+    if (rootIntact && !sealIntegrityRoot(user.id, VaultIntegrity::deriveKey(credentials.keys.masterKey))) {
+        return endWrite(false);
+    }
+    
+    if (!endWrite(true)) {
+        return false;
     }
     
-    return valid;
+    qDebug() << "Credential upgrade completed for user:" << user.username;
+    return true;
+}
+
+Database::Session::~Session()
+{
+    OPENSSL_cleanse(masterKey.data(), masterKey.size());
+    OPENSSL_cleanse(indexKey.data(), indexKey.size());
+    OPENSSL_cleanse(integrityKey.data(), integrityKey.size());
+}
+
+Database::SessionRef Database::currentSession() const
+{
+    QMutexLocker locker(&sessionMutex);
+    return activeSession;
+}
+
+int Database::getCurrentUserId() const
+{
+    return currentSession()->userId;
 }
 
-bool Database::setMasterKey(const QString &password)
+void Database::startSession(int userId, const QString &username, const QByteArray &masterKey)
 {
-    qDebug() << "Setting master key for password";
+    auto next = std::make_shared<Session>();
+    next->userId = userId;
+    next->username = username;
+    next->masterKey = masterKey;
+    next->indexKey = BlindIndex::deriveKey(masterKey);
+    next->integrityKey = VaultIntegrity::deriveKey(masterKey);
+    
+    // The previous session is wiped once the calls still using it return
+    {
+        QMutexLocker locker(&sessionMutex);
+        activeSession = std::move(next);
+    }
     
-    // Store the password directly as the master key
-    // This is simpler and more reliable for now
-    masterKey = QCryptographicHash::hash(password.toUtf8(), QCryptographicHash::Sha256);
+    // Dictionaries are derived from note contents, so they go with the key
+    {
+        QMutexLocker locker(&noteDictionaryMutex);
+        for (QByteArray &dictionary : noteDictionaries) {
+            OPENSSL_cleanse(dictionary.data(), dictionary.size());
+        }
+        noteDictionaries.clear();
+        activeDictionaryId = 0;
+    }
     
     qDebug() << "Master key set, size:" << masterKey.size();
-    return true;
 }
 
 QByteArray Database::generateIV()
@@ -311,15 +631,38 @@ QByteArray Database::generateIV()
     return iv;
 }
 
-QByteArray Database::encryptPassword(const QString &password)
+QByteArray Database::encryptPassword(const QString &password, const QByteArray &context)
 {
-    if (masterKey.isEmpty()) {
+    const SessionRef session = currentSession();
+    
+    if (session->masterKey.isEmpty()) {
         qWarning() << "Master key not set";
         return QByteArray();
     }
     
+    return encryptWithKey(session->masterKey, password.toUtf8(), context);
+}
+
+QString Database::decryptPassword(const QByteArray &encryptedData)
+{
+    const SessionRef session = currentSession();
+    
+    if (session->masterKey.isEmpty()) {
+        return QString();
+    }
+    
+    return QString::fromUtf8(decryptWithKey(session->masterKey, encryptedData));
+}
+
+QByteArray Database::encryptWithKey(const QByteArray &key, const QByteArray &plaintext, const QByteArray &context)
+{
+    return encryptWithKey(key, plaintext.constData(), plaintext.size(), context);
+}
+
+QByteArray Database::encryptWithKey(const QByteArray &key, const char *plaintext, int plaintextSize,
+                                    const QByteArray &context)
+{
     QByteArray iv = generateIV();
-    QByteArray plaintext = password.toUtf8();
     QByteArray ciphertext;
     
     // Create and initialize the context
@@ -329,21 +672,32 @@ QByteArray Database::encryptPassword(const QString &password)
     }
     
     // Initialize the encryption operation
-    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr,
-                          reinterpret_cast<const unsigned char*>(masterKey.constData()),
+    if (EVP_EncryptInit_ex(ctx, gcmCipher(), nullptr,
+                          reinterpret_cast<const unsigned char*>(key.constData()),
                           reinterpret_cast<const unsigned char*>(iv.constData())) != 1) {
         EVP_CIPHER_CTX_free(ctx);
         return QByteArray();
     }
     
+    // The context is authenticated with the tag but not stored
+    int len = 0;
+    if (!context.isEmpty() &&
+        EVP_EncryptUpdate(ctx, nullptr, &len,
+                         reinterpret_cast<const unsigned char*>(context.constData()),
+                         context.size()) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return QByteArray();
+    }
+    
     // Encrypt the plaintext
-    ciphertext.resize(plaintext.size() + EVP_MAX_BLOCK_LENGTH);
-    int len;
-    if (EVP_EncryptUpdate(ctx,
+    ciphertext.resize(plaintextSize + EVP_MAX_BLOCK_LENGTH);
+    len = 0;
+    if (plaintextSize > 0 &&
+        EVP_EncryptUpdate(ctx,
                          reinterpret_cast<unsigned char*>(ciphertext.data()),
                          &len,
-                         reinterpret_cast<const unsigned char*>(plaintext.constData()),
-                         plaintext.size()) != 1) {
+                         reinterpret_cast<const unsigned char*>(plaintext),
+                         plaintextSize) != 1) {
         EVP_CIPHER_CTX_free(ctx);
         return QByteArray();
     }
@@ -375,217 +729,3258 @@ QByteArray Database::encryptPassword(const QString &password)
     return result;
 }
 
-QString Database::decryptPassword(const QByteArray &encryptedData)
+QByteArray Database::decryptWithKey(const QByteArray &key, const QByteArray &encryptedData, const QByteArray &context)
 {
-    if (masterKey.isEmpty() || encryptedData.size() < IV_SIZE + 16) {
-        return QString();
+    QByteArray plaintext(qMax(0, encryptedData.size() - IV_SIZE - 16), Qt::Uninitialized);
+    
+    int length = decryptInto(key, encryptedData, plaintext.data(), context);
+    if (length < 0) {
+        return QByteArray();
+    }
+    
+    plaintext.truncate(length);
+    return plaintext;
+}
+
+SecretBuffer Database::decryptSecret(const QByteArray &encryptedData, const QByteArray &context, bool *ok)
+{
+    const SessionRef session = currentSession();
+    
+    if (ok) {
+        *ok = false;
+    }
+    if (session->masterKey.isEmpty()) {
+        return SecretBuffer();
+    }
+    
+    // Decrypt straight into locked memory so no unlocked copy of the plaintext exists
+    SecretBuffer secret(qMax(0, encryptedData.size() - IV_SIZE - 16));
+    
+    int length = decryptInto(session->masterKey, encryptedData, secret.data(), context);
+    if (length < 0) {
+        return SecretBuffer();
+    }
+    
+    secret.truncate(length);
+    if (ok) {
+        *ok = true;
+    }
+    return secret;
+}
+
+int Database::decryptInto(const QByteArray &key, const QByteArray &encryptedData, char *output, const QByteArray &context)
+{
+    if (key.size() != KEY_SIZE || encryptedData.size() < IV_SIZE + 16) {
+        return -1;
+    }
+    
+    // Layout is IV + ciphertext + tag; read the parts in place
+    const unsigned char *iv = reinterpret_cast<const unsigned char*>(encryptedData.constData());
+    const unsigned char *ciphertext = iv + IV_SIZE;
+    const int ciphertextSize = encryptedData.size() - IV_SIZE - 16;
+    unsigned char tag[16];
+    memcpy(tag, ciphertext + ciphertextSize, sizeof(tag));
+    
+    // A missing buffer is only acceptable for empty secrets (failed secure allocation otherwise)
+    if (!output && ciphertextSize > 0) {
+        return -1;
     }
     
-    // Extract IV, ciphertext and tag
-    QByteArray iv = encryptedData.left(IV_SIZE);
-    QByteArray tag = encryptedData.right(16);
-    QByteArray ciphertext = encryptedData.mid(IV_SIZE, encryptedData.size() - IV_SIZE - 16);
+    // Empty secrets have no buffer; GCM still needs somewhere to point
+    unsigned char empty[1];
+    unsigned char *out = output ? reinterpret_cast<unsigned char*>(output) : empty;
     
     // Create and initialize the context
     EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
     if (!ctx) {
-        return QString();
+        return -1;
     }
     
     // Initialize the decryption operation
-    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr,
-                          reinterpret_cast<const unsigned char*>(masterKey.constData()),
-                          reinterpret_cast<const unsigned char*>(iv.constData())) != 1) {
+    if (EVP_DecryptInit_ex(ctx, gcmCipher(), nullptr,
+                          reinterpret_cast<const unsigned char*>(key.constData()),
+                          iv) != 1) {
         EVP_CIPHER_CTX_free(ctx);
-        return QString();
+        return -1;
     }
     
     // Set the tag
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, 16,
-                           const_cast<char*>(tag.constData())) != 1) {
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, 16, tag) != 1) {
         EVP_CIPHER_CTX_free(ctx);
-        return QString();
+        return -1;
+    }
+    
+    // Ciphertext moved to another entry or field fails the tag check below
+    int len = 0;
+    if (!context.isEmpty() &&
+        EVP_DecryptUpdate(ctx, nullptr, &len,
+                         reinterpret_cast<const unsigned char*>(context.constData()),
+                         context.size()) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return -1;
     }
     
     // Decrypt the ciphertext
-    QByteArray plaintext;
-    plaintext.resize(ciphertext.size());
-    int len;
-    if (EVP_DecryptUpdate(ctx,
-                         reinterpret_cast<unsigned char*>(plaintext.data()),
+    len = 0;
+    if (ciphertextSize > 0 &&
+        EVP_DecryptUpdate(ctx,
+                         out,
                          &len,
-                         reinterpret_cast<const unsigned char*>(ciphertext.constData()),
-                         ciphertext.size()) != 1) {
+                         ciphertext,
+                         ciphertextSize) != 1) {
         EVP_CIPHER_CTX_free(ctx);
-        return QString();
+        return -1;
     }
     
-    // Finalize the decryption
-    int finalLen;
-    if (EVP_DecryptFinal_ex(ctx,
-                           reinterpret_cast<unsigned char*>(plaintext.data() + len),
-                           &finalLen) != 1) {
+    // Finalize the decryption; this is where the tag is checked
+    int finalLen = 0;
+    if (EVP_DecryptFinal_ex(ctx, out + len, &finalLen) != 1) {
         EVP_CIPHER_CTX_free(ctx);
-        return QString();
+        if (len > 0) {
+            OPENSSL_cleanse(out, len);
+        }
+        return -1;
     }
     
     EVP_CIPHER_CTX_free(ctx);
     
-    return QString::fromUtf8(plaintext.left(len + finalLen));
+    return len + finalLen;
 }
 
-QString Database::hashPassword(const QString &password)
+
+bool Database::addPassword(const QString &name, const QString &url, const QString &username, const QString &password, const QString &note,
+                           const QList<CustomField> &fields)
 {
-    qDebug() << "Hashing password of length:" << password.length();
-    
-    // Use SHA-256 for consistent hashing
-    QByteArray hash = QCryptographicHash::hash(
-        password.toUtf8(),
-        QCryptographicHash::Sha256
-    );
+    if (!pool->isWriterThread()) {
+        return addPasswordAsync(name, url, username, password, note, fields).result();
+    }
     
-    QString hexHash = hash.toHex();
-    qDebug() << "Generated hash of length:" << hexHash.length();
+    const SessionRef session = currentSession();
     
-    return hexHash;
-}
-
-bool Database::addPassword(const QString &name, const QString &url, const QString &username, const QString &password, const QString &note)
-{
-    if (currentUserId <= 0) {
+    if (session->userId <= 0) {
         qWarning() << "No user is logged in";
         return false;
     }
     
-    qDebug() << "Adding password for name:" << name << "url:" << url << "username:" << username << "user_id:" << currentUserId;
+    clearPrefetchedEntries();
     
-    QByteArray encryptedData = encryptPassword(password);
-    if (encryptedData.isEmpty()) {
-        qWarning() << "Failed to encrypt password";
+    if (!beginWrite()) {
         return false;
     }
     
-    qDebug() << "Password encrypted successfully. Encrypted data size:" << encryptedData.size();
-    
-    QSqlQuery query;
-    query.prepare("INSERT INTO passwords (user_id, name, url, username, password, note) VALUES (?, ?, ?, ?, ?, ?)");
-    query.addBindValue(currentUserId);
-    query.addBindValue(name);
-    query.addBindValue(url);
-    query.addBindValue(username);
-    query.addBindValue(encryptedData);
-    query.addBindValue(note);
-    
-    if (!query.exec()) {
-        qWarning() << "Failed to add password. SQL error:" << query.lastError().text();
-        qDebug() << "SQL driver error code:" << query.lastError().nativeErrorCode();
-        qDebug() << "SQL query:" << query.lastQuery();
-        return false;
+    int id = insertEntry(name, url, username, password, note, fields);
+    if (id <= 0) {
+        return endWrite(false);
     }
     
-    qDebug() << "Password added successfully for name:" << name << "url:" << url;
-    return true;
+    qDebug() << "Password added successfully with ID:" << id;
+    return endWrite(true);
 }
 
-bool Database::updatePassword(int id, const QString &name, const QString &url, const QString &username, const QString &password, const QString &note)
+int Database::insertEntry(const QString &name, const QString &url, const QString &username, const QString &password,
+                          const QString &note, const QList<CustomField> &fields, QByteArray *uuidOut)
 {
-    if (currentUserId <= 0) {
-        qWarning() << "No user is logged in";
-        return false;
-    }
+    const SessionRef session = currentSession();
+    
+    qDebug() << "Adding password for user_id:" << session->userId;
     
-    QByteArray encryptedData = encryptPassword(password);
+    // Every field is bound to the new entry's uuid
+    QByteArray uuid = VaultSync::generateUuid();
+    QByteArray encryptedData = encryptPassword(password, VaultIntegrity::fieldContext(session->userId, uuid, "password"));
     if (encryptedData.isEmpty()) {
         qWarning() << "Failed to encrypt password";
-        return false;
+        return -1;
     }
     
-    QSqlQuery query;
-    query.prepare("UPDATE passwords SET name = ?, url = ?, username = ?, password = ?, note = ?, updated_at = CURRENT_TIMESTAMP "
-                 "WHERE id = ? AND user_id = ?");
-    query.addBindValue(name);
-    query.addBindValue(url);
-    query.addBindValue(username);
-    query.addBindValue(encryptedData);
-    query.addBindValue(note);
-    query.addBindValue(id);
-    query.addBindValue(currentUserId);
+    qDebug() << "Password encrypted successfully. Encrypted data size:" << encryptedData.size();
     
-    if (!query.exec()) {
-        qWarning() << "Failed to update password:" << query.lastError().text();
-        return false;
+    QByteArray storedFields;
+    if (!packFields(session->masterKey, fields, VaultIntegrity::fieldContext(session->userId, uuid, "fields"), storedFields)) {
+        return -1;
     }
     
-    return query.numRowsAffected() > 0;
-}
-
-bool Database::deletePassword(int id)
-{
-    if (currentUserId <= 0) {
-        qWarning() << "No user is logged in";
-        return false;
+    QByteArray encryptedName = encryptField(session->masterKey, name, VaultIntegrity::fieldContext(session->userId, uuid, "name"));
+    QByteArray encryptedUrl = encryptField(session->masterKey, url, VaultIntegrity::fieldContext(session->userId, uuid, "url"));
+    QByteArray encryptedUsername = encryptField(session->masterKey, username,
+                                                VaultIntegrity::fieldContext(session->userId, uuid, "username"));
+    QByteArray noteText = note.toUtf8();
+    qint64 noteDictionaryId = -1;
+    QByteArray storedNote = packNote(session->masterKey, noteText, VaultIntegrity::fieldContext(session->userId, uuid, "note"),
+                                     &noteDictionaryId);
+    
+    CachedStatement query = statement(SQL_INSERT_ENTRY);
+    query->addBindValue(session->userId);
+    query->addBindValue(encryptedName);
+    query->addBindValue(encryptedUrl);
+    query->addBindValue(encryptedUsername);
+    query->addBindValue(encryptedData);
+    query->addBindValue(noteText.size());
+    query->addBindValue(storedFields.isEmpty() ? QVariant() : QVariant(storedFields));
+    query->addBindValue(uuid);
+    query->addBindValue(VaultSync::bucketOf(uuid));
+    query->addBindValue(VaultSync::entryHash(encryptedName, encryptedUrl, encryptedUsername, encryptedData,
+                                             storedNote, storedFields));
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to add password. SQL error:" << query->lastError().text();
+        qDebug() << "SQL driver error code:" << query->lastError().nativeErrorCode();
+        return -1;
     }
     
-    QSqlQuery query;
-    query.prepare("DELETE FROM passwords WHERE id = ? AND user_id = ?");
-    query.addBindValue(id);
-    query.addBindValue(currentUserId);
-    
-    if (!query.exec()) {
-        qWarning() << "Failed to delete password:" << query.lastError().text();
-        return false;
+    int id = query->lastInsertId().toInt();
+    if (!storeNote(id, storedNote, noteDictionaryId) ||
+        !storeSearchTokens(session->userId, id, session->indexKey, name, url, username) ||
+        !recordChange(session->userId, id, EntryChange::Added)) {
+        return -1;
     }
     
-    return query.numRowsAffected() > 0;
+    if (uuidOut) {
+        *uuidOut = uuid;
+    }
+    return id;
 }
 
-QSqlQuery Database::getPasswords(const QString &search)
+bool Database::updatePassword(int id, const QString &name, const QString &url, const QString &username, const QString &password, const QString &note,
+                              const QList<CustomField> &fields)
 {
-    QSqlQuery query;
+    if (!pool->isWriterThread()) {
+        return updatePasswordAsync(id, name, url, username, password, note, fields).result();
+    }
+    
+    const SessionRef session = currentSession();
     
-    if (currentUserId <= 0) {
+    if (session->userId <= 0) {
         qWarning() << "No user is logged in";
-        return query;
+        return false;
     }
     
-    if (search.isEmpty()) {
-        query.prepare("SELECT id, name, url, username, password, note FROM passwords "
-                     "WHERE user_id = ? "
-                     "ORDER BY name ASC");
-        query.addBindValue(currentUserId);
-    } else {
-        query.prepare("SELECT id, name, url, username, password, note FROM passwords "
-                     "WHERE user_id = ? AND (name LIKE ? OR url LIKE ? OR username LIKE ?) "
-                     "ORDER BY name ASC");
-        query.addBindValue(currentUserId);
-        query.addBindValue("%" + search + "%");
-        query.addBindValue("%" + search + "%");
-        query.addBindValue("%" + search + "%");
-    }
+    clearPrefetchedEntries();
     
-    if (!query.exec()) {
-        qWarning() << "Failed to get passwords:" << query.lastError().text();
+    // Every field is bound to the entry's uuid, which never changes
+    QByteArray uuid;
+    {
+        CachedStatement selectUuid = statement(SQL_SELECT_ENTRY_UUID);
+        selectUuid->addBindValue(id);
+        selectUuid->addBindValue(session->userId);
+        if (!selectUuid->exec() || !selectUuid->next()) {
+            qWarning() << "Entry with ID" << id << "not found";
+            return false;
+        }
+        uuid = selectUuid->value(0).toByteArray();
     }
     
-    return query;
+    QByteArray encryptedData = encryptPassword(password, VaultIntegrity::fieldContext(session->userId, uuid, "password"));
+    if (encryptedData.isEmpty()) {
+        qWarning() << "Failed to encrypt password";
+        return false;
+    }
+    
+    QByteArray storedFields;
+    if (!packFields(session->masterKey, fields, VaultIntegrity::fieldContext(session->userId, uuid, "fields"), storedFields) ||
+        !beginWrite()) {
+        return false;
+    }
+    
+    // The version being replaced goes to the history in the same transaction
+    EntryVersion next;
+    next.name = name;
+    next.url = url;
+    next.username = username;
+    next.password = password;
+    next.note = note;
+    next.fields = fields;
+    if (!recordHistory(id, next)) {
+        return endWrite(false);
+    }
+    
+    QByteArray encryptedName = encryptField(session->masterKey, name, VaultIntegrity::fieldContext(session->userId, uuid, "name"));
+    QByteArray encryptedUrl = encryptField(session->masterKey, url, VaultIntegrity::fieldContext(session->userId, uuid, "url"));
+    QByteArray encryptedUsername = encryptField(session->masterKey, username,
+                                                VaultIntegrity::fieldContext(session->userId, uuid, "username"));
+    QByteArray noteText = note.toUtf8();
+    qint64 noteDictionaryId = -1;
+    QByteArray storedNote = packNote(session->masterKey, noteText, VaultIntegrity::fieldContext(session->userId, uuid, "note"),
+                                     &noteDictionaryId);
+    
+    CachedStatement query = statement(SQL_UPDATE_ENTRY);
+    query->addBindValue(encryptedName);
+    query->addBindValue(encryptedUrl);
+    query->addBindValue(encryptedUsername);
+    query->addBindValue(encryptedData);
+    query->addBindValue(noteText.size());
+    query->addBindValue(storedFields.isEmpty() ? QVariant() : QVariant(storedFields));
+    query->addBindValue(VaultSync::entryHash(encryptedName, encryptedUrl, encryptedUsername, encryptedData,
+                                             storedNote, storedFields));
+    query->addBindValue(id);
+    query->addBindValue(session->userId);
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to update password:" << query->lastError().text();
+        return endWrite(false);
+    }
+    
+    if (query->numRowsAffected() <= 0) {
+        return endWrite(false);
+    }
+    
+    return endWrite(storeNote(id, storedNote, noteDictionaryId) &&
+                    storeSearchTokens(session->userId, id, session->indexKey, name, url, username) &&
+                    recordChange(session->userId, id, EntryChange::Updated));
+}
+
+bool Database::deletePassword(int id)
+{
+    if (!pool->isWriterThread()) {
+        return deletePasswordAsync(id).result();
+    }
+    
+    const SessionRef session = currentSession();
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return false;
+    }
+    
+    clearPrefetchedEntries();
+    
+    if (!beginWrite()) {
+        return false;
+    }
+    
+    // The tombstone carries the deletion to other copies of the vault
+    CachedStatement selectUuid = statement(SQL_SELECT_ENTRY_UUID);
+    selectUuid->addBindValue(id);
+    selectUuid->addBindValue(session->userId);
+    
+    if (!selectUuid->exec() || !selectUuid->next()) {
+        qWarning() << "Password to delete not found:" << id;
+        return endWrite(false);
+    }
+    
+    QByteArray uuid = selectUuid->value(0).toByteArray();
+    int bucket = selectUuid->value(1).toInt();
+    selectUuid->finish();
+    
+    CachedStatement tombstone = statement(SQL_INSERT_TOMBSTONE);
+    tombstone->addBindValue(uuid);
+    tombstone->addBindValue(session->userId);
+    tombstone->addBindValue(bucket);
+    tombstone->addBindValue(VaultSync::tombstoneHash(uuid));
+    
+    if (!tombstone->exec()) {
+        qWarning() << "Failed to record deletion:" << tombstone->lastError().text();
+        return endWrite(false);
+    }
+    
+    CachedStatement query = statement(SQL_DELETE_ENTRY_TOKENS);
+    query->addBindValue(id);
+    query->addBindValue(session->userId);
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to delete search tokens:" << query->lastError().text();
+        return endWrite(false);
+    }
+    
+    CachedStatement deleteEntry = statement(SQL_DELETE_ENTRY);
+    deleteEntry->addBindValue(id);
+    deleteEntry->addBindValue(session->userId);
+    
+    if (!deleteEntry->exec()) {
+        qWarning() << "Failed to delete password:" << deleteEntry->lastError().text();
+        return endWrite(false);
+    }
+
+    if (deleteEntry->numRowsAffected() <= 0) {
+        return endWrite(false);
+    }
+    
+    return endWrite(recordChange(session->userId, id, EntryChange::Deleted));
+}
+
+bool Database::deletePasswords(const QList<int> &ids)
+{
+    if (!pool->isWriterThread()) {
+        return deletePasswordsAsync(ids).result();
+    }
+    
+    const SessionRef session = currentSession();
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return false;
+    }
+    
+    clearPrefetchedEntries();
+    
+    if (!beginWrite()) {
+        return false;
+    }
+    
+    if (!fillBulkIds(ids)) {
+        return endWrite(false);
+    }
+    
+    // Tombstone hashes are computed here, so this is the one per-row step
+    CachedStatement selectUuids = statement(SQL_SELECT_BULK_UUIDS);
+    if (!selectUuids->exec()) {
+        qWarning() << "Failed to read entries to delete:" << selectUuids->lastError().text();
+        return endWrite(false);
+    }
+    
+    QList<QPair<QByteArray, int>> uuids;
+    while (selectUuids->next()) {
+        uuids.append({selectUuids->value(0).toByteArray(), selectUuids->value(1).toInt()});
+    }
+    selectUuids->finish();
+    
+    if (uuids.isEmpty()) {
+        qWarning() << "None of the passwords to delete were found";
+        return endWrite(false);
+    }
+    
+    CachedStatement tombstone = statement(SQL_INSERT_TOMBSTONE);
+    for (const auto &uuid : std::as_const(uuids)) {
+        tombstone->addBindValue(uuid.first);
+        tombstone->addBindValue(session->userId);
+        tombstone->addBindValue(uuid.second);
+        tombstone->addBindValue(VaultSync::tombstoneHash(uuid.first));
+        
+        if (!tombstone->exec()) {
+            qWarning() << "Failed to record deletion:" << tombstone->lastError().text();
+            return endWrite(false);
+        }
+    }
+    
+    CachedStatement tokens = statement(SQL_DELETE_BULK_TOKENS);
+    if (!tokens->exec()) {
+        qWarning() << "Failed to delete search tokens:" << tokens->lastError().text();
+        return endWrite(false);
+    }
+    
+    CachedStatement changes = statement(SQL_RECORD_BULK_CHANGES);
+    changes->addBindValue(session->userId);
+    changes->addBindValue(int(EntryChange::Deleted));
+    if (!changes->exec()) {
+        qWarning() << "Failed to record changes:" << changes->lastError().text();
+        return endWrite(false);
+    }
+    
+    // Notes, attachments and history go with their entries through ON DELETE CASCADE
+    CachedStatement deleteEntries = statement(SQL_DELETE_BULK_ENTRIES);
+    if (!deleteEntries->exec()) {
+        qWarning() << "Failed to delete passwords:" << deleteEntries->lastError().text();
+        return endWrite(false);
+    }
+    
+    qDebug() << "Deleted" << deleteEntries->numRowsAffected() << "passwords";
+    return endWrite(deleteEntries->numRowsAffected() == uuids.size());
+}
+
+bool Database::editPasswords(const QList<int> &ids, const BulkEdit &edit)
+{
+    if (!pool->isWriterThread()) {
+        return editPasswordsAsync(ids, edit).result();
+    }
+    
+    const SessionRef session = currentSession();
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return false;
+    }
+    
+    clearPrefetchedEntries();
+    
+    if (!beginWrite()) {
+        return false;
+    }
+    
+    if (!fillBulkIds(ids)) {
+        return endWrite(false);
+    }
+    
+    QList<StoredEntry> rows;
+    {
+        CachedStatement select = statement(SQL_SELECT_BULK_ENTRIES);
+        if (!select->exec()) {
+            qWarning() << "Failed to read entries:" << select->lastError().text();
+            return endWrite(false);
+        }
+        while (select->next()) {
+            rows.append(readStoredEntry(*select, true));
+        }
+    }
+    
+    // The id list, search tokens and journal are handled in one statement each. Every row
+    // still gets its own IVs, hash and tokens, but the password, note and custom fields
+    // keep their ciphertext, and a metadata edit does not push the history along.
+    CachedStatement clearTokens = statement(SQL_DELETE_BULK_TOKENS);
+    if (!clearTokens->exec()) {
+        qWarning() << "Failed to delete search tokens:" << clearTokens->lastError().text();
+        return endWrite(false);
+    }
+    
+    CachedStatement update = statement(SQL_UPDATE_ENTRY_METADATA);
+    for (const StoredEntry &row : std::as_const(rows)) {
+        // Rows the login could not bind did not decrypt then either; none is rewritten
+        // with blanks in place of a field that does not decrypt
+        QString name;
+        QString url;
+        QString username;
+        if (!row.boundFields || !decryptField(session->masterKey, row.name, rowContext(row, "name"), name) ||
+            !decryptField(session->masterKey, row.url, rowContext(row, "url"), url) ||
+            !decryptField(session->masterKey, row.username, rowContext(row, "username"), username)) {
+            qWarning() << "Entry" << row.id << "could not be decrypted; bulk edit cancelled";
+            return endWrite(false);
+        }
+        
+        if (edit.setSite) {
+            name = edit.name;
+            url = edit.url;
+        }
+        if (edit.setUsername) {
+            username = edit.username;
+        }
+        
+        QByteArray encryptedName = encryptField(session->masterKey, name, rowContext(row, "name"));
+        QByteArray encryptedUrl = encryptField(session->masterKey, url, rowContext(row, "url"));
+        QByteArray encryptedUsername = encryptField(session->masterKey, username, rowContext(row, "username"));
+        
+        update->addBindValue(encryptedName);
+        update->addBindValue(encryptedUrl);
+        update->addBindValue(encryptedUsername);
+        update->addBindValue(VaultSync::entryHash(encryptedName, encryptedUrl, encryptedUsername, row.password,
+                                                  row.note, row.fields));
+        update->addBindValue(row.id);
+        update->addBindValue(session->userId);
+        
+        if (!update->exec()) {
+            qWarning() << "Failed to update password:" << update->lastError().text();
+            return endWrite(false);
+        }
+        if (!insertSearchTokens(session->userId, row.id, session->indexKey, name, url, username)) {
+            return endWrite(false);
+        }
+    }
+    
+    CachedStatement changes = statement(SQL_RECORD_BULK_CHANGES);
+    changes->addBindValue(session->userId);
+    changes->addBindValue(int(EntryChange::Updated));
+    if (!changes->exec()) {
+        qWarning() << "Failed to record changes:" << changes->lastError().text();
+        return endWrite(false);
+    }
+    
+    qDebug() << "Edited" << rows.size() << "passwords";
+    return endWrite(true);
+}
+
+QList<PlainEntry> Database::getPlainEntries(const QList<int> &ids, bool withExtras)
+{
+    const SessionRef session = currentSession();
+    
+    QList<PlainEntry> entries;
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return entries;
+    }
+    
+    // All or nothing: a missing or unreadable entry empties the list, so callers never act
+    // on part of a selection
+    auto fail = [&entries]() {
+        for (PlainEntry &entry : entries) {
+            entry.wipe();
+        }
+        entries.clear();
+        return entries;
+    };
+    
+    CachedStatement query = statement(SQL_SELECT_ENTRY_WITH_NOTE);
+    for (int id : ids) {
+        query->addBindValue(id);
+        query->addBindValue(session->userId);
+        
+        if (!query->exec()) {
+            qWarning() << "Failed to read entry:" << query->lastError().text();
+            return fail();
+        }
+        if (!query->next()) {
+            qWarning() << "Entry" << id << "not found";
+            query->finish();
+            return fail();
+        }
+        
+        StoredEntry row = readStoredEntry(*query, true);
+        query->finish();
+        
+        bool readable = false;
+        bool passwordReadable = false;
+        PasswordEntry stored = decryptStoredEntry(row, session->masterKey, &readable);
+        
+        PlainEntry entry;
+        entry.name = stored.name;
+        entry.url = stored.url;
+        entry.username = stored.username;
+        entry.note = stored.note;
+        entry.fields = stored.fields;
+        {
+            SecretBuffer password = decryptSecret(row.password, rowContext(row, "password"), &passwordReadable);
+            entry.password = password.toString();
+        }
+        entries.append(entry);
+        
+        if (!readable || !passwordReadable) {
+            qWarning() << "Entry" << id << "could not be decrypted";
+            return fail();
+        }
+        if (withExtras && !readEntryExtras(id, entries.last())) {
+            return fail();
+        }
+    }
+    
+    return entries;
+}
+
+bool Database::readEntryExtras(int id, PlainEntry &entry)
+{
+    const SessionRef session = currentSession();
+    
+    // Listed here rather than through getHistory, which cannot tell a failed read from
+    // an entry without versions; dropping them would lose them with the source entry
+    QList<qint64> versionIds;
+    {
+        CachedStatement query = statement(SQL_SELECT_HISTORY);
+        query->addBindValue(id);
+        query->addBindValue(session->userId);
+        
+        if (!query->exec()) {
+            qWarning() << "Failed to list entry history:" << query->lastError().text();
+            return false;
+        }
+        while (query->next()) {
+            versionIds.prepend(query->value(0).toLongLong());
+        }
+    }
+    
+    for (qint64 versionId : versionIds) {
+        EntryVersion version = getHistoryVersion(id, versionId);
+        if (version.id < 0) {
+            qWarning() << "Version" << versionId << "of entry" << id << "could not be decoded";
+            return false;
+        }
+        entry.history.append(version);
+    }
+    
+    CachedStatement query = statement(SQL_SELECT_ENTRY_ATTACHMENT_KEYS);
+    query->addBindValue(id);
+    query->addBindValue(session->userId);
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to list attachments:" << query->lastError().text();
+        return false;
+    }
+    
+    while (query->next()) {
+        const bool bound = query->value(5).toBool();
+        const QByteArray uuid = query->value(6).toByteArray();
+        
+        // Appended before checking, so a failure still wipes the key
+        entry.attachments.append(MovedAttachment());
+        MovedAttachment &attachment = entry.attachments.last();
+        attachment.sourceId = query->value(0).toLongLong();
+        attachment.key = decryptWithKey(session->masterKey, query->value(2).toByteArray(),
+                                        boundContext(bound, session->userId, uuid, "attachment key"));
+        attachment.size = query->value(3).toLongLong();
+        
+        bool named = decryptField(session->masterKey, query->value(1).toByteArray(),
+                                  boundContext(bound, session->userId, uuid, "attachment name"), attachment.name);
+        if (!named || attachment.key.size() != AttachmentStore::KEY_SIZE) {
+            qWarning() << "Attachment" << attachment.sourceId << "of entry" << id << "could not be decrypted";
+            return false;
+        }
+        if (query->value(4).toInt() != AttachmentStore::CHUNK_SIZE) {
+            qWarning() << "Unsupported attachment chunk size:" << query->value(4).toInt();
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+void PlainEntry::wipe()
+{
+    SecretBuffer::wipe(password);
+    for (EntryVersion &version : history) {
+        SecretBuffer::wipe(version.password);
+    }
+    for (MovedAttachment &attachment : attachments) {
+        OPENSSL_cleanse(attachment.key.data(), attachment.key.size());
+    }
+}
+
+bool Database::fillBulkIds(const QList<int> &ids)
+{
+    const SessionRef session = currentSession();
+    
+    QSqlQuery setup(connection());
+    if (!setup.exec(SQL_CREATE_BULK_IDS) || !setup.exec(SQL_CLEAR_BULK_IDS)) {
+        qWarning() << "Failed to prepare the bulk id list:" << setup.lastError().text();
+        return false;
+    }
+    
+    // Ids of other users or already deleted entries never make it into the list
+    CachedStatement insert = statement(SQL_INSERT_BULK_ID);
+    for (int id : ids) {
+        insert->addBindValue(id);
+        insert->addBindValue(session->userId);
+        
+        if (!insert->exec()) {
+            qWarning() << "Failed to fill the bulk id list:" << insert->lastError().text();
+            return false;
+        }
+    }
+    
+    return true;
 }
 
 bool Database::importPasswords(const QList<QPair<QString, QPair<QString, QString>>> &passwords)
 {
-    if (currentUserId <= 0) {
+    if (!pool->isWriterThread()) {
+        return importPasswordsAsync(passwords).result();
+    }
+    
+    const SessionRef session = currentSession();
+    
+    if (session->userId <= 0) {
         qWarning() << "No user is logged in";
         return false;
     }
     
-    db.transaction();
+    if (!beginWrite()) {
+        return false;
+    }
     
     for (const auto &entry : passwords) {
         // Use the URL as name, and empty note
         if (!addPassword(entry.first, entry.first, entry.second.first, entry.second.second, QString())) {
-            db.rollback();
+            return endWrite(false);
+        }
+    }
+    
+    return endWrite(true);
+}
+
+bool Database::importEntries(const QList<PlainEntry> &entries, const QString &sourcePath)
+{
+    if (!pool->isWriterThread()) {
+        return importEntriesAsync(entries, sourcePath).result();
+    }
+    
+    const SessionRef session = currentSession();
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return false;
+    }
+    
+    clearPrefetchedEntries();
+    
+    // Sealed attachment chunks are copied straight from the source vault's file, through a
+    // read-only connection of its own so the writer's schema stays as it is
+    sqlite3 *source = nullptr;
+    const bool withAttachments = std::any_of(entries.cbegin(), entries.cend(), [](const PlainEntry &entry) {
+        return !entry.attachments.isEmpty();
+    });
+    if (withAttachments) {
+        if (sourcePath.isEmpty() || !ConnectionPool::nativeHandle(connection())) {
+            qWarning() << "Attachments need the source vault and the raw SQLite handle";
+            return false;
+        }
+        if (sqlite3_open_v2(sourcePath.toUtf8().constData(), &source, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+            qWarning() << "Failed to open the source vault:" << sqlite3_errmsg(source);
+            sqlite3_close(source);
+            return false;
+        }
+    }
+    
+    bool ok = beginWrite();
+    if (ok) {
+        for (const PlainEntry &entry : entries) {
+            QByteArray uuid;
+            int id = insertEntry(entry.name, entry.url, entry.username, entry.password, entry.note, entry.fields, &uuid);
+            if (id <= 0 || !storeEntryExtras(id, uuid, entry, source)) {
+                ok = false;
+                break;
+            }
+        }
+        ok = endWrite(ok);
+    }
+    
+    sqlite3_close(source);
+    return ok;
+}
+
+bool Database::storeEntryExtras(int id, const QByteArray &uuid, const PlainEntry &entry, sqlite3 *source)
+{
+    const SessionRef session = currentSession();
+    
+    // Oldest first, so each version becomes the delta base of the one stored before it;
+    // with history turned off here the versions are left behind like any others
+    const int keep = EntryHistory::keepCount();
+    if (keep > 0 && !entry.history.isEmpty()) {
+        for (const EntryVersion &version : entry.history) {
+            QByteArray snapshot = EntryHistory::serialize(version);
+            bool stored = !snapshot.isEmpty() && storeHistoryVersion(id, uuid, snapshot, version.changedAt);
+            OPENSSL_cleanse(snapshot.data(), snapshot.size());
+            if (!stored) {
+                return false;
+            }
+        }
+        
+        CachedStatement prune = statement(SQL_PRUNE_HISTORY);
+        prune->addBindValue(id);
+        prune->addBindValue(id);
+        prune->addBindValue(keep);
+        
+        if (!prune->exec()) {
+            qWarning() << "Failed to prune entry history:" << prune->lastError().text();
+            return false;
+        }
+    }
+    
+    if (entry.attachments.isEmpty()) {
+        return true;
+    }
+    
+    sqlite3 *handle = ConnectionPool::nativeHandle(connection());
+    for (const MovedAttachment &attachment : entry.attachments) {
+        // The chunks were sealed under the attachment's own key and carry no row id, so
+        // only the name and key are encrypted again, bound to the new entry
+        CachedStatement insert = statement(SQL_INSERT_ATTACHMENT);
+        insert->addBindValue(encryptField(session->masterKey, attachment.name,
+                                          VaultIntegrity::fieldContext(session->userId, uuid, "attachment name")));
+        insert->addBindValue(encryptWithKey(session->masterKey, attachment.key,
+                                            VaultIntegrity::fieldContext(session->userId, uuid, "attachment key")));
+        insert->addBindValue(attachment.size);
+        insert->addBindValue(AttachmentStore::CHUNK_SIZE);
+        insert->addBindValue(AttachmentStore::storedSize(attachment.size));
+        insert->addBindValue(id);
+        insert->addBindValue(session->userId);
+        
+        if (!insert->exec() || insert->numRowsAffected() != 1) {
+            qWarning() << "Failed to add attachment:" << insert->lastError().text();
+            return false;
+        }
+        
+        qint64 rowId = insert->lastInsertId().toLongLong();
+        insert->finish();
+        
+        if (!AttachmentStore::copy(source, attachment.sourceId, handle, rowId, attachment.size)) {
+            qWarning() << "Failed to copy attachment" << attachment.sourceId;
             return false;
         }
     }
     
-    return db.commit();
-} 
\ No newline at end of file
+    return true;
+}
+
+QFuture<bool> Database::addPasswordAsync(const QString &name, const QString &url, const QString &username, const QString &password, const QString &note,
+                                         const QList<CustomField> &fields)
+{
+    return pool->write([=]() { return addPassword(name, url, username, password, note, fields); });
+}
+
+QFuture<bool> Database::updatePasswordAsync(int id, const QString &name, const QString &url, const QString &username, const QString &password, const QString &note,
+                                            const QList<CustomField> &fields)
+{
+    return pool->write([=]() { return updatePassword(id, name, url, username, password, note, fields); });
+}
+
+QFuture<bool> Database::deletePasswordAsync(int id)
+{
+    return pool->write([=]() { return deletePassword(id); });
+}
+
+QFuture<bool> Database::deletePasswordsAsync(const QList<int> &ids)
+{
+    return pool->write([=]() { return deletePasswords(ids); });
+}
+
+QFuture<bool> Database::editPasswordsAsync(const QList<int> &ids, const BulkEdit &edit)
+{
+    return pool->write([=]() { return editPasswords(ids, edit); });
+}
+
+QFuture<QList<PlainEntry>> Database::getPlainEntriesAsync(const QList<int> &ids, bool withExtras)
+{
+    return pool->read([=]() { return getPlainEntries(ids, withExtras); });
+}
+
+QFuture<bool> Database::importPasswordsAsync(const QList<QPair<QString, QPair<QString, QString>>> &passwords)
+{
+    return pool->write([=]() { return importPasswords(passwords); });
+}
+
+QFuture<bool> Database::importEntriesAsync(const QList<PlainEntry> &entries, const QString &sourcePath)
+{
+    return pool->write([=]() { return importEntries(entries, sourcePath); });
+}
+
+QFuture<QList<PasswordEntry>> Database::getPasswordEntriesAsync(const QString &search)
+{
+    return pool->read([=]() { return getPasswordEntries(search); });
+}
+
+QFuture<bool> Database::entryExistsAsync(const QString &url, const QString &username)
+{
+    return pool->read([=]() { return entryExists(url, username); });
+}
+
+QList<PasswordEntry> Database::getPasswordEntries(const QString &search)
+{
+    const SessionRef session = currentSession();
+    
+    QList<PasswordEntry> entries;
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return entries;
+    }
+    
+    QList<StoredEntry> rows;
+    bool prefetched = false;
+    if (search.isEmpty()) {
+        // Login may finish before the prefetch does; its rows are still the fastest way in
+        QFuture<void> pending;
+        {
+            QMutexLocker locker(&prefetchMutex);
+            pending = prefetchTask;
+        }
+        pending.waitForFinished();
+        
+        QMutexLocker locker(&prefetchMutex);
+        if (prefetchedUserId == session->userId) {
+            rows = std::move(prefetchedEntries);
+            prefetchedEntries.clear();
+            prefetchedUserId = -1;
+            prefetched = true;
+        }
+    }
+    
+    if (!prefetched) {
+        rows = fetchStoredEntries(session->userId, BlindIndex::searchTokens(session->indexKey, search));
+    }
+    
+    for (const StoredEntry &row : rows) {
+        PasswordEntry entry = decryptStoredEntry(row, session->masterKey);
+        
+        // Trigram matches are a superset of substring matches
+        if (BlindIndex::matches(search, entry.name, entry.url, entry.username)) {
+            entries.append(entry);
+        }
+    }
+    
+    // Names are ciphertext on disk, so ordering happens after decryption
+    std::sort(entries.begin(), entries.end(), [](const PasswordEntry &a, const PasswordEntry &b) {
+        return QString::compare(a.name, b.name, Qt::CaseInsensitive) < 0;
+    });
+    
+    return entries;
+}
+
+bool Database::entryExists(const QString &url, const QString &username)
+{
+    const SessionRef session = currentSession();
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return false;
+    }
+    
+    QList<QByteArray> tokens = {
+        BlindIndex::exactToken(session->indexKey, BlindIndex::UrlField, url),
+        BlindIndex::exactToken(session->indexKey, BlindIndex::UsernameField, username)
+    };
+    
+    // Exact tokens are case-folded, so candidates are compared again in plaintext
+    const QList<StoredEntry> rows = fetchStoredEntries(session->userId, tokens);
+    for (const StoredEntry &row : rows) {
+        PasswordEntry entry = decryptStoredEntry(row, session->masterKey);
+        if (entry.url == url && entry.username == username) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+QFuture<void> Database::prefetchPasswordEntriesAsync(int userId)
+{
+    QMutexLocker locker(&prefetchMutex);
+    quint64 generation = ++prefetchGeneration;
+    prefetchedUserId = -1;
+    prefetchedEntries.clear();
+    
+    prefetchTask = pool->read([this, userId, generation]() {
+        QList<StoredEntry> rows = fetchStoredEntries(userId);
+        
+        // A write or a failed login while the rows were read makes them stale
+        QMutexLocker locker(&prefetchMutex);
+        if (generation != prefetchGeneration) {
+            return;
+        }
+        
+        qDebug() << "Prefetched" << rows.size() << "entries for user ID:" << userId;
+        prefetchedEntries = std::move(rows);
+        prefetchedUserId = userId;
+    });
+    return prefetchTask;
+}
+
+void Database::clearPrefetchedEntries()
+{
+    // Mutations clear this from the writer thread while reader threads may be filling it
+    QMutexLocker locker(&prefetchMutex);
+    ++prefetchGeneration;
+    prefetchedUserId = -1;
+    prefetchedEntries.clear();
+}
+
+bool Database::waitUntilReady()
+{
+    // Initialization runs on the writer thread, so writer-side callers are already behind it
+    if (pool->isWriterThread()) {
+        return true;
+    }
+    
+    initialized.waitForFinished();
+    return initialized.result();
+}
+
+QSqlDatabase Database::connection()
+{
+    waitUntilReady();
+    return pool->connection();
+}
+
+CachedStatement Database::statement(const QString &sql)
+{
+    waitUntilReady();
+    return pool->statement(sql);
+}
+
+ConnectionPool::StatementStats Database::statementCacheStats() const
+{
+    return pool->statementStats();
+}
+
+QList<EntryChange> Database::changesSince(qint64 seq, int limit)
+{
+    const SessionRef session = currentSession();
+    
+    QList<EntryChange> changes;
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return changes;
+    }
+    
+    CachedStatement query = statement(SQL_SELECT_CHANGES);
+    query->addBindValue(session->userId);
+    query->addBindValue(seq);
+    query->addBindValue(limit);
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to read change journal:" << query->lastError().text();
+        return changes;
+    }
+    
+    while (query->next()) {
+        EntryChange change;
+        change.seq = query->value(0).toLongLong();
+        change.passwordId = query->value(1).toInt();
+        change.type = EntryChange::Type(query->value(2).toInt());
+        changes.append(change);
+    }
+    
+    return changes;
+}
+
+QList<PasswordEntry> Database::getPasswordEntriesById(const QList<int> &ids)
+{
+    const SessionRef session = currentSession();
+    
+    QList<PasswordEntry> entries;
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return entries;
+    }
+    
+    // Primary-key lookups on one cached statement; ids that no longer exist are skipped
+    CachedStatement query = statement(SQL_SELECT_ENTRY);
+    for (int id : ids) {
+        query->addBindValue(id);
+        query->addBindValue(session->userId);
+        
+        if (!query->exec()) {
+            qWarning() << "Failed to read entry:" << query->lastError().text();
+            continue;
+        }
+        
+        if (query->next()) {
+            entries.append(decryptStoredEntry(readStoredEntry(*query), session->masterKey));
+        }
+        query->finish();
+    }
+    
+    return entries;
+}
+
+bool Database::getPasswordEntriesPage(int afterId, int limit, QList<PasswordEntry> &entries, bool withNotes)
+{
+    const SessionRef session = currentSession();
+    
+    entries.clear();
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return false;
+    }
+    
+    QList<StoredEntry> rows;
+    if (!fetchStoredPage(session->userId, afterId, limit, withNotes, rows)) {
+        return false;
+    }
+    
+    for (const StoredEntry &row : std::as_const(rows)) {
+        entries.append(decryptStoredEntry(row, session->masterKey));
+    }
+    
+    return true;
+}
+
+QString Database::getNote(int id)
+{
+    const SessionRef session = currentSession();
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return QString();
+    }
+    
+    CachedStatement query = statement(SQL_SELECT_NOTE);
+    query->addBindValue(id);
+    query->addBindValue(session->userId);
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to read note:" << query->lastError().text();
+        return QString();
+    }
+    
+    // Entries without a note have no row
+    if (!query->next()) {
+        return QString();
+    }
+    
+    StoredEntry row;
+    row.encryptedFields = query->value(0).toInt() > 0;
+    row.boundFields = query->value(0).toInt() > 1;
+    row.noteDictionaryId = query->value(1).isNull() ? -1 : query->value(1).toLongLong();
+    row.note = query->value(2).toByteArray();
+    row.userId = query->value(3).toInt();
+    row.uuid = query->value(4).toByteArray();
+    query->finish();
+    
+    return unpackNote(session->masterKey, row.note, row.noteDictionaryId, row.encryptedFields, rowContext(row, "note"));
+}
+
+QFuture<QString> Database::getNoteAsync(int id)
+{
+    return pool->read([=]() { return getNote(id); });
+}
+
+QList<CustomField> Database::getCustomFields(int id)
+{
+    const SessionRef session = currentSession();
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return QList<CustomField>();
+    }
+    
+    CachedStatement query = statement(SQL_SELECT_FIELDS);
+    query->addBindValue(id);
+    query->addBindValue(session->userId);
+    
+    if (!query->exec() || !query->next()) {
+        qWarning() << "Failed to read custom fields:" << query->lastError().text();
+        return QList<CustomField>();
+    }
+    
+    StoredEntry row;
+    row.fields = query->value(0).toByteArray();
+    row.boundFields = query->value(1).toInt() > 1;
+    row.userId = query->value(2).toInt();
+    row.uuid = query->value(3).toByteArray();
+    query->finish();
+    
+    return unpackFields(session->masterKey, row.fields, rowContext(row, "fields"));
+}
+
+QFuture<QList<CustomField>> Database::getCustomFieldsAsync(int id)
+{
+    return pool->read([=]() { return getCustomFields(id); });
+}
+
+QFuture<int> Database::compactNotesAsync()
+{
+    auto promise = std::make_shared<QPromise<int>>();
+    QFuture<int> future = promise->future();
+    promise->start();
+    
+    pool->write([this, promise]() {
+        if (currentSession()->userId <= 0) {
+            promise->addResult(0);
+            promise->finish();
+            return;
+        }
+        
+        if (activeDictionaryId <= 0 && !trainNoteDictionary()) {
+            qDebug() << "Too few notes to train a dictionary yet, compressing without one";
+        }
+        queueNoteBatch(promise, 0, 0);
+    });
+    return future;
+}
+
+void Database::queueNoteBatch(std::shared_ptr<QPromise<int>> promise, int afterId, int compacted)
+{
+    // Every batch is its own write task, queued behind whatever was submitted meanwhile,
+    // so edits only wait for one batch and no thread blocks on the writer
+    pool->write([this, promise, afterId, compacted]() {
+        int total = compacted;
+        int nextId = compactNoteBatch(afterId, &total);
+        if (nextId >= 0) {
+            queueNoteBatch(promise, nextId, total);
+            return;
+        }
+        
+        qDebug() << "Compressed" << total << "notes";
+        promise->addResult(total);
+        promise->finish();
+    });
+}
+
+qint64 Database::addAttachment(int passwordId, const QString &filePath)
+{
+    if (!pool->isWriterThread()) {
+        return addAttachmentAsync(passwordId, filePath).result();
+    }
+    
+    const SessionRef session = currentSession();
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return -1;
+    }
+    
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "Failed to open attachment:" << file.errorString();
+        return -1;
+    }
+    
+    const qint64 size = file.size();
+    if (size > AttachmentStore::MAX_ATTACHMENT_SIZE) {
+        qWarning() << "Attachment of" << size << "bytes is too large";
+        return -1;
+    }
+    
+    sqlite3 *handle = ConnectionPool::nativeHandle(connection());
+    if (!handle) {
+        qWarning() << "Attachments need the raw SQLite handle";
+        return -1;
+    }
+    
+    QByteArray key = AttachmentStore::generateKey();
+    if (key.isEmpty() || !beginWrite()) {
+        return -1;
+    }
+    
+    // Name and key are bound to the entry, so neither can be moved to another one
+    QByteArray uuid;
+    {
+        CachedStatement entry = statement(SQL_SELECT_ENTRY_UUID);
+        entry->addBindValue(passwordId);
+        entry->addBindValue(session->userId);
+        if (!entry->exec() || !entry->next()) {
+            qWarning() << "Entry with ID" << passwordId << "not found";
+            OPENSSL_cleanse(key.data(), key.size());
+            endWrite(false);
+            return -1;
+        }
+        uuid = entry->value(0).toByteArray();
+    }
+    
+    // The row starts as a zeroblob of the final size; the chunks are then written in place
+    CachedStatement insert = statement(SQL_INSERT_ATTACHMENT);
+    insert->addBindValue(encryptField(session->masterKey, QFileInfo(filePath).fileName(),
+                                      VaultIntegrity::fieldContext(session->userId, uuid, "attachment name")));
+    insert->addBindValue(encryptWithKey(session->masterKey, key, VaultIntegrity::fieldContext(session->userId, uuid, "attachment key")));
+    insert->addBindValue(size);
+    insert->addBindValue(AttachmentStore::CHUNK_SIZE);
+    insert->addBindValue(AttachmentStore::storedSize(size));
+    insert->addBindValue(passwordId);
+    insert->addBindValue(session->userId);
+    
+    if (!insert->exec() || insert->numRowsAffected() != 1) {
+        qWarning() << "Failed to add attachment:" << insert->lastError().text();
+        OPENSSL_cleanse(key.data(), key.size());
+        endWrite(false);
+        return -1;
+    }
+    
+    qint64 id = insert->lastInsertId().toLongLong();
+    insert->finish();
+    
+    bool ok = AttachmentStore::write(handle, id, key, file, size);
+    OPENSSL_cleanse(key.data(), key.size());
+    
+    if (!endWrite(ok)) {
+        return -1;
+    }
+    
+    qDebug() << "Added attachment of" << size << "bytes to entry" << passwordId;
+    return id;
+}
+
+bool Database::saveAttachment(qint64 attachmentId, const QString &filePath)
+{
+    const SessionRef session = currentSession();
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return false;
+    }
+    
+    QSqlDatabase db = connection();
+    sqlite3 *handle = ConnectionPool::nativeHandle(db);
+    if (!handle) {
+        qWarning() << "Attachments need the raw SQLite handle";
+        return false;
+    }
+    
+    // One read transaction, so the row and its blob come from the same snapshot
+    if (!db.transaction()) {
+        qWarning() << "Failed to start read transaction:" << db.lastError().text();
+        return false;
+    }
+    
+    CachedStatement query = statement(SQL_SELECT_ATTACHMENT);
+    query->addBindValue(attachmentId);
+    query->addBindValue(session->userId);
+    
+    if (!query->exec() || !query->next()) {
+        qWarning() << "Attachment not found:" << attachmentId;
+        db.rollback();
+        return false;
+    }
+    
+    QByteArray key = decryptWithKey(session->masterKey, query->value(0).toByteArray(),
+                                    boundContext(query->value(3).toBool(), session->userId, query->value(4).toByteArray(),
+                                                 "attachment key"));
+    qint64 size = query->value(1).toLongLong();
+    int chunkSize = query->value(2).toInt();
+    query->finish();
+    
+    bool ok = false;
+    if (chunkSize != AttachmentStore::CHUNK_SIZE) {
+        qWarning() << "Unsupported attachment chunk size:" << chunkSize;
+    } else if (key.size() != AttachmentStore::KEY_SIZE) {
+        qWarning() << "Failed to unwrap attachment key";
+    } else {
+        // Nothing replaces the target unless every chunk authenticated
+        QSaveFile file(filePath);
+        if (!file.open(QIODevice::WriteOnly)) {
+            qWarning() << "Failed to create file:" << file.errorString();
+        } else if (AttachmentStore::read(handle, attachmentId, key, size, file)) {
+            ok = file.commit();
+        } else {
+            file.cancelWriting();
+        }
+    }
+    
+    OPENSSL_cleanse(key.data(), key.size());
+    db.rollback();
+    return ok;
+}
+
+bool Database::deleteAttachment(qint64 attachmentId)
+{
+    if (!pool->isWriterThread()) {
+        return deleteAttachmentAsync(attachmentId).result();
+    }
+    
+    const SessionRef session = currentSession();
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return false;
+    }
+    
+    if (!beginWrite()) {
+        return false;
+    }
+    
+    // Freed pages go back to the file during idle maintenance
+    CachedStatement query = statement(SQL_DELETE_ATTACHMENT);
+    query->addBindValue(attachmentId);
+    query->addBindValue(session->userId);
+    
+    if (!query->exec() || query->numRowsAffected() != 1) {
+        qWarning() << "Failed to delete attachment:" << attachmentId << query->lastError().text();
+        return endWrite(false);
+    }
+    
+    return endWrite(true);
+}
+
+QList<AttachmentInfo> Database::getAttachments(int passwordId)
+{
+    const SessionRef session = currentSession();
+    
+    QList<AttachmentInfo> attachments;
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return attachments;
+    }
+    
+    CachedStatement query = statement(SQL_SELECT_ATTACHMENTS);
+    query->addBindValue(passwordId);
+    query->addBindValue(session->userId);
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to list attachments:" << query->lastError().text();
+        return attachments;
+    }
+    
+    while (query->next()) {
+        AttachmentInfo info;
+        info.id = query->value(0).toLongLong();
+        info.passwordId = passwordId;
+        info.name = QString::fromUtf8(decryptWithKey(session->masterKey, query->value(1).toByteArray(),
+                                                     boundContext(query->value(3).toBool(), session->userId,
+                                                                  query->value(4).toByteArray(), "attachment name")));
+        info.size = query->value(2).toLongLong();
+        attachments.append(info);
+    }
+    
+    return attachments;
+}
+
+QFuture<qint64> Database::addAttachmentAsync(int passwordId, const QString &filePath)
+{
+    return pool->write([=]() { return addAttachment(passwordId, filePath); });
+}
+
+QFuture<bool> Database::saveAttachmentAsync(qint64 attachmentId, const QString &filePath)
+{
+    return pool->read([=]() { return saveAttachment(attachmentId, filePath); });
+}
+
+QFuture<bool> Database::deleteAttachmentAsync(qint64 attachmentId)
+{
+    return pool->write([=]() { return deleteAttachment(attachmentId); });
+}
+
+QFuture<QList<AttachmentInfo>> Database::getAttachmentsAsync(int passwordId)
+{
+    return pool->read([=]() { return getAttachments(passwordId); });
+}
+
+QList<EntryVersion> Database::getHistory(int passwordId)
+{
+    const SessionRef session = currentSession();
+    
+    QList<EntryVersion> versions;
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return versions;
+    }
+    
+    // Only dates; versions are decoded one at a time when they are opened
+    CachedStatement query = statement(SQL_SELECT_HISTORY);
+    query->addBindValue(passwordId);
+    query->addBindValue(session->userId);
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to list entry history:" << query->lastError().text();
+        return versions;
+    }
+    
+    while (query->next()) {
+        EntryVersion version;
+        version.id = query->value(0).toLongLong();
+        version.changedAt = QDateTime::fromSecsSinceEpoch(query->value(1).toLongLong());
+        versions.append(version);
+    }
+    
+    return versions;
+}
+
+EntryVersion Database::getHistoryVersion(int passwordId, qint64 historyId)
+{
+    const SessionRef session = currentSession();
+    
+    EntryVersion version;
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return version;
+    }
+    
+    // Newest first: each delta is inflated against the snapshot decoded just before it
+    CachedStatement query = statement(SQL_SELECT_HISTORY_CHAIN);
+    query->addBindValue(passwordId);
+    query->addBindValue(session->userId);
+    query->addBindValue(historyId);
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to read entry history:" << query->lastError().text();
+        return version;
+    }
+    
+    QByteArray snapshot;
+    qint64 id = -1;
+    qint64 changedAt = 0;
+    bool ok = true;
+    
+    while (ok && query->next()) {
+        id = query->value(0).toLongLong();
+        changedAt = query->value(1).toLongLong();
+        bool delta = query->value(2).toBool();
+        
+        QByteArray packed = decryptWithKey(session->masterKey, query->value(3).toByteArray(),
+                                           boundContext(query->value(4).toBool(), session->userId,
+                                                        query->value(5).toByteArray(), "history"));
+        QByteArray base = delta ? snapshot : QByteArray();
+        QByteArray decoded;
+        ok = !packed.isEmpty() && (!delta || !snapshot.isEmpty()) &&
+             NoteCodec::unpack(packed, base, EntryHistory::MAX_SNAPSHOT_SIZE, decoded);
+        
+        OPENSSL_cleanse(packed.data(), packed.size());
+        OPENSSL_cleanse(snapshot.data(), snapshot.size());
+        snapshot = decoded;
+    }
+    query->finish();
+    
+    if (!ok || id != historyId) {
+        qWarning() << "Failed to decode version" << historyId << "of entry" << passwordId;
+        OPENSSL_cleanse(snapshot.data(), snapshot.size());
+        return version;
+    }
+    
+    if (EntryHistory::deserialize(snapshot, version)) {
+        version.id = id;
+        version.changedAt = QDateTime::fromSecsSinceEpoch(changedAt);
+    }
+    OPENSSL_cleanse(snapshot.data(), snapshot.size());
+    return version;
+}
+
+QFuture<QList<EntryVersion>> Database::getHistoryAsync(int passwordId)
+{
+    return pool->read([=]() { return getHistory(passwordId); });
+}
+
+QFuture<EntryVersion> Database::getHistoryVersionAsync(int passwordId, qint64 historyId)
+{
+    return pool->read([=]() { return getHistoryVersion(passwordId, historyId); });
+}
+
+bool Database::recordHistory(int id, const EntryVersion &next)
+{
+    const SessionRef session = currentSession();
+    
+    int keep = EntryHistory::keepCount();
+    
+    if (keep > 0) {
+        CachedStatement select = statement(SQL_SELECT_ENTRY_WITH_NOTE);
+        select->addBindValue(id);
+        select->addBindValue(session->userId);
+        
+        if (!select->exec() || !select->next()) {
+            qWarning() << "Entry to update not found:" << id;
+            return false;
+        }
+        
+        StoredEntry row = readStoredEntry(*select, true);
+        select->finish();
+        
+        // A version that does not decrypt would be recorded with blanks in its place
+        bool readable = false;
+        bool passwordReadable = false;
+        PasswordEntry stored = decryptStoredEntry(row, session->masterKey, &readable);
+        SecretBuffer password = decryptSecret(row.password, rowContext(row, "password"), &passwordReadable);
+        if (!readable || !passwordReadable) {
+            qWarning() << "Entry" << id << "could not be decrypted; update cancelled";
+            return false;
+        }
+        
+        EntryVersion previous;
+        previous.name = stored.name;
+        previous.url = stored.url;
+        previous.username = stored.username;
+        previous.note = stored.note;
+        previous.fields = stored.fields;
+        previous.password = password.toString();
+        
+        QByteArray snapshot = EntryHistory::serialize(previous);
+        SecretBuffer::wipe(previous.password);
+        QByteArray nextSnapshot = EntryHistory::serialize(next);
+        bool unchanged = snapshot == nextSnapshot;
+        OPENSSL_cleanse(nextSnapshot.data(), nextSnapshot.size());
+        
+        // Saving without changes does not push the history along
+        bool ok = unchanged || (!snapshot.isEmpty() && storeHistoryVersion(id, row.uuid, snapshot));
+        OPENSSL_cleanse(snapshot.data(), snapshot.size());
+        if (!ok) {
+            return false;
+        }
+    }
+    
+    CachedStatement prune = statement(SQL_PRUNE_HISTORY);
+    prune->addBindValue(id);
+    prune->addBindValue(id);
+    prune->addBindValue(keep);
+    
+    if (!prune->exec()) {
+        qWarning() << "Failed to prune entry history:" << prune->lastError().text();
+        return false;
+    }
+    return true;
+}
+
+bool Database::storeHistoryVersion(int id, const QByteArray &uuid, const QByteArray &snapshot, const QDateTime &changedAt)
+{
+    const SessionRef session = currentSession();
+    
+    // Every version is bound to its entry; one written before binding is rebound when rewritten
+    const QByteArray context = VaultIntegrity::fieldContext(session->userId, uuid, "history");
+    
+    CachedStatement latest = statement(SQL_SELECT_LATEST_HISTORY);
+    latest->addBindValue(id);
+    
+    if (!latest->exec()) {
+        qWarning() << "Failed to read entry history:" << latest->lastError().text();
+        return false;
+    }
+    
+    // The newest version so far is stored whole; it becomes a delta against the one
+    // recorded now. If it cannot be decoded it simply stays whole.
+    if (latest->next() && !latest->value(1).toBool()) {
+        qint64 latestId = latest->value(0).toLongLong();
+        QByteArray packed = decryptWithKey(session->masterKey, latest->value(2).toByteArray(),
+                                           latest->value(3).toBool() ? context : QByteArray());
+        latest->finish();
+        
+        QByteArray newest;
+        if (!packed.isEmpty() && NoteCodec::unpack(packed, QByteArray(), EntryHistory::MAX_SNAPSHOT_SIZE, newest)) {
+            QByteArray delta = NoteCodec::pack(newest, snapshot);
+            QByteArray storedDelta = delta.isEmpty() ? QByteArray() : encryptWithKey(session->masterKey, delta, context);
+            OPENSSL_cleanse(delta.data(), delta.size());
+            OPENSSL_cleanse(newest.data(), newest.size());
+            
+            CachedStatement update = statement(SQL_UPDATE_HISTORY);
+            update->addBindValue(1);
+            update->addBindValue(storedDelta);
+            update->addBindValue(latestId);
+            
+            if (storedDelta.isEmpty() || !update->exec()) {
+                qWarning() << "Failed to store history delta:" << update->lastError().text();
+                OPENSSL_cleanse(packed.data(), packed.size());
+                return false;
+            }
+        } else {
+            qWarning() << "Version" << latestId << "of entry" << id << "could not be decoded, keeping it whole";
+        }
+        OPENSSL_cleanse(packed.data(), packed.size());
+    }
+    latest->finish();
+    
+    QByteArray packed = NoteCodec::pack(snapshot, QByteArray());
+    QByteArray storedVersion = packed.isEmpty() ? QByteArray() : encryptWithKey(session->masterKey, packed, context);
+    OPENSSL_cleanse(packed.data(), packed.size());
+    
+    CachedStatement insert = statement(SQL_INSERT_HISTORY);
+    insert->addBindValue(id);
+    insert->addBindValue(changedAt.isValid() ? QVariant(changedAt.toSecsSinceEpoch()) : QVariant());
+    insert->addBindValue(storedVersion);
+    
+    if (storedVersion.isEmpty() || !insert->exec()) {
+        qWarning() << "Failed to store entry history:" << insert->lastError().text();
+        return false;
+    }
+    return true;
+}
+
+bool Database::rewrapHistory(int userId, const QByteArray &oldKey, const QByteArray &newKey, bool unboundOnly)
+{
+    struct StoredVersion
+    {
+        qint64 id;
+        int delta;
+        QByteArray version;
+        bool bound;
+        QByteArray uuid;
+    };
+    
+    CachedStatement select = statement(SQL_SELECT_USER_HISTORY);
+    select->addBindValue(userId);
+    select->addBindValue(unboundOnly ? 0 : 1);
+    
+    if (!select->exec()) {
+        qWarning() << "Failed to read entry history:" << select->lastError().text();
+        return false;
+    }
+    
+    QList<StoredVersion> versions;
+    while (select->next()) {
+        versions.append({select->value(0).toLongLong(), select->value(1).toInt(), select->value(2).toByteArray(),
+                         select->value(3).toBool(), select->value(4).toByteArray()});
+    }
+    select->finish();
+    
+    // Deltas are over plaintext, so only the encryption changes
+    for (const StoredVersion &stored : std::as_const(versions)) {
+        QByteArray packed = decryptWithKey(oldKey, stored.version, boundContext(stored.bound, userId, stored.uuid, "history"));
+        if (packed.isEmpty()) {
+            qWarning() << "Failed to decrypt version" << stored.id << "of the entry history";
+            // Binding leaves a version it cannot read as it is; a key change cannot
+            if (unboundOnly) {
+                continue;
+            }
+            return false;
+        }
+        
+        CachedStatement update = statement(SQL_UPDATE_HISTORY);
+        update->addBindValue(stored.delta);
+        update->addBindValue(encryptWithKey(newKey, packed, VaultIntegrity::fieldContext(userId, stored.uuid, "history")));
+        update->addBindValue(stored.id);
+        OPENSSL_cleanse(packed.data(), packed.size());
+        
+        if (!update->exec()) {
+            qWarning() << "Failed to re-encrypt entry history:" << update->lastError().text();
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+bool Database::rewrapAttachmentKeys(int userId, const QByteArray &oldKey, const QByteArray &newKey, bool unboundOnly)
+{
+    struct WrappedKey
+    {
+        qint64 id;
+        QByteArray name;
+        QByteArray key;
+        bool bound;
+        QByteArray uuid;
+    };
+    
+    CachedStatement select = statement(SQL_SELECT_USER_ATTACHMENT_KEYS);
+    select->addBindValue(userId);
+    select->addBindValue(unboundOnly ? 0 : 1);
+    
+    if (!select->exec()) {
+        qWarning() << "Failed to read attachment keys:" << select->lastError().text();
+        return false;
+    }
+    
+    QList<WrappedKey> keys;
+    while (select->next()) {
+        keys.append({select->value(0).toLongLong(), select->value(1).toByteArray(), select->value(2).toByteArray(),
+                     select->value(3).toBool(), select->value(4).toByteArray()});
+    }
+    select->finish();
+    
+    for (const WrappedKey &wrapped : std::as_const(keys)) {
+        QByteArray name = decryptWithKey(oldKey, wrapped.name,
+                                         boundContext(wrapped.bound, userId, wrapped.uuid, "attachment name"));
+        QByteArray key = decryptWithKey(oldKey, wrapped.key,
+                                        boundContext(wrapped.bound, userId, wrapped.uuid, "attachment key"));
+        if (key.size() != AttachmentStore::KEY_SIZE) {
+            qWarning() << "Failed to unwrap key of attachment" << wrapped.id;
+            OPENSSL_cleanse(key.data(), key.size());
+            if (unboundOnly) {
+                continue;
+            }
+            return false;
+        }
+        
+        CachedStatement update = statement(SQL_UPDATE_ATTACHMENT_KEY);
+        update->addBindValue(encryptWithKey(newKey, name, VaultIntegrity::fieldContext(userId, wrapped.uuid, "attachment name")));
+        update->addBindValue(encryptWithKey(newKey, key, VaultIntegrity::fieldContext(userId, wrapped.uuid, "attachment key")));
+        update->addBindValue(wrapped.id);
+        OPENSSL_cleanse(key.data(), key.size());
+        
+        if (!update->exec()) {
+            qWarning() << "Failed to rewrap attachment key:" << update->lastError().text();
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+bool Database::syncWith(const QString &path, SyncStats *stats)
+{
+    if (!pool->isWriterThread()) {
+        return pool->write([=]() { return syncWith(path, stats); }).result();
+    }
+    
+    const SessionRef session = currentSession();
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return false;
+    }
+    
+    clearPrefetchedEntries();
+    
+    bool rootIntact = integrityRootStatus(session->userId, session->integrityKey) == IntegrityReport::RootIntact;
+    qint64 mergedAfter = latestChangeSeq();
+    
+    // Merged rows are journaled like local edits, so open windows pick them up
+    if (!VaultSync::syncWithFile(connection(), path, session->username, stats)) {
+        return false;
+    }
+    
+    // The merge commits on its own and moves the root. It is resealed only if it was
+    // intact before and every row that came in authenticates under the vault key;
+    // otherwise the mismatch stays for the integrity check to report.
+    if (!rootIntact) {
+        return true;
+    }
+    
+    QSet<int> mergedIds;
+    while (true) {
+        const QList<EntryChange> changes = changesSince(mergedAfter);
+        if (changes.isEmpty()) {
+            break;
+        }
+        
+        for (const EntryChange &change : changes) {
+            if (change.type != EntryChange::Deleted) {
+                mergedIds.insert(change.passwordId);
+            }
+        }
+        mergedAfter = changes.last().seq;
+    }
+    
+    if (!beginWrite()) {
+        qWarning() << "Failed to seal the integrity root after sync";
+        return true;
+    }
+    
+    QList<StoredEntry> rows;
+    QList<qint64> hashes;
+    for (int id : std::as_const(mergedIds)) {
+        CachedStatement query = statement(SQL_SELECT_INTEGRITY_ENTRY);
+        query->addBindValue(id);
+        query->addBindValue(session->userId);
+        
+        if (!query->exec()) {
+            qWarning() << "Failed to read a merged entry:" << query->lastError().text();
+            endWrite(false);
+            return true;
+        }
+        
+        // Entries the merge added and then deleted again have no row left
+        if (query->next()) {
+            rows.append(readStoredEntry(*query, true));
+            hashes.append(query->value(12).toLongLong());
+        }
+    }
+    
+    const QList<IntegrityProblem> problems = verifyStoredEntries(rows, hashes, session->masterKey);
+    if (!problems.isEmpty()) {
+        qWarning() << problems.size() << "merged entries failed authentication; the integrity root stays unsealed";
+        endWrite(false);
+        return true;
+    }
+    
+    if (!endWrite(sealIntegrityRoot(session->userId, session->integrityKey))) {
+        qWarning() << "Failed to seal the integrity root after sync";
+    }
+    return true;
+}
+
+IntegrityReport::RootStatus Database::quickIntegrityCheck()
+{
+    const SessionRef session = currentSession();
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return IntegrityReport::RootMismatch;
+    }
+    
+    return integrityRootStatus(session->userId, session->integrityKey);
+}
+
+QFuture<IntegrityReport> Database::verifyIntegrityAsync()
+{
+    return pool->read([this]() { return verifyIntegrity(); });
+}
+
+IntegrityReport Database::verifyIntegrity()
+{
+    const SessionRef session = currentSession();
+    
+    IntegrityReport report;
+    QElapsedTimer timer;
+    timer.start();
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return report;
+    }
+    
+    // One read transaction, so the rows and the root come from the same snapshot
+    QSqlDatabase db = connection();
+    if (!db.transaction()) {
+        qWarning() << "Failed to start integrity check:" << db.lastError().text();
+        return report;
+    }
+    
+    const int userId = session->userId;
+    qint64 storedSum = 0;
+    qint64 storedCount = 0;
+    qint64 leafSum = 0;
+    report.rootStatus = integrityRootStatus(userId, session->integrityKey, &storedSum, &storedCount);
+    report.completed = scanIntegrity(userId, session->masterKey, report, &leafSum);
+    db.commit();
+    
+    if (!report.completed) {
+        return report;
+    }
+    
+    // Rows removed, added or rewritten behind the app's back show up here even if every remaining row authenticates
+    if (report.rowsChecked != storedCount) {
+        IntegrityProblem problem;
+        problem.reason = QStringLiteral("root covers %1 rows, the vault has %2").arg(storedCount).arg(report.rowsChecked);
+        report.problems.append(problem);
+    } else if (leafSum != storedSum) {
+        IntegrityProblem problem;
+        problem.reason = QStringLiteral("root does not match the stored entries and notes");
+        report.problems.append(problem);
+    }
+    if (report.rootStatus != IntegrityReport::RootIntact) {
+        IntegrityProblem problem;
+        problem.reason = report.rootStatus == IntegrityReport::RootUnsealed ? QStringLiteral("root is not sealed")
+                                                                            : QStringLiteral("root seal does not match");
+        report.problems.append(problem);
+    }
+    
+    report.elapsedMs = timer.elapsed();
+    qDebug() << "Integrity check of" << report.rowsChecked << "entries found" << report.problems.size()
+             << "problems in" << report.elapsedMs << "ms";
+    return report;
+}
+
+QFuture<bool> Database::acceptIntegrityStateAsync()
+{
+    return pool->write([this]() { return acceptIntegrityState(); });
+}
+
+bool Database::acceptIntegrityState()
+{
+    if (!pool->isWriterThread()) {
+        return acceptIntegrityStateAsync().result();
+    }
+    
+    const SessionRef session = currentSession();
+    
+    if (session->userId <= 0) {
+        qWarning() << "No user is logged in";
+        return false;
+    }
+    
+    if (!beginWrite()) {
+        return false;
+    }
+    
+    // Checked again inside the write transaction, so nothing can change between the check and the seal
+    IntegrityReport report;
+    qint64 leafSum = 0;
+    if (!scanIntegrity(session->userId, session->masterKey, report, &leafSum)) {
+        return endWrite(false);
+    }
+    if (!report.problems.isEmpty()) {
+        qWarning() << "Not resealing the integrity root:" << report.problems.size() << "entries failed verification";
+        return endWrite(false);
+    }
+    
+    CachedStatement ensure = statement(SQL_ENSURE_INTEGRITY_ROOT);
+    ensure->addBindValue(session->userId);
+    CachedStatement reset = statement(SQL_RESET_INTEGRITY_ROOT);
+    reset->addBindValue(leafSum);
+    reset->addBindValue(report.rowsChecked);
+    reset->addBindValue(session->userId);
+    
+    if (!ensure->exec() || !reset->exec()) {
+        qWarning() << "Failed to reset the integrity root:" << reset->lastError().text();
+        return endWrite(false);
+    }
+    
+    qDebug() << "Integrity root reset to the current" << report.rowsChecked << "entries";
+    return endWrite(sealIntegrityRoot(session->userId, session->integrityKey));
+}
+
+bool Database::scanIntegrity(int userId, const QByteArray &key, IntegrityReport &report, qint64 *leafSum)
+{
+    // Pages are read here while earlier pages are verified on the other cores
+    const int window = qMax(2, QThread::idealThreadCount());
+    QList<QFuture<QList<IntegrityProblem>>> pending;
+    int afterId = 0;
+    bool readFailed = false;
+    *leafSum = 0;
+    
+    while (true) {
+        QList<StoredEntry> rows;
+        QList<qint64> hashes;
+        {
+            CachedStatement query = statement(SQL_SELECT_INTEGRITY_PAGE);
+            query->addBindValue(userId);
+            query->addBindValue(afterId);
+            query->addBindValue(INTEGRITY_BATCH_SIZE);
+            
+            if (!query->exec()) {
+                qWarning() << "Failed to read entries for the integrity check:" << query->lastError().text();
+                readFailed = true;
+                break;
+            }
+            
+            while (query->next()) {
+                rows.append(readStoredEntry(*query, true));
+                hashes.append(query->value(12).toLongLong());
+                *leafSum += integrityLeaves(*query);
+            }
+        }
+        
+        if (rows.isEmpty()) {
+            break;
+        }
+        
+        afterId = rows.last().id;
+        report.rowsChecked += rows.size();
+        
+        pending.append(QtConcurrent::run([this, rows, hashes, key]() {
+            return verifyStoredEntries(rows, hashes, key);
+        }));
+        if (pending.size() >= window) {
+            report.problems.append(pending.takeFirst().result());
+        }
+    }
+    
+    for (QFuture<QList<IntegrityProblem>> &future : pending) {
+        report.problems.append(future.result());
+    }
+    if (readFailed) {
+        return false;
+    }
+    
+    // Ciphertext outside the rows that is not bound yet could have been moved between
+    // entries or accounts; the next login binds it
+    CachedStatement extras = statement(SQL_SELECT_UNBOUND_EXTRAS);
+    extras->addBindValue(userId);
+    extras->addBindValue(userId);
+    extras->addBindValue(userId);
+    
+    if (!extras->exec()) {
+        qWarning() << "Failed to read unbound attachments and history:" << extras->lastError().text();
+        return false;
+    }
+    
+    const QString reasons[] = {QStringLiteral("attachment is not bound to the entry"),
+                               QStringLiteral("history versions are not bound to the entry"),
+                               QStringLiteral("note dictionary is not bound to the account")};
+    QSet<QPair<int, int>> reported;
+    while (extras->next()) {
+        QPair<int, int> key(extras->value(0).toInt(), extras->value(1).toInt());
+        if (key.second < 0 || key.second > 2 || reported.contains(key)) {
+            continue;
+        }
+        reported.insert(key);
+        
+        IntegrityProblem problem;
+        problem.id = key.first;
+        problem.reason = reasons[key.second];
+        report.problems.append(problem);
+    }
+    return true;
+}
+
+qint64 Database::dataVersion()
+{
+    // Per connection: changes whenever any other connection commits to the file
+    QSqlQuery query(connection());
+    if (!query.exec("PRAGMA data_version") || !query.next()) {
+        return -1;
+    }
+    
+    return query.value(0).toLongLong();
+}
+
+qint64 Database::latestChangeSeq()
+{
+    const SessionRef session = currentSession();
+    
+    if (session->userId <= 0) {
+        return 0;
+    }
+    
+    CachedStatement query = statement(SQL_LATEST_CHANGE);
+    query->addBindValue(session->userId);
+    
+    if (!query->exec() || !query->next()) {
+        qWarning() << "Failed to read change journal position:" << query->lastError().text();
+        return 0;
+    }
+    
+    return query->value(0).toLongLong();
+}
+
+bool Database::recordChange(int userId, int passwordId, EntryChange::Type type)
+{
+    // Same transaction as the change itself, so the journal never lags or leads the data
+    CachedStatement query = statement(SQL_INSERT_CHANGE);
+    query->addBindValue(userId);
+    query->addBindValue(passwordId);
+    query->addBindValue(int(type));
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to record change:" << query->lastError().text();
+        return false;
+    }
+    
+    return true;
+}
+
+bool Database::verifyQueryPlans()
+{
+    if (!pool->isWriterThread()) {
+        return pool->write([this]() { return verifyQueryPlans(); }).result();
+    }
+    
+    struct HotQuery
+    {
+        const char *name;
+        QString sql;
+        QStringList plan; // exact steps, for statements that walk an id list or a small table by design
+    };
+    
+    const QList<HotQuery> queries = {
+        {"insert user", SQL_INSERT_USER},
+        {"find user", SQL_FIND_USER},
+        {"select newest kdf", SQL_SELECT_NEWEST_KDF, {"SCAN users"}},
+        {"update user credentials", SQL_UPDATE_USER_CREDENTIALS},
+        {"insert entry", SQL_INSERT_ENTRY},
+        {"update entry", SQL_UPDATE_ENTRY},
+        {"delete entry tokens", SQL_DELETE_ENTRY_TOKENS},
+        {"delete entry", SQL_DELETE_ENTRY},
+        {"select entry uuid", SQL_SELECT_ENTRY_UUID},
+        {"insert tombstone", SQL_INSERT_TOMBSTONE},
+        {"clear entry tokens", SQL_CLEAR_ENTRY_TOKENS},
+        {"insert token", SQL_INSERT_TOKEN},
+        {"rewrite entry", SQL_REWRITE_ENTRY},
+        {"select unbound entries", SQL_SELECT_UNBOUND_ENTRIES},
+        {"select integrity page", SQL_SELECT_INTEGRITY_PAGE},
+        {"select integrity entry", SQL_SELECT_INTEGRITY_ENTRY},
+        {"select integrity root", SQL_SELECT_INTEGRITY_ROOT},
+        {"ensure integrity root", SQL_ENSURE_INTEGRITY_ROOT},
+        {"seal integrity root", SQL_SEAL_INTEGRITY_ROOT},
+        {"reset integrity root", SQL_RESET_INTEGRITY_ROOT},
+        {"select legacy root", SQL_SELECT_LEGACY_ROOT},
+        {"clear legacy root", SQL_CLEAR_LEGACY_ROOT},
+        {"select entry", SQL_SELECT_ENTRY},
+        {"select entry page", SQL_SELECT_ENTRY_PAGE},
+        {"select entry page with notes", SQL_SELECT_ENTRY_PAGE_WITH_NOTES},
+        {"select fields", SQL_SELECT_FIELDS},
+        {"select note", SQL_SELECT_NOTE},
+        {"store note", SQL_STORE_NOTE},
+        {"delete note", SQL_DELETE_NOTE},
+        {"select note samples", SQL_SELECT_NOTE_SAMPLES},
+        {"select uncompressed notes", SQL_SELECT_UNCOMPRESSED_NOTES},
+        {"update entry hash", SQL_UPDATE_ENTRY_HASH},
+        {"select note dictionary", SQL_SELECT_NOTE_DICTIONARY},
+        {"select note dictionaries", SQL_SELECT_NOTE_DICTIONARIES},
+        {"store note dictionary", SQL_STORE_NOTE_DICTIONARY},
+        {"insert attachment", SQL_INSERT_ATTACHMENT},
+        {"select attachments", SQL_SELECT_ATTACHMENTS},
+        {"select attachment", SQL_SELECT_ATTACHMENT},
+        {"delete attachment", SQL_DELETE_ATTACHMENT},
+        {"select user attachment keys", SQL_SELECT_USER_ATTACHMENT_KEYS},
+        {"update attachment key", SQL_UPDATE_ATTACHMENT_KEY},
+        {"select entry with note", SQL_SELECT_ENTRY_WITH_NOTE},
+        {"select latest history", SQL_SELECT_LATEST_HISTORY},
+        {"insert history", SQL_INSERT_HISTORY},
+        {"update history", SQL_UPDATE_HISTORY},
+        {"prune history", SQL_PRUNE_HISTORY},
+        {"select history", SQL_SELECT_HISTORY},
+        {"select history chain", SQL_SELECT_HISTORY_CHAIN},
+        {"select user history", SQL_SELECT_USER_HISTORY},
+        {"select unbound extras", SQL_SELECT_UNBOUND_EXTRAS},
+        {"select unbound dictionaries", SQL_SELECT_UNBOUND_DICTIONARIES},
+        {"select entry attachment keys", SQL_SELECT_ENTRY_ATTACHMENT_KEYS},
+        {"insert bulk id", SQL_INSERT_BULK_ID, {"SEARCH passwords USING INTEGER PRIMARY KEY (rowid=?)"}},
+        {"select bulk uuids", SQL_SELECT_BULK_UUIDS,
+         {"SCAN bulk_ids", "SEARCH p USING INTEGER PRIMARY KEY (rowid=?)"}},
+        {"delete bulk tokens", SQL_DELETE_BULK_TOKENS,
+         {"SEARCH search_tokens USING COVERING INDEX idx_search_tokens_password_id (password_id=?)",
+          "USING ROWID SEARCH ON TABLE bulk_ids FOR IN-OPERATOR"}},
+        {"record bulk changes", SQL_RECORD_BULK_CHANGES, {"SCAN bulk_ids"}},
+        {"delete bulk entries", SQL_DELETE_BULK_ENTRIES,
+         {"SEARCH passwords USING INTEGER PRIMARY KEY (rowid=?)", "USING ROWID SEARCH ON TABLE bulk_ids FOR IN-OPERATOR"}},
+        {"select bulk entries", SQL_SELECT_BULK_ENTRIES,
+         {"SCAN bulk_ids", "SEARCH p USING INTEGER PRIMARY KEY (rowid=?)",
+          "SEARCH n USING INTEGER PRIMARY KEY (rowid=?) LEFT-JOIN"}},
+        {"update entry metadata", SQL_UPDATE_ENTRY_METADATA},
+        {"insert change", SQL_INSERT_CHANGE},
+        {"select changes", SQL_SELECT_CHANGES},
+        {"latest change", SQL_LATEST_CHANGE},
+        {"list entries", entrySearchSql(0)},
+        {"search entries", entrySearchSql(3)}
+    };
+    
+    bool passed = true;
+    QSqlQuery query(connection());
+    
+    // The bulk statements refer to the writer's temporary id list
+    if (!query.exec(SQL_CREATE_BULK_IDS)) {
+        qWarning() << "Failed to create the bulk id list:" << query.lastError().text();
+        return false;
+    }
+    
+    for (const HotQuery &hot : queries) {
+        query.prepare("EXPLAIN QUERY PLAN " + hot.sql);
+        for (int i = 0; i < hot.sql.count('?'); ++i) {
+            query.addBindValue(QVariant());
+        }
+        
+        if (!query.exec()) {
+            qWarning() << "Failed to explain" << hot.name << ":" << query.lastError().text();
+            passed = false;
+            continue;
+        }
+        
+        QStringList steps;
+        bool regressed = false;
+        while (query.next()) {
+            // SQLite before 3.36 wrote "SCAN TABLE x"; newer ones qualify temporary tables
+            QString detail = query.value(3).toString();
+            detail.replace("SCAN TABLE ", "SCAN ").replace("SEARCH TABLE ", "SEARCH ").remove("temp.");
+            steps.append(detail);
+            
+            if (detail.startsWith("SCAN ") || detail.contains("USE TEMP B-TREE")) {
+                regressed = true;
+            }
+        }
+        
+        // Bulk statements scan their id list and nothing else, one primary key lookup per id
+        if (!hot.plan.isEmpty()) {
+            regressed = steps != hot.plan;
+        }
+        
+        qDebug().noquote() << (regressed ? "FAIL" : "ok  ") << hot.name << "|" << steps.join("; ");
+        passed = passed && !regressed;
+    }
+    
+    return passed;
+}
+
+QList<Database::StoredEntry> Database::fetchStoredEntries(int userId, const QList<QByteArray> &tokens)
+{
+    QList<StoredEntry> rows;
+    
+    // One cached statement per token count, which is bounded by the indexed trigram limit
+    CachedStatement query = statement(entrySearchSql(tokens.size()));
+    query->addBindValue(userId);
+    if (!tokens.isEmpty()) {
+        query->addBindValue(tokens.first());
+        query->addBindValue(userId);
+        for (int i = 1; i < tokens.size(); ++i) {
+            query->addBindValue(userId);
+            query->addBindValue(tokens[i]);
+        }
+    }
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to get passwords:" << query->lastError().text();
+        return rows;
+    }
+    
+    while (query->next()) {
+        rows.append(readStoredEntry(*query));
+    }
+    
+    return rows;
+}
+
+bool Database::fetchStoredPage(int userId, int afterId, int limit, bool withNotes, QList<StoredEntry> &rows)
+{
+    // Keyset pagination on the primary key, so each page is an index range read
+    CachedStatement query = statement(withNotes ? SQL_SELECT_ENTRY_PAGE_WITH_NOTES : SQL_SELECT_ENTRY_PAGE);
+    query->addBindValue(userId);
+    query->addBindValue(afterId);
+    query->addBindValue(limit);
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to read entries:" << query->lastError().text();
+        return false;
+    }
+    
+    while (query->next()) {
+        rows.append(readStoredEntry(*query, withNotes));
+    }
+    
+    return true;
+}
+
+Database::StoredEntry Database::readStoredEntry(const QSqlQuery &query, bool withNote)
+{
+    StoredEntry row;
+    row.id = query.value(0).toInt();
+    row.name = query.value(1).toByteArray();
+    row.url = query.value(2).toByteArray();
+    row.username = query.value(3).toByteArray();
+    row.password = query.value(4).toByteArray();
+    row.noteSize = query.value(5).toInt();
+    row.encryptedFields = query.value(6).toInt() > 0;
+    row.boundFields = query.value(6).toInt() > 1;
+    row.userId = query.value(7).toInt();
+    row.uuid = query.value(8).toByteArray();
+    
+    if (withNote) {
+        row.note = query.value(9).toByteArray();
+        row.noteDictionaryId = query.value(10).isNull() ? -1 : query.value(10).toLongLong();
+        row.fields = query.value(11).toByteArray();
+    }
+    return row;
+}
+
+PasswordEntry Database::decryptStoredEntry(const StoredEntry &row, const QByteArray &key, bool *ok)
+{
+    PasswordEntry entry;
+    entry.id = row.id;
+    entry.encryptedPassword = row.password;
+    entry.passwordContext = rowContext(row, "password");
+    entry.noteSize = row.noteSize;
+    
+    bool intact = true;
+    if (row.encryptedFields) {
+        intact &= decryptField(key, row.name, rowContext(row, "name"), entry.name);
+        intact &= decryptField(key, row.url, rowContext(row, "url"), entry.url);
+        intact &= decryptField(key, row.username, rowContext(row, "username"), entry.username);
+    } else {
+        entry.name = QString::fromUtf8(row.name);
+        entry.url = QString::fromUtf8(row.url);
+        entry.username = QString::fromUtf8(row.username);
+    }
+    
+    bool noteIntact = true;
+    bool fieldsIntact = true;
+    entry.note = unpackNote(key, row.note, row.noteDictionaryId, row.encryptedFields, rowContext(row, "note"), &noteIntact);
+    entry.fields = unpackFields(key, row.fields, rowContext(row, "fields"), &fieldsIntact);
+    
+    if (ok) {
+        *ok = intact && noteIntact && fieldsIntact;
+    }
+    return entry;
+}
+
+QByteArray Database::rowContext(const StoredEntry &row, const char *field)
+{
+    return boundContext(row.boundFields, row.userId, row.uuid, field);
+}
+
+QByteArray Database::boundContext(bool bound, int userId, const QByteArray &uuid, const char *field)
+{
+    return bound ? VaultIntegrity::fieldContext(userId, uuid, field) : QByteArray();
+}
+
+QByteArray Database::dictionaryContext(bool bound, int userId, qint64 id)
+{
+    // The dictionary id stands in for the entry uuid
+    QByteArray owner(8, 0);
+    qToBigEndian<qint64>(id, owner.data());
+    return boundContext(bound, userId, owner, "note dictionary");
+}
+
+QByteArray Database::encryptField(const QByteArray &key, const QString &value, const QByteArray &context)
+{
+    return encryptWithKey(key, value.toUtf8(), context);
+}
+
+bool Database::decryptField(const QByteArray &key, const QByteArray &encryptedField, const QByteArray &context, QString &value)
+{
+    // Checked through decryptInto, since an empty field and a failed one both decrypt to an empty array
+    QByteArray plaintext(qMax(0, encryptedField.size() - IV_SIZE - 16), Qt::Uninitialized);
+    int length = decryptInto(key, encryptedField, plaintext.data(), context);
+    if (length < 0) {
+        value.clear();
+        return false;
+    }
+    
+    value = QString::fromUtf8(plaintext.constData(), length);
+    OPENSSL_cleanse(plaintext.data(), plaintext.size());
+    return true;
+}
+
+bool Database::packFields(const QByteArray &key, const QList<CustomField> &fields, const QByteArray &context,
+                          QByteArray &storedFields)
+{
+    storedFields.clear();
+    
+    QByteArray record;
+    if (!CustomFieldRecord::pack(fields, record)) {
+        return false;
+    }
+    if (record.isEmpty()) {
+        return true;
+    }
+    
+    storedFields = encryptWithKey(key, record, context);
+    OPENSSL_cleanse(record.data(), record.size());
+    
+    if (storedFields.isEmpty()) {
+        qWarning() << "Failed to encrypt custom fields";
+        return false;
+    }
+    return true;
+}
+
+QList<CustomField> Database::unpackFields(const QByteArray &key, const QByteArray &storedFields, const QByteArray &context,
+                                          bool *ok)
+{
+    QList<CustomField> fields;
+    if (ok) {
+        *ok = true;
+    }
+    if (storedFields.isEmpty()) {
+        return fields;
+    }
+    
+    // One decrypt for the whole record, into locked memory
+    SecretBuffer record(qMax(0, storedFields.size() - IV_SIZE - 16));
+    int recordSize = decryptInto(key, storedFields, record.data(), context);
+    if (recordSize < 0 || !CustomFieldRecord::unpack(record.constData(), recordSize, fields)) {
+        qWarning() << "Failed to decrypt custom fields";
+        fields.clear();
+        if (ok) {
+            *ok = false;
+        }
+    }
+    return fields;
+}
+
+QByteArray Database::packNote(const QByteArray &key, const QByteArray &note, const QByteArray &context, qint64 *dictionaryId)
+{
+    *dictionaryId = -1;
+    if (note.isEmpty()) {
+        return QByteArray();
+    }
+    
+    // Compression happens before encryption; ciphertext would not compress at all
+    QByteArray packed = NoteCodec::compress(note, noteDictionary(activeDictionaryId, key));
+    if (packed.isEmpty()) {
+        return encryptWithKey(key, note, context);
+    }
+    
+    *dictionaryId = activeDictionaryId;
+    QByteArray storedNote = encryptWithKey(key, packed, context);
+    OPENSSL_cleanse(packed.data(), packed.size());
+    return storedNote;
+}
+
+QString Database::unpackNote(const QByteArray &key, const QByteArray &storedNote, qint64 dictionaryId, bool encrypted,
+                             const QByteArray &context, bool *ok)
+{
+    if (ok) {
+        *ok = true;
+    }
+    if (storedNote.isEmpty()) {
+        return QString();
+    }
+    
+    if (!encrypted) {
+        return QString::fromUtf8(storedNote);
+    }
+    
+    QByteArray plaintext(qMax(0, storedNote.size() - IV_SIZE - 16), Qt::Uninitialized);
+    int length = decryptInto(key, storedNote, plaintext.data(), context);
+    if (length < 0) {
+        qWarning() << "Failed to decrypt note";
+        if (ok) {
+            *ok = false;
+        }
+        return QString();
+    }
+    plaintext.truncate(length);
+    
+    if (dictionaryId < 0) {
+        QString note = QString::fromUtf8(plaintext);
+        OPENSSL_cleanse(plaintext.data(), plaintext.size());
+        return note;
+    }
+    
+    QByteArray note;
+    if (!NoteCodec::decompress(plaintext, noteDictionary(dictionaryId, key), note)) {
+        qWarning() << "Note could not be decompressed with dictionary" << dictionaryId;
+        if (ok) {
+            *ok = false;
+        }
+    }
+    OPENSSL_cleanse(plaintext.data(), plaintext.size());
+    return QString::fromUtf8(note);
+}
+
+bool Database::storeNote(int passwordId, const QByteArray &storedNote, qint64 dictionaryId)
+{
+    if (storedNote.isEmpty()) {
+        CachedStatement query = statement(SQL_DELETE_NOTE);
+        query->addBindValue(passwordId);
+        
+        if (!query->exec()) {
+            qWarning() << "Failed to delete note:" << query->lastError().text();
+            return false;
+        }
+        return true;
+    }
+    
+    CachedStatement query = statement(SQL_STORE_NOTE);
+    query->addBindValue(passwordId);
+    query->addBindValue(dictionaryId >= 0 ? QVariant(dictionaryId) : QVariant());
+    query->addBindValue(storedNote);
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to store note:" << query->lastError().text();
+        return false;
+    }
+    return true;
+}
+
+QByteArray Database::noteDictionary(qint64 id, const QByteArray &key)
+{
+    if (id <= 0) {
+        return QByteArray();
+    }
+    
+    QMutexLocker locker(&noteDictionaryMutex);
+    auto cached = noteDictionaries.constFind(id);
+    if (cached != noteDictionaries.constEnd()) {
+        return cached.value();
+    }
+    
+    // Dictionaries that arrived by sync after the unlock are loaded on first use
+    CachedStatement query = statement(SQL_SELECT_NOTE_DICTIONARY);
+    query->addBindValue(id);
+    
+    if (!query->exec() || !query->next()) {
+        qWarning() << "Note dictionary" << id << "not found";
+        return QByteArray();
+    }
+    
+    QByteArray dictionary = decryptWithKey(key, query->value(0).toByteArray(),
+                                           dictionaryContext(query->value(2).toBool(), query->value(1).toInt(), id));
+    query->finish();
+    
+    if (dictionary.isEmpty()) {
+        qWarning() << "Note dictionary" << id << "could not be decrypted";
+        return QByteArray();
+    }
+    
+    noteDictionaries.insert(id, dictionary);
+    return dictionary;
+}
+
+QList<qint64> Database::loadNoteDictionaries(int userId, const QByteArray &key)
+{
+    QList<qint64> ids;
+    
+    CachedStatement query = statement(SQL_SELECT_NOTE_DICTIONARIES);
+    query->addBindValue(userId);
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to read note dictionaries:" << query->lastError().text();
+        return ids;
+    }
+    
+    // Copies of a vault may each have trained one; all of them pick the lowest id for new notes
+    QMutexLocker locker(&noteDictionaryMutex);
+    activeDictionaryId = 0;
+    while (query->next()) {
+        qint64 id = query->value(0).toLongLong();
+        QByteArray dictionary = decryptWithKey(key, query->value(1).toByteArray(),
+                                               dictionaryContext(query->value(2).toBool(), userId, id));
+        if (dictionary.isEmpty()) {
+            qWarning() << "Note dictionary" << id << "could not be decrypted";
+            continue;
+        }
+        
+        noteDictionaries.insert(id, dictionary);
+        ids.append(id);
+        if (activeDictionaryId == 0) {
+            activeDictionaryId = id;
+        }
+    }
+    
+    return ids;
+}
+
+bool Database::storeNoteDictionary(int userId, qint64 id, const QByteArray &key)
+{
+    const QByteArray dictionary = noteDictionary(id, key);
+    if (dictionary.isEmpty()) {
+        return false;
+    }
+    QByteArray encrypted = encryptWithKey(key, dictionary, dictionaryContext(true, userId, id));
+    
+    CachedStatement query = statement(SQL_STORE_NOTE_DICTIONARY);
+    query->addBindValue(id);
+    query->addBindValue(userId);
+    query->addBindValue(encrypted);
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to store note dictionary:" << query->lastError().text();
+        return false;
+    }
+    return true;
+}
+
+bool Database::trainNoteDictionary()
+{
+    const SessionRef session = currentSession();
+    
+    QList<QByteArray> samples;
+    {
+        CachedStatement query = statement(SQL_SELECT_NOTE_SAMPLES);
+        query->addBindValue(session->userId);
+        query->addBindValue(NoteCodec::MIN_COMPRESSED_SIZE);
+        query->addBindValue(NoteCodec::MAX_TRAINING_SAMPLES);
+        
+        if (!query->exec()) {
+            qWarning() << "Failed to read notes for the dictionary:" << query->lastError().text();
+            return false;
+        }
+        
+        while (query->next()) {
+            StoredEntry row;
+            row.encryptedFields = query->value(0).toInt() > 0;
+            row.boundFields = query->value(0).toInt() > 1;
+            row.userId = query->value(3).toInt();
+            row.uuid = query->value(4).toByteArray();
+            qint64 dictionaryId = query->value(1).isNull() ? -1 : query->value(1).toLongLong();
+            samples.append(unpackNote(session->masterKey, query->value(2).toByteArray(), dictionaryId, row.encryptedFields,
+                                      rowContext(row, "note")).toUtf8());
+        }
+    }
+    
+    if (samples.size() < NoteCodec::MIN_TRAINING_SAMPLES) {
+        return false;
+    }
+    
+    QByteArray dictionary = NoteCodec::train(samples);
+    for (QByteArray &sample : samples) {
+        OPENSSL_cleanse(sample.data(), sample.size());
+    }
+    
+    // Random rather than content-derived ids: nothing about the dictionary leaks, and copies
+    // of the vault can merge theirs without collisions
+    quint64 random = 0;
+    if (RAND_bytes(reinterpret_cast<unsigned char*>(&random), sizeof(random)) != 1) {
+        return false;
+    }
+    qint64 id = qint64(random >> 1) | 1;
+    
+    {
+        QMutexLocker locker(&noteDictionaryMutex);
+        noteDictionaries.insert(id, dictionary);
+    }
+    
+    if (!beginWrite()) {
+        return false;
+    }
+    
+    if (!storeNoteDictionary(session->userId, id, session->masterKey) || !endWrite(true)) {
+        return false;
+    }
+    
+    activeDictionaryId = id;
+    return true;
+}
+
+int Database::compactNoteBatch(int afterId, int *compacted)
+{
+    const SessionRef session = currentSession();
+    
+    QList<StoredEntry> rows;
+    {
+        CachedStatement query = statement(SQL_SELECT_UNCOMPRESSED_NOTES);
+        query->addBindValue(session->userId);
+        query->addBindValue(afterId);
+        query->addBindValue(NoteCodec::MIN_COMPRESSED_SIZE);
+        query->addBindValue(NOTE_BATCH_SIZE);
+        
+        if (!query->exec()) {
+            qWarning() << "Failed to read notes to compress:" << query->lastError().text();
+            return -1;
+        }
+        
+        while (query->next()) {
+            rows.append(readStoredEntry(*query, true));
+        }
+    }
+    
+    if (rows.isEmpty()) {
+        return -1;
+    }
+    
+    if (!beginWrite()) {
+        return -1;
+    }
+    
+    const QByteArray dictionary = noteDictionary(activeDictionaryId, session->masterKey);
+    int batchCompacted = 0;
+    
+    for (const StoredEntry &row : std::as_const(rows)) {
+        // The note keeps the binding of its row; one that does not authenticate is left alone
+        const QByteArray context = rowContext(row, "note");
+        QByteArray note(qMax(0, row.note.size() - IV_SIZE - 16), Qt::Uninitialized);
+        int length = decryptInto(session->masterKey, row.note, note.data(), context);
+        if (length < 0) {
+            qWarning() << "Note of entry" << row.id << "could not be decrypted; left uncompressed";
+            continue;
+        }
+        note.truncate(length);
+        
+        QByteArray packed = NoteCodec::compress(note, dictionary);
+        OPENSSL_cleanse(note.data(), note.size());
+        
+        // Notes that do not shrink (random recovery codes, keys) stay as they are
+        if (packed.isEmpty()) {
+            continue;
+        }
+        
+        QByteArray storedNote = encryptWithKey(session->masterKey, packed, context);
+        OPENSSL_cleanse(packed.data(), packed.size());
+        
+        // Same plaintext, new ciphertext: only the leaf hash changes, not the journal
+        CachedStatement rehash = statement(SQL_UPDATE_ENTRY_HASH);
+        rehash->addBindValue(VaultSync::entryHash(row.name, row.url, row.username, row.password, storedNote, row.fields));
+        rehash->addBindValue(row.id);
+        
+        if (storedNote.isEmpty() || !storeNote(row.id, storedNote, activeDictionaryId) || !rehash->exec()) {
+            qWarning() << "Failed to store compressed note of entry" << row.id;
+            endWrite(false);
+            return -1;
+        }
+        batchCompacted++;
+    }
+    
+    if (!endWrite(true)) {
+        return -1;
+    }
+    
+    *compacted += batchCompacted;
+    return rows.last().id;
+}
+
+bool Database::storeSearchTokens(int userId, int passwordId, const QByteArray &tokenKey,
+                                 const QString &name, const QString &url, const QString &username)
+{
+    CachedStatement query = statement(SQL_CLEAR_ENTRY_TOKENS);
+    query->addBindValue(passwordId);
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to clear search tokens:" << query->lastError().text();
+        return false;
+    }
+    
+    return insertSearchTokens(userId, passwordId, tokenKey, name, url, username);
+}
+
+bool Database::insertSearchTokens(int userId, int passwordId, const QByteArray &tokenKey,
+                                  const QString &name, const QString &url, const QString &username)
+{
+    CachedStatement insert = statement(SQL_INSERT_TOKEN);
+    
+    const QList<QByteArray> tokens = BlindIndex::entryTokens(tokenKey, name, url, username);
+    for (const QByteArray &token : tokens) {
+        insert->addBindValue(userId);
+        insert->addBindValue(token);
+        insert->addBindValue(passwordId);
+        
+        if (!insert->exec()) {
+            qWarning() << "Failed to store search token:" << insert->lastError().text();
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+bool Database::rewriteStoredEntry(const StoredEntry &row, int userId, const QByteArray &oldKey, const QByteArray &newKey)
+{
+    // Read with the binding the row has; always written back bound to (userId, uuid, field).
+    // A field that does not decrypt would be written back empty under the new key;
+    // leave the row untouched and let the caller roll back or skip it instead
+    bool readable = false;
+    PasswordEntry entry = decryptStoredEntry(row, oldKey, &readable);
+    if (!readable) {
+        qWarning() << "Entry with ID" << row.id << "could not be decrypted with the old key";
+        return false;
+    }
+    
+    SecretBuffer password(qMax(0, row.password.size() - IV_SIZE - 16));
+    int length = decryptInto(oldKey, row.password, password.data(), rowContext(row, "password"));
+    if (length < 0) {
+        qWarning() << "Password with ID" << row.id << "could not be decrypted with the old key";
+        return false;
+    }
+    password.truncate(length);
+    QByteArray encryptedPassword = encryptWithKey(newKey, password.constData(), password.size(),
+                                                  VaultIntegrity::fieldContext(userId, row.uuid, "password"));
+    
+    if (encryptedPassword.isEmpty()) {
+        qWarning() << "Failed to re-encrypt password with ID:" << row.id;
+        return false;
+    }
+    
+    QByteArray encryptedName = encryptField(newKey, entry.name, VaultIntegrity::fieldContext(userId, row.uuid, "name"));
+    QByteArray encryptedUrl = encryptField(newKey, entry.url, VaultIntegrity::fieldContext(userId, row.uuid, "url"));
+    QByteArray encryptedUsername = encryptField(newKey, entry.username,
+                                                VaultIntegrity::fieldContext(userId, row.uuid, "username"));
+    QByteArray noteText = entry.note.toUtf8();
+    qint64 noteDictionaryId = -1;
+    QByteArray storedNote = packNote(newKey, noteText, VaultIntegrity::fieldContext(userId, row.uuid, "note"),
+                                     &noteDictionaryId);
+    
+    // The packed record moves to the new key as it is, without unpacking the fields
+    QByteArray storedFields;
+    if (!row.fields.isEmpty()) {
+        SecretBuffer record(qMax(0, row.fields.size() - IV_SIZE - 16));
+        int recordSize = decryptInto(oldKey, row.fields, record.data(), rowContext(row, "fields"));
+        if (recordSize < 0) {
+            qWarning() << "Custom fields of entry" << row.id << "could not be decrypted with the old key";
+            return false;
+        }
+        storedFields = encryptWithKey(newKey, record.constData(), recordSize,
+                                      VaultIntegrity::fieldContext(userId, row.uuid, "fields"));
+    }
+    
+    CachedStatement query = statement(SQL_REWRITE_ENTRY);
+    query->addBindValue(encryptedName);
+    query->addBindValue(encryptedUrl);
+    query->addBindValue(encryptedUsername);
+    query->addBindValue(encryptedPassword);
+    query->addBindValue(noteText.size());
+    query->addBindValue(storedFields.isEmpty() ? QVariant() : QVariant(storedFields));
+    query->addBindValue(VaultSync::entryHash(encryptedName, encryptedUrl, encryptedUsername, encryptedPassword,
+                                             storedNote, storedFields));
+    query->addBindValue(row.id);
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to rewrite entry:" << query->lastError().text();
+        return false;
+    }
+    
+    // Ciphertext changed, so cached copies of the row are stale even though the plaintext is not
+    return storeNote(row.id, storedNote, noteDictionaryId) &&
+           storeSearchTokens(userId, row.id, BlindIndex::deriveKey(newKey), entry.name, entry.url, entry.username) &&
+           recordChange(userId, row.id, EntryChange::Updated);
+}
+
+bool Database::convertLegacyEntries()
+{
+    const SessionRef session = currentSession();
+    
+    const int batchSize = 500;
+    int converted = 0;
+    int afterId = 0;
+    QList<int> unreadable;
+    
+    // Rows with plaintext metadata (encrypted_fields = 0) get it encrypted, and rows not yet
+    // bound to their entry (1) are re-encrypted bound. Small batches keep each write
+    // transaction short on large vaults. Paged by id, since rows that cannot be converted
+    // stay behind as they are.
+    while (true) {
+        CachedStatement query = statement(SQL_SELECT_UNBOUND_ENTRIES);
+        query->addBindValue(session->userId);
+        query->addBindValue(afterId);
+        query->addBindValue(batchSize);
+        
+        if (!query->exec()) {
+            qWarning() << "Failed to read entries to convert:" << query->lastError().text();
+            return false;
+        }
+        
+        QList<StoredEntry> rows;
+        while (query->next()) {
+            rows.append(readStoredEntry(*query, true));
+        }
+        query->finish();
+        
+        if (rows.isEmpty()) {
+            break;
+        }
+        
+        if (!beginWrite()) {
+            return false;
+        }
+        
+        int batchConverted = 0;
+        for (const StoredEntry &row : rows) {
+            // A password or custom field record that does not authenticate would be
+            // rewritten empty; keep such rows as they are for the user to inspect
+            bool readable = false;
+            bool passwordReadable = false;
+            decryptStoredEntry(row, session->masterKey, &readable);
+            decryptSecret(row.password, rowContext(row, "password"), &passwordReadable);
+            if (!readable || !passwordReadable) {
+                unreadable.append(row.id);
+                continue;
+            }
+            
+            if (!rewriteStoredEntry(row, session->userId, session->masterKey, session->masterKey)) {
+                endWrite(false);
+                return false;
+            }
+            batchConverted++;
+        }
+        
+        if (!endWrite(true)) {
+            return false;
+        }
+        
+        converted += batchConverted;
+        afterId = rows.last().id;
+    }
+    
+    if (converted > 0) {
+        clearPrefetchedEntries();
+        qDebug() << "Converted" << converted << "entries to bound, encrypted metadata";
+    }
+    
+    if (!unreadable.isEmpty()) {
+        qWarning() << "Entries left unconverted because they could not be decrypted:" << unreadable;
+        return false;
+    }
+    return true;
+}
+
+bool Database::bindLegacyExtras()
+{
+    const SessionRef session = currentSession();
+    
+    if (!beginWrite()) {
+        return false;
+    }
+    
+    // Re-encrypted under the same key, now with their owner as additional data
+    bool bound = rewrapAttachmentKeys(session->userId, session->masterKey, session->masterKey, true) &&
+                 rewrapHistory(session->userId, session->masterKey, session->masterKey, true);
+    
+    QList<qint64> dictionaryIds;
+    if (bound) {
+        CachedStatement query = statement(SQL_SELECT_UNBOUND_DICTIONARIES);
+        query->addBindValue(session->userId);
+        bound = query->exec();
+        while (bound && query->next()) {
+            dictionaryIds.append(query->value(0).toLongLong());
+        }
+    }
+    
+    // Dictionaries were decrypted at login; those that could not be stay as they are
+    for (qint64 id : std::as_const(dictionaryIds)) {
+        if (!noteDictionary(id, session->masterKey).isEmpty()) {
+            bound = bound && storeNoteDictionary(session->userId, id, session->masterKey);
+        }
+    }
+    
+    return endWrite(bound);
+}
+
+IntegrityReport::RootStatus Database::integrityRootStatus(int userId, const QByteArray &key,
+                                                          qint64 *leafSum, qint64 *leafCount)
+{
+    CachedStatement query = statement(SQL_SELECT_INTEGRITY_ROOT);
+    query->addBindValue(userId);
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to read integrity root:" << query->lastError().text();
+        return IntegrityReport::RootMismatch;
+    }
+    
+    // Accounts that never stored an entry have no root row yet
+    qint64 sum = 0;
+    qint64 count = 0;
+    QByteArray seal;
+    if (query->next()) {
+        sum = query->value(0).toLongLong();
+        count = query->value(1).toLongLong();
+        seal = query->value(2).toByteArray();
+    }
+    
+    if (leafSum) {
+        *leafSum = sum;
+    }
+    if (leafCount) {
+        *leafCount = count;
+    }
+    
+    if (seal.isEmpty()) {
+        return IntegrityReport::RootUnsealed;
+    }
+    return VaultIntegrity::verifySeal(key, userId, sum, count, seal) ? IntegrityReport::RootIntact
+                                                                    : IntegrityReport::RootMismatch;
+}
+
+bool Database::upgradeIntegrityRoot(int userId, const QByteArray &key)
+{
+    CachedStatement query = statement(SQL_SELECT_LEGACY_ROOT);
+    query->addBindValue(userId);
+    
+    if (!query->exec()) {
+        qWarning() << "Failed to read the integrity root:" << query->lastError().text();
+        return false;
+    }
+    if (!query->next()) {
+        return true;
+    }
+    
+    const qint64 legacySum = query->value(0).toLongLong();
+    const qint64 legacyCount = query->value(1).toLongLong();
+    const QByteArray seal = query->value(2).toByteArray();
+    bool carryOver = !seal.isEmpty() && query->value(3).toLongLong() == legacySum &&
+                     query->value(4).toLongLong() == legacyCount &&
+                     VaultIntegrity::verifySeal(key, userId, legacySum, legacyCount, seal);
+    query->finish();
+    
+    if (!beginWrite()) {
+        return false;
+    }
+    
+    // The old seal only covered the sync hashes; it carries over to the ciphertext leaves
+    // if every sync hash still matches its row. Otherwise the seal is left as it is,
+    // which no longer matches, and the user decides after a full check.
+    int afterId = 0;
+    while (carryOver) {
+        CachedStatement page = statement(SQL_SELECT_INTEGRITY_PAGE);
+        page->addBindValue(userId);
+        page->addBindValue(afterId);
+        page->addBindValue(INTEGRITY_BATCH_SIZE);
+        
+        if (!page->exec()) {
+            qWarning() << "Failed to read entries for the integrity root:" << page->lastError().text();
+            return endWrite(false);
+        }
+        
+        const int lastId = afterId;
+        while (page->next()) {
+            const StoredEntry row = readStoredEntry(*page, true);
+            if (VaultSync::entryHash(row.name, row.url, row.username, row.password, row.note, row.fields) !=
+                page->value(12).toLongLong()) {
+                qWarning() << "Entry" << row.id << "no longer matches its sync hash";
+                carryOver = false;
+            }
+            afterId = row.id;
+        }
+        if (afterId == lastId) {
+            break;
+        }
+    }
+    
+    CachedStatement clear = statement(SQL_CLEAR_LEGACY_ROOT);
+    clear->addBindValue(userId);
+    
+    if (!clear->exec()) {
+        qWarning() << "Failed to upgrade the integrity root:" << clear->lastError().text();
+        return endWrite(false);
+    }
+    
+    if (carryOver) {
+        qDebug() << "Integrity root now covers the ciphertext of" << legacyCount << "entries";
+        return endWrite(sealIntegrityRoot(userId, key));
+    }
+    return endWrite(true);
+}
+
+qint64 Database::integrityLeaves(const QSqlQuery &query)
+{
+    // Same values, in the same order, as the triggers of schema step 14
+    qint64 sum = VaultIntegrity::leaf({QByteArrayLiteral("entry"), query.value(7), query.value(8), query.value(6),
+                                       query.value(1), query.value(2), query.value(3), query.value(4),
+                                       query.value(11)});
+    
+    if (!query.value(13).isNull()) {
+        const QVariant dictionaryId = query.value(10);
+        sum += VaultIntegrity::leaf({QByteArrayLiteral("note"), query.value(13),
+                                     dictionaryId.isNull() ? QVariant(qint64(-1)) : dictionaryId, query.value(9)});
+    }
+    return sum;
+}
+
+bool Database::sealIntegrityRoot(int userId, const QByteArray &key)
+{
+    CachedStatement ensure = statement(SQL_ENSURE_INTEGRITY_ROOT);
+    ensure->addBindValue(userId);
+    if (!ensure->exec()) {
+        qWarning() << "Failed to create integrity root:" << ensure->lastError().text();
+        return false;
+    }
+    
+    qint64 leafSum = 0;
+    qint64 leafCount = 0;
+    integrityRootStatus(userId, key, &leafSum, &leafCount);
+    
+    CachedStatement query = statement(SQL_SEAL_INTEGRITY_ROOT);
+    query->addBindValue(VaultIntegrity::seal(key, userId, leafSum, leafCount));
+    query->addBindValue(userId);
+    if (!query->exec()) {
+        qWarning() << "Failed to seal integrity root:" << query->lastError().text();
+        return false;
+    }
+    return true;
+}
+
+QList<IntegrityProblem> Database::verifyStoredEntries(const QList<StoredEntry> &rows, const QList<qint64> &hashes,
+                                                      const QByteArray &key)
+{
+    QList<IntegrityProblem> problems;
+    QByteArray scratch;
+    
+    for (int i = 0; i < rows.size(); ++i) {
+        const StoredEntry &row = rows[i];
+        
+        // A GCM tag check needs the full decryption; the plaintext is discarded
+        QStringList failed;
+        auto authenticate = [&](const char *label, const char *field, const QByteArray &data) {
+            int needed = qMax(0, data.size() - IV_SIZE - 16);
+            if (scratch.size() < needed) {
+                scratch.resize(needed);
+            }
+            if (decryptInto(key, data, scratch.data(), rowContext(row, field)) < 0) {
+                failed.append(QLatin1String(label));
+            }
+        };
+        
+        authenticate("password", "password", row.password);
+        if (row.encryptedFields) {
+            authenticate("name", "name", row.name);
+            authenticate("url", "url", row.url);
+            authenticate("username", "username", row.username);
+            
+            // Entries without a note have no entry_notes row
+            if (!row.note.isEmpty()) {
+                authenticate("note", "note", row.note);
+            }
+        }
+        
+        // Custom fields are only ever written encrypted
+        if (!row.fields.isEmpty()) {
+            authenticate("custom fields", "fields", row.fields);
+        }
+        
+        if (!failed.isEmpty()) {
+            IntegrityProblem problem;
+            problem.id = row.id;
+            problem.reason = QStringLiteral("%1 failed authentication").arg(failed.join(", "));
+            problems.append(problem);
+        }
+        
+        // Unbound ciphertext could have been swapped with another entry's; the next login binds it
+        if (!row.boundFields) {
+            IntegrityProblem problem;
+            problem.id = row.id;
+            problem.reason = QStringLiteral("fields are not bound to the entry");
+            problems.append(problem);
+        }
+        
+        if (VaultSync::entryHash(row.name, row.url, row.username, row.password, row.note, row.fields) != hashes[i]) {
+            IntegrityProblem problem;
+            problem.id = row.id;
+            problem.reason = QStringLiteral("stored hash does not match the row");
+            problems.append(problem);
+        }
+    }
+    
+    if (!scratch.isEmpty()) {
+        OPENSSL_cleanse(scratch.data(), size_t(scratch.size()));
+    }
+    return problems;
+}
+
+bool Database::beginWrite()
+{
+    if (!pool->isWriterThread()) {
+        qWarning() << "Write transaction requested outside the writer thread";
+        return false;
+    }
+    
+    const SessionRef session = currentSession();
+    
+    QSqlDatabase db = connection();
+    
+    // Nested writes (e.g. addPassword inside importPasswords) join the outer transaction
+    if (transactionDepth == 0) {
+        if (!db.transaction()) {
+            qWarning() << "Failed to start transaction:" << db.lastError().text();
+            return false;
+        }
+        
+        // A root that already fails its seal is not resealed over; that would make
+        // whatever changed it look like one of this transaction's writes
+        sealOnCommit = session->userId > 0 && !session->integrityKey.isEmpty() &&
+                       integrityRootStatus(session->userId, session->integrityKey) == IntegrityReport::RootIntact;
+    }
+    
+    transactionDepth++;
+    return true;
+}
+
+bool Database::endWrite(bool success)
+{
+    const SessionRef session = currentSession();
+    
+    transactionDepth--;
+    if (transactionDepth > 0) {
+        return success;
+    }
+    
+    QSqlDatabase db = connection();
+    
+    if (!success) {
+        db.rollback();
+        return false;
+    }
+    
+    // The triggers moved the root; only a commit made with the vault key may seal it
+    if (sealOnCommit && !sealIntegrityRoot(session->userId, session->integrityKey)) {
+        db.rollback();
+        return false;
+    }
+    
+    if (!db.commit()) {
+        qWarning() << "Failed to commit transaction:" << db.lastError().text();
+        db.rollback();
+        return false;
+    }
+    
+    return true;
+}
@@ -8,9 +8,115 @@
 #include <QCryptographicHash>
 #include <QDateTime>
 #include <QByteArray>
+#include <QFuture>
+#include <QMutex>
+#include <QHash>
+#include <memory>
 #include <openssl/aes.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
+#include "keyderivation.h"
+#include "securememory.h"
+#include "connectionpool.h"
+#include "vaultintegrity.h"
+#include "attachmentstore.h"
+#include "customfields.h"
+#include "entryhistory.h"
+
+struct SyncStats;
+
+// Row of the users table needed to authenticate
+struct UserRecord
+{
+    int id = -1;
+    QString username;
+    QString passwordHash;
+    QByteArray salt;
+    KdfParams kdf;
+};
+
+// Salt, KDF parameters and derived keys for a new or upgraded account
+struct CredentialSet
+{
+    QByteArray salt;
+    KdfParams kdf;
+    DerivedKeys keys;
+
+    bool isValid() const { return !salt.isEmpty() && keys.isValid(); }
+};
+
+// Result of the slow part of a login, computed off the GUI thread
+struct LoginResult
+{
+    bool verified = false;
+    DerivedKeys keys;
+    CredentialSet upgrade; // set when a legacy account should move to the current KDF
+};
+
+// Decrypted metadata of one row of the passwords table; the password itself stays encrypted
+struct PasswordEntry
+{
+    int id = -1;
+    QString name;
+    QString url;
+    QString username;
+    QByteArray encryptedPassword;
+    QByteArray passwordContext; // authenticated with encryptedPassword; empty for entries not bound yet
+    QString note;     // only loaded on request, see Database::getNote
+    int noteSize = 0; // bytes of UTF-8, known without reading the note
+    QList<CustomField> fields; // only loaded on request, see Database::getCustomFields
+};
+
+// Attachment of an entry moved between vaults. Its sealed chunks are copied from the
+// source vault as they are; only the name and key are encrypted again.
+struct MovedAttachment
+{
+    qint64 sourceId = -1; // row in the source vault
+    QString name;
+    QByteArray key; // unwrapped; wipe with OPENSSL_cleanse() once the entry is used
+    qint64 size = 0;
+};
+
+// Complete entry in plaintext, as moved between vaults and in and out of archives; keep these short-lived
+struct PlainEntry
+{
+    QString name;
+    QString url;
+    QString username;
+    QString password; // decrypted; wipe with SecretBuffer::wipe() once the entry is used
+    QString note;
+    QList<CustomField> fields;
+    QList<EntryVersion> history; // oldest first; only filled for moves between vaults
+    QList<MovedAttachment> attachments; // likewise
+    
+    // Wipes the password, the passwords of earlier versions and the attachment keys
+    void wipe();
+};
+
+// Changes applied to every entry of a bulk edit; parts not set are left as they are
+struct BulkEdit
+{
+    bool setSite = false;
+    QString name;
+    QString url;
+    bool setUsername = false;
+    QString username;
+};
+
+// One row of the change journal. Sequence numbers only grow, so a consumer can
+// remember the last one it applied and ask for everything after it.
+struct EntryChange
+{
+    enum Type {
+        Added = 1,
+        Updated = 2,
+        Deleted = 3
+    };
+    
+    qint64 seq = 0;
+    int passwordId = -1;
+    Type type = Updated;
+};
 
 class Database : public QObject
 {
@@ -18,48 +124,306 @@ class Database : public QObject
 
 public:
     explicit Database(QObject *parent = nullptr);
+    
+    // A vault file other than the default one; each instance has its own connections,
+    // writer thread and key, so several vaults can be open at once
+    explicit Database(const QString &path, QObject *parent = nullptr);
     ~Database();
+    
+    static QString defaultPath();
 
     bool initialize();
-    bool createTables();
+    
+    // Blocks until the background open and schema check finished; false if it failed
+    bool waitUntilReady();
     
     // User management
     bool createUser(const QString &username, const QString &password);
     bool validateUser(const QString &username, const QString &password);
-    bool setMasterKey(const QString &password);
-    int getCurrentUserId() const { return currentUserId; }
+    int getCurrentUserId() const;
+
+    // Split login: findUser/createUser/completeLogin touch the database and run on the
+    // GUI thread, prepareCredentials/deriveLogin only do the KDF and may run on a worker.
+    bool findUser(const QString &username, UserRecord &user);
+    // Stand-in for a username findUser did not find: a random salt and the KDF parameters
+    // of the newest account, so deriveLogin takes as long as for a wrong password and the
+    // response time does not tell which usernames exist. It never verifies.
+    UserRecord decoyUser(const QString &username);
+    bool createUser(const QString &username, const CredentialSet &credentials);
+    bool completeLogin(const UserRecord &user, const LoginResult &result);
+    static CredentialSet prepareCredentials(const QString &password);
+    static LoginResult deriveLogin(const UserRecord &user, const QString &password);
+    
+    // Unlock with keys from the session cache; fails if they no longer match the stored verifier
+    bool resumeLogin(const QString &username, const DerivedKeys &keys);
+    QString databasePath() const;
     
     // Password management
-    bool addPassword(const QString &name, const QString &url, const QString &username, const QString &password, const QString &note = QString());
-    bool updatePassword(int id, const QString &name, const QString &url, const QString &username, const QString &password, const QString &note = QString());
+    bool addPassword(const QString &name, const QString &url, const QString &username, const QString &password, const QString &note = QString(),
+                     const QList<CustomField> &fields = QList<CustomField>());
+    bool updatePassword(int id, const QString &name, const QString &url, const QString &username, const QString &password, const QString &note = QString(),
+                        const QList<CustomField> &fields = QList<CustomField>());
     bool deletePassword(int id);
-    QSqlQuery getPasswords(const QString &search = QString());
+    QList<PasswordEntry> getPasswordEntries(const QString &search = QString());
+    
+    // Operations on a selection, each in one write transaction. Deletion and editing are
+    // set-based: the ids go into a temporary list and every step that does not need the
+    // key is one statement joined against it. A bulk edit re-encrypts only name, url and
+    // username and records no history. Ids that do not exist or belong to another user
+    // are ignored.
+    bool deletePasswords(const QList<int> &ids);
+    bool editPasswords(const QList<int> &ids, const BulkEdit &edit);
+    // withExtras also decodes every earlier version and unwraps the attachment keys
+    QList<PlainEntry> getPlainEntries(const QList<int> &ids, bool withExtras = false);
+    bool entryExists(const QString &url, const QString &username);
+    
+    // Loads a user's rows on a reader thread while their key is still being derived;
+    // the next unfiltered getPasswordEntries() call for that user waits for it and is
+    // served from memory
+    QFuture<void> prefetchPasswordEntriesAsync(int userId);
+    void clearPrefetchedEntries();
+    
+    // Change journal of the current user, written in the same transaction as each mutation
+    QList<EntryChange> changesSince(qint64 seq, int limit = 1000);
+    qint64 latestChangeSeq();
+    QList<PasswordEntry> getPasswordEntriesById(const QList<int> &ids);
+    
+    // Up to limit entries with an id above afterId, in id order; for streaming the whole vault
+    bool getPasswordEntriesPage(int afterId, int limit, QList<PasswordEntry> &entries, bool withNotes = false);
+    
+    // Notes are kept out of the listing queries and read one entry at a time
+    QString getNote(int id);
+    QFuture<QString> getNoteAsync(int id);
+    
+    // Custom fields live in one packed, encrypted column of the entry's row: one read, one decrypt
+    QList<CustomField> getCustomFields(int id);
+    QFuture<QList<CustomField>> getCustomFieldsAsync(int id);
+    
+    // Trains the vault's note dictionary once it has enough notes, then compresses the notes
+    // still stored as-is, in short write transactions; for idle time
+    QFuture<int> compactNotesAsync();
+    
+    // Earlier versions of an entry, newest first. The list only carries ids and dates;
+    // a version is decoded on request, walking the delta chain down from the newest.
+    QList<EntryVersion> getHistory(int passwordId);
+    EntryVersion getHistoryVersion(int passwordId, qint64 historyId);
+    QFuture<QList<EntryVersion>> getHistoryAsync(int passwordId);
+    QFuture<EntryVersion> getHistoryVersionAsync(int passwordId, qint64 historyId);
+    
+    // Files attached to an entry. Content is encrypted in fixed-size chunks and streamed
+    // through SQLite's incremental blob I/O, so memory stays at one chunk whatever the
+    // file size. addAttachment returns the new attachment's id, or -1.
+    qint64 addAttachment(int passwordId, const QString &filePath);
+    bool saveAttachment(qint64 attachmentId, const QString &filePath);
+    bool deleteAttachment(qint64 attachmentId);
+    QList<AttachmentInfo> getAttachments(int passwordId);
+    QFuture<qint64> addAttachmentAsync(int passwordId, const QString &filePath);
+    QFuture<bool> saveAttachmentAsync(qint64 attachmentId, const QString &filePath);
+    QFuture<bool> deleteAttachmentAsync(qint64 attachmentId);
+    QFuture<QList<AttachmentInfo>> getAttachmentsAsync(int passwordId);
+    
+    // Two-way merge with another copy of this vault (same account and master password)
+    bool syncWith(const QString &path, SyncStats *stats = nullptr);
+    
+    // Integrity of the current user's entries. The quick check only compares the sealed
+    // root (one row); the full check authenticates every stored field on all cores and
+    // checks each row against its hash and the root. Neither changes the root.
+    IntegrityReport::RootStatus quickIntegrityCheck();
+    IntegrityReport verifyIntegrity();
+    QFuture<IntegrityReport> verifyIntegrityAsync();
+    
+    // Makes the current rows the trusted state after the user confirmed a root mismatch:
+    // verifies every row again inside the write and reseals the root over them, or
+    // changes nothing if any row fails
+    bool acceptIntegrityState();
+    QFuture<bool> acceptIntegrityStateAsync();
+    
+    // SQLite's data_version for the calling thread's connection; -1 on error
+    qint64 dataVersion();
     
     // Browser import
     bool importPasswords(const QList<QPair<QString, QPair<QString, QString>>> &passwords);
+    // Attachments of moved entries are copied from the vault file at sourcePath
+    bool importEntries(const QList<PlainEntry> &entries, const QString &sourcePath = QString());
+    
+    // Asynchronous variants. Reads run on a pool thread with its own WAL read connection,
+    // so they proceed while a write is in progress; writes are queued on the single writer
+    // connection in submission order. The synchronous calls above wait on the same queue.
+    QFuture<QList<PasswordEntry>> getPasswordEntriesAsync(const QString &search = QString());
+    QFuture<bool> entryExistsAsync(const QString &url, const QString &username);
+    QFuture<bool> addPasswordAsync(const QString &name, const QString &url, const QString &username, const QString &password, const QString &note = QString(),
+                                   const QList<CustomField> &fields = QList<CustomField>());
+    QFuture<bool> updatePasswordAsync(int id, const QString &name, const QString &url, const QString &username, const QString &password, const QString &note = QString(),
+                                      const QList<CustomField> &fields = QList<CustomField>());
+    QFuture<bool> deletePasswordAsync(int id);
+    QFuture<bool> deletePasswordsAsync(const QList<int> &ids);
+    QFuture<bool> editPasswordsAsync(const QList<int> &ids, const BulkEdit &edit);
+    QFuture<QList<PlainEntry>> getPlainEntriesAsync(const QList<int> &ids, bool withExtras = false);
+    QFuture<bool> importPasswordsAsync(const QList<QPair<QString, QPair<QString, QString>>> &passwords);
+    QFuture<bool> importEntriesAsync(const QList<PlainEntry> &entries, const QString &sourcePath = QString());
     
-    // Encryption/Decryption
-    QByteArray encryptPassword(const QString &password);
+    // Prepared-statement cache counters across all connections, for profiling
+    ConnectionPool::StatementStats statementCacheStats() const;
+    
+    // Runs EXPLAIN QUERY PLAN for every cached statement and logs the plans; false if
+    // one of them scans a table or needs a temporary B-tree for any reason
+    bool verifyQueryPlans();
+    
+    // Encryption/Decryption. Entry passwords are bound to their entry: pass the
+    // PasswordEntry::passwordContext the ciphertext was read with.
+    QByteArray encryptPassword(const QString &password, const QByteArray &context = QByteArray());
     QString decryptPassword(const QByteArray &encryptedPassword);
+    // Empty on failure; ok tells that apart from an empty password
+    SecretBuffer decryptSecret(const QByteArray &encryptedPassword, const QByteArray &context, bool *ok = nullptr);
+    
+    // AES-256-GCM implementation, fetched from the OpenSSL providers once
+    static const EVP_CIPHER *gcmCipher();
 
 private:
-    QString hashPassword(const QString &password);
+    // Row as stored on disk; metadata is ciphertext when encryptedFields is set, and every
+    // field's ciphertext is bound to (userId, uuid, field name) when boundFields is set
+    struct StoredEntry
+    {
+        int id = -1;
+        int userId = -1;
+        QByteArray uuid;
+        QByteArray name;
+        QByteArray url;
+        QByteArray username;
+        QByteArray password;
+        QByteArray note; // empty unless read together with its note
+        QByteArray fields; // packed custom fields, read together with the note
+        qint64 noteDictionaryId = -1; // -1: note stored as-is
+        int noteSize = 0;
+        bool encryptedFields = false;
+        bool boundFields = false;
+    };
+    
+    bool upgradeUserCredentials(const UserRecord &user, const QByteArray &oldKey, const CredentialSet &credentials);
+    // context, when given, is authenticated as GCM additional data and must be passed again to decrypt
+    QByteArray encryptWithKey(const QByteArray &key, const QByteArray &plaintext, const QByteArray &context = QByteArray());
+    QByteArray encryptWithKey(const QByteArray &key, const char *plaintext, int plaintextSize,
+                              const QByteArray &context = QByteArray());
+    QByteArray decryptWithKey(const QByteArray &key, const QByteArray &encryptedData,
+                              const QByteArray &context = QByteArray());
+    int decryptInto(const QByteArray &key, const QByteArray &encryptedData, char *output,
+                    const QByteArray &context = QByteArray());
     bool initializeEncryption();
     QByteArray generateIV();
-    bool upgradeDatabase();
+    QList<StoredEntry> fetchStoredEntries(int userId, const QList<QByteArray> &tokens = QList<QByteArray>());
+    bool fetchStoredPage(int userId, int afterId, int limit, bool withNotes, QList<StoredEntry> &rows);
+    StoredEntry readStoredEntry(const QSqlQuery &query, bool withNote = false);
+    // ok, when given, is cleared if any field fails to authenticate; those fields come back empty
+    PasswordEntry decryptStoredEntry(const StoredEntry &row, const QByteArray &key, bool *ok = nullptr);
+    // Additional data for one field of a row; empty for rows written before binding
+    static QByteArray rowContext(const StoredEntry &row, const char *field);
+    // Same for attachment names and keys, history versions and note dictionaries, which
+    // carry their own bound flag; dictionaries belong to the account, not to an entry
+    static QByteArray boundContext(bool bound, int userId, const QByteArray &uuid, const char *field);
+    static QByteArray dictionaryContext(bool bound, int userId, qint64 id);
+    QByteArray encryptField(const QByteArray &key, const QString &value, const QByteArray &context);
+    bool decryptField(const QByteArray &key, const QByteArray &encryptedField, const QByteArray &context, QString &value);
+    bool packFields(const QByteArray &key, const QList<CustomField> &fields, const QByteArray &context,
+                    QByteArray &storedFields);
+    QList<CustomField> unpackFields(const QByteArray &key, const QByteArray &storedFields, const QByteArray &context,
+                                    bool *ok = nullptr);
+    
+    // Notes: compressed with the active dictionary when that saves space, then encrypted
+    QByteArray packNote(const QByteArray &key, const QByteArray &note, const QByteArray &context, qint64 *dictionaryId);
+    QString unpackNote(const QByteArray &key, const QByteArray &storedNote, qint64 dictionaryId, bool encrypted,
+                       const QByteArray &context, bool *ok = nullptr);
+    bool storeNote(int passwordId, const QByteArray &storedNote, qint64 dictionaryId);
+    QByteArray noteDictionary(qint64 id, const QByteArray &key);
+    QList<qint64> loadNoteDictionaries(int userId, const QByteArray &key);
+    bool storeNoteDictionary(int userId, qint64 id, const QByteArray &key);
+    bool trainNoteDictionary();
+    int compactNoteBatch(int afterId, int *compacted);
+    void queueNoteBatch(std::shared_ptr<QPromise<int>> promise, int afterId, int compacted);
+    // unboundOnly: re-encrypts just the rows not bound yet, skipping those it cannot read
+    bool rewrapAttachmentKeys(int userId, const QByteArray &oldKey, const QByteArray &newKey, bool unboundOnly = false);
+    bool fillBulkIds(const QList<int> &ids);
+    bool recordHistory(int id, const EntryVersion &next);
+    // changedAt, when valid, keeps the date of a version carried over from another vault
+    bool storeHistoryVersion(int id, const QByteArray &uuid, const QByteArray &snapshot,
+                             const QDateTime &changedAt = QDateTime());
+    // Entries moved between vaults: the source side decodes the extras, the target side
+    // inserts the entry and stores them again under its own key
+    bool readEntryExtras(int id, PlainEntry &entry);
+    int insertEntry(const QString &name, const QString &url, const QString &username, const QString &password,
+                    const QString &note, const QList<CustomField> &fields, QByteArray *uuidOut = nullptr);
+    bool storeEntryExtras(int id, const QByteArray &uuid, const PlainEntry &entry, sqlite3 *source);
+    bool rewrapHistory(int userId, const QByteArray &oldKey, const QByteArray &newKey, bool unboundOnly = false);
+    bool storeSearchTokens(int userId, int passwordId, const QByteArray &tokenKey,
+                           const QString &name, const QString &url, const QString &username);
+    // Adds the tokens of an entry whose old tokens are already gone
+    bool insertSearchTokens(int userId, int passwordId, const QByteArray &tokenKey,
+                            const QString &name, const QString &url, const QString &username);
+    bool rewriteStoredEntry(const StoredEntry &row, int userId, const QByteArray &oldKey, const QByteArray &newKey);
+    bool convertLegacyEntries();
+    bool bindLegacyExtras();
+    bool recordChange(int userId, int passwordId, EntryChange::Type type);
+    IntegrityReport::RootStatus integrityRootStatus(int userId, const QByteArray &key,
+                                                    qint64 *leafSum = nullptr, qint64 *leafCount = nullptr);
+    bool sealIntegrityRoot(int userId, const QByteArray &key);
+    bool upgradeIntegrityRoot(int userId, const QByteArray &key);
+    // Leaves the triggers added for one row of SQL_SELECT_INTEGRITY_PAGE
+    static qint64 integrityLeaves(const QSqlQuery &query);
+    // Reads and verifies every row of userId; false if the rows could not be read
+    bool scanIntegrity(int userId, const QByteArray &key, IntegrityReport &report, qint64 *leafSum);
+    QList<IntegrityProblem> verifyStoredEntries(const QList<StoredEntry> &rows, const QList<qint64> &hashes,
+                                                const QByteArray &key);
+    bool beginWrite();
+    bool endWrite(bool success);
+    QSqlDatabase connection();
+    CachedStatement statement(const QString &sql);
     
-    QSqlDatabase db;
+    std::unique_ptr<ConnectionPool> pool;
+    QFuture<bool> initialized;
     static const QString DATABASE_NAME;
     
-    // Encryption related members
-    QByteArray masterKey;
+    // The logged-in user and the keys derived for them. A session is never changed in
+    // place: a login publishes a new one under sessionMutex, and each call takes its own
+    // reference first, so a read thread keeps one user and key for the whole call even
+    // while the writer thread logs in. Keys are wiped when the last reference goes.
+    struct Session
+    {
+        int userId = -1;
+        QString username;
+        QByteArray masterKey;
+        QByteArray indexKey;
+        QByteArray integrityKey;
+        
+        ~Session();
+    };
+    using SessionRef = std::shared_ptr<const Session>;
+    
+    SessionRef currentSession() const;
+    void startSession(int userId, const QString &username, const QByteArray &masterKey);
+    
+    mutable QMutex sessionMutex;
+    SessionRef activeSession; // never null once constructed
+    
     static const int KEY_SIZE = 32; // 256 bits
     static const int IV_SIZE = 16;  // 128 bits
     static const int SALT_SIZE = 32;
+    static const int INTEGRITY_BATCH_SIZE = 1024;
+    static const int NOTE_BATCH_SIZE = 256;
+    
+    // A prefetch only keeps its rows if nothing cleared them since it started
+    QMutex prefetchMutex;
+    int prefetchedUserId;
+    QList<StoredEntry> prefetchedEntries;
+    quint64 prefetchGeneration;
+    QFuture<void> prefetchTask;
+    
+    // Plaintext note dictionaries by id; read threads fill it on demand. New notes use
+    // the active one (0: none trained yet), which only the writer thread changes.
+    QMutex noteDictionaryMutex;
+    QHash<qint64, QByteArray> noteDictionaries;
+    qint64 activeDictionaryId;
     
-    // Current user info
-    int currentUserId;
-    QString currentUsername;
+    int transactionDepth;
+    bool sealOnCommit; // the root's seal was intact when the outermost write began
 };
 
 #endif // DATABASE_H 
\ No newline at end of file
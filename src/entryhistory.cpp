@@ -0,0 +1,81 @@
+#include "entryhistory.h"
+#include <QDataStream>
+#include <QSettings>
+#include <QDebug>
+#include <openssl/crypto.h>
+
+namespace {
+const char *KEEP_SETTING = "history/keep";
+const quint8 SNAPSHOT_VERSION = 1;
+
+// Fixed so stored snapshots decode the same whatever Qt version reads them
+const QDataStream::Version STREAM_VERSION = QDataStream::Qt_6_0;
+}
+
+int EntryHistory::keepCount()
+{
+    int keep = QSettings().value(KEEP_SETTING, DEFAULT_KEEP_COUNT).toInt();
+    return keep >= 0 ? keep : DEFAULT_KEEP_COUNT;
+}
+
+void EntryHistory::setKeepCount(int keep)
+{
+    QSettings().setValue(KEEP_SETTING, keep);
+}
+
+QByteArray EntryHistory::serialize(const EntryVersion &version)
+{
+    QByteArray fieldsRecord;
+    if (!CustomFieldRecord::pack(version.fields, fieldsRecord)) {
+        return QByteArray();
+    }
+    
+    QByteArray password = version.password.toUtf8();
+    QByteArray note = version.note.toUtf8();
+    
+    // Fields in the order they usually change least, so a delta finds long matches early
+    QByteArray snapshot;
+    {
+        QDataStream out(&snapshot, QIODevice::WriteOnly);
+        out.setVersion(STREAM_VERSION);
+        out << SNAPSHOT_VERSION << version.name.toUtf8() << version.url.toUtf8() << version.username.toUtf8()
+            << note << fieldsRecord << password;
+    }
+    
+    OPENSSL_cleanse(password.data(), password.size());
+    OPENSSL_cleanse(note.data(), note.size());
+    OPENSSL_cleanse(fieldsRecord.data(), fieldsRecord.size());
+    return snapshot;
+}
+
+bool EntryHistory::deserialize(const QByteArray &snapshot, EntryVersion &version)
+{
+    QDataStream in(snapshot);
+    in.setVersion(STREAM_VERSION);
+    
+    quint8 format = 0;
+    QByteArray name;
+    QByteArray url;
+    QByteArray username;
+    QByteArray note;
+    QByteArray fieldsRecord;
+    QByteArray password;
+    in >> format >> name >> url >> username >> note >> fieldsRecord >> password;
+    
+    bool ok = in.status() == QDataStream::Ok && in.atEnd() && format == SNAPSHOT_VERSION &&
+              CustomFieldRecord::unpack(fieldsRecord.constData(), int(fieldsRecord.size()), version.fields);
+    if (ok) {
+        version.name = QString::fromUtf8(name);
+        version.url = QString::fromUtf8(url);
+        version.username = QString::fromUtf8(username);
+        version.note = QString::fromUtf8(note);
+        version.password = QString::fromUtf8(password);
+    } else {
+        qWarning() << "Malformed entry history snapshot";
+    }
+    
+    OPENSSL_cleanse(password.data(), password.size());
+    OPENSSL_cleanse(note.data(), note.size());
+    OPENSSL_cleanse(fieldsRecord.data(), fieldsRecord.size());
+    return ok;
+}
@@ -0,0 +1,44 @@
+#ifndef ENTRYHISTORY_H
+#define ENTRYHISTORY_H
+
+#include <QString>
+#include <QByteArray>
+#include <QDateTime>
+#include <QList>
+#include "customfields.h"
+
+// One earlier version of an entry. Listings only fill id and changedAt; the rest
+// is decoded on request. Holds the password in plaintext, keep it short-lived.
+struct EntryVersion
+{
+    qint64 id = -1;
+    QDateTime changedAt;
+    QString name;
+    QString url;
+    QString username;
+    QString password;
+    QString note;
+    QList<CustomField> fields;
+};
+
+// Earlier versions of entries, kept in the entry_history table as reverse deltas:
+// the newest version of an entry is stored whole, every older one as a deflate
+// stream primed with the version after it, so consecutive versions that differ
+// in one field cost a few bytes. Retention drops the oldest versions, which
+// nothing else depends on. Each version is encrypted with the vault key.
+class EntryHistory
+{
+public:
+    static const int DEFAULT_KEEP_COUNT = 20;
+    static const int MAX_SNAPSHOT_SIZE = 32 * 1024 * 1024; // refused on decoding
+    
+    // Versions kept per entry, persisted in QSettings; 0 turns history off
+    static int keepCount();
+    static void setKeepCount(int keep);
+    
+    // Stable binary form of one version that deltas are computed over
+    static QByteArray serialize(const EntryVersion &version);
+    static bool deserialize(const QByteArray &snapshot, EntryVersion &version);
+};
+
+#endif // ENTRYHISTORY_H
@@ -0,0 +1,121 @@
+#include "keyderivation.h"
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QDebug>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+namespace {
+const int SCRYPT_BLOCK_SIZE = 8;
+const int SCRYPT_PARALLELISM = 1;
+const int KEY_HALF_SIZE = 32;
+}
+
+KdfParams KeyDerivation::legacyParams()
+{
+    KdfParams params;
+    params.algorithm = QStringLiteral("sha256");
+    return params;
+}
+
+KdfParams KeyDerivation::calibrate(int targetMs)
+{
+    KdfParams params;
+    params.algorithm = QStringLiteral("scrypt");
+    params.cost = MIN_COST;
+    params.blockSize = SCRYPT_BLOCK_SIZE;
+    params.parallelism = SCRYPT_PARALLELISM;
+
+    // Time a single run at the minimum cost with throwaway inputs
+    QByteArray probeSalt = generateSalt(16);
+    QElapsedTimer timer;
+    timer.start();
+    if (scrypt(QByteArrayLiteral("calibration"), probeSalt, params, 2 * KEY_HALF_SIZE).isEmpty()) {
+        qWarning() << "KDF calibration run failed, using minimum cost";
+        return params;
+    }
+    qint64 elapsed = qMax<qint64>(1, timer.elapsed());
+
+    // scrypt time scales linearly with N, so each extra cost step doubles it
+    while (params.cost < MAX_COST && elapsed * 2 <= targetMs) {
+        params.cost++;
+        elapsed *= 2;
+    }
+
+    qDebug() << "KDF calibrated to scrypt N = 2^" << params.cost << "estimated" << elapsed << "ms";
+    return params;
+}
+
+DerivedKeys KeyDerivation::derive(const QString &password, const QByteArray &salt, const KdfParams &params)
+{
+    DerivedKeys keys;
+
+    if (params.isLegacy()) {
+        // Same construction the original single SHA-256 scheme used
+        keys.verifier = QCryptographicHash::hash((password + salt.toHex()).toUtf8(),
+                                                 QCryptographicHash::Sha256).toHex();
+        keys.masterKey = QCryptographicHash::hash(password.toUtf8(), QCryptographicHash::Sha256);
+        return keys;
+    }
+
+    QByteArray output = scrypt(password.toUtf8(), salt, params, 2 * KEY_HALF_SIZE);
+    if (output.isEmpty()) {
+        return keys;
+    }
+
+    // First half authenticates the user, second half encrypts the vault
+    keys.verifier = QCryptographicHash::hash(output.left(KEY_HALF_SIZE), QCryptographicHash::Sha256).toHex();
+    keys.masterKey = output.mid(KEY_HALF_SIZE);
+
+    OPENSSL_cleanse(output.data(), output.size());
+    return keys;
+}
+
+bool KeyDerivation::verify(const DerivedKeys &keys, const QString &storedVerifier)
+{
+    QByteArray calculated = keys.verifier.toLatin1();
+    QByteArray stored = storedVerifier.toLatin1();
+
+    if (calculated.isEmpty() || calculated.size() != stored.size()) {
+        return false;
+    }
+
+    return CRYPTO_memcmp(calculated.constData(), stored.constData(), calculated.size()) == 0;
+}
+
+QByteArray KeyDerivation::generateSalt(int size)
+{
+    QByteArray salt(size, 0);
+    if (RAND_bytes(reinterpret_cast<unsigned char*>(salt.data()), size) != 1) {
+        qWarning() << "Failed to generate salt";
+        return QByteArray();
+    }
+    return salt;
+}
+
+QByteArray KeyDerivation::scrypt(const QByteArray &password, const QByteArray &salt, const KdfParams &params, int outputSize)
+{
+    if (params.cost < MIN_COST || params.cost > MAX_COST || params.blockSize <= 0 || params.parallelism <= 0) {
+        qWarning() << "Invalid scrypt parameters:" << params.cost << params.blockSize << params.parallelism;
+        return QByteArray();
+    }
+
+    const uint64_t n = uint64_t(1) << params.cost;
+    const uint64_t r = uint64_t(params.blockSize);
+    const uint64_t p = uint64_t(params.parallelism);
+
+    // OpenSSL refuses anything above 32 MiB unless maxmem is raised explicitly
+    const uint64_t maxMem = 128 * r * (n + p + 2) + (uint64_t(1) << 20);
+
+    QByteArray output(outputSize, 0);
+    if (EVP_PBE_scrypt(password.constData(), size_t(password.size()),
+                       reinterpret_cast<const unsigned char*>(salt.constData()), size_t(salt.size()),
+                       n, r, p, maxMem,
+                       reinterpret_cast<unsigned char*>(output.data()), size_t(outputSize)) != 1) {
+        qWarning() << "scrypt derivation failed";
+        return QByteArray();
+    }
+
+    return output;
+}
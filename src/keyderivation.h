@@ -0,0 +1,49 @@
+#ifndef KEYDERIVATION_H
+#define KEYDERIVATION_H
+
+#include <QString>
+#include <QByteArray>
+
+// Parameters of the key derivation function, stored per user
+struct KdfParams
+{
+    QString algorithm;   // "scrypt", or "sha256" for accounts created before the KDF upgrade
+    int cost = 0;        // log2 of the scrypt N parameter
+    int blockSize = 0;   // scrypt r
+    int parallelism = 0; // scrypt p
+
+    bool isLegacy() const { return algorithm != QLatin1String("scrypt"); }
+};
+
+// Output of one derivation: a verifier stored in the users table and the
+// vault key used for AES-256-GCM. Both halves come from the same KDF run.
+struct DerivedKeys
+{
+    QString verifier;
+    QByteArray masterKey;
+
+    bool isValid() const { return !verifier.isEmpty() && !masterKey.isEmpty(); }
+};
+
+class KeyDerivation
+{
+public:
+    static const int DEFAULT_TARGET_MS = 500;
+    static const int MIN_COST = 14;  // N = 16384, 16 MiB with r = 8
+    static const int MAX_COST = 20;  // N = 1048576, 1 GiB with r = 8
+
+    // Tunes the scrypt cost so one derivation takes about targetMs on this machine.
+    // Blocking; call it from a worker thread.
+    static KdfParams calibrate(int targetMs = DEFAULT_TARGET_MS);
+    static KdfParams legacyParams();
+
+    // Thread-safe; does not touch the database
+    static DerivedKeys derive(const QString &password, const QByteArray &salt, const KdfParams &params);
+    static bool verify(const DerivedKeys &keys, const QString &storedVerifier);
+    static QByteArray generateSalt(int size);
+
+private:
+    static QByteArray scrypt(const QByteArray &password, const QByteArray &salt, const KdfParams &params, int outputSize);
+};
+
+#endif // KEYDERIVATION_H
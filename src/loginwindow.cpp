@@ -3,16 +3,23 @@
 #include <QApplication>
 #include <QScreen>
 #include <QStyle>
+#include <QDebug>
+#include <QtConcurrent>
+#include "sessioncache.h"
+#include "startuptimer.h"
 
 LoginWindow::LoginWindow(Database *db, QWidget *parent)
     : QDialog(parent)
     , db(db)
     , isLoginMode(true)
+    , painted(false)
+    , loginWatcher(new QFutureWatcher<LoginResult>(this))
+    , registerWatcher(new QFutureWatcher<CredentialSet>(this))
 {
     setupUI();
     setupConnections();
     setWindowTitle(tr("Password Manager - Login"));
-    setFixedSize(400, 300);
+    setFixedSize(400, 330);
     
     // Center the login window on screen
     setGeometry(
@@ -29,12 +36,24 @@ LoginWindow::~LoginWindow()
 {
 }
 
+void LoginWindow::paintEvent(QPaintEvent *event)
+{
+    QDialog::paintEvent(event);
+    
+    // First paint is the end of the measured startup path
+    if (!painted) {
+        painted = true;
+        StartupTimer::finish("login dialog painted");
+    }
+}
+
 void LoginWindow::setupUI()
 {
     // Set dark theme
     QString darkStyle = 
         "QDialog { background-color: #1E1E1E; color: #FFFFFF; }"
         "QLabel { color: #FFFFFF; }"
+        "QCheckBox { color: #FFFFFF; }"
         "QPushButton { background-color: #0078D7; color: white; border: none; padding: 5px 10px; border-radius: 2px; }"
         "QPushButton:hover { background-color: #1C97EA; }"
         "QPushButton:pressed { background-color: #00559B; }"
@@ -71,6 +90,13 @@ void LoginWindow::setupUI()
     confirmLabel->hide();
     confirmPasswordEdit->hide();
     
+    // Session unlock cache (Linux keyring only)
+    rememberCheck = new QCheckBox(tr("Stay unlocked for this session"), this);
+    rememberCheck->setChecked(SessionCache::isEnabled());
+    rememberCheck->setToolTip(tr("Keeps the vault key in the kernel keyring for %1 minutes")
+                              .arg(SessionCache::timeoutSeconds() / 60));
+    rememberCheck->setVisible(SessionCache::isAvailable());
+    
     // Buttons
     loginButton = new QPushButton(tr("Login"), this);
     registerButton = new QPushButton(tr("Register"), this);
@@ -89,6 +115,7 @@ void LoginWindow::setupUI()
     mainLayout->addWidget(passwordEdit);
     mainLayout->addWidget(confirmLabel);
     mainLayout->addWidget(confirmPasswordEdit);
+    mainLayout->addWidget(rememberCheck);
     mainLayout->addWidget(statusLabel);
     mainLayout->addSpacing(10);
     mainLayout->addWidget(loginButton);
@@ -101,6 +128,8 @@ void LoginWindow::setupConnections()
 {
     connect(loginButton, &QPushButton::clicked, this, &LoginWindow::handleLogin);
     connect(registerButton, &QPushButton::clicked, this, &LoginWindow::handleRegister);
+    connect(loginWatcher, &QFutureWatcher<LoginResult>::finished, this, &LoginWindow::finishLogin);
+    connect(registerWatcher, &QFutureWatcher<CredentialSet>::finished, this, &LoginWindow::finishRegister);
     connect(switchButton, &QPushButton::clicked, this, [this]() {
         if (isLoginMode) {
             switchToRegister();
@@ -119,11 +148,62 @@ void LoginWindow::handleLogin()
     QString username = usernameEdit->text();
     QString password = passwordEdit->text();
     
-    // Implement actual login logic with database
-    if (db->validateUser(username, password)) {
+    // An unknown username goes through the same derivation as a wrong password
+    pendingUser = UserRecord();
+    if (!db->findUser(username, pendingUser)) {
+        pendingUser = db->decoyUser(username);
+    }
+    
+    setBusy(true, tr("Unlocking..."));
+    UserRecord user = pendingUser;
+    loginWatcher->setFuture(QtConcurrent::run([user, password]() {
+        return Database::deriveLogin(user, password);
+    }));
+    if (user.id > 0) {
+        emit loginStarted(user.id);
+    }
+}
+
+bool LoginWindow::resumeSession()
+{
+    if (!SessionCache::isEnabled()) {
+        return false;
+    }
+    
+    QString username;
+    DerivedKeys keys;
+    if (!SessionCache::lookup(db->databasePath(), username, keys)) {
+        return false;
+    }
+    
+    if (!db->resumeLogin(username, keys)) {
+        // Stale entry, e.g. the password changed since it was cached
+        SessionCache::remove(db->databasePath());
+        return false;
+    }
+    
+    qDebug() << "Unlocked from session keyring";
+    return true;
+}
+
+void LoginWindow::finishLogin()
+{
+    setBusy(false);
+    
+    LoginResult result = loginWatcher->result();
+    if (db->completeLogin(pendingUser, result)) {
+        SessionCache::setEnabled(rememberCheck->isChecked());
+        if (rememberCheck->isChecked()) {
+            // Upgraded legacy accounts unlock with the new keys from now on
+            SessionCache::store(db->databasePath(), pendingUser.username,
+                                result.upgrade.isValid() ? result.upgrade.keys : result.keys);
+        } else {
+            SessionCache::remove(db->databasePath());
+        }
         accept(); // Close dialog with Accepted result
     } else {
         statusLabel->setText(tr("Invalid username or password"));
+        emit loginFailed();
     }
 }
 
@@ -133,7 +213,6 @@ void LoginWindow::handleRegister()
         return;
     }
     
-    QString username = usernameEdit->text();
     QString password = passwordEdit->text();
     QString confirmPassword = confirmPasswordEdit->text();
     
@@ -142,8 +221,20 @@ void LoginWindow::handleRegister()
         return;
     }
     
-    // Implement actual registration logic with database
-    if (db->createUser(username, password)) {
+    // Calibration measures this machine, so it runs on the worker together with the derivation
+    pendingUsername = usernameEdit->text();
+    setBusy(true, tr("Creating account..."));
+    registerWatcher->setFuture(QtConcurrent::run([password]() {
+        return Database::prepareCredentials(password);
+    }));
+}
+
+void LoginWindow::finishRegister()
+{
+    setBusy(false);
+    
+    CredentialSet credentials = registerWatcher->result();
+    if (credentials.isValid() && db->createUser(pendingUsername, credentials)) {
         QMessageBox::information(this, tr("Success"), tr("Registration successful. You can now login."));
         switchToLogin();
     } else {
@@ -151,6 +242,18 @@ void LoginWindow::handleRegister()
     }
 }
 
+void LoginWindow::setBusy(bool busy, const QString &message)
+{
+    usernameEdit->setEnabled(!busy);
+    passwordEdit->setEnabled(!busy);
+    confirmPasswordEdit->setEnabled(!busy);
+    rememberCheck->setEnabled(!busy);
+    loginButton->setEnabled(!busy);
+    registerButton->setEnabled(!busy);
+    switchButton->setEnabled(!busy);
+    statusLabel->setText(message);
+}
+
 void LoginWindow::switchToRegister()
 {
     isLoginMode = false;
@@ -159,6 +262,7 @@ void LoginWindow::switchToRegister()
     registerButton->show();
     confirmPasswordEdit->parentWidget()->show();
     confirmPasswordEdit->show();
+    rememberCheck->hide();
     switchButton->setText(tr("Switch to Login"));
     statusLabel->clear();
 }
@@ -171,6 +275,7 @@ void LoginWindow::switchToLogin()
     loginButton->show();
     confirmPasswordEdit->parentWidget()->hide();
     confirmPasswordEdit->hide();
+    rememberCheck->setVisible(SessionCache::isAvailable());
     switchButton->setText(tr("Switch to Register"));
     statusLabel->clear();
 }
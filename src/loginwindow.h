@@ -6,6 +6,8 @@
 #include <QPushButton>
 #include <QLabel>
 #include <QVBoxLayout>
+#include <QFutureWatcher>
+#include <QCheckBox>
 #include "database.h"
 
 class LoginWindow : public QDialog
@@ -15,21 +17,36 @@ class LoginWindow : public QDialog
 public:
     explicit LoginWindow(Database *db, QWidget *parent = nullptr);
     ~LoginWindow();
+    
+    // Unlocks from the session keyring without showing the dialog; true on success
+    bool resumeSession();
+
+protected:
+    void paintEvent(QPaintEvent *event) override;
+
+signals:
+    // Emitted once the user row is found and key derivation has started
+    void loginStarted(int userId);
+    void loginFailed();
 
 private slots:
     void handleLogin();
     void handleRegister();
     void switchToRegister();
     void switchToLogin();
+    void finishLogin();
+    void finishRegister();
 
 private:
     void setupUI();
     void setupConnections();
     bool validateInput();
+    void setBusy(bool busy, const QString &message = QString());
     
     QLineEdit *usernameEdit;
     QLineEdit *passwordEdit;
     QLineEdit *confirmPasswordEdit;
+    QCheckBox *rememberCheck;
     QPushButton *loginButton;
     QPushButton *registerButton;
     QPushButton *switchButton;
@@ -37,6 +54,13 @@ private:
     
     Database *db;
     bool isLoginMode;
+    bool painted;
+    
+    // Key derivation runs on a worker thread so the dialog keeps painting
+    QFutureWatcher<LoginResult> *loginWatcher;
+    QFutureWatcher<CredentialSet> *registerWatcher;
+    UserRecord pendingUser;
+    QString pendingUsername;
 };
 
 #endif // LOGINWINDOW_H 
\ No newline at end of file
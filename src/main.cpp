@@ -1,14 +1,71 @@
 #include <QApplication>
 #include <QMessageBox>
 #include <QSystemTrayIcon>
+#include <QTimer>
+#include <QTemporaryDir>
+#include <QDebug>
+#include <memory>
 #include "mainwindow.h"
 #include "loginwindow.h"
 #include "database.h"
 #include "passwordmanager.h"
+#include "startuptimer.h"
+#include "vaultsync.h"
+#include "migrationcheck.h"
 
 int main(int argc, char *argv[])
 {
+    StartupTimer::start();
     QApplication app(argc, argv);
+    StartupTimer::mark("QApplication");
+    
+    // Set application information
+    QApplication::setApplicationName("Password Manager");
+    QApplication::setApplicationVersion("1.0.0");
+    QApplication::setOrganizationName("YourOrganization");
+    QApplication::setOrganizationDomain("yourorganization.com");
+    
+    // Fails when a hot query stops using its index: --verify-query-plans [database].
+    // Without a path the plans are checked on a fresh database, which is what ctest does.
+    int plansIndex = app.arguments().indexOf("--verify-query-plans");
+    if (plansIndex >= 0) {
+        QTemporaryDir dir;
+        QString path = app.arguments().value(plansIndex + 1);
+        Database db(path.isEmpty() || path.startsWith("--") ? dir.filePath("query-plans.db") : path);
+        return db.verifyQueryPlans() ? 0 : 1;
+    }
+    
+    // Migrates databases of every earlier schema version and checks the result:
+    // --verify-migrations [entries]. ctest runs the smallest size; pass e.g. 100000 to
+    // see how the chunked steps hold up on a large vault.
+    int migrationsIndex = app.arguments().indexOf("--verify-migrations");
+    if (migrationsIndex >= 0) {
+        QString count = app.arguments().value(migrationsIndex + 1);
+        bool numeric = false;
+        int entries = count.toInt(&numeric);
+        if (!count.isEmpty() && !count.startsWith("--") && (!numeric || entries <= 0)) {
+            qWarning() << "Usage: --verify-migrations [entries]";
+            return 2;
+        }
+        return MigrationCheck::run(numeric ? entries : 0) ? 0 : 1;
+    }
+    
+    // Merges two vault files without the GUI: --sync-vaults <local> <other> <username>
+    int syncIndex = app.arguments().indexOf("--sync-vaults");
+    if (syncIndex >= 0) {
+        const QStringList args = app.arguments();
+        if (args.size() < syncIndex + 4) {
+            qWarning() << "Usage: --sync-vaults <local> <other> <username>";
+            return 2;
+        }
+        
+        SyncStats stats;
+        if (!VaultSync::syncFiles(args[syncIndex + 1], args[syncIndex + 2], args[syncIndex + 3], &stats)) {
+            return 1;
+        }
+        qInfo() << "Pulled" << stats.pulled << "pushed" << stats.pushed << "in" << stats.elapsedMs << "ms";
+        return 0;
+    }
     
     // Check if system tray is available
     if (!QSystemTrayIcon::isSystemTrayAvailable()) {
@@ -17,30 +74,46 @@ int main(int argc, char *argv[])
         return 1;
     }
     
+    StartupTimer::mark("system tray check");
+    
     // Allow the application to run in the background when all windows are closed
     QApplication::setQuitOnLastWindowClosed(false);
     
-    // Set application information
-    QApplication::setApplicationName("Password Manager");
-    QApplication::setApplicationVersion("1.0.0");
-    QApplication::setOrganizationName("YourOrganization");
-    QApplication::setOrganizationDomain("yourorganization.com");
-    
     // Initialize database
     Database db;
+    StartupTimer::mark("database constructed");
     
     // Initialize password manager
     PasswordManager passwordManager(&db);
     
-    // Show login window
     LoginWindow loginWindow(&db);
-    if (loginWindow.exec() != QDialog::Accepted) {
-        return 0;
+    StartupTimer::mark("login window constructed");
+    std::unique_ptr<MainWindow> mainWindow;
+    auto createMainWindow = [&]() {
+        mainWindow = std::make_unique<MainWindow>(&db, &passwordManager);
+        
+        QObject::connect(&loginWindow, &LoginWindow::loginStarted,
+                         mainWindow.get(), &MainWindow::prefetchPasswordList, Qt::QueuedConnection);
+        QObject::connect(&loginWindow, &LoginWindow::loginFailed,
+                         mainWindow.get(), &MainWindow::discardPrefetchedList);
+        QObject::connect(&loginWindow, &QDialog::accepted,
+                         mainWindow.get(), &MainWindow::unlock);
+    };
+    
+    if (loginWindow.resumeSession()) {
+        // Vault key came from the session keyring, so there is nothing to wait for
+        createMainWindow();
+        mainWindow->unlock();
+        StartupTimer::finish("unlocked from session keyring");
+    } else {
+        // Show login window first; everything else is built behind it.
+        // The main window is built once the event loop runs, so it does not hold up the
+        // login dialog, and stays hidden until the key is available
+        loginWindow.show();
+        QTimer::singleShot(0, &loginWindow, createMainWindow);
     }
     
-    // Show main window
-    MainWindow mainWindow(&db, &passwordManager);
-    mainWindow.show();
+    QObject::connect(&loginWindow, &QDialog::rejected, &app, &QApplication::quit);
     
     return app.exec();
-} 
\ No newline at end of file
+}
\ No newline at end of file
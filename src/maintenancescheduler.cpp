@@ -0,0 +1,357 @@
+#include "maintenancescheduler.h"
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QSettings>
+#include <QStringList>
+#include <QCoreApplication>
+#include <QEvent>
+#include <QThread>
+#include <QtConcurrent>
+#include <QDebug>
+#include <functional>
+
+namespace {
+const char *ENABLED_SETTING = "maintenance/enabled";
+const char *INTERVAL_SETTING = "maintenance/intervalHours";
+const char *BUDGET_SETTING = "maintenance/budgetPercent";
+const char *LAST_RUN_SETTING = "maintenance/lastRun";
+const char *NEXT_TABLE_SETTING = "maintenance/nextCheckTable";
+
+const int PACE_SLICE_MS = 50;
+
+std::atomic<int> runCounter(0);
+
+qint64 pragmaValue(QSqlDatabase db, const char *pragma)
+{
+    QSqlQuery query(db);
+    if (!query.exec(QStringLiteral("PRAGMA %1").arg(QLatin1String(pragma))) || !query.next()) {
+        return -1;
+    }
+    return query.value(0).toLongLong();
+}
+
+bool execStatement(QSqlDatabase db, const QString &sql)
+{
+    QSqlQuery query(db);
+    if (!query.exec(sql)) {
+        qWarning() << "Maintenance statement failed:" << query.lastError().text() << sql;
+        return false;
+    }
+    return true;
+}
+
+// incremental_vacuum frees one page per sqlite3_step, but Qt steps a statement
+// without result columns only once, so pages are freed one execution at a time
+bool vacuumPages(QSqlDatabase db, int pages)
+{
+    if (!db.transaction()) {
+        qWarning() << "Failed to start incremental vacuum:" << db.lastError().text();
+        return false;
+    }
+    
+    QSqlQuery vacuum(db);
+    bool ok = vacuum.prepare("PRAGMA incremental_vacuum(1)");
+    for (int i = 0; ok && i < pages; ++i) {
+        ok = vacuum.exec();
+    }
+    
+    if (!ok) {
+        qWarning() << "Incremental vacuum failed:" << vacuum.lastError().text();
+        vacuum.finish();
+        db.rollback();
+        return false;
+    }
+    
+    vacuum.finish();
+    return db.commit();
+}
+
+// Sleeps long enough that working for workedMs stays within budgetPercent of the
+// elapsed time; false if the run was interrupted in the meantime
+bool pace(qint64 workedMs, int budgetPercent, const std::atomic<bool> *interrupted)
+{
+    qint64 restMs = workedMs * (100 - budgetPercent) / budgetPercent;
+    while (restMs > 0) {
+        if (interrupted->load()) {
+            return false;
+        }
+        
+        qint64 slice = qMin<qint64>(restMs, PACE_SLICE_MS);
+        QThread::msleep(static_cast<unsigned long>(slice));
+        restMs -= slice;
+    }
+    return !interrupted->load();
+}
+}
+
+MaintenanceScheduler::MaintenanceScheduler(const QString &databasePath, QObject *parent)
+    : QObject(parent)
+    , path(databasePath)
+    , watcher(new QFutureWatcher<MaintenanceReport>(this))
+    , scheduleTimer(new QTimer(this))
+    , interrupted(false)
+    , yieldToInput(true)
+{
+    // Runs are sequential and keep their connection on one thread
+    maintenanceThread.setMaxThreadCount(1);
+    sinceInput.start();
+    
+    scheduleTimer->setInterval(CHECK_INTERVAL_MS);
+    connect(scheduleTimer, &QTimer::timeout, this, &MaintenanceScheduler::checkSchedule);
+    connect(watcher, &QFutureWatcher<MaintenanceReport>::finished, this, &MaintenanceScheduler::runFinished);
+}
+
+MaintenanceScheduler::~MaintenanceScheduler()
+{
+    // Stops after the current step; only a full VACUUM has to be waited out
+    interrupted = true;
+    maintenanceThread.waitForDone();
+}
+
+bool MaintenanceScheduler::isEnabled()
+{
+    return QSettings().value(ENABLED_SETTING, true).toBool();
+}
+
+int MaintenanceScheduler::intervalHours()
+{
+    int hours = QSettings().value(INTERVAL_SETTING, DEFAULT_INTERVAL_HOURS).toInt();
+    return hours > 0 ? hours : DEFAULT_INTERVAL_HOURS;
+}
+
+int MaintenanceScheduler::budgetPercent()
+{
+    int percent = QSettings().value(BUDGET_SETTING, DEFAULT_BUDGET_PERCENT).toInt();
+    return percent > 0 && percent <= 100 ? percent : DEFAULT_BUDGET_PERCENT;
+}
+
+QDateTime MaintenanceScheduler::lastRunTime() const
+{
+    return QSettings().value(LAST_RUN_SETTING).toDateTime();
+}
+
+void MaintenanceScheduler::start()
+{
+    qApp->installEventFilter(this);
+    scheduleTimer->start();
+}
+
+bool MaintenanceScheduler::runNow()
+{
+    return startRun(false);
+}
+
+bool MaintenanceScheduler::eventFilter(QObject *watched, QEvent *event)
+{
+    switch (event->type()) {
+    case QEvent::KeyPress:
+    case QEvent::MouseButtonPress:
+    case QEvent::Wheel:
+    case QEvent::TouchBegin:
+        sinceInput.restart();
+        if (yieldToInput && watcher->isRunning()) {
+            interrupted = true;
+        }
+        break;
+    default:
+        break;
+    }
+    return QObject::eventFilter(watched, event);
+}
+
+void MaintenanceScheduler::checkSchedule()
+{
+    if (!isEnabled() || watcher->isRunning()) {
+        return;
+    }
+    
+    if (sinceInput.elapsed() < qint64(IDLE_MINUTES) * 60 * 1000) {
+        return;
+    }
+    
+    QDateTime last = lastRunTime();
+    if (!last.isValid() || last.secsTo(QDateTime::currentDateTime()) >= qint64(intervalHours()) * 3600) {
+        startRun(true);
+    }
+}
+
+bool MaintenanceScheduler::startRun(bool yield)
+{
+    if (watcher->isRunning()) {
+        return false;
+    }
+    
+    interrupted = false;
+    yieldToInput = yield;
+    
+    QString databasePath = path;
+    int budget = budgetPercent();
+    int tableIndex = QSettings().value(NEXT_TABLE_SETTING, 0).toInt();
+    const std::atomic<bool> *stop = &interrupted;
+    
+    // A full VACUUM cannot yield to input and holds the write lock until it is done,
+    // so idle-time runs never start one
+    bool allowFullVacuum = !yield;
+    watcher->setFuture(QtConcurrent::run(&maintenanceThread, [databasePath, budget, tableIndex, allowFullVacuum, stop]() {
+        return runTasks(databasePath, budget, tableIndex, allowFullVacuum, stop);
+    }));
+    return true;
+}
+
+void MaintenanceScheduler::runFinished()
+{
+    MaintenanceReport report = watcher->result();
+    
+    // The spot-check rotates through the tables across runs
+    QSettings settings;
+    if (!report.checkedTable.isEmpty()) {
+        settings.setValue(NEXT_TABLE_SETTING, settings.value(NEXT_TABLE_SETTING, 0).toInt() + 1);
+    }
+    if (report.completed) {
+        settings.setValue(LAST_RUN_SETTING, QDateTime::currentDateTime());
+    }
+    
+    qInfo().nospace() << "Maintenance " << (report.completed ? "finished" : "stopped") << " after "
+                      << report.elapsedMs << " ms: reclaimed " << report.reclaimedBytes() / 1024 << " KiB, free pages "
+                      << QString::number(report.fragmentationBefore(), 'f', 1) << "% -> "
+                      << QString::number(report.fragmentationAfter(), 'f', 1) << "%, "
+                      << report.checkpointedFrames << " WAL frames checkpointed";
+    if (report.fullVacuumDeferred) {
+        qInfo() << "The vault file needs a one-time full VACUUM; run maintenance from the File menu to reclaim its free pages";
+    }
+    
+    emit maintenanceFinished(report);
+}
+
+MaintenanceReport MaintenanceScheduler::runTasks(const QString &databasePath, int budgetPercent, int tableIndex,
+                                                 bool allowFullVacuum, const std::atomic<bool> *interrupted)
+{
+    MaintenanceReport report;
+    QElapsedTimer total;
+    total.start();
+    
+    // SCHED_IDLE on Linux: the scheduler only gives this thread otherwise unused CPU time
+    QThread::currentThread()->setPriority(QThread::IdlePriority);
+    
+    QString connectionName = QStringLiteral("PasswordManager-maintenance-%1").arg(runCounter.fetch_add(1));
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", connectionName);
+        db.setDatabaseName(databasePath);
+        db.setConnectOptions(QStringLiteral("QSQLITE_BUSY_TIMEOUT=%1").arg(BUSY_TIMEOUT_MS));
+        
+        if (!db.open()) {
+            qWarning() << "Failed to open database for maintenance:" << db.lastError().text();
+        } else {
+            report.pageSize = pragmaValue(db, "page_size");
+            report.pagesBefore = pragmaValue(db, "page_count");
+            report.freePagesBefore = pragmaValue(db, "freelist_count");
+            
+            // Every task is short and followed by a pause that keeps the run within budget
+            auto step = [&](const std::function<bool()> &work) {
+                if (interrupted->load()) {
+                    return false;
+                }
+                
+                QElapsedTimer timer;
+                timer.start();
+                if (!work()) {
+                    return false;
+                }
+                return pace(timer.elapsed(), budgetPercent, interrupted);
+            };
+            
+            bool ok = true;
+            if (pragmaValue(db, "auto_vacuum") == 2) {
+                qint64 freePages = report.freePagesBefore;
+                while (ok && freePages > 0) {
+                    ok = step([&]() {
+                        return vacuumPages(db, int(qMin<qint64>(freePages, VACUUM_PAGES_PER_STEP)));
+                    });
+                    
+                    qint64 remaining = pragmaValue(db, "freelist_count");
+                    if (remaining >= freePages) {
+                        break;
+                    }
+                    freePages = remaining;
+                }
+            } else if (report.freePagesBefore * 100 >= report.pagesBefore * FULL_VACUUM_PERCENT) {
+                // Files created before incremental auto_vacuum need one full rebuild to switch;
+                // unlike the other tasks it cannot be split into steps, so it waits for runNow()
+                if (allowFullVacuum) {
+                    ok = step([&]() {
+                        return execStatement(db, "PRAGMA auto_vacuum = INCREMENTAL") && execStatement(db, "VACUUM");
+                    });
+                } else {
+                    report.fullVacuumDeferred = true;
+                }
+            }
+            
+            // Refreshes statistics only for tables whose size changed noticeably
+            if (ok) {
+                ok = step([&]() {
+                    return execStatement(db, "PRAGMA analysis_limit = 400") && execStatement(db, "PRAGMA optimize");
+                });
+                report.optimized = ok;
+            }
+            
+            QStringList tables;
+            QSqlQuery tableQuery(db);
+            if (tableQuery.exec("SELECT name FROM sqlite_master WHERE type = 'table' AND name NOT LIKE 'sqlite_%' ORDER BY name")) {
+                while (tableQuery.next()) {
+                    tables.append(tableQuery.value(0).toString());
+                }
+            }
+            tableQuery.finish();
+            
+            // One table (and its indexes) per run instead of the whole file
+            if (ok && !tables.isEmpty()) {
+                QString table = tables[tableIndex % tables.size()];
+                ok = step([&]() {
+                    QSqlQuery check(db);
+                    if (!check.exec(QStringLiteral("PRAGMA quick_check(\"%1\")").arg(table))) {
+                        qWarning() << "Integrity check failed to run:" << check.lastError().text();
+                        return false;
+                    }
+                    
+                    while (check.next()) {
+                        QString result = check.value(0).toString();
+                        if (result != QLatin1String("ok")) {
+                            qCritical() << "Integrity check of" << table << "reported:" << result;
+                            report.integrityOk = false;
+                        }
+                    }
+                    return true;
+                });
+                if (ok) {
+                    report.checkedTable = table;
+                }
+            }
+            
+            // Last, so it also moves the pages the vacuum just wrote into the file
+            if (ok) {
+                ok = step([&]() {
+                    QSqlQuery checkpoint(db);
+                    if (!checkpoint.exec("PRAGMA wal_checkpoint(PASSIVE)") || !checkpoint.next()) {
+                        return false;
+                    }
+                    report.checkpointedFrames = checkpoint.value(2).toLongLong();
+                    return true;
+                });
+            }
+            
+            report.completed = ok;
+            report.pagesAfter = pragmaValue(db, "page_count");
+            report.freePagesAfter = pragmaValue(db, "freelist_count");
+            
+            if (!ok && interrupted->load()) {
+                qDebug() << "Maintenance yielded to user input";
+            }
+        }
+        db.close();
+    }
+    QSqlDatabase::removeDatabase(connectionName);
+    
+    report.elapsedMs = total.elapsed();
+    return report;
+}
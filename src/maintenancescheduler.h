@@ -0,0 +1,102 @@
+#ifndef MAINTENANCESCHEDULER_H
+#define MAINTENANCESCHEDULER_H
+
+#include <QObject>
+#include <QString>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QThreadPool>
+#include <QFutureWatcher>
+#include <QTimer>
+#include <atomic>
+
+// What one maintenance run did and how the file looked before and after it
+struct MaintenanceReport
+{
+    bool completed = false; // false when it yielded to the user or a task failed
+    qint64 elapsedMs = 0;
+    
+    qint64 pageSize = 0;
+    qint64 pagesBefore = 0;
+    qint64 pagesAfter = 0;
+    qint64 freePagesBefore = 0;
+    qint64 freePagesAfter = 0;
+    
+    bool fullVacuumDeferred = false; // the file needs a full VACUUM that only runNow() performs
+    bool optimized = false;
+    qint64 checkpointedFrames = 0;
+    QString checkedTable;       // table covered by this run's integrity spot-check
+    bool integrityOk = true;
+    
+    qint64 reclaimedBytes() const { return (pagesBefore - pagesAfter) * pageSize; }
+    
+    // Share of the file that is free pages, in percent
+    double fragmentationBefore() const { return pagesBefore > 0 ? 100.0 * freePagesBefore / pagesBefore : 0.0; }
+    double fragmentationAfter() const { return pagesAfter > 0 ? 100.0 * freePagesAfter / pagesAfter : 0.0; }
+};
+
+// Housekeeping of the vault file while the application sits idle in the tray:
+// reclaiming free pages (incremental_vacuum), refreshing planner statistics
+// (PRAGMA optimize), an integrity spot-check of one table per run and a WAL
+// checkpoint. Tasks run in small steps on a low-priority thread with their own
+// connection and sleep between steps to stay within a CPU and I/O budget. Any
+// keyboard or mouse input stops a scheduled run after the current step; it
+// resumes at the next idle period.
+class MaintenanceScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    static const int DEFAULT_INTERVAL_HOURS = 24;
+    static const int DEFAULT_BUDGET_PERCENT = 10; // share of wall time spent working
+    static const int IDLE_MINUTES = 5;
+    
+    explicit MaintenanceScheduler(const QString &databasePath, QObject *parent = nullptr);
+    ~MaintenanceScheduler();
+    
+    // Persisted in QSettings
+    static bool isEnabled();
+    static int intervalHours();
+    static int budgetPercent();
+    QDateTime lastRunTime() const;
+    
+    bool isRunning() const { return watcher->isRunning(); }
+    
+    // Starts watching for input and checking the schedule
+    void start();
+
+public slots:
+    // Runs right away without waiting for idle time; input does not interrupt it.
+    // Only these runs convert a file without incremental auto_vacuum (a full VACUUM)
+    bool runNow();
+
+signals:
+    void maintenanceFinished(const MaintenanceReport &report);
+
+protected:
+    bool eventFilter(QObject *watched, QEvent *event) override;
+
+private slots:
+    void checkSchedule();
+    void runFinished();
+
+private:
+    bool startRun(bool yieldToInput);
+    static MaintenanceReport runTasks(const QString &databasePath, int budgetPercent, int tableIndex,
+                                      bool allowFullVacuum, const std::atomic<bool> *interrupted);
+    
+    static const int CHECK_INTERVAL_MS = 60 * 1000;
+    static const int BUSY_TIMEOUT_MS = 250;     // the app's own writes win over maintenance
+    static const int VACUUM_PAGES_PER_STEP = 256;
+    static const int FULL_VACUUM_PERCENT = 25;  // converts a file without incremental auto_vacuum
+    
+    QString path;
+    QThreadPool maintenanceThread;
+    QFutureWatcher<MaintenanceReport> *watcher;
+    QTimer *scheduleTimer;
+    QElapsedTimer sinceInput;
+    std::atomic<bool> interrupted;
+    bool yieldToInput;
+};
+
+#endif // MAINTENANCESCHEDULER_H
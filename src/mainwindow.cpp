@@ -1,5 +1,9 @@
 #include "mainwindow.h"
 #include "passworddialog.h"
+#include "sessioncache.h"
+#include "blindindex.h"
+#include "vaultarchive.h"
+#include "vaultsync.h"
 #include <QMessageBox>
 #include <QMenuBar>
 #include <QToolBar>
@@ -10,17 +14,57 @@
 #include <QStyle>
 #include <QFileDialog>
 #include <QDir>
+#include <QFileInfo>
 #include <QUrl>
 #include <QTimer>
 #include <QSqlQuery>
 #include <QGuiApplication>
 #include <QClipboard>
+#include <QMimeData>
+#include <QPointer>
+#include <QSet>
+#include <QInputDialog>
+#include <QDialog>
+#include <QLocale>
+#include <QPlainTextEdit>
+#include <QSharedPointer>
+#include <QCheckBox>
+#include <QDialogButtonBox>
+#include <QFormLayout>
+#include <QtConcurrent>
+
+namespace {
+const QString PASSWORD_MASK = QStringLiteral("\u2022\u2022\u2022\u2022\u2022\u2022\u2022\u2022");
+
+// Entry name for a website field: the host of a URL without "www.", or the text itself
+QString siteName(const QString &website)
+{
+    if (!website.contains("://")) {
+        return website;
+    }
+    
+    QString name = QUrl(website).host();
+    if (name.isEmpty()) {
+        return website;
+    }
+    return name.startsWith("www.") ? name.mid(4) : name;
+}
+}
 
 MainWindow::MainWindow(Database *db, PasswordManager *passwordManager, QWidget *parent)
     : QMainWindow(parent)
     , db(db)
     , passwordManager(passwordManager)
+    , searchWatcher(new QFutureWatcher<QList<PasswordEntry>>(this))
+    , changeMonitor(new ChangeMonitor(db, this))
+    , appliedSeq(0)
+    , searchSeq(0)
+    , backupManager(new BackupManager(db->databasePath(), this))
+    , maintenanceScheduler(new MaintenanceScheduler(db->databasePath(), this))
+    , vaults(std::make_unique<VaultSet>())
 {
+    vaults->addVault(tr("This vault"), db);
+    
     setupUI();
     createMenuBar();
     createToolBar();
@@ -32,14 +76,49 @@ MainWindow::MainWindow(Database *db, PasswordManager *passwordManager, QWidget *
     setWindowTitle(tr("Password Manager"));
     setWindowIcon(QIcon(style()->standardIcon(QStyle::SP_DriveFDIcon)));
     setMinimumSize(800, 600);
-    
-    refreshPasswordList();
 }
 
 MainWindow::~MainWindow()
 {
 }
 
+void MainWindow::prefetchPasswordList(int userId)
+{
+    db->prefetchPasswordEntriesAsync(userId);
+}
+
+void MainWindow::discardPrefetchedList()
+{
+    db->clearPrefetchedEntries();
+}
+
+void MainWindow::unlock()
+{
+    // Served from the prefetched rows, so only decryption is left at this point
+    refreshPasswordList();
+    changeMonitor->start();
+    backupManager->start();
+    maintenanceScheduler->start();
+    
+    trayIcon->show();
+    clipboardMonitorTimer->start(1000); // Check every second
+    lastClipboardText = QApplication::clipboard()->text();
+    
+    show();
+    
+    // One row read; the full check only runs when this one fails or on request
+    if (db->quickIntegrityCheck() == IntegrityReport::RootMismatch) {
+        QMessageBox::StandardButton reply = QMessageBox::warning(
+            this, tr("Vault Integrity"),
+            tr("The vault was changed outside this application or is damaged.\n"
+               "Verify every entry now?"),
+            QMessageBox::Yes | QMessageBox::No);
+        if (reply == QMessageBox::Yes) {
+            verifyIntegrity();
+        }
+    }
+}
+
 void MainWindow::closeEvent(QCloseEvent *event)
 {
     if (trayIcon->isVisible()) {
@@ -89,6 +168,7 @@ void MainWindow::setupUI()
     passwordTable->setHorizontalHeaderLabels({tr("name"), tr("url"), tr("username"), tr("password"), tr("note")});
     passwordTable->horizontalHeader()->setSectionResizeMode(QHeaderView::Stretch);
     passwordTable->setSelectionBehavior(QAbstractItemView::SelectRows);
+    passwordTable->setSelectionMode(QAbstractItemView::ExtendedSelection);
     passwordTable->setEditTriggers(QAbstractItemView::NoEditTriggers);
     
     // Buttons
@@ -114,7 +194,23 @@ void MainWindow::createMenuBar()
 {
     QMenu *fileMenu = menuBar()->addMenu(tr("&File"));
     fileMenu->addAction(tr("&Import from CSV"), this, &MainWindow::importFromCsv);
+    fileMenu->addAction(tr("E&xport Vault..."), this, &MainWindow::exportVault);
+    fileMenu->addAction(tr("Import &Vault..."), this, &MainWindow::importVault);
+    fileMenu->addAction(tr("&Sync with Vault File..."), this, &MainWindow::syncWithVault);
+    fileMenu->addAction(tr("&Back Up Now"), this, &MainWindow::backupNow);
+    fileMenu->addAction(tr("Run &Maintenance Now"), this, &MainWindow::runMaintenance);
+    fileMenu->addAction(tr("&Verify Vault Integrity"), this, &MainWindow::verifyIntegrity);
+    fileMenu->addSeparator();
+    fileMenu->addAction(tr("&Open Another Vault..."), this, &MainWindow::openAnotherVault);
+    fileMenu->addAction(tr("Search &All Vaults..."), this, &MainWindow::searchAllVaults);
     fileMenu->addSeparator();
+    if (SessionCache::isAvailable()) {
+        fileMenu->addAction(tr("&Forget Session Unlock"), this, [this]() {
+            SessionCache::setEnabled(false);
+            SessionCache::remove(db->databasePath());
+            statusBar()->showMessage(tr("The next launch will ask for the master password"), 3000);
+        });
+    }
     
     // Replace Exit with Hide to Tray
     fileMenu->addAction(tr("&Hide to Tray"), this, &QWidget::hide);
@@ -124,6 +220,10 @@ void MainWindow::createMenuBar()
     editMenu->addAction(tr("&Add Password"), this, &MainWindow::addPassword);
     editMenu->addAction(tr("&Delete Password"), this, &MainWindow::deletePassword);
     editMenu->addAction(tr("&Edit Password"), this, &MainWindow::editPassword);
+    editMenu->addAction(tr("&Copy Password"), this, &MainWindow::copyPassword);
+    editMenu->addAction(tr("A&ttachments..."), this, &MainWindow::manageAttachments);
+    editMenu->addAction(tr("Password &History..."), this, &MainWindow::showHistory);
+    editMenu->addAction(tr("&Move to Vault..."), this, &MainWindow::moveToVault);
 }
 
 void MainWindow::createToolBar()
@@ -143,6 +243,26 @@ void MainWindow::setupConnections()
     connect(editButton, &QPushButton::clicked, this, &MainWindow::editPassword);
     connect(importCsvButton, &QPushButton::clicked, this, &MainWindow::importFromCsv);
     connect(searchBox, &QLineEdit::textChanged, this, &MainWindow::searchPasswords);
+    connect(searchWatcher, &QFutureWatcher<QList<PasswordEntry>>::finished, this, &MainWindow::showSearchResults);
+    connect(changeMonitor, &ChangeMonitor::changed, this, &MainWindow::applyJournalChanges);
+    connect(backupManager, &BackupManager::backupFinished, this, &MainWindow::showBackupResult);
+    connect(maintenanceScheduler, &MaintenanceScheduler::maintenanceFinished, this, &MainWindow::showMaintenanceResult);
+    
+    // Notes are compressed in the same idle window; the next vacuum returns the freed pages
+    connect(maintenanceScheduler, &MaintenanceScheduler::maintenanceFinished, this, [this](const MaintenanceReport &report) {
+        if (report.completed) {
+            db->compactNotesAsync();
+        }
+    });
+    
+    connect(passwordTable, &QTableWidget::cellDoubleClicked, this, [this](int row, int column) {
+        if (column == 3) {
+            passwordTable->selectRow(row);
+            copyPassword();
+        } else if (column == 4) {
+            showNote(row);
+        }
+    });
 }
 
 void MainWindow::setupTrayIcon()
@@ -167,7 +287,7 @@ void MainWindow::setupTrayIcon()
     trayIcon->setContextMenu(trayIconMenu);
     connect(trayIcon, &QSystemTrayIcon::activated, this, &MainWindow::trayIconActivated);
     
-    trayIcon->show();
+    // Shown by unlock(), the tray must not offer the window before login
 }
 
 void MainWindow::trayIconActivated(QSystemTrayIcon::ActivationReason reason)
@@ -210,23 +330,12 @@ void MainWindow::addPassword()
         QString username = dialog.getUsername();
         QString password = dialog.getPassword();
         
-        // Extract name and URL from website field
-        QString name = website;
+        // The website field is stored as the URL; the name is its host
+        QString name = siteName(website);
         QString url = website;
         
-        // If website contains a URL, separate name and URL
-        if (website.contains("://")) {
-            QUrl websiteUrl(website);
-            name = websiteUrl.host();
-            if (name.isEmpty()) {
-                name = website;
-            } else if (name.startsWith("www.")) {
-                name = name.mid(4);
-            }
-        }
-        
-        if (passwordManager->addPassword(name, url, username, password)) {
-            refreshPasswordList();
+        if (passwordManager->addPassword(name, url, username, password, QString(), dialog.getCustomFields())) {
+            applyJournalChanges();
             statusBar()->showMessage(tr("Password added successfully"), 3000);
         } else {
             QMessageBox::warning(this, tr("Error"), tr("Failed to add password"));
@@ -242,6 +351,24 @@ void MainWindow::deletePassword()
         return;
     }
     
+    // Several rows go in one transaction, and the view drops them in one pass
+    if (selection.size() > 1) {
+        QList<int> ids = selectedPasswordIds();
+        if (QMessageBox::question(this, tr("Confirm Delete"),
+                                  tr("Are you sure you want to delete the %1 selected passwords?").arg(ids.size()),
+                                  QMessageBox::Yes | QMessageBox::No) != QMessageBox::Yes) {
+            return;
+        }
+        
+        if (passwordManager->deletePasswords(ids)) {
+            applyJournalChanges();
+            statusBar()->showMessage(tr("%1 passwords deleted").arg(ids.size()), 3000);
+        } else {
+            QMessageBox::warning(this, tr("Error"), tr("Failed to delete the selected passwords"));
+        }
+        return;
+    }
+    
     int row = selection.first().row();
     int id = passwordTable->item(row, 0)->data(Qt::UserRole).toInt();
     QString name = passwordTable->item(row, 0)->text();
@@ -256,7 +383,7 @@ void MainWindow::deletePassword()
     
     if (reply == QMessageBox::Yes) {
         if (passwordManager->deletePassword(id)) {
-            refreshPasswordList();
+            applyJournalChanges();
             statusBar()->showMessage(tr("Password deleted successfully"), 3000);
         } else {
             QMessageBox::warning(this, tr("Error"), tr("Failed to delete password"));
@@ -272,41 +399,41 @@ void MainWindow::editPassword()
         return;
     }
     
+    if (selection.size() > 1) {
+        editSelectedPasswords(selectedPasswordIds());
+        return;
+    }
+    
     int row = selection.first().row();
     int id = passwordTable->item(row, 0)->data(Qt::UserRole).toInt();
     QString name = passwordTable->item(row, 0)->text();
     QString url = passwordTable->item(row, 1)->text();
     QString username = passwordTable->item(row, 2)->text();
-    QString password = passwordTable->item(row, 3)->text();
-    QString note = passwordTable->item(row, 4)->text();
+    QString note = db->getNote(id);
     
     PasswordDialog dialog(this, true);
     dialog.setWebsite(url);
     dialog.setUsername(username);
-    dialog.setPassword(password);
+    dialog.setCustomFields(db->getCustomFields(id));
+    
+    // The table only holds ciphertext; decrypt for the dialog and wipe right after
+    {
+        SecretBuffer password = db->decryptSecret(passwordTable->item(row, 3)->data(Qt::UserRole).toByteArray(),
+                                                  passwordTable->item(row, 3)->data(Qt::UserRole + 1).toByteArray());
+        dialog.setPassword(password.toString());
+    }
     
     if (dialog.exec() == QDialog::Accepted) {
         QString newWebsite = dialog.getWebsite();
         QString newUsername = dialog.getUsername();
         QString newPassword = dialog.getPassword();
         
-        // Extract name and URL from website field
-        QString newName = newWebsite;
+        // The website field is stored as the URL; the name is its host
+        QString newName = siteName(newWebsite);
         QString newUrl = newWebsite;
         
-        // If website contains a URL, separate name and URL
-        if (newWebsite.contains("://")) {
-            QUrl websiteUrl(newWebsite);
-            newName = websiteUrl.host();
-            if (newName.isEmpty()) {
-                newName = newWebsite;
-            } else if (newName.startsWith("www.")) {
-                newName = newName.mid(4);
-            }
-        }
-        
-        if (passwordManager->updatePassword(id, newName, newUrl, newUsername, newPassword, note)) {
-            refreshPasswordList();
+        if (passwordManager->updatePassword(id, newName, newUrl, newUsername, newPassword, note, dialog.getCustomFields())) {
+            applyJournalChanges();
             statusBar()->showMessage(tr("Password updated successfully"), 3000);
         } else {
             QMessageBox::warning(this, tr("Error"), tr("Failed to update password"));
@@ -316,40 +443,624 @@ void MainWindow::editPassword()
 
 void MainWindow::searchPasswords()
 {
+    // Journal position first: anything committed while the search runs is replayed afterwards
+    searchSeq = db->latestChangeSeq();
+    
+    // Replacing the future drops the result of a search that is still running
     QString searchText = searchBox->text();
-    QSqlQuery query = db->getPasswords(searchText);
+    searchWatcher->setFuture(db->getPasswordEntriesAsync(searchText));
+}
+
+void MainWindow::showSearchResults()
+{
+    populatePasswordTable(searchWatcher->result());
+    appliedSeq = searchSeq;
+    applyJournalChanges();
+}
+
+void MainWindow::applyJournalChanges()
+{
+    // A running search will replay the journal itself once its result is shown
+    if (searchWatcher->isRunning()) {
+        return;
+    }
+    
+    // Only the last change per entry matters
+    QSet<int> removed;
+    QSet<int> modified;
+    qint64 seq = appliedSeq;
+    while (true) {
+        const QList<EntryChange> changes = db->changesSince(seq, JOURNAL_PAGE_SIZE);
+        for (const EntryChange &change : changes) {
+            if (change.type == EntryChange::Deleted) {
+                modified.remove(change.passwordId);
+                removed.insert(change.passwordId);
+            } else {
+                removed.remove(change.passwordId);
+                modified.insert(change.passwordId);
+            }
+        }
+        if (!changes.isEmpty()) {
+            seq = changes.last().seq;
+        }
+        if (changes.size() < JOURNAL_PAGE_SIZE) {
+            break;
+        }
+    }
+    
+    if (seq == appliedSeq) {
+        return;
+    }
+    
+    // Large batches of new or changed rows (imports, re-keying) are cheaper to reload than
+    // to fetch one by one; deletions cost nothing to apply, however many there are
+    if (modified.size() >= MAX_INCREMENTAL_CHANGES) {
+        searchPasswords();
+        return;
+    }
+    appliedSeq = seq;
+    
+    const QList<PasswordEntry> entries = db->getPasswordEntriesById(modified.values());
+    QSet<int> found;
+    for (const PasswordEntry &entry : entries) {
+        found.insert(entry.id);
+        
+        // Keep the table consistent with the active filter
+        if (BlindIndex::matches(searchBox->text(), entry.name, entry.url, entry.username)) {
+            upsertPasswordRow(entry);
+        } else {
+            removed.insert(entry.id);
+        }
+    }
+    
+    // Rows deleted again after the journal was read
+    for (int id : std::as_const(modified)) {
+        if (!found.contains(id)) {
+            removed.insert(id);
+        }
+    }
+    
+    removePasswordRows(removed);
+}
+
+void MainWindow::removePasswordRows(const QSet<int> &ids)
+{
+    if (ids.isEmpty()) {
+        return;
+    }
+    
+    // One pass from the bottom, dropping each run of adjacent rows with a single call
+    passwordTable->setUpdatesEnabled(false);
+    int row = passwordTable->rowCount() - 1;
+    while (row >= 0) {
+        int end = row;
+        while (row >= 0 && ids.contains(passwordTable->item(row, 0)->data(Qt::UserRole).toInt())) {
+            row--;
+        }
+        if (row < end) {
+            passwordTable->model()->removeRows(row + 1, end - row);
+        } else {
+            row--;
+        }
+    }
+    passwordTable->setUpdatesEnabled(true);
+}
+
+QList<int> MainWindow::selectedPasswordIds() const
+{
+    QList<int> ids;
+    const QModelIndexList selection = passwordTable->selectionModel()->selectedRows();
+    for (const QModelIndex &index : selection) {
+        ids.append(passwordTable->item(index.row(), 0)->data(Qt::UserRole).toInt());
+    }
+    return ids;
+}
+
+void MainWindow::editSelectedPasswords(const QList<int> &ids)
+{
+    QDialog dialog(this);
+    dialog.setWindowTitle(tr("Edit %1 Passwords").arg(ids.size()));
+    
+    QCheckBox *websiteCheck = new QCheckBox(tr("Set website:"), &dialog);
+    QLineEdit *websiteEdit = new QLineEdit(&dialog);
+    QCheckBox *usernameCheck = new QCheckBox(tr("Set username:"), &dialog);
+    QLineEdit *usernameEdit = new QLineEdit(&dialog);
+    websiteEdit->setEnabled(false);
+    usernameEdit->setEnabled(false);
+    connect(websiteCheck, &QCheckBox::toggled, websiteEdit, &QWidget::setEnabled);
+    connect(usernameCheck, &QCheckBox::toggled, usernameEdit, &QWidget::setEnabled);
+    
+    QDialogButtonBox *buttons = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel, &dialog);
+    connect(buttons, &QDialogButtonBox::accepted, &dialog, &QDialog::accept);
+    connect(buttons, &QDialogButtonBox::rejected, &dialog, &QDialog::reject);
+    
+    QFormLayout *layout = new QFormLayout(&dialog);
+    layout->addRow(websiteCheck, websiteEdit);
+    layout->addRow(usernameCheck, usernameEdit);
+    layout->addRow(buttons);
     
+    if (dialog.exec() != QDialog::Accepted || (!websiteCheck->isChecked() && !usernameCheck->isChecked())) {
+        return;
+    }
+    
+    BulkEdit edit;
+    edit.setSite = websiteCheck->isChecked();
+    edit.name = siteName(websiteEdit->text());
+    edit.url = websiteEdit->text();
+    edit.setUsername = usernameCheck->isChecked();
+    edit.username = usernameEdit->text();
+    
+    if (passwordManager->editPasswords(ids, edit)) {
+        applyJournalChanges();
+        statusBar()->showMessage(tr("%1 passwords updated").arg(ids.size()), 3000);
+    } else {
+        QMessageBox::warning(this, tr("Error"), tr("Failed to update the selected passwords"));
+    }
+}
+
+void MainWindow::moveToVault()
+{
+    QList<int> ids = selectedPasswordIds();
+    if (ids.isEmpty()) {
+        QMessageBox::warning(this, tr("Warning"), tr("Please select the passwords to move"));
+        return;
+    }
+    
+    QStringList targets;
+    const QStringList labels = vaults->labels();
+    for (const QString &label : labels) {
+        if (vaults->vault(label) != db) {
+            targets.append(label);
+        }
+    }
+    if (targets.isEmpty()) {
+        QMessageBox::information(this, tr("Move to Vault"),
+                                 tr("Open the vault to move them to first (File > Open Another Vault...)."));
+        return;
+    }
+    
+    bool ok = false;
+    QString label = QInputDialog::getItem(this, tr("Move to Vault"),
+                                          tr("Move %1 passwords to:").arg(ids.size()), targets, 0, false, &ok);
+    QPointer<Database> target = ok ? vaults->vault(label) : nullptr;
+    if (!target) {
+        return;
+    }
+    
+    if (QMessageBox::question(this, tr("Move to Vault"),
+                              tr("Move %1 passwords to \"%2\"?").arg(ids.size()).arg(label),
+                              QMessageBox::Yes | QMessageBox::No) == QMessageBox::Yes) {
+        transferEntries(ids, target, label);
+    }
+}
+
+void MainWindow::transferEntries(const QList<int> &ids, QPointer<Database> target, const QString &label)
+{
+    // Each vault has its own file and key, so this is one transaction on each side. Earlier
+    // versions and attachment keys go along decrypted and are encrypted again there; the
+    // sealed attachment content is copied from this vault's file. The entries are only
+    // deleted here once the other vault has committed them; a failure in between leaves
+    // copies in both vaults rather than in neither.
+    QPointer<Database> source = db;
+    QFutureWatcher<QList<PlainEntry>> *reader = new QFutureWatcher<QList<PlainEntry>>(this);
+    connect(reader, &QFutureWatcher<QList<PlainEntry>>::finished, this, [this, reader, ids, source, target, label]() {
+        QSharedPointer<QList<PlainEntry>> entries(new QList<PlainEntry>(reader->result()));
+        reader->deleteLater();
+        
+        // getPlainEntries returns all of the selection or nothing
+        if (entries->size() != ids.size() || !source || !target) {
+            for (PlainEntry &entry : *entries) {
+                entry.wipe();
+            }
+            QMessageBox::warning(this, tr("Error"), tr("Failed to read the selected passwords"));
+            return;
+        }
+        
+        QFutureWatcher<bool> *importer = new QFutureWatcher<bool>(this);
+        connect(importer, &QFutureWatcher<bool>::finished, this, [this, importer, entries, ids, source, label]() {
+            bool copied = importer->result();
+            importer->deleteLater();
+            for (PlainEntry &entry : *entries) {
+                entry.wipe();
+            }
+            
+            if (!copied) {
+                QMessageBox::warning(this, tr("Error"), tr("Failed to copy the passwords to \"%1\"").arg(label));
+                return;
+            }
+            if (!source) {
+                return;
+            }
+            
+            QFutureWatcher<bool> *remover = new QFutureWatcher<bool>(this);
+            connect(remover, &QFutureWatcher<bool>::finished, this, [this, remover, ids, label]() {
+                bool deleted = remover->result();
+                remover->deleteLater();
+                
+                if (deleted) {
+                    applyJournalChanges();
+                    statusBar()->showMessage(tr("%1 passwords moved to %2").arg(ids.size()).arg(label), 3000);
+                } else {
+                    QMessageBox::warning(this, tr("Error"),
+                                         tr("The passwords were copied to \"%1\" but could not be deleted here").arg(label));
+                }
+            });
+            remover->setFuture(source->deletePasswordsAsync(ids));
+        });
+        importer->setFuture(target->importEntriesAsync(*entries, source->databasePath()));
+    });
+    reader->setFuture(source->getPlainEntriesAsync(ids, true));
+}
+
+void MainWindow::populatePasswordTable(const QList<PasswordEntry> &entries)
+{
     passwordTable->setRowCount(0);
+    passwordTable->setRowCount(entries.size());
+    
+    int row = 0;
+    for (const PasswordEntry &entry : entries) {
+        setPasswordRow(row, entry);
+        row++;
+    }
+}
+
+void MainWindow::setPasswordRow(int row, const PasswordEntry &entry)
+{
+    QTableWidgetItem *nameItem = new QTableWidgetItem(entry.name);
+    QTableWidgetItem *urlItem = new QTableWidgetItem(entry.url);
+    QTableWidgetItem *usernameItem = new QTableWidgetItem(entry.username);
+    QTableWidgetItem *passwordItem = new QTableWidgetItem(PASSWORD_MASK);
+    QTableWidgetItem *noteItem = new QTableWidgetItem(entry.noteSize > 0 ? tr("[%1 bytes]").arg(entry.noteSize) : QString());
+    
+    // Store the password ID for later use
+    nameItem->setData(Qt::UserRole, entry.id);
+    
+    // Passwords are decrypted on demand (copy, edit) instead of for every listed row
+    passwordItem->setData(Qt::UserRole, entry.encryptedPassword);
+    passwordItem->setData(Qt::UserRole + 1, entry.passwordContext);
+    passwordItem->setToolTip(tr("Double-click to copy"));
+    
+    // Notes stay on disk until asked for, so the list only knows their size
+    if (entry.noteSize > 0) {
+        noteItem->setToolTip(tr("Double-click to show"));
+    }
+    
+    passwordTable->setItem(row, 0, nameItem);
+    passwordTable->setItem(row, 1, urlItem);
+    passwordTable->setItem(row, 2, usernameItem);
+    passwordTable->setItem(row, 3, passwordItem);
+    passwordTable->setItem(row, 4, noteItem);
+}
+
+void MainWindow::showNote(int row)
+{
+    int id = passwordTable->item(row, 0)->data(Qt::UserRole).toInt();
+    
+    QFutureWatcher<QString> *watcher = new QFutureWatcher<QString>(this);
+    connect(watcher, &QFutureWatcher<QString>::finished, this, [this, watcher, id]() {
+        watcher->deleteLater();
+        
+        // The table may have been refreshed while the note was read
+        int current = findPasswordRow(id);
+        if (current < 0) {
+            return;
+        }
+        
+        QTableWidgetItem *noteItem = passwordTable->item(current, 4);
+        noteItem->setText(watcher->result());
+        noteItem->setToolTip(watcher->result());
+    });
+    watcher->setFuture(db->getNoteAsync(id));
+}
+
+void MainWindow::manageAttachments()
+{
+    QModelIndexList selection = passwordTable->selectionModel()->selectedRows();
+    if (selection.isEmpty()) {
+        QMessageBox::warning(this, tr("Warning"), tr("Please select a password to manage its attachments"));
+        return;
+    }
+    
+    int row = selection.first().row();
+    int id = passwordTable->item(row, 0)->data(Qt::UserRole).toInt();
+    
+    QDialog *dialog = new QDialog(this);
+    dialog->setAttribute(Qt::WA_DeleteOnClose);
+    dialog->setWindowTitle(tr("Attachments of %1").arg(passwordTable->item(row, 0)->text()));
+    dialog->resize(500, 300);
+    
+    QListWidget *list = new QListWidget(dialog);
+    QPushButton *addAttachmentButton = new QPushButton(tr("Add..."), dialog);
+    QPushButton *saveAttachmentButton = new QPushButton(tr("Save As..."), dialog);
+    QPushButton *deleteAttachmentButton = new QPushButton(tr("Delete"), dialog);
+    
+    // Files are encrypted and written chunk by chunk on the writer thread
+    connect(addAttachmentButton, &QPushButton::clicked, dialog, [this, dialog, list, id]() {
+        QString path = QFileDialog::getOpenFileName(dialog, tr("Attach File"), QDir::homePath());
+        if (path.isEmpty()) {
+            return;
+        }
+        
+        statusBar()->showMessage(tr("Attaching %1...").arg(QFileInfo(path).fileName()));
+        QFutureWatcher<qint64> *watcher = new QFutureWatcher<qint64>(dialog);
+        connect(watcher, &QFutureWatcher<qint64>::finished, dialog, [this, watcher, list, id]() {
+            watcher->deleteLater();
+            if (watcher->result() < 0) {
+                QMessageBox::warning(this, tr("Error"), tr("Failed to attach the file"));
+                return;
+            }
+            statusBar()->showMessage(tr("File attached"), 3000);
+            loadAttachments(list, id);
+        });
+        watcher->setFuture(db->addAttachmentAsync(id, path));
+    });
+    
+    // Only written to disk once every chunk has authenticated
+    connect(saveAttachmentButton, &QPushButton::clicked, dialog, [this, dialog, list]() {
+        QListWidgetItem *item = list->currentItem();
+        if (!item) {
+            return;
+        }
+        
+        QString path = QFileDialog::getSaveFileName(dialog, tr("Save Attachment"),
+                                                    QDir::home().filePath(item->data(Qt::UserRole + 1).toString()));
+        if (path.isEmpty()) {
+            return;
+        }
+        
+        QFutureWatcher<bool> *watcher = new QFutureWatcher<bool>(this);
+        connect(watcher, &QFutureWatcher<bool>::finished, this, [this, watcher]() {
+            watcher->deleteLater();
+            if (!watcher->result()) {
+                QMessageBox::warning(this, tr("Error"), tr("Failed to save the attachment"));
+                return;
+            }
+            statusBar()->showMessage(tr("Attachment saved"), 3000);
+        });
+        watcher->setFuture(db->saveAttachmentAsync(item->data(Qt::UserRole).toLongLong(), path));
+    });
     
-    while (query.next()) {
-        int id = query.value("id").toInt();
-        QString name = query.value("name").toString();
-        QString url = query.value("url").toString();
-        QString username = query.value("username").toString();
-        QByteArray encryptedPassword = query.value("password").toByteArray();
-        QString note = query.value("note").toString();
+    connect(deleteAttachmentButton, &QPushButton::clicked, dialog, [this, dialog, list, id]() {
+        QListWidgetItem *item = list->currentItem();
+        if (!item || QMessageBox::question(dialog, tr("Confirm Deletion"),
+                                           tr("Are you sure you want to delete this attachment?"),
+                                           QMessageBox::Yes | QMessageBox::No) != QMessageBox::Yes) {
+            return;
+        }
         
-        // Decrypt the password
-        QString password = db->decryptPassword(encryptedPassword);
+        QFutureWatcher<bool> *watcher = new QFutureWatcher<bool>(dialog);
+        connect(watcher, &QFutureWatcher<bool>::finished, dialog, [this, watcher, list, id]() {
+            watcher->deleteLater();
+            if (!watcher->result()) {
+                QMessageBox::warning(this, tr("Error"), tr("Failed to delete the attachment"));
+                return;
+            }
+            loadAttachments(list, id);
+        });
+        watcher->setFuture(db->deleteAttachmentAsync(item->data(Qt::UserRole).toLongLong()));
+    });
+    
+    QHBoxLayout *buttonLayout = new QHBoxLayout();
+    buttonLayout->addWidget(addAttachmentButton);
+    buttonLayout->addWidget(saveAttachmentButton);
+    buttonLayout->addWidget(deleteAttachmentButton);
+    buttonLayout->addStretch();
+    
+    QVBoxLayout *layout = new QVBoxLayout(dialog);
+    layout->addWidget(list);
+    layout->addLayout(buttonLayout);
+    
+    loadAttachments(list, id);
+    dialog->show();
+}
+
+void MainWindow::showHistory()
+{
+    QModelIndexList selection = passwordTable->selectionModel()->selectedRows();
+    if (selection.isEmpty()) {
+        QMessageBox::warning(this, tr("Warning"), tr("Please select a password to show its history"));
+        return;
+    }
+    
+    int row = selection.first().row();
+    int id = passwordTable->item(row, 0)->data(Qt::UserRole).toInt();
+    
+    QDialog *dialog = new QDialog(this);
+    dialog->setAttribute(Qt::WA_DeleteOnClose);
+    dialog->setWindowTitle(tr("History of %1").arg(passwordTable->item(row, 0)->text()));
+    dialog->resize(600, 350);
+    
+    QListWidget *list = new QListWidget(dialog);
+    QPlainTextEdit *details = new QPlainTextEdit(dialog);
+    details->setReadOnly(true);
+    QPushButton *copyVersionButton = new QPushButton(tr("Copy Password"), dialog);
+    QPushButton *restoreButton = new QPushButton(tr("Restore"), dialog);
+    copyVersionButton->setEnabled(false);
+    restoreButton->setEnabled(false);
+    
+    // The version shown on the right; only the selected one is ever decoded
+    QSharedPointer<EntryVersion> current(new EntryVersion);
+    
+    connect(list, &QListWidget::currentItemChanged, dialog,
+            [this, dialog, list, details, copyVersionButton, restoreButton, current, id](QListWidgetItem *item) {
+        *current = EntryVersion();
+        details->clear();
+        copyVersionButton->setEnabled(false);
+        restoreButton->setEnabled(false);
+        if (!item) {
+            return;
+        }
         
-        int row = passwordTable->rowCount();
-        passwordTable->insertRow(row);
+        qint64 historyId = item->data(Qt::UserRole).toLongLong();
+        QFutureWatcher<EntryVersion> *watcher = new QFutureWatcher<EntryVersion>(dialog);
+        connect(watcher, &QFutureWatcher<EntryVersion>::finished, dialog,
+                [watcher, list, details, copyVersionButton, restoreButton, current, historyId]() {
+            watcher->deleteLater();
+            
+            // Another version may have been selected while this one was decoded
+            QListWidgetItem *selected = list->currentItem();
+            if (!selected || selected->data(Qt::UserRole).toLongLong() != historyId) {
+                return;
+            }
+            
+            EntryVersion version = watcher->result();
+            if (version.id < 0) {
+                details->setPlainText(tr("This version could not be read."));
+                return;
+            }
+            
+            QStringList lines;
+            lines << tr("Name: %1").arg(version.name)
+                  << tr("URL: %1").arg(version.url)
+                  << tr("Username: %1").arg(version.username)
+                  << tr("Password: %1").arg(PASSWORD_MASK);
+            for (const CustomField &field : std::as_const(version.fields)) {
+                lines << QStringLiteral("%1: %2").arg(field.name,
+                    field.type == CustomField::Hidden ? PASSWORD_MASK : field.value);
+            }
+            if (!version.note.isEmpty()) {
+                lines << QString() << version.note;
+            }
+            details->setPlainText(lines.join(QLatin1Char('\n')));
+            
+            *current = version;
+            copyVersionButton->setEnabled(true);
+            restoreButton->setEnabled(true);
+        });
+        watcher->setFuture(db->getHistoryVersionAsync(id, historyId));
+    });
+    
+    connect(copyVersionButton, &QPushButton::clicked, dialog, [this, current]() {
+        QApplication::clipboard()->setText(current->password);
+        statusBar()->showMessage(tr("Password copied to clipboard"), 3000);
+    });
+    
+    // Restoring is an ordinary update, so the version being replaced is kept as well
+    connect(restoreButton, &QPushButton::clicked, dialog, [this, dialog, current, id]() {
+        if (QMessageBox::question(dialog, tr("Restore Version"),
+                                  tr("Replace the entry with the version from %1?")
+                                      .arg(QLocale().toString(current->changedAt, QLocale::ShortFormat)),
+                                  QMessageBox::Yes | QMessageBox::No) != QMessageBox::Yes) {
+            return;
+        }
         
-        QTableWidgetItem *nameItem = new QTableWidgetItem(name);
-        QTableWidgetItem *urlItem = new QTableWidgetItem(url);
-        QTableWidgetItem *usernameItem = new QTableWidgetItem(username);
-        QTableWidgetItem *passwordItem = new QTableWidgetItem(password);
-        QTableWidgetItem *noteItem = new QTableWidgetItem(note);
+        if (passwordManager->updatePassword(id, current->name, current->url, current->username,
+                                            current->password, current->note, current->fields)) {
+            applyJournalChanges();
+            statusBar()->showMessage(tr("Password restored"), 3000);
+            dialog->close();
+        } else {
+            QMessageBox::warning(this, tr("Error"), tr("Failed to restore the password"));
+        }
+    });
+    
+    QHBoxLayout *contentLayout = new QHBoxLayout();
+    contentLayout->addWidget(list, 1);
+    contentLayout->addWidget(details, 2);
+    
+    QHBoxLayout *buttonLayout = new QHBoxLayout();
+    buttonLayout->addWidget(copyVersionButton);
+    buttonLayout->addWidget(restoreButton);
+    buttonLayout->addStretch();
+    
+    QVBoxLayout *layout = new QVBoxLayout(dialog);
+    layout->addLayout(contentLayout);
+    layout->addLayout(buttonLayout);
+    
+    QFutureWatcher<QList<EntryVersion>> *watcher = new QFutureWatcher<QList<EntryVersion>>(list);
+    connect(watcher, &QFutureWatcher<QList<EntryVersion>>::finished, list, [watcher, list, details]() {
+        watcher->deleteLater();
         
-        // Store the password ID for later use
-        nameItem->setData(Qt::UserRole, id);
+        const QList<EntryVersion> versions = watcher->result();
+        if (versions.isEmpty()) {
+            details->setPlainText(tr("No earlier versions are kept for this entry."));
+            return;
+        }
+        for (const EntryVersion &version : versions) {
+            QListWidgetItem *item = new QListWidgetItem(QLocale().toString(version.changedAt, QLocale::ShortFormat), list);
+            item->setData(Qt::UserRole, version.id);
+        }
+    });
+    watcher->setFuture(db->getHistoryAsync(id));
+    
+    dialog->show();
+}
+
+void MainWindow::loadAttachments(QListWidget *list, int passwordId)
+{
+    QFutureWatcher<QList<AttachmentInfo>> *watcher = new QFutureWatcher<QList<AttachmentInfo>>(list);
+    connect(watcher, &QFutureWatcher<QList<AttachmentInfo>>::finished, list, [watcher, list]() {
+        watcher->deleteLater();
         
-        passwordTable->setItem(row, 0, nameItem);
-        passwordTable->setItem(row, 1, urlItem);
-        passwordTable->setItem(row, 2, usernameItem);
-        passwordTable->setItem(row, 3, passwordItem);
-        passwordTable->setItem(row, 4, noteItem);
+        list->clear();
+        for (const AttachmentInfo &attachment : watcher->result()) {
+            QListWidgetItem *item = new QListWidgetItem(
+                QStringLiteral("%1 (%2)").arg(attachment.name, QLocale().formattedDataSize(attachment.size)), list);
+            item->setData(Qt::UserRole, attachment.id);
+            item->setData(Qt::UserRole + 1, attachment.name);
+        }
+    });
+    watcher->setFuture(db->getAttachmentsAsync(passwordId));
+}
+
+void MainWindow::upsertPasswordRow(const PasswordEntry &entry)
+{
+    int row = findPasswordRow(entry.id);
+    if (row >= 0) {
+        passwordTable->removeRow(row);
+    }
+    
+    // Rows are ordered by name like the full listing
+    row = 0;
+    while (row < passwordTable->rowCount() &&
+           QString::compare(passwordTable->item(row, 0)->text(), entry.name, Qt::CaseInsensitive) <= 0) {
+        row++;
+    }
+    
+    passwordTable->insertRow(row);
+    setPasswordRow(row, entry);
+}
+
+int MainWindow::findPasswordRow(int id) const
+{
+    for (int row = 0; row < passwordTable->rowCount(); ++row) {
+        QTableWidgetItem *item = passwordTable->item(row, 0);
+        if (item && item->data(Qt::UserRole).toInt() == id) {
+            return row;
+        }
     }
+    return -1;
+}
+
+void MainWindow::copyPassword()
+{
+    QModelIndexList selection = passwordTable->selectionModel()->selectedRows();
+    if (selection.isEmpty()) {
+        QMessageBox::warning(this, tr("Warning"), tr("Please select a password to copy"));
+        return;
+    }
+    
+    int row = selection.first().row();
+    SecretBuffer password = db->decryptSecret(passwordTable->item(row, 3)->data(Qt::UserRole).toByteArray(),
+                                              passwordTable->item(row, 3)->data(Qt::UserRole + 1).toByteArray());
+    copySecretToClipboard(password);
+    statusBar()->showMessage(tr("Password copied to clipboard"), 3000);
+}
+
+void MainWindow::copySecretToClipboard(const SecretBuffer &password)
+{
+    // The clipboard keeps its own copy of the text; take it back after a while unless
+    // something else has been copied since, which deletes this mime data
+    QMimeData *data = new QMimeData;
+    data->setText(password.toString());
+    QApplication::clipboard()->setMimeData(data);
+    
+    QPointer<QMimeData> copied(data);
+    QTimer::singleShot(CLIPBOARD_CLEAR_MS, this, [copied]() {
+        if (copied && QApplication::clipboard()->mimeData() == copied) {
+            QApplication::clipboard()->clear();
+        }
+    });
 }
 
 void MainWindow::importFromBrowsers()
@@ -410,6 +1121,383 @@ void MainWindow::importFromCsv()
     }
 }
 
+void MainWindow::backupNow()
+{
+    if (backupManager->backupNow()) {
+        statusBar()->showMessage(tr("Creating backup..."));
+    } else {
+        statusBar()->showMessage(tr("A backup is already in progress"), 3000);
+    }
+}
+
+void MainWindow::showBackupResult(bool success, const QString &path)
+{
+    if (success) {
+        statusBar()->showMessage(tr("Backup saved to %1").arg(QDir::toNativeSeparators(path)), 5000);
+    } else {
+        statusBar()->showMessage(tr("Backup failed"), 5000);
+    }
+}
+
+void MainWindow::runMaintenance()
+{
+    if (maintenanceScheduler->runNow()) {
+        statusBar()->showMessage(tr("Running maintenance..."));
+    } else {
+        statusBar()->showMessage(tr("Maintenance is already running"), 3000);
+    }
+}
+
+void MainWindow::verifyIntegrity()
+{
+    statusBar()->showMessage(tr("Verifying vault integrity..."));
+    
+    QFutureWatcher<IntegrityReport> *watcher = new QFutureWatcher<IntegrityReport>(this);
+    connect(watcher, &QFutureWatcher<IntegrityReport>::finished, this, [this, watcher]() {
+        IntegrityReport report = watcher->result();
+        watcher->deleteLater();
+        statusBar()->clearMessage();
+        
+        if (!report.completed) {
+            QMessageBox::warning(this, tr("Vault Integrity"), tr("The integrity check could not read the vault."));
+            return;
+        }
+        
+        if (report.problems.isEmpty()) {
+            statusBar()->showMessage(tr("All %1 entries verified in %2 ms")
+                                     .arg(report.rowsChecked).arg(report.elapsedMs), 5000);
+            return;
+        }
+        
+        // Ids are listed so the rows can be restored from a backup or deleted
+        QStringList lines;
+        bool rowsIntact = true;
+        for (const IntegrityProblem &problem : std::as_const(report.problems)) {
+            lines.append(problem.id >= 0 ? tr("Entry %1: %2").arg(problem.id).arg(problem.reason) : problem.reason);
+            rowsIntact &= problem.id < 0;
+        }
+        
+        QMessageBox box(QMessageBox::Warning, tr("Vault Integrity"),
+                        tr("%1 problems found in %2 entries.").arg(report.problems.size()).arg(report.rowsChecked),
+                        QMessageBox::Ok, this);
+        box.setDetailedText(lines.join("\n"));
+        
+        // Every entry authenticates, but the root does not match them: entries may have been
+        // removed or restored from elsewhere. Only the user can decide that this is expected.
+        QPushButton *acceptButton = nullptr;
+        if (rowsIntact) {
+            box.setInformativeText(tr("Every remaining entry is authentic, but the vault no longer matches its sealed "
+                                      "state; entries may have been removed. Accept the current entries only if you "
+                                      "know why this happened."));
+            acceptButton = box.addButton(tr("Accept Current Entries"), QMessageBox::DestructiveRole);
+        }
+        box.exec();
+        
+        if (acceptButton && box.clickedButton() == acceptButton) {
+            acceptIntegrityState();
+        }
+    });
+    watcher->setFuture(db->verifyIntegrityAsync());
+}
+
+void MainWindow::acceptIntegrityState()
+{
+    QFutureWatcher<bool> *watcher = new QFutureWatcher<bool>(this);
+    connect(watcher, &QFutureWatcher<bool>::finished, this, [this, watcher]() {
+        bool accepted = watcher->result();
+        watcher->deleteLater();
+        
+        if (accepted) {
+            statusBar()->showMessage(tr("The current entries are now the vault's sealed state"), 5000);
+        } else {
+            QMessageBox::warning(this, tr("Vault Integrity"),
+                                 tr("The vault was not resealed because an entry failed verification."));
+        }
+    });
+    watcher->setFuture(db->acceptIntegrityStateAsync());
+}
+
+void MainWindow::showMaintenanceResult(const MaintenanceReport &report)
+{
+    if (!report.integrityOk) {
+        QMessageBox::warning(this, tr("Vault Integrity"),
+                             tr("The integrity check of the %1 table found problems. "
+                                "Restore the vault from a backup.").arg(report.checkedTable));
+    }
+    
+    // Scheduled runs happen while the window is hidden; only the requested one is reported
+    if (!isVisible()) {
+        return;
+    }
+    
+    statusBar()->showMessage(tr("Maintenance %1: %2 KiB reclaimed, %3% of the file free")
+                             .arg(report.completed ? tr("finished") : tr("stopped"))
+                             .arg(report.reclaimedBytes() / 1024)
+                             .arg(report.fragmentationAfter(), 0, 'f', 1), 5000);
+}
+
+void MainWindow::exportVault()
+{
+    QString filePath = QFileDialog::getSaveFileName(
+        this,
+        tr("Export Vault"),
+        QDir::homePath() + "/passwords.pmvault",
+        tr("Vault Archives (*.pmvault);;All Files (*)")
+    );
+    
+    if (filePath.isEmpty()) {
+        return;
+    }
+    
+    bool ok = false;
+    QString passphrase = QInputDialog::getText(this, tr("Export Vault"), tr("Passphrase for the archive:"),
+                                               QLineEdit::Password, QString(), &ok);
+    if (!ok || passphrase.isEmpty()) {
+        return;
+    }
+    
+    QString confirmation = QInputDialog::getText(this, tr("Export Vault"), tr("Repeat the passphrase:"),
+                                                 QLineEdit::Password, QString(), &ok);
+    if (!ok) {
+        return;
+    }
+    
+    if (confirmation != passphrase) {
+        QMessageBox::warning(this, tr("Export Failed"), tr("The passphrases do not match."));
+        return;
+    }
+    
+    statusBar()->showMessage(tr("Exporting vault..."));
+    
+    // Key derivation and encryption take a while for large vaults; keep the window responsive
+    QFutureWatcher<qint64> *watcher = new QFutureWatcher<qint64>(this);
+    connect(watcher, &QFutureWatcher<qint64>::finished, this, [this, watcher]() {
+        qint64 exported = watcher->result();
+        watcher->deleteLater();
+        
+        if (exported < 0) {
+            statusBar()->clearMessage();
+            QMessageBox::warning(this, tr("Export Failed"), tr("Failed to export the vault."));
+        } else {
+            statusBar()->showMessage(tr("Exported %1 passwords").arg(exported), 5000);
+        }
+    });
+    
+    Database *database = db;
+    watcher->setFuture(QtConcurrent::run([database, filePath, passphrase]() {
+        qint64 exported = 0;
+        return VaultArchive::exportVault(database, filePath, passphrase, &exported) ? exported : qint64(-1);
+    }));
+}
+
+void MainWindow::importVault()
+{
+    QString filePath = QFileDialog::getOpenFileName(
+        this,
+        tr("Import Vault"),
+        QDir::homePath(),
+        tr("Vault Archives (*.pmvault);;All Files (*)")
+    );
+    
+    if (filePath.isEmpty()) {
+        return;
+    }
+    
+    bool ok = false;
+    QString passphrase = QInputDialog::getText(this, tr("Import Vault"), tr("Passphrase of the archive:"),
+                                               QLineEdit::Password, QString(), &ok);
+    if (!ok) {
+        return;
+    }
+    
+    statusBar()->showMessage(tr("Importing vault..."));
+    
+    QFutureWatcher<QPair<bool, qint64>> *watcher = new QFutureWatcher<QPair<bool, qint64>>(this);
+    connect(watcher, &QFutureWatcher<QPair<bool, qint64>>::finished, this, [this, watcher]() {
+        QPair<bool, qint64> result = watcher->result();
+        watcher->deleteLater();
+        
+        // Chunks are committed as they are read, so show whatever made it in
+        applyJournalChanges();
+        
+        if (!result.first) {
+            statusBar()->clearMessage();
+            QMessageBox::warning(this, tr("Import Failed"),
+                                 tr("Failed to import the vault after %1 passwords.\n"
+                                    "Check the passphrase and that the file is complete.").arg(result.second));
+        } else {
+            statusBar()->showMessage(tr("Imported %1 passwords").arg(result.second), 5000);
+        }
+    });
+    
+    Database *database = db;
+    watcher->setFuture(QtConcurrent::run([database, filePath, passphrase]() {
+        qint64 imported = 0;
+        bool success = VaultArchive::importVault(database, filePath, passphrase, &imported);
+        return qMakePair(success, imported);
+    }));
+}
+
+void MainWindow::syncWithVault()
+{
+    QString filePath = QFileDialog::getOpenFileName(
+        this,
+        tr("Sync with Vault File"),
+        QDir::homePath(),
+        tr("Vault Files (*.db);;All Files (*)")
+    );
+    
+    if (filePath.isEmpty()) {
+        return;
+    }
+    
+    if (QFileInfo(filePath).canonicalFilePath() == QFileInfo(db->databasePath()).canonicalFilePath()) {
+        QMessageBox::warning(this, tr("Sync Failed"), tr("Choose a copy of the vault, not the open vault itself."));
+        return;
+    }
+    
+    statusBar()->showMessage(tr("Syncing..."));
+    
+    QFutureWatcher<QPair<bool, SyncStats>> *watcher = new QFutureWatcher<QPair<bool, SyncStats>>(this);
+    connect(watcher, &QFutureWatcher<QPair<bool, SyncStats>>::finished, this, [this, watcher]() {
+        QPair<bool, SyncStats> result = watcher->result();
+        watcher->deleteLater();
+        
+        if (!result.first) {
+            statusBar()->clearMessage();
+            QMessageBox::warning(this, tr("Sync Failed"),
+                                 tr("Failed to sync with the vault file.\n"
+                                    "Both copies must belong to the same account with the same master password."));
+            return;
+        }
+        
+        applyJournalChanges();
+        statusBar()->showMessage(tr("Synced: %1 changes received, %2 sent")
+                                 .arg(result.second.pulled).arg(result.second.pushed), 5000);
+    });
+    
+    Database *database = db;
+    watcher->setFuture(QtConcurrent::run([database, filePath]() {
+        SyncStats stats;
+        bool success = database->syncWith(filePath, &stats);
+        return qMakePair(success, stats);
+    }));
+}
+
+void MainWindow::openAnotherVault()
+{
+    QString filePath = QFileDialog::getOpenFileName(
+        this,
+        tr("Open Another Vault"),
+        QDir::homePath(),
+        tr("Vault Files (*.db);;All Files (*)")
+    );
+    
+    if (filePath.isEmpty()) {
+        return;
+    }
+    
+    if (vaults->containsPath(filePath)) {
+        QMessageBox::information(this, tr("Open Vault"), tr("This vault is already open."));
+        return;
+    }
+    
+    bool ok = false;
+    QString label = QInputDialog::getText(this, tr("Open Vault"), tr("Name for this vault:"),
+                                          QLineEdit::Normal, QFileInfo(filePath).completeBaseName(), &ok);
+    if (!ok || label.trimmed().isEmpty()) {
+        return;
+    }
+    label = label.trimmed();
+    
+    if (vaults->vault(label)) {
+        QMessageBox::warning(this, tr("Open Vault"), tr("Another open vault is already named \"%1\".").arg(label));
+        return;
+    }
+    
+    QString username = QInputDialog::getText(this, tr("Open Vault"), tr("Username:"), QLineEdit::Normal, QString(), &ok);
+    if (!ok || username.isEmpty()) {
+        return;
+    }
+    
+    QString password = QInputDialog::getText(this, tr("Open Vault"), tr("Master password:"), QLineEdit::Password, QString(), &ok);
+    if (!ok || password.isEmpty()) {
+        return;
+    }
+    
+    // The key derivation takes about a second
+    QApplication::setOverrideCursor(Qt::WaitCursor);
+    bool opened = vaults->open(label, filePath, username, password);
+    QApplication::restoreOverrideCursor();
+    
+    if (!opened) {
+        QMessageBox::warning(this, tr("Open Vault"), tr("Failed to unlock the vault. Check the username and master password."));
+        return;
+    }
+    statusBar()->showMessage(tr("Opened vault \"%1\"").arg(label), 3000);
+}
+
+void MainWindow::searchAllVaults()
+{
+    bool ok = false;
+    QString searchText = QInputDialog::getText(this, tr("Search All Vaults"), tr("Search for:"),
+                                               QLineEdit::Normal, searchBox->text(), &ok);
+    if (!ok) {
+        return;
+    }
+    
+    statusBar()->showMessage(tr("Searching %1 vaults...").arg(vaults->labels().size()));
+    
+    QFutureWatcher<QList<VaultMatch>> *watcher = new QFutureWatcher<QList<VaultMatch>>(this);
+    connect(watcher, &QFutureWatcher<QList<VaultMatch>>::finished, this, [this, watcher]() {
+        const QList<VaultMatch> matches = watcher->result();
+        watcher->deleteLater();
+        statusBar()->clearMessage();
+        
+        QDialog *dialog = new QDialog(this);
+        dialog->setAttribute(Qt::WA_DeleteOnClose);
+        dialog->setWindowTitle(tr("Search Results (%1)").arg(matches.size()));
+        dialog->resize(700, 400);
+        
+        QTableWidget *table = new QTableWidget(matches.size(), 4, dialog);
+        table->setHorizontalHeaderLabels({tr("Vault"), tr("Name"), tr("URL"), tr("Username")});
+        table->horizontalHeader()->setSectionResizeMode(QHeaderView::Stretch);
+        table->setSelectionBehavior(QAbstractItemView::SelectRows);
+        table->setEditTriggers(QAbstractItemView::NoEditTriggers);
+        table->setToolTip(tr("Double-click to copy the password"));
+        
+        for (int row = 0; row < matches.size(); ++row) {
+            const VaultMatch &match = matches[row];
+            QTableWidgetItem *vaultItem = new QTableWidgetItem(match.vault);
+            vaultItem->setData(Qt::UserRole, match.entry.encryptedPassword);
+            vaultItem->setData(Qt::UserRole + 1, match.entry.passwordContext);
+            table->setItem(row, 0, vaultItem);
+            table->setItem(row, 1, new QTableWidgetItem(match.entry.name));
+            table->setItem(row, 2, new QTableWidgetItem(match.entry.url));
+            table->setItem(row, 3, new QTableWidgetItem(match.entry.username));
+        }
+        
+        // Each password is decrypted with the key of the vault it came from
+        connect(table, &QTableWidget::cellDoubleClicked, dialog, [this, table](int row) {
+            QTableWidgetItem *vaultItem = table->item(row, 0);
+            Database *source = vaults->vault(vaultItem->text());
+            if (!source) {
+                return;
+            }
+            
+            SecretBuffer password = source->decryptSecret(vaultItem->data(Qt::UserRole).toByteArray(),
+                                                          vaultItem->data(Qt::UserRole + 1).toByteArray());
+            copySecretToClipboard(password);
+            statusBar()->showMessage(tr("Password copied to clipboard"), 3000);
+        });
+        
+        QVBoxLayout *layout = new QVBoxLayout(dialog);
+        layout->addWidget(table);
+        dialog->show();
+    });
+    watcher->setFuture(vaults->search(searchText));
+}
+
 void MainWindow::refreshPasswordList()
 {
     searchBox->clear();
@@ -420,8 +1508,6 @@ void MainWindow::setupAutofillMonitor()
 {
     clipboardMonitorTimer = new QTimer(this);
     connect(clipboardMonitorTimer, &QTimer::timeout, this, &MainWindow::checkClipboardForLoginForms);
-    clipboardMonitorTimer->start(1000); // Check every second
-    lastClipboardText = QApplication::clipboard()->text();
 }
 
 void MainWindow::checkClipboardForLoginForms()
@@ -441,21 +1527,14 @@ void MainWindow::checkClipboardForLoginForms()
         QString urlString = url.toString();
         
         // Check if we have credentials for this URL
-        QSqlQuery query = db->getPasswords();
-        QList<QPair<QString, QPair<QString, QString>>> matchingCredentials;
+        const QList<PasswordEntry> entries = db->getPasswordEntries();
+        QList<PasswordEntry> matchingCredentials;
         
-        while (query.next()) {
-            QString storedUrl = query.value("url").toString();
-            QString username = query.value("username").toString();
-            QByteArray encryptedPassword = query.value("password").toByteArray();
-            
-            // Check if the URL matches
-            if (urlString.contains(storedUrl, Qt::CaseInsensitive) || 
-                storedUrl.contains(url.host(), Qt::CaseInsensitive)) {
-                
-                // Decrypt the password
-                QString password = db->decryptPassword(encryptedPassword);
-                matchingCredentials.append({storedUrl, {username, password}});
+        for (const PasswordEntry &entry : entries) {
+            // Check if the URL matches; passwords stay encrypted until one is picked
+            if (urlString.contains(entry.url, Qt::CaseInsensitive) || 
+                entry.url.contains(url.host(), Qt::CaseInsensitive)) {
+                matchingCredentials.append(entry);
             }
         }
         
@@ -470,7 +1549,7 @@ void MainWindow::checkClipboardForLoginForms()
             
             QList<QPushButton*> credentialButtons;
             for (const auto &cred : matchingCredentials) {
-                QString buttonText = tr("Use %1").arg(cred.second.first);
+                QString buttonText = tr("Use %1").arg(cred.username);
                 QPushButton *credButton = msgBox.addButton(buttonText, QMessageBox::AcceptRole);
                 credentialButtons.append(credButton);
             }
@@ -483,14 +1562,16 @@ void MainWindow::checkClipboardForLoginForms()
                 int index = credentialButtons.indexOf(qobject_cast<QPushButton*>(clickedButton));
                 if (index >= 0 && index < matchingCredentials.size()) {
                     const auto &selectedCred = matchingCredentials[index];
-                    autofillCredentials(urlString, selectedCred.second.first, selectedCred.second.second);
+                    autofillCredentials(urlString, selectedCred.username, selectedCred.encryptedPassword,
+                                        selectedCred.passwordContext);
                 }
             }
         }
     }
 }
 
-void MainWindow::autofillCredentials(const QString &url, const QString &username, const QString &password)
+void MainWindow::autofillCredentials(const QString &url, const QString &username, const QByteArray &encryptedPassword,
+                                     const QByteArray &passwordContext)
 {
     // Copy username to clipboard
     QApplication::clipboard()->setText(username);
@@ -503,8 +1584,9 @@ void MainWindow::autofillCredentials(const QString &url, const QString &username
     );
     
     // Schedule password copy after a delay
-    QTimer::singleShot(3000, [this, password]() {
-        QApplication::clipboard()->setText(password);
+    QTimer::singleShot(3000, [this, encryptedPassword, passwordContext]() {
+        SecretBuffer password = db->decryptSecret(encryptedPassword, passwordContext);
+        copySecretToClipboard(password);
         QMessageBox::information(
             this,
             tr("Autofill"),
@@ -3,6 +3,7 @@
 
 #include <QMainWindow>
 #include <QTableWidget>
+#include <QListWidget>
 #include <QPushButton>
 #include <QLineEdit>
 #include <QVBoxLayout>
@@ -14,8 +15,16 @@
 #include <QCloseEvent>
 #include <QTimer>
 #include <QClipboard>
+#include <QFutureWatcher>
+#include <QPointer>
+#include <QSet>
 #include "database.h"
 #include "passwordmanager.h"
+#include "changemonitor.h"
+#include "backupmanager.h"
+#include "maintenancescheduler.h"
+#include "vaultset.h"
+#include <memory>
 
 class MainWindow : public QMainWindow
 {
@@ -25,6 +34,12 @@ public:
     explicit MainWindow(Database *db, PasswordManager *passwordManager, QWidget *parent = nullptr);
     ~MainWindow();
 
+public slots:
+    // Called around login: prefetch runs while the key is derived, unlock once it is ready
+    void prefetchPasswordList(int userId);
+    void discardPrefetchedList();
+    void unlock();
+
 protected:
     void closeEvent(QCloseEvent *event) override;
 
@@ -32,14 +47,31 @@ private slots:
     void addPassword();
     void deletePassword();
     void editPassword();
+    void copyPassword();
+    void manageAttachments();
+    void showHistory();
+    void moveToVault();
     void searchPasswords();
+    void showSearchResults();
+    void applyJournalChanges();
+    void backupNow();
+    void exportVault();
+    void importVault();
+    void syncWithVault();
+    void openAnotherVault();
+    void searchAllVaults();
+    void showBackupResult(bool success, const QString &path);
+    void runMaintenance();
+    void verifyIntegrity();
+    void showMaintenanceResult(const MaintenanceReport &report);
     void importFromBrowsers();
     void importFromCsv(); // CSV dosyasından içe aktarma için yeni slot
     void refreshPasswordList();
     void trayIconActivated(QSystemTrayIcon::ActivationReason reason);
     void showHideWindow();
     void checkClipboardForLoginForms(); // Pano kontrolü için yeni slot
-    void autofillCredentials(const QString &url, const QString &username, const QString &password); // Otomatik doldurma için yeni slot
+    void autofillCredentials(const QString &url, const QString &username, const QByteArray &encryptedPassword,
+                             const QByteArray &passwordContext); // Otomatik doldurma için yeni slot
 
 private:
     void setupUI();
@@ -49,6 +81,18 @@ private:
     void setupTrayIcon();
     void positionWindowAtBottomRight();
     void setupAutofillMonitor(); // Otomatik doldurma izleyicisi kurulumu
+    void populatePasswordTable(const QList<PasswordEntry> &entries);
+    void setPasswordRow(int row, const PasswordEntry &entry);
+    void upsertPasswordRow(const PasswordEntry &entry);
+    int findPasswordRow(int id) const;
+    void removePasswordRows(const QSet<int> &ids);
+    QList<int> selectedPasswordIds() const;
+    void editSelectedPasswords(const QList<int> &ids);
+    void showNote(int row);
+    void loadAttachments(QListWidget *list, int passwordId);
+    void copySecretToClipboard(const SecretBuffer &password);
+    void acceptIntegrityState();
+    void transferEntries(const QList<int> &ids, QPointer<Database> target, const QString &label);
 
     QTableWidget *passwordTable;
     QLineEdit *searchBox;
@@ -66,8 +110,28 @@ private:
     Database *db;
     PasswordManager *passwordManager;
     
+    // Searches run on a read connection off the GUI thread; only the latest result is shown
+    QFutureWatcher<QList<PasswordEntry>> *searchWatcher;
+    
+    // Table updates from the change journal: appliedSeq is the last change shown,
+    // searchSeq the journal position when the running search started
+    static const int MAX_INCREMENTAL_CHANGES = 200;
+    static const int JOURNAL_PAGE_SIZE = 1000;
+    ChangeMonitor *changeMonitor;
+    qint64 appliedSeq;
+    qint64 searchSeq;
+    
+    BackupManager *backupManager;
+    MaintenanceScheduler *maintenanceScheduler;
+    
+    // This vault plus any opened next to it, for searches across all of them
+    std::unique_ptr<VaultSet> vaults;
+    
     QTimer *clipboardMonitorTimer; // Pano izleme zamanlayıcısı
     QString lastClipboardText; // Son pano metni
+    
+    // Copied passwords are cleared from the clipboard after this long
+    static const int CLIPBOARD_CLEAR_MS = 30000;
 };
 
 #endif // MAINWINDOW_H 
\ No newline at end of file
@@ -0,0 +1,601 @@
+#include "migrationcheck.h"
+#include "schemamigrations.h"
+#include "vaultsync.h"
+#include "vaultintegrity.h"
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QTemporaryDir>
+#include <QCryptographicHash>
+#include <QVariantList>
+#include <QElapsedTimer>
+#include <QDebug>
+
+namespace {
+// Enough rows for every chunked step to need more than one chunk
+const int MIN_ENTRY_COUNT = SchemaMigrations::CHUNK_SIZE + SchemaMigrations::CHUNK_SIZE / 2;
+const int MAX_REPORTED_PROBLEMS = 20;
+}
+
+bool MigrationCheck::run(int entryCount)
+{
+    if (entryCount == 0) {
+        entryCount = MIN_ENTRY_COUNT;
+    } else if (entryCount < MIN_ENTRY_COUNT) {
+        qWarning() << "Migration check: at least" << MIN_ENTRY_COUNT << "entries are needed to span two chunks";
+        return false;
+    }
+    qInfo() << "Migration check with" << entryCount << "entries per case";
+    
+    QTemporaryDir dir;
+    if (!dir.isValid()) {
+        qWarning() << "Migration check: could not create a temporary directory";
+        return false;
+    }
+    
+    // The shape every migrated database has to end up with
+    QStringList reference;
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "migration-check-reference");
+        db.setDatabaseName(dir.filePath("reference.db"));
+        if (db.open() && VaultIntegrity::installFunctions(db) && SchemaMigrations::migrate(db)) {
+            reference = schemaSignature(db);
+        }
+        db.close();
+    }
+    QSqlDatabase::removeDatabase("migration-check-reference");
+    
+    if (reference.isEmpty()) {
+        qWarning() << "Migration check: could not create a database at the latest version";
+        return false;
+    }
+    
+    bool ok = checkCase("first release", dir.filePath("first-release.db"), 0, true, entryCount, reference);
+    for (int version = 0; version <= SchemaMigrations::LATEST_VERSION; ++version) {
+        QString label = version == 0 ? QStringLiteral("unversioned baseline") : QStringLiteral("version %1").arg(version);
+        ok &= checkCase(label, dir.filePath(QStringLiteral("v%1.db").arg(version)), version, false, entryCount, reference);
+    }
+    
+    // A crash in the middle of a chunked step: the chunks committed so far stay, the
+    // version does not move, and the next start has to finish the step from there
+    const Interruption interruptions[] = {
+        {5, "DELETE", "search_tokens", "1"},
+        {9, "UPDATE", "passwords", "note IS NOT NULL"}
+    };
+    for (const Interruption &interruption : interruptions) {
+        int version = interruption.version - 1;
+        ok &= checkCase(QStringLiteral("version %1, step %2 interrupted").arg(version).arg(interruption.version),
+                        dir.filePath(QStringLiteral("v%1-interrupted.db").arg(version)), version, false, entryCount,
+                        reference, &interruption);
+    }
+    
+    if (ok) {
+        qInfo() << "All migration checks passed";
+    } else {
+        qWarning() << "Migration checks failed";
+    }
+    return ok;
+}
+
+bool MigrationCheck::checkCase(const QString &label, const QString &path, int version, bool firstRelease, int entryCount,
+                               const QStringList &reference, const Interruption *interruption)
+{
+    const QString connectionName = QStringLiteral("migration-check-") + label;
+    QStringList problems;
+    qint64 migrationMs = -1;
+    
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", connectionName);
+        db.setDatabaseName(path);
+        
+        if (!db.open() || !VaultIntegrity::installFunctions(db)) {
+            problems.append("could not open the database: " + db.lastError().text());
+        } else {
+            QSqlQuery(db).exec("PRAGMA foreign_keys = ON");
+            
+            // Unversioned databases only differ from version 1 by their user_version
+            bool built = firstRelease ? createFirstRelease(db)
+                                      : SchemaMigrations::migrate(db, qMax(version, 1)) &&
+                                            (version > 0 || QSqlQuery(db).exec("PRAGMA user_version = 0"));
+            
+            Fixture fixture;
+            // Only the final migration is timed; seeding and the interruption are not
+            auto migrate = [&db, &migrationMs]() {
+                QElapsedTimer timer;
+                timer.start();
+                bool migrated = SchemaMigrations::migrate(db);
+                migrationMs = timer.elapsed();
+                return migrated;
+            };
+            
+            if (!built || !seed(db, entryCount, fixture)) {
+                problems.append(QStringLiteral("could not build a version %1 database").arg(version));
+            } else if (interruption && !interrupt(db, *interruption, problems)) {
+                // interrupt() reported what went wrong
+            } else if (!migrate()) {
+                problems.append("migration failed");
+            } else {
+                if (SchemaMigrations::version(db) != SchemaMigrations::LATEST_VERSION) {
+                    problems.append(QStringLiteral("ended at version %1").arg(SchemaMigrations::version(db)));
+                }
+                
+                const QStringList signature = schemaSignature(db);
+                for (const QString &line : reference) {
+                    if (!signature.contains(line)) {
+                        problems.append("missing " + line);
+                    }
+                }
+                for (const QString &line : signature) {
+                    if (!reference.contains(line)) {
+                        problems.append("unexpected " + line);
+                    }
+                }
+                
+                verifyRows(db, fixture, problems);
+            }
+        }
+        db.close();
+    }
+    QSqlDatabase::removeDatabase(connectionName);
+    
+    if (problems.isEmpty()) {
+        qInfo() << "Migration check passed:" << label << "migrated in" << migrationMs << "ms";
+        return true;
+    }
+    
+    qWarning() << "Migration check failed:" << label;
+    for (const QString &problem : problems.mid(0, MAX_REPORTED_PROBLEMS)) {
+        qWarning().noquote() << "   " << problem;
+    }
+    if (problems.size() > MAX_REPORTED_PROBLEMS) {
+        qWarning() << "    and" << problems.size() - MAX_REPORTED_PROBLEMS << "more";
+    }
+    return false;
+}
+
+bool MigrationCheck::createFirstRelease(QSqlDatabase db)
+{
+    // Entries had neither a name nor a note yet, and nothing recorded a schema version
+    QSqlQuery query(db);
+    return query.exec("CREATE TABLE users ("
+                      "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+                      "username TEXT UNIQUE NOT NULL,"
+                      "password TEXT NOT NULL,"
+                      "salt BLOB NOT NULL,"
+                      "created_at DATETIME DEFAULT CURRENT_TIMESTAMP)") &&
+           query.exec("CREATE TABLE passwords ("
+                      "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+                      "user_id INTEGER NOT NULL,"
+                      "url TEXT NOT NULL,"
+                      "username TEXT NOT NULL,"
+                      "password BLOB NOT NULL,"
+                      "created_at DATETIME DEFAULT CURRENT_TIMESTAMP,"
+                      "updated_at DATETIME DEFAULT CURRENT_TIMESTAMP,"
+                      "FOREIGN KEY (user_id) REFERENCES users(id))") &&
+           query.exec("CREATE INDEX idx_passwords_user_id ON passwords(user_id)");
+}
+
+bool MigrationCheck::seed(QSqlDatabase db, int entryCount, Fixture &fixture)
+{
+    // Rows are written in the layout of whatever version the database is at
+    const QStringList passwordColumns = columns(db, "passwords");
+    const bool hasName = passwordColumns.contains("name");
+    const bool hasEncryption = passwordColumns.contains("encrypted_fields");
+    const bool hasSync = passwordColumns.contains("uuid");
+    const bool hasFields = passwordColumns.contains("fields");
+    const bool notesApart = hasTable(db, "entry_notes");
+    const bool hasNote = passwordColumns.contains("note") && !notesApart;
+    const bool hasTokens = hasTable(db, "search_tokens");
+    const bool hasChanges = hasTable(db, "changes");
+    
+    if (!db.transaction()) {
+        return false;
+    }
+    
+    QSqlQuery query(db);
+    auto exec = [&](const QString &sql, const QVariantList &values) {
+        query.prepare(sql);
+        for (const QVariant &value : values) {
+            query.addBindValue(value);
+        }
+        if (!query.exec()) {
+            qWarning() << "Migration check: could not seed the database:" << query.lastError().text() << sql;
+            return false;
+        }
+        return true;
+    };
+    auto blob = [](const QByteArray &data) {
+        return data.isEmpty() ? QVariant() : QVariant(data);
+    };
+    
+    for (int user = 1; user <= USER_COUNT; ++user) {
+        if (!exec("INSERT INTO users (id, username, password, salt) VALUES (?, ?, ?, ?)",
+                  {user, QStringLiteral("user%1").arg(user), QString::fromLatin1(sample("verifier", user).toHex()),
+                   sample("salt", user)})) {
+            db.rollback();
+            return false;
+        }
+    }
+    
+    for (int i = 0; i < entryCount; ++i) {
+        SeededEntry entry;
+        entry.id = i + 1;
+        entry.userId = i % USER_COUNT + 1;
+        entry.encryptedFields = hasEncryption && i % 3 != 0 ? 1 : 0;
+        
+        // Migrations never decrypt, so stand-ins of the right shape do for ciphertext
+        if (entry.encryptedFields) {
+            entry.name = sample("name", i);
+            entry.url = sample("url", i);
+            entry.username = sample("username", i);
+            entry.note = i % 4 == 0 ? QByteArray() : sample("note", i) + sample("note tag", i);
+        } else {
+            entry.url = "https://site-" + QByteArray::number(i) + ".example";
+            entry.name = hasName ? "Site " + QByteArray::number(i) : entry.url;
+            entry.username = "user" + QByteArray::number(i);
+            if (i % 4 != 0 && (hasNote || notesApart)) {
+                entry.note = "Note of entry " + QByteArray::number(i);
+            }
+        }
+        entry.password = sample("password", i) + sample("password tag", i).left(12);
+        if (hasFields && i % 5 == 0) {
+            entry.fields = sample("fields", i);
+        }
+        
+        QStringList names = {"id", "user_id", "url", "username", "password"};
+        QVariantList values = {entry.id, entry.userId, entry.url, entry.username, entry.password};
+        if (hasName) {
+            names << "name";
+            values << entry.name;
+        }
+        if (hasNote) {
+            names << "note";
+            values << blob(entry.note);
+        }
+        if (hasEncryption) {
+            names << "encrypted_fields";
+            values << entry.encryptedFields;
+        }
+        if (notesApart) {
+            names << "note_size";
+            values << noteSize(entry);
+        }
+        if (hasFields) {
+            names << "fields";
+            values << blob(entry.fields);
+        }
+        if (hasSync) {
+            entry.uuid = sample("uuid", i).left(16);
+            names << "uuid" << "sync_bucket" << "sync_hash";
+            values << entry.uuid << VaultSync::bucketOf(entry.uuid)
+                   << VaultSync::entryHash(entry.name, entry.url, entry.username, entry.password, entry.note,
+                                           entry.fields);
+        }
+        
+        QString placeholders = QStringList(names.size(), QStringLiteral("?")).join(", ");
+        if (!exec(QStringLiteral("INSERT INTO passwords (%1) VALUES (%2)").arg(names.join(", "), placeholders), values) ||
+            (notesApart && !entry.note.isEmpty() &&
+             !exec("INSERT INTO entry_notes (password_id, note) VALUES (?, ?)", {entry.id, entry.note}))) {
+            db.rollback();
+            return false;
+        }
+        fixture.entries.append(entry);
+        
+        if (hasTokens) {
+            for (const char *label : {"token a", "token b"}) {
+                SeededToken token;
+                token.userId = entry.userId;
+                token.token = sample(label, i).left(16);
+                token.passwordId = entry.id;
+                
+                if (!exec("INSERT INTO search_tokens (user_id, token, password_id) VALUES (?, ?, ?)",
+                          {token.userId, token.token, token.passwordId})) {
+                    db.rollback();
+                    return false;
+                }
+                fixture.tokens.append(token);
+            }
+        }
+        
+        if (hasChanges) {
+            if (!exec("INSERT INTO changes (user_id, password_id, change_type) VALUES (?, ?, 0)",
+                      {entry.userId, entry.id})) {
+                db.rollback();
+                return false;
+            }
+            fixture.changes++;
+        }
+    }
+    
+    // Roots themselves are kept by the triggers; the seal is what the application wrote
+    if (hasTable(db, "integrity_roots")) {
+        for (int user = 1; user <= USER_COUNT; ++user) {
+            QByteArray seal = sample("seal", user);
+            if (!exec("UPDATE integrity_roots SET seal = ? WHERE user_id = ?", {seal, user})) {
+                db.rollback();
+                return false;
+            }
+            fixture.seals.append(seal);
+        }
+    }
+    
+    if (hasTable(db, "attachments")) {
+        if (!exec("INSERT INTO attachments (password_id, name, wrapped_key, size, chunk_size, data) "
+                  "VALUES (1, ?, ?, 0, 65536, zeroblob(0))", {sample("attachment name", 0), sample("attachment key", 0)})) {
+            db.rollback();
+            return false;
+        }
+        fixture.attachments = 1;
+    }
+    
+    query.finish();
+    return db.commit();
+}
+
+bool MigrationCheck::interrupt(QSqlDatabase db, const Interruption &interruption, QStringList &problems)
+{
+    const int before = SchemaMigrations::version(db);
+    const QString pending = QStringLiteral("SELECT COUNT(*) FROM %1 WHERE %2").arg(interruption.table, interruption.pending);
+    const qint64 pendingBefore = count(db, pending);
+    
+    // The last row of the first chunk; the step is stopped as soon as it reaches past it
+    QSqlQuery query(db);
+    if (!query.exec(QStringLiteral("SELECT rowid FROM %1 WHERE %2 ORDER BY rowid LIMIT 1 OFFSET %3")
+                        .arg(interruption.table, interruption.pending).arg(SchemaMigrations::CHUNK_SIZE - 1)) ||
+        !query.next()) {
+        problems.append(QStringLiteral("too few rows to interrupt step %1").arg(interruption.version));
+        return false;
+    }
+    qint64 lastOfChunk = query.value(0).toLongLong();
+    query.finish();
+    
+    if (!query.exec(QStringLiteral("CREATE TEMP TRIGGER interrupt_migration BEFORE %1 ON %2 WHEN OLD.rowid > %3 "
+                                   "BEGIN SELECT RAISE(ABORT, 'interrupted by the migration check'); END")
+                        .arg(interruption.event, interruption.table).arg(lastOfChunk))) {
+        problems.append("could not install the interruption: " + query.lastError().text());
+        return false;
+    }
+    
+    bool finished = SchemaMigrations::migrate(db, interruption.version);
+    query.exec("DROP TRIGGER temp.interrupt_migration");
+    
+    if (finished || SchemaMigrations::version(db) != before) {
+        problems.append(QStringLiteral("step %1 ran to the end despite the interruption").arg(interruption.version));
+        return false;
+    }
+    
+    // Exactly the first chunk is committed; the rest is left for the next run
+    if (count(db, pending) != pendingBefore - SchemaMigrations::CHUNK_SIZE) {
+        problems.append(QStringLiteral("step %1 did not keep its first chunk").arg(interruption.version));
+        return false;
+    }
+    return true;
+}
+
+void MigrationCheck::verifyRows(QSqlDatabase db, const Fixture &fixture, QStringList &problems)
+{
+    if (count(db, "SELECT COUNT(*) FROM users WHERE kdf = 'sha256'") != USER_COUNT) {
+        problems.append("users were lost or did not get the legacy KDF");
+    }
+    if (count(db, "SELECT COUNT(*) FROM passwords") != fixture.entries.size()) {
+        problems.append(QStringLiteral("%1 entries instead of %2")
+                            .arg(count(db, "SELECT COUNT(*) FROM passwords")).arg(fixture.entries.size()));
+    }
+    
+    QSqlQuery query(db);
+    query.prepare("SELECT p.user_id, p.name, p.url, p.username, p.password, p.encrypted_fields, p.note_size, "
+                  "p.note IS NULL, p.uuid, p.sync_bucket, p.sync_hash, p.fields, n.note, n.dictionary_id IS NULL "
+                  "FROM passwords p LEFT JOIN entry_notes n ON n.password_id = p.id WHERE p.id = ?");
+    
+    for (const SeededEntry &entry : fixture.entries) {
+        query.addBindValue(entry.id);
+        if (!query.exec() || !query.next()) {
+            problems.append(QStringLiteral("entry %1 is missing").arg(entry.id));
+            continue;
+        }
+        
+        const QByteArray uuid = query.value(8).toByteArray();
+        QStringList wrong;
+        if (query.value(0).toInt() != entry.userId) {
+            wrong << "user_id";
+        }
+        if (query.value(1).toByteArray() != entry.name) {
+            wrong << "name";
+        }
+        if (query.value(2).toByteArray() != entry.url) {
+            wrong << "url";
+        }
+        if (query.value(3).toByteArray() != entry.username) {
+            wrong << "username";
+        }
+        if (query.value(4).toByteArray() != entry.password) {
+            wrong << "password";
+        }
+        if (query.value(5).toInt() != entry.encryptedFields) {
+            wrong << "encrypted_fields";
+        }
+        if (query.value(6).toInt() != noteSize(entry)) {
+            wrong << "note_size";
+        }
+        if (!query.value(7).toBool()) {
+            wrong << "note left in passwords";
+        }
+        if (uuid.size() != 16 || (!entry.uuid.isEmpty() && uuid != entry.uuid)) {
+            wrong << "uuid";
+        }
+        if (query.value(9).toInt() != VaultSync::bucketOf(uuid)) {
+            wrong << "sync_bucket";
+        }
+        if (query.value(10).toLongLong() != VaultSync::entryHash(entry.name, entry.url, entry.username, entry.password,
+                                                                 entry.note, entry.fields)) {
+            wrong << "sync_hash";
+        }
+        if (query.value(11).toByteArray() != entry.fields) {
+            wrong << "fields";
+        }
+        if (query.value(12).toByteArray() != entry.note || !query.value(13).toBool()) {
+            wrong << "note";
+        }
+        query.finish();
+        
+        if (!wrong.isEmpty()) {
+            problems.append(QStringLiteral("entry %1 has the wrong %2").arg(entry.id).arg(wrong.join(", ")));
+        }
+    }
+    
+    if (count(db, "SELECT COUNT(*) FROM search_tokens") != fixture.tokens.size()) {
+        problems.append(QStringLiteral("%1 search tokens instead of %2")
+                            .arg(count(db, "SELECT COUNT(*) FROM search_tokens")).arg(fixture.tokens.size()));
+    }
+    
+    query.prepare("SELECT 1 FROM search_tokens WHERE user_id = ? AND token = ? AND password_id = ?");
+    int missingTokens = 0;
+    for (const SeededToken &token : fixture.tokens) {
+        query.addBindValue(token.userId);
+        query.addBindValue(token.token);
+        query.addBindValue(token.passwordId);
+        if (!query.exec() || !query.next()) {
+            missingTokens++;
+        }
+        query.finish();
+    }
+    if (missingTokens > 0) {
+        problems.append(QStringLiteral("%1 search tokens were lost").arg(missingTokens));
+    }
+    
+    if (count(db, "SELECT COUNT(*) FROM changes") != fixture.changes) {
+        problems.append("change journal rows were lost");
+    }
+    if (count(db, "SELECT COUNT(*) FROM attachments") != fixture.attachments) {
+        problems.append("attachments were lost");
+    }
+    
+    // Whatever version the rows came from, each root has to cover exactly its account's rows and
+    // notes, and a root carried over from the sync hash leaves has to cover those until login
+    query.prepare("SELECT r.leaf_sum, r.leaf_count, r.seal, "
+                  "(SELECT IFNULL(SUM(integrity_leaf('entry', p.user_id, p.uuid, p.encrypted_fields, p.name, p.url, "
+                  "p.username, p.password, p.fields)), 0) FROM passwords p WHERE p.user_id = r.user_id) + "
+                  "(SELECT IFNULL(SUM(integrity_leaf('note', n.password_id, IFNULL(n.dictionary_id, -1), n.note)), 0) "
+                  "FROM entry_notes n JOIN passwords p ON p.id = n.password_id WHERE p.user_id = r.user_id), "
+                  "(SELECT COUNT(*) FROM passwords WHERE user_id = r.user_id), "
+                  "r.legacy_sum, r.legacy_count, "
+                  "(SELECT IFNULL(SUM(sync_hash), 0) FROM passwords WHERE user_id = r.user_id) "
+                  "FROM integrity_roots r WHERE r.user_id = ?");
+    for (int user = 1; user <= USER_COUNT; ++user) {
+        query.addBindValue(user);
+        if (!query.exec() || !query.next()) {
+            problems.append(QStringLiteral("user %1 has no integrity root").arg(user));
+            continue;
+        }
+        
+        if (query.value(0).toLongLong() != query.value(3).toLongLong() ||
+            query.value(1).toLongLong() != query.value(4).toLongLong()) {
+            problems.append(QStringLiteral("integrity root of user %1 does not cover its rows").arg(user));
+        }
+        if (!query.value(5).isNull() && (query.value(5).toLongLong() != query.value(7).toLongLong() ||
+                                         query.value(6).toLongLong() != query.value(4).toLongLong())) {
+            problems.append(QStringLiteral("previous integrity root of user %1 was not kept").arg(user));
+        }
+        if (!fixture.seals.isEmpty() && query.value(2).toByteArray() != fixture.seals[user - 1]) {
+            problems.append(QStringLiteral("integrity seal of user %1 was lost").arg(user));
+        }
+        query.finish();
+    }
+}
+
+QStringList MigrationCheck::schemaSignature(QSqlDatabase db)
+{
+    // Columns added with ALTER TABLE end up in a different order and with fewer
+    // constraints than in a fresh CREATE TABLE. Every query names its columns, so
+    // tables are compared by their column sets.
+    QStringList signature;
+    QStringList tables;
+    
+    QSqlQuery objects(db);
+    if (!objects.exec("SELECT type, name, tbl_name FROM sqlite_master "
+                      "WHERE type IN ('table', 'trigger') AND name NOT LIKE 'sqlite_%'")) {
+        return signature;
+    }
+    
+    while (objects.next()) {
+        QString name = objects.value(1).toString();
+        if (objects.value(0).toString() == "table") {
+            QStringList tableColumns = columns(db, name);
+            tableColumns.sort();
+            signature.append(QStringLiteral("table %1 (%2)").arg(name, tableColumns.join(", ")));
+            tables.append(name);
+        } else {
+            signature.append(QStringLiteral("trigger %1 on %2").arg(name, objects.value(2).toString()));
+        }
+    }
+    
+    // Listed per table so the implicit indexes of keys (WITHOUT ROWID tables) count too
+    for (const QString &table : std::as_const(tables)) {
+        QSqlQuery indexes(db);
+        if (!indexes.exec(QStringLiteral("PRAGMA index_list(%1)").arg(table))) {
+            continue;
+        }
+        
+        while (indexes.next()) {
+            QString index = indexes.value(1).toString();
+            QStringList indexColumns;
+            QSqlQuery info(db);
+            if (info.exec(QStringLiteral("PRAGMA index_info(%1)").arg(index))) {
+                while (info.next()) {
+                    indexColumns.append(info.value(2).toString());
+                }
+            }
+            
+            signature.append(QStringLiteral("index %1 on %2 (%3) unique=%4 origin=%5 partial=%6")
+                                 .arg(index, table, indexColumns.join(", "))
+                                 .arg(indexes.value(2).toInt())
+                                 .arg(indexes.value(3).toString())
+                                 .arg(indexes.value(4).toInt()));
+        }
+    }
+    
+    signature.sort();
+    return signature;
+}
+
+QStringList MigrationCheck::columns(QSqlDatabase db, const QString &table)
+{
+    QStringList names;
+    QSqlQuery query(db);
+    if (query.exec(QStringLiteral("PRAGMA table_info(%1)").arg(table))) {
+        while (query.next()) {
+            names.append(query.value(1).toString());
+        }
+    }
+    return names;
+}
+
+bool MigrationCheck::hasTable(QSqlDatabase db, const QString &table)
+{
+    QSqlQuery query(db);
+    query.prepare("SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?");
+    query.addBindValue(table);
+    return query.exec() && query.next();
+}
+
+qint64 MigrationCheck::count(QSqlDatabase db, const QString &sql)
+{
+    QSqlQuery query(db);
+    if (!query.exec(sql) || !query.next()) {
+        return -1;
+    }
+    return query.value(0).toLongLong();
+}
+
+int MigrationCheck::noteSize(const SeededEntry &entry)
+{
+    // Plaintext size: encrypted notes carry a 16-byte IV and a 16-byte GCM tag
+    if (entry.note.isEmpty()) {
+        return 0;
+    }
+    return entry.encryptedFields ? entry.note.size() - 32 : entry.note.size();
+}
+
+QByteArray MigrationCheck::sample(const char *label, int index)
+{
+    return QCryptographicHash::hash(QByteArray(label) + '-' + QByteArray::number(index), QCryptographicHash::Sha256);
+}
@@ -0,0 +1,35 @@
+#ifndef NOTECODEC_H
+#define NOTECODEC_H
+
+#include <QByteArray>
+#include <QList>
+
+// Compression applied to notes before they are encrypted. Notes are raw deflate
+// streams primed with a dictionary trained on the vault's own notes, so the
+// certificate headers, config keys and boilerplate lines that repeat across
+// entries compress well even in short notes. The dictionary is itself secret
+// and stored encrypted next to the notes.
+class NoteCodec
+{
+public:
+    static const int MIN_COMPRESSED_SIZE = 128;            // shorter notes are stored as-is
+    static const int MAX_NOTE_SIZE = 16 * 1024 * 1024;     // refused on decompression
+    static const int MAX_DICTIONARY_SIZE = 32 * 1024;      // deflate's window
+    static const int MIN_TRAINING_SAMPLES = 32;
+    static const int MAX_TRAINING_SAMPLES = 512;
+    
+    // Built-in boilerplate, then lines and key prefixes shared by several samples,
+    // most useful last so deflate reaches them with the shortest distances
+    static QByteArray train(const QList<QByteArray> &samples);
+    
+    // Size header and deflate stream; empty if compression would not save space
+    static QByteArray compress(const QByteArray &note, const QByteArray &dictionary);
+    static bool decompress(const QByteArray &packed, const QByteArray &dictionary, QByteArray &note);
+    
+    // The same framing without the note limits, for callers that bring their own; a
+    // dictionary that is an earlier or later version of data turns this into a delta
+    static QByteArray pack(const QByteArray &data, const QByteArray &dictionary);
+    static bool unpack(const QByteArray &packed, const QByteArray &dictionary, int maxSize, QByteArray &data);
+};
+
+#endif // NOTECODEC_H
@@ -1,5 +1,7 @@
 #include "passworddialog.h"
 #include <QGridLayout>
+#include <QHeaderView>
+#include <QComboBox>
 #include <QRandomGenerator>
 
 PasswordDialog::PasswordDialog(QWidget *parent, bool isEdit)
@@ -10,7 +12,7 @@ PasswordDialog::PasswordDialog(QWidget *parent, bool isEdit)
     setupConnections();
     
     setWindowTitle(isEditMode ? tr("Edit Password") : tr("Add Password"));
-    setFixedSize(400, 300);
+    setFixedSize(460, 460);
 }
 
 PasswordDialog::~PasswordDialog()
@@ -28,7 +30,10 @@ void PasswordDialog::setupUI()
         "QPushButton:pressed { background-color: #00559B; }"
         "QPushButton:disabled { background-color: #333333; color: #666666; }"
         "QPushButton:checked { background-color: #00559B; }"
-        "QLineEdit { background-color: #333333; color: #FFFFFF; border: 1px solid #3E3E3E; padding: 5px; border-radius: 2px; }";
+        "QLineEdit { background-color: #333333; color: #FFFFFF; border: 1px solid #3E3E3E; padding: 5px; border-radius: 2px; }"
+        "QTableWidget { background-color: #252526; color: #FFFFFF; border: 1px solid #3E3E3E; }"
+        "QHeaderView::section { background-color: #333333; color: #FFFFFF; border: none; padding: 3px; }"
+        "QComboBox { background-color: #333333; color: #FFFFFF; border: 1px solid #3E3E3E; padding: 3px; }";
     
     setStyleSheet(darkStyle);
 
@@ -66,6 +71,18 @@ void PasswordDialog::setupUI()
     // Generate password button
     generateButton = new QPushButton(tr("Generate"), this);
     
+    // Custom fields
+    QLabel *fieldsLabel = new QLabel(tr("Custom fields:"), this);
+    fieldsTable = new QTableWidget(0, 3, this);
+    fieldsTable->setHorizontalHeaderLabels({tr("Name"), tr("Type"), tr("Value")});
+    fieldsTable->horizontalHeader()->setSectionResizeMode(QHeaderView::Stretch);
+    fieldsTable->horizontalHeader()->setSectionResizeMode(1, QHeaderView::ResizeToContents);
+    fieldsTable->verticalHeader()->hide();
+    fieldsTable->setSelectionBehavior(QAbstractItemView::SelectRows);
+    fieldsTable->setSelectionMode(QAbstractItemView::SingleSelection);
+    addFieldButton = new QPushButton(tr("Add Field"), this);
+    removeFieldButton = new QPushButton(tr("Remove Field"), this);
+    
     // Status label
     statusLabel = new QLabel(this);
     statusLabel->setStyleSheet("QLabel { color: #FF6347; }");
@@ -90,14 +107,23 @@ void PasswordDialog::setupUI()
     mainLayout->addWidget(toggleVisibilityButton, 4, 2);
     
     mainLayout->addWidget(generateButton, 5, 1);
-    mainLayout->addWidget(statusLabel, 6, 0, 1, 3);
+    
+    QHBoxLayout *fieldButtonLayout = new QHBoxLayout;
+    fieldButtonLayout->addWidget(addFieldButton);
+    fieldButtonLayout->addWidget(removeFieldButton);
+    fieldButtonLayout->addStretch();
+    mainLayout->addWidget(fieldsLabel, 6, 0);
+    mainLayout->addWidget(fieldsTable, 7, 0, 1, 3);
+    mainLayout->addLayout(fieldButtonLayout, 8, 0, 1, 3);
+    
+    mainLayout->addWidget(statusLabel, 9, 0, 1, 3);
     
     QHBoxLayout *buttonLayout = new QHBoxLayout;
     buttonLayout->addWidget(okButton);
     buttonLayout->addWidget(cancelButton);
-    mainLayout->addLayout(buttonLayout, 7, 0, 1, 3);
+    mainLayout->addLayout(buttonLayout, 10, 0, 1, 3);
     
-    mainLayout->setRowStretch(8, 1);
+    mainLayout->setRowStretch(7, 1);
 }
 
 void PasswordDialog::setupConnections()
@@ -108,6 +134,8 @@ void PasswordDialog::setupConnections()
     
     connect(generateButton, &QPushButton::clicked, this, &PasswordDialog::generatePassword);
     connect(toggleVisibilityButton, &QPushButton::toggled, this, &PasswordDialog::togglePasswordVisibility);
+    connect(addFieldButton, &QPushButton::clicked, this, &PasswordDialog::addCustomField);
+    connect(removeFieldButton, &QPushButton::clicked, this, &PasswordDialog::removeCustomField);
     
     connect(okButton, &QPushButton::clicked, this, &QDialog::accept);
     connect(cancelButton, &QPushButton::clicked, this, &QDialog::reject);
@@ -128,6 +156,52 @@ void PasswordDialog::validateInput()
     }
 }
 
+void PasswordDialog::addCustomField()
+{
+    appendCustomFieldRow(CustomField());
+    fieldsTable->setCurrentCell(fieldsTable->rowCount() - 1, 0);
+    
+    if (QWidget *nameEdit = fieldsTable->cellWidget(fieldsTable->rowCount() - 1, 0)) {
+        nameEdit->setFocus();
+    }
+}
+
+void PasswordDialog::removeCustomField()
+{
+    int row = fieldsTable->currentRow();
+    if (row >= 0) {
+        fieldsTable->removeRow(row);
+    }
+}
+
+void PasswordDialog::appendCustomFieldRow(const CustomField &field)
+{
+    int row = fieldsTable->rowCount();
+    fieldsTable->insertRow(row);
+    
+    QLineEdit *nameEdit = new QLineEdit(field.name, fieldsTable);
+    nameEdit->setPlaceholderText(tr("Field name"));
+    
+    QComboBox *typeBox = new QComboBox(fieldsTable);
+    typeBox->addItem(tr("Text"), int(CustomField::Text));
+    typeBox->addItem(tr("Hidden"), int(CustomField::Hidden));
+    typeBox->addItem(tr("URL"), int(CustomField::Url));
+    typeBox->setCurrentIndex(typeBox->findData(int(field.type)));
+    
+    QLineEdit *valueEdit = new QLineEdit(field.value, fieldsTable);
+    valueEdit->setEchoMode(field.type == CustomField::Hidden ? QLineEdit::Password : QLineEdit::Normal);
+    
+    // Hidden values are masked like the password
+    connect(typeBox, &QComboBox::currentIndexChanged, valueEdit, [typeBox, valueEdit]() {
+        bool hidden = typeBox->currentData().toInt() == CustomField::Hidden;
+        valueEdit->setEchoMode(hidden ? QLineEdit::Password : QLineEdit::Normal);
+    });
+    
+    fieldsTable->setCellWidget(row, 0, nameEdit);
+    fieldsTable->setCellWidget(row, 1, typeBox);
+    fieldsTable->setCellWidget(row, 2, valueEdit);
+}
+
 void PasswordDialog::generatePassword()
 {
     QString newPassword = generateRandomPassword();
@@ -175,6 +249,39 @@ QString PasswordDialog::getPassword() const
     return passwordEdit->text();
 }
 
+QList<CustomField> PasswordDialog::getCustomFields() const
+{
+    QList<CustomField> fields;
+    for (int row = 0; row < fieldsTable->rowCount(); ++row) {
+        QLineEdit *nameEdit = qobject_cast<QLineEdit*>(fieldsTable->cellWidget(row, 0));
+        QComboBox *typeBox = qobject_cast<QComboBox*>(fieldsTable->cellWidget(row, 1));
+        QLineEdit *valueEdit = qobject_cast<QLineEdit*>(fieldsTable->cellWidget(row, 2));
+        if (!nameEdit || !typeBox || !valueEdit) {
+            continue;
+        }
+        
+        // Rows left completely empty are dropped
+        if (nameEdit->text().isEmpty() && valueEdit->text().isEmpty()) {
+            continue;
+        }
+        
+        CustomField field;
+        field.type = CustomField::Type(typeBox->currentData().toInt());
+        field.name = nameEdit->text();
+        field.value = valueEdit->text();
+        fields.append(field);
+    }
+    return fields;
+}
+
+void PasswordDialog::setCustomFields(const QList<CustomField> &fields)
+{
+    fieldsTable->setRowCount(0);
+    for (const CustomField &field : fields) {
+        appendCustomFieldRow(field);
+    }
+}
+
 void PasswordDialog::setWebsite(const QString &website)
 {
     websiteEdit->setText(website);
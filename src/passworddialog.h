@@ -6,6 +6,8 @@
 #include <QPushButton>
 #include <QLabel>
 #include <QVBoxLayout>
+#include <QTableWidget>
+#include "customfields.h"
 
 class PasswordDialog : public QDialog
 {
@@ -18,26 +20,34 @@ public:
     QString getWebsite() const;
     QString getUsername() const;
     QString getPassword() const;
+    QList<CustomField> getCustomFields() const;
 
     void setWebsite(const QString &website);
     void setUsername(const QString &username);
     void setPassword(const QString &password);
+    void setCustomFields(const QList<CustomField> &fields);
 
 private slots:
     void generatePassword();
     void togglePasswordVisibility();
     void validateInput();
+    void addCustomField();
+    void removeCustomField();
 
 private:
     void setupUI();
     void setupConnections();
     QString generateRandomPassword(int length = 16) const;
+    void appendCustomFieldRow(const CustomField &field);
 
     QLineEdit *websiteEdit;
     QLineEdit *usernameEdit;
     QLineEdit *passwordEdit;
     QPushButton *generateButton;
     QPushButton *toggleVisibilityButton;
+    QTableWidget *fieldsTable; // name edit, type combo and value edit per row
+    QPushButton *addFieldButton;
+    QPushButton *removeFieldButton;
     QPushButton *okButton;
     QPushButton *cancelButton;
     QLabel *statusLabel;
@@ -172,14 +172,16 @@ QStringList PasswordManager::parseCSVLine(const QString &line)
     return fields;
 }
 
-bool PasswordManager::addPassword(const QString &name, const QString &url, const QString &username, const QString &password, const QString &note)
+bool PasswordManager::addPassword(const QString &name, const QString &url, const QString &username, const QString &password, const QString &note,
+                                  const QList<CustomField> &fields)
 {
-    return db->addPassword(name, url, username, password, note);
+    return db->addPassword(name, url, username, password, note, fields);
 }
 
-bool PasswordManager::updatePassword(int id, const QString &name, const QString &url, const QString &username, const QString &password, const QString &note)
+bool PasswordManager::updatePassword(int id, const QString &name, const QString &url, const QString &username, const QString &password, const QString &note,
+                                     const QList<CustomField> &fields)
 {
-    return db->updatePassword(id, name, url, username, password, note);
+    return db->updatePassword(id, name, url, username, password, note, fields);
 }
 
 bool PasswordManager::deletePassword(int id)
@@ -187,41 +189,26 @@ bool PasswordManager::deletePassword(int id)
     return db->deletePassword(id);
 }
 
-QList<QPair<QString, QPair<QString, QString>>> PasswordManager::searchPasswords(const QString &query)
+bool PasswordManager::deletePasswords(const QList<int> &ids)
 {
-    QList<QPair<QString, QPair<QString, QString>>> results;
-    QSqlQuery sqlQuery = db->getPasswords(query);
-    
-    while (sqlQuery.next()) {
-        QString name = sqlQuery.value("name").toString();
-        QString url = sqlQuery.value("url").toString();
-        QString username = sqlQuery.value("username").toString();
-        QByteArray encryptedPassword = sqlQuery.value("password").toByteArray();
-        
-        // Decrypt the password
-        QString password = db->decryptPassword(encryptedPassword);
-        
-        // Use URL as the first element, and username/password as the pair
-        results.append({url, {username, password}});
-    }
-    
-    return results;
+    return db->deletePasswords(ids);
+}
+
+bool PasswordManager::editPasswords(const QList<int> &ids, const BulkEdit &edit)
+{
+    return db->editPasswords(ids, edit);
+}
+
+QList<PasswordEntry> PasswordManager::searchPasswords(const QString &query)
+{
+    // Passwords stay encrypted; callers decrypt the one they need with Database::decryptSecret
+    return db->getPasswordEntries(query);
 }
 
 bool PasswordManager::passwordExists(const QString &url, const QString &username)
 {
-    QSqlQuery sqlQuery = db->getPasswords();
-    
-    while (sqlQuery.next()) {
-        QString storedUrl = sqlQuery.value("url").toString();
-        QString storedUsername = sqlQuery.value("username").toString();
-        
-        if (storedUrl == url && storedUsername == username) {
-            return true;
-        }
-    }
-    
-    return false;
+    // Exact-match blind-index lookup instead of decrypting the whole vault
+    return db->entryExists(url, username);
 }
 
 QList<QPair<QString, QPair<QString, QString>>> PasswordManager::readChromePasswords()
@@ -683,7 +670,7 @@ QString PasswordManager::decryptChromePassword(const QByteArray &encryptedPasswo
         }
         
         // Initialize the decryption operation
-        if (EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, nullptr, nullptr) != 1) {
+        if (EVP_DecryptInit_ex(ctx, Database::gcmCipher(), nullptr, nullptr, nullptr) != 1) {
             qWarning() << "Failed to initialize AES-GCM decryption";
             EVP_CIPHER_CTX_free(ctx);
             return QString();
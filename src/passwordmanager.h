@@ -21,10 +21,14 @@ public:
     bool importFromCsv(const QString &filePath); // CSV dosyasından içe aktarma için yeni metot
 
     // Password operations
-    bool addPassword(const QString &name, const QString &url, const QString &username, const QString &password, const QString &note = QString());
-    bool updatePassword(int id, const QString &name, const QString &url, const QString &username, const QString &password, const QString &note = QString());
+    bool addPassword(const QString &name, const QString &url, const QString &username, const QString &password, const QString &note = QString(),
+                     const QList<CustomField> &fields = QList<CustomField>());
+    bool updatePassword(int id, const QString &name, const QString &url, const QString &username, const QString &password, const QString &note = QString(),
+                        const QList<CustomField> &fields = QList<CustomField>());
     bool deletePassword(int id);
-    QList<QPair<QString, QPair<QString, QString>>> searchPasswords(const QString &query = QString());
+    bool deletePasswords(const QList<int> &ids);
+    bool editPasswords(const QList<int> &ids, const BulkEdit &edit);
+    QList<PasswordEntry> searchPasswords(const QString &query = QString());
 
     // Check if password already exists
     bool passwordExists(const QString &url, const QString &username);
@@ -0,0 +1,713 @@
+#include "schemamigrations.h"
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QStringList>
+#include <QDebug>
+#include "vaultsync.h"
+
+bool SchemaMigrations::migrate(QSqlDatabase db)
+{
+    return migrate(db, LATEST_VERSION);
+}
+
+bool SchemaMigrations::migrate(QSqlDatabase db, int targetVersion)
+{
+    int current = version(db);
+    if (current < 0) {
+        return false;
+    }
+    
+    if (current > LATEST_VERSION) {
+        qCritical() << "Database schema version" << current << "is newer than this build supports";
+        return false;
+    }
+    
+    if (current >= targetVersion) {
+        return true;
+    }
+    
+    qDebug() << "Migrating database schema from version" << current << "to" << targetVersion;
+    
+    for (int next = current + 1; next <= targetVersion; ++next) {
+        if (!migrateTo(db, next)) {
+            qCritical() << "Schema migration to version" << next << "failed";
+            return false;
+        }
+        
+        if (!setVersion(db, next)) {
+            return false;
+        }
+        
+        qDebug() << "Database schema is now at version" << next;
+    }
+    
+    return true;
+}
+
+int SchemaMigrations::version(QSqlDatabase db)
+{
+    QSqlQuery query(db);
+    if (!query.exec("PRAGMA user_version") || !query.next()) {
+        qWarning() << "Failed to read schema version:" << query.lastError().text();
+        return -1;
+    }
+    
+    return query.value(0).toInt();
+}
+
+bool SchemaMigrations::migrateTo(QSqlDatabase db, int version)
+{
+    switch (version) {
+    case 1:
+        return createBaseSchema(db);
+    case 2:
+        return addMetadataEncryption(db);
+    case 3:
+        return addKdfParameters(db);
+    case 4:
+        return addSearchTokens(db);
+    case 5:
+        return clusterSearchTokens(db);
+    case 6:
+        return addChangeJournal(db);
+    case 7:
+        return addSyncMetadata(db);
+    case 8:
+        return addIntegrityRoots(db);
+    case 9:
+        return moveNotesOut(db);
+    case 10:
+        return addAttachments(db);
+    case 11:
+        return addCustomFields(db);
+    case 12:
+        return addEntryHistory(db);
+    case 13:
+        return addExtraBinding(db);
+    case 14:
+        return hashCiphertextLeaves(db);
+    case 15:
+        return indexUnboundEntries(db);
+    default:
+        qWarning() << "Unknown schema version:" << version;
+        return false;
+    }
+}
+
+bool SchemaMigrations::setVersion(QSqlDatabase db, int version)
+{
+    // PRAGMA does not take bound parameters; version is always one of our constants
+    QSqlQuery query(db);
+    if (!query.exec(QStringLiteral("PRAGMA user_version = %1").arg(version))) {
+        qWarning() << "Failed to record schema version:" << query.lastError().text();
+        return false;
+    }
+    
+    return true;
+}
+
+bool SchemaMigrations::createBaseSchema(QSqlDatabase db)
+{
+    // Databases from before versioning already have some or all of these tables
+    if (!execAll(db, {
+            "CREATE TABLE IF NOT EXISTS users ("
+            "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+            "username TEXT UNIQUE NOT NULL,"
+            "password TEXT NOT NULL,"
+            "salt BLOB NOT NULL,"
+            "created_at DATETIME DEFAULT CURRENT_TIMESTAMP)",
+            "CREATE TABLE IF NOT EXISTS passwords ("
+            "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+            "user_id INTEGER NOT NULL,"
+            "name TEXT NOT NULL,"
+            "url TEXT NOT NULL,"
+            "username TEXT NOT NULL,"
+            "password BLOB NOT NULL,"
+            "note TEXT,"
+            "created_at DATETIME DEFAULT CURRENT_TIMESTAMP,"
+            "updated_at DATETIME DEFAULT CURRENT_TIMESTAMP,"
+            "FOREIGN KEY (user_id) REFERENCES users(id))",
+            "CREATE INDEX IF NOT EXISTS idx_passwords_user_id ON passwords(user_id)"
+        })) {
+        return false;
+    }
+    
+    // The first release stored entries without name and note. Columns are added in place
+    // and names backfilled from the url in chunks, instead of copying the whole table.
+    if (!hasColumn(db, "passwords", "note") && !execAll(db, {"ALTER TABLE passwords ADD COLUMN note TEXT"})) {
+        return false;
+    }
+    
+    if (!hasColumn(db, "passwords", "name")) {
+        if (!execAll(db, {"ALTER TABLE passwords ADD COLUMN name TEXT"})) {
+            return false;
+        }
+    }
+    
+    return updateInChunks(db, "passwords", "name = url", "name IS NULL");
+}
+
+bool SchemaMigrations::addMetadataEncryption(QSqlDatabase db)
+{
+    // Metadata columns hold ciphertext once a row is flagged; older rows are converted at login
+    if (hasColumn(db, "passwords", "encrypted_fields")) {
+        return true;
+    }
+    
+    return execAll(db, {"ALTER TABLE passwords ADD COLUMN encrypted_fields INTEGER NOT NULL DEFAULT 0"});
+}
+
+bool SchemaMigrations::addKdfParameters(QSqlDatabase db)
+{
+    // Accounts created before the KDF upgrade keep their SHA-256 hash until next login
+    if (hasColumn(db, "users", "kdf")) {
+        return true;
+    }
+    
+    if (!db.transaction()) {
+        qWarning() << "Failed to start migration transaction:" << db.lastError().text();
+        return false;
+    }
+    
+    if (!execAll(db, {
+            "ALTER TABLE users ADD COLUMN kdf TEXT NOT NULL DEFAULT 'sha256'",
+            "ALTER TABLE users ADD COLUMN kdf_cost INTEGER NOT NULL DEFAULT 0",
+            "ALTER TABLE users ADD COLUMN kdf_block INTEGER NOT NULL DEFAULT 0",
+            "ALTER TABLE users ADD COLUMN kdf_parallel INTEGER NOT NULL DEFAULT 0"
+        })) {
+        db.rollback();
+        return false;
+    }
+    
+    return db.commit();
+}
+
+bool SchemaMigrations::addSearchTokens(QSqlDatabase db)
+{
+    // Blind-index tokens over the encrypted name, url and username
+    return execAll(db, {
+        "CREATE TABLE IF NOT EXISTS search_tokens ("
+        "user_id INTEGER NOT NULL,"
+        "token BLOB NOT NULL,"
+        "password_id INTEGER NOT NULL,"
+        "FOREIGN KEY (password_id) REFERENCES passwords(id) ON DELETE CASCADE)",
+        "CREATE INDEX IF NOT EXISTS idx_search_tokens_token ON search_tokens(user_id, token)",
+        "CREATE INDEX IF NOT EXISTS idx_search_tokens_password_id ON search_tokens(password_id)"
+    });
+}
+
+bool SchemaMigrations::clusterSearchTokens(QSqlDatabase db)
+{
+    // Search tokens move into a WITHOUT ROWID table keyed by (user_id, token, password_id):
+    // token lookups then read password_id straight from the key instead of a separate index
+    // plus a rowid lookup per match. Rows are moved in chunks; a restart picks up the rest.
+    if (!hasTable(db, "search_tokens_new")) {
+        QSqlQuery query(db);
+        if (query.exec("SELECT sql FROM sqlite_master WHERE type = 'table' AND name = 'search_tokens'") &&
+            query.next() && query.value(0).toString().contains("WITHOUT ROWID", Qt::CaseInsensitive)) {
+            return true;
+        }
+    }
+    
+    if (!execAll(db, {
+            "CREATE TABLE IF NOT EXISTS search_tokens_new ("
+            "user_id INTEGER NOT NULL,"
+            "token BLOB NOT NULL,"
+            "password_id INTEGER NOT NULL,"
+            "PRIMARY KEY (user_id, token, password_id),"
+            "FOREIGN KEY (password_id) REFERENCES passwords(id) ON DELETE CASCADE) WITHOUT ROWID"
+        })) {
+        return false;
+    }
+    
+    const QString chunk = QStringLiteral("SELECT rowid FROM search_tokens ORDER BY rowid LIMIT %1").arg(CHUNK_SIZE);
+    qint64 moved = 0;
+    
+    while (true) {
+        if (!db.transaction()) {
+            qWarning() << "Failed to start migration transaction:" << db.lastError().text();
+            return false;
+        }
+        
+        // Orphaned tokens would violate the foreign key and are dropped instead
+        QSqlQuery query(db);
+        if (!query.exec("INSERT OR IGNORE INTO search_tokens_new (user_id, token, password_id) "
+                        "SELECT user_id, token, password_id FROM search_tokens "
+                        "WHERE rowid IN (" + chunk + ") AND password_id IN (SELECT id FROM passwords)") ||
+            !query.exec("DELETE FROM search_tokens WHERE rowid IN (" + chunk + ")")) {
+            qWarning() << "Failed to move search tokens:" << query.lastError().text();
+            db.rollback();
+            return false;
+        }
+        
+        int affected = query.numRowsAffected();
+        query.finish();
+        
+        if (!db.commit()) {
+            qWarning() << "Failed to commit migration chunk:" << db.lastError().text();
+            db.rollback();
+            return false;
+        }
+        
+        moved += affected;
+        if (affected < CHUNK_SIZE) {
+            break;
+        }
+    }
+    
+    qDebug() << "Moved" << moved << "search tokens to the clustered table";
+    
+    // The swap is one transaction, so the old table never disappears without its replacement
+    if (!db.transaction()) {
+        qWarning() << "Failed to start migration transaction:" << db.lastError().text();
+        return false;
+    }
+    
+    if (!execAll(db, {
+            "DROP TABLE search_tokens",
+            "ALTER TABLE search_tokens_new RENAME TO search_tokens",
+            "CREATE INDEX IF NOT EXISTS idx_search_tokens_password_id ON search_tokens(password_id)"
+        })) {
+        db.rollback();
+        return false;
+    }
+    
+    return db.commit();
+}
+
+bool SchemaMigrations::addChangeJournal(QSqlDatabase db)
+{
+    // Append-only; rows outlive the entries they describe, so there is no foreign key
+    return execAll(db, {
+        "CREATE TABLE IF NOT EXISTS changes ("
+        "seq INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "user_id INTEGER NOT NULL,"
+        "password_id INTEGER NOT NULL,"
+        "change_type INTEGER NOT NULL,"
+        "changed_at DATETIME DEFAULT CURRENT_TIMESTAMP)",
+        "CREATE INDEX IF NOT EXISTS idx_changes_user_seq ON changes(user_id, seq)"
+    });
+}
+
+bool SchemaMigrations::addSyncMetadata(QSqlDatabase db)
+{
+    // uuid identifies an entry across copies of the vault; bucket and hash are its Merkle leaf
+    const QStringList columns = {"uuid BLOB", "sync_bucket INTEGER", "sync_hash INTEGER"};
+    for (const QString &column : columns) {
+        if (!hasColumn(db, "passwords", column.section(' ', 0, 0)) &&
+            !execAll(db, {"ALTER TABLE passwords ADD COLUMN " + column})) {
+            return false;
+        }
+    }
+    
+    if (!updateInChunks(db, "passwords", "uuid = randomblob(16)", "uuid IS NULL") ||
+        !hashEntriesInChunks(db)) {
+        return false;
+    }
+    
+    // Indexes are built after the backfill so it does not maintain them row by row.
+    // Tombstones are kept so a deletion still reaches copies that sync much later.
+    return execAll(db, {
+        "CREATE UNIQUE INDEX IF NOT EXISTS idx_passwords_uuid ON passwords(uuid)",
+        "CREATE INDEX IF NOT EXISTS idx_passwords_sync ON passwords(user_id, sync_bucket, sync_hash)",
+        "CREATE TABLE IF NOT EXISTS tombstones ("
+        "uuid BLOB PRIMARY KEY,"
+        "user_id INTEGER NOT NULL,"
+        "sync_bucket INTEGER NOT NULL,"
+        "sync_hash INTEGER NOT NULL,"
+        "deleted_at DATETIME DEFAULT CURRENT_TIMESTAMP"
+        ") WITHOUT ROWID",
+        "CREATE INDEX IF NOT EXISTS idx_tombstones_sync ON tombstones(user_id, sync_bucket, sync_hash)"
+    });
+}
+
+bool SchemaMigrations::addIntegrityRoots(QSqlDatabase db)
+{
+    // One root per account, kept current by triggers; the seal is written by the application
+    return execAll(db, {
+        "CREATE TABLE IF NOT EXISTS integrity_roots ("
+        "user_id INTEGER PRIMARY KEY,"
+        "leaf_sum INTEGER NOT NULL DEFAULT 0,"
+        "leaf_count INTEGER NOT NULL DEFAULT 0,"
+        "seal BLOB)",
+        "INSERT OR REPLACE INTO integrity_roots (user_id, leaf_sum, leaf_count) "
+        "SELECT user_id, SUM(IFNULL(sync_hash, 0)), COUNT(*) FROM passwords GROUP BY user_id",
+        "CREATE TRIGGER IF NOT EXISTS integrity_after_insert AFTER INSERT ON passwords BEGIN "
+        "INSERT OR IGNORE INTO integrity_roots (user_id) VALUES (NEW.user_id); "
+        "UPDATE integrity_roots SET leaf_sum = leaf_sum + IFNULL(NEW.sync_hash, 0), leaf_count = leaf_count + 1 "
+        "WHERE user_id = NEW.user_id; "
+        "END",
+        "CREATE TRIGGER IF NOT EXISTS integrity_after_delete AFTER DELETE ON passwords BEGIN "
+        "UPDATE integrity_roots SET leaf_sum = leaf_sum - IFNULL(OLD.sync_hash, 0), leaf_count = leaf_count - 1 "
+        "WHERE user_id = OLD.user_id; "
+        "END",
+        "CREATE TRIGGER IF NOT EXISTS integrity_after_update AFTER UPDATE OF sync_hash, user_id ON passwords BEGIN "
+        "UPDATE integrity_roots SET leaf_sum = leaf_sum - IFNULL(OLD.sync_hash, 0), leaf_count = leaf_count - 1 "
+        "WHERE user_id = OLD.user_id; "
+        "INSERT OR IGNORE INTO integrity_roots (user_id) VALUES (NEW.user_id); "
+        "UPDATE integrity_roots SET leaf_sum = leaf_sum + IFNULL(NEW.sync_hash, 0), leaf_count = leaf_count + 1 "
+        "WHERE user_id = NEW.user_id; "
+        "END"
+    });
+}
+
+bool SchemaMigrations::moveNotesOut(QSqlDatabase db)
+{
+    // Notes live in their own table so listing queries read short rows without overflow
+    // pages. dictionary_id is NULL for a note stored as-is and names the trained
+    // dictionary (0 for none) of a compressed one.
+    if (!execAll(db, {
+            "CREATE TABLE IF NOT EXISTS note_dictionaries ("
+            "id INTEGER PRIMARY KEY,"
+            "user_id INTEGER NOT NULL,"
+            "dictionary BLOB NOT NULL,"
+            "FOREIGN KEY (user_id) REFERENCES users(id))",
+            "CREATE INDEX IF NOT EXISTS idx_note_dictionaries_user ON note_dictionaries(user_id)",
+            "CREATE TABLE IF NOT EXISTS entry_notes ("
+            "password_id INTEGER PRIMARY KEY,"
+            "dictionary_id INTEGER,"
+            "note BLOB NOT NULL,"
+            "FOREIGN KEY (password_id) REFERENCES passwords(id) ON DELETE CASCADE)"
+        })) {
+        return false;
+    }
+    
+    if (!hasColumn(db, "passwords", "note_size") &&
+        !execAll(db, {"ALTER TABLE passwords ADD COLUMN note_size INTEGER NOT NULL DEFAULT 0"})) {
+        return false;
+    }
+    
+    // Ciphertext moves byte for byte, so sync hashes and the integrity root stay valid.
+    // note_size is the plaintext size: ciphertext minus IV and GCM tag.
+    const QString chunk = QStringLiteral("SELECT id FROM passwords WHERE note IS NOT NULL ORDER BY id LIMIT %1").arg(CHUNK_SIZE);
+    qint64 moved = 0;
+    
+    while (true) {
+        if (!db.transaction()) {
+            qWarning() << "Failed to start migration transaction:" << db.lastError().text();
+            return false;
+        }
+        
+        QSqlQuery query(db);
+        if (!query.exec("INSERT OR REPLACE INTO entry_notes (password_id, note) "
+                        "SELECT id, CAST(note AS BLOB) FROM passwords "
+                        "WHERE id IN (" + chunk + ") AND length(CAST(note AS BLOB)) > 0") ||
+            !query.exec("UPDATE passwords SET "
+                        "note_size = CASE WHEN encrypted_fields = 1 THEN max(length(CAST(note AS BLOB)) - 32, 0) "
+                        "ELSE length(CAST(note AS BLOB)) END, "
+                        "note = NULL WHERE id IN (" + chunk + ")")) {
+            qWarning() << "Failed to move notes:" << query.lastError().text();
+            db.rollback();
+            return false;
+        }
+        
+        int affected = query.numRowsAffected();
+        query.finish();
+        
+        if (!db.commit()) {
+            qWarning() << "Failed to commit migration chunk:" << db.lastError().text();
+            db.rollback();
+            return false;
+        }
+        
+        moved += affected;
+        if (affected < CHUNK_SIZE) {
+            break;
+        }
+    }
+    
+    qDebug() << "Moved" << moved << "notes to the entry_notes table";
+    return true;
+}
+
+bool SchemaMigrations::addAttachments(QSqlDatabase db)
+{
+    // data holds the encrypted chunks and is only touched through incremental blob
+    // I/O; as the last column it never has to be stepped over to reach the others
+    return execAll(db, {
+        "CREATE TABLE IF NOT EXISTS attachments ("
+        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "password_id INTEGER NOT NULL,"
+        "name BLOB NOT NULL,"
+        "wrapped_key BLOB NOT NULL,"
+        "size INTEGER NOT NULL,"
+        "chunk_size INTEGER NOT NULL,"
+        "created_at DATETIME DEFAULT CURRENT_TIMESTAMP,"
+        "data BLOB NOT NULL,"
+        "FOREIGN KEY (password_id) REFERENCES passwords(id) ON DELETE CASCADE)",
+        "CREATE INDEX IF NOT EXISTS idx_attachments_password ON attachments(password_id)"
+    });
+}
+
+bool SchemaMigrations::addCustomFields(QSqlDatabase db)
+{
+    // One packed, encrypted record per entry; NULL when the entry has no custom fields,
+    // so existing rows and their sync hashes stay as they are
+    if (hasColumn(db, "passwords", "fields")) {
+        return true;
+    }
+    return execAll(db, {"ALTER TABLE passwords ADD COLUMN fields BLOB"});
+}
+
+bool SchemaMigrations::addEntryHistory(QSqlDatabase db)
+{
+    // Kept out of passwords so listings never read it. delta is 0 for a version stored
+    // whole and 1 for one stored against the next newer version of the same entry.
+    return execAll(db, {
+        "CREATE TABLE IF NOT EXISTS entry_history ("
+        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "password_id INTEGER NOT NULL,"
+        "changed_at INTEGER NOT NULL DEFAULT (strftime('%s', 'now')),"
+        "delta INTEGER NOT NULL DEFAULT 0,"
+        "version BLOB NOT NULL,"
+        "FOREIGN KEY (password_id) REFERENCES passwords(id) ON DELETE CASCADE)",
+        "CREATE INDEX IF NOT EXISTS idx_entry_history_password ON entry_history(password_id)"
+    });
+}
+
+bool SchemaMigrations::addExtraBinding(QSqlDatabase db)
+{
+    // Flags ciphertext that carries its owner (account, entry uuid) as GCM additional
+    // data; older attachment keys and names, history versions and note dictionaries
+    // are rebound at login
+    for (const QString &table : {QStringLiteral("attachments"), QStringLiteral("entry_history"),
+                                 QStringLiteral("note_dictionaries")}) {
+        if (!hasColumn(db, table, "bound") &&
+            !execAll(db, {"ALTER TABLE " + table + " ADD COLUMN bound INTEGER NOT NULL DEFAULT 0"})) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool SchemaMigrations::hashCiphertextLeaves(QSqlDatabase db)
+{
+    // The leaves were the stored sync hashes, which a changed ciphertext need not touch.
+    // Now the triggers hash the ciphertext itself with integrity_leaf() (registered by
+    // VaultIntegrity::installFunctions), one leaf per entry and one per note. The old
+    // root stays in legacy_sum and legacy_count until the next login has checked its
+    // seal and resealed the new one.
+    if (hasColumn(db, "integrity_roots", "legacy_sum")) {
+        return true;
+    }
+    
+    auto entryLeaf = [](const char *row) {
+        return QStringLiteral("integrity_leaf('entry', %1.user_id, %1.uuid, %1.encrypted_fields, %1.name, %1.url, "
+                              "%1.username, %1.password, %1.fields)").arg(QLatin1String(row));
+    };
+    auto noteLeaf = [](const char *row) {
+        return QStringLiteral("integrity_leaf('note', %1.password_id, IFNULL(%1.dictionary_id, -1), %1.note)")
+            .arg(QLatin1String(row));
+    };
+    // Leaf of the note of entry OLD or NEW, 0 if it has none
+    auto entryNoteLeaf = [&](const char *row) {
+        return QStringLiteral("IFNULL((SELECT %1 FROM entry_notes n WHERE n.password_id = %2.id), 0)")
+            .arg(noteLeaf("n"), QLatin1String(row));
+    };
+    
+    if (!db.transaction()) {
+        qWarning() << "Failed to start migration transaction:" << db.lastError().text();
+        return false;
+    }
+    
+    if (!execAll(db, {
+            "ALTER TABLE integrity_roots ADD COLUMN legacy_sum INTEGER",
+            "ALTER TABLE integrity_roots ADD COLUMN legacy_count INTEGER",
+            "DROP TRIGGER IF EXISTS integrity_after_insert",
+            "DROP TRIGGER IF EXISTS integrity_after_delete",
+            "DROP TRIGGER IF EXISTS integrity_after_update",
+            "UPDATE integrity_roots SET legacy_sum = leaf_sum, legacy_count = leaf_count, leaf_sum = "
+            "IFNULL((SELECT SUM(" + entryLeaf("p") + ") FROM passwords p WHERE p.user_id = integrity_roots.user_id), 0) + "
+            "IFNULL((SELECT SUM(" + noteLeaf("n") + ") FROM entry_notes n JOIN passwords p ON p.id = n.password_id "
+            "WHERE p.user_id = integrity_roots.user_id), 0)",
+            "CREATE TRIGGER IF NOT EXISTS integrity_entry_insert AFTER INSERT ON passwords BEGIN "
+            "INSERT OR IGNORE INTO integrity_roots (user_id) VALUES (NEW.user_id); "
+            "UPDATE integrity_roots SET leaf_sum = leaf_sum + " + entryLeaf("NEW") + ", leaf_count = leaf_count + 1 "
+            "WHERE user_id = NEW.user_id; "
+            "END",
+            // The note is still there before the delete; ON DELETE CASCADE removes it
+            // after the entry, when the note trigger no longer finds an account
+            "CREATE TRIGGER IF NOT EXISTS integrity_entry_before_delete BEFORE DELETE ON passwords BEGIN "
+            "UPDATE integrity_roots SET leaf_sum = leaf_sum - " + entryNoteLeaf("OLD") + " "
+            "WHERE user_id = OLD.user_id; "
+            "END",
+            "CREATE TRIGGER IF NOT EXISTS integrity_entry_delete AFTER DELETE ON passwords BEGIN "
+            "UPDATE integrity_roots SET leaf_sum = leaf_sum - " + entryLeaf("OLD") + ", leaf_count = leaf_count - 1 "
+            "WHERE user_id = OLD.user_id; "
+            "END",
+            "CREATE TRIGGER IF NOT EXISTS integrity_entry_update AFTER UPDATE OF user_id, uuid, encrypted_fields, "
+            "name, url, username, password, fields ON passwords BEGIN "
+            "UPDATE integrity_roots SET leaf_sum = leaf_sum - " + entryLeaf("OLD") + " - " + entryNoteLeaf("NEW") + ", "
+            "leaf_count = leaf_count - 1 WHERE user_id = OLD.user_id; "
+            "INSERT OR IGNORE INTO integrity_roots (user_id) VALUES (NEW.user_id); "
+            "UPDATE integrity_roots SET leaf_sum = leaf_sum + " + entryLeaf("NEW") + " + " + entryNoteLeaf("NEW") + ", "
+            "leaf_count = leaf_count + 1 WHERE user_id = NEW.user_id; "
+            "END",
+            "CREATE TRIGGER IF NOT EXISTS integrity_note_insert AFTER INSERT ON entry_notes BEGIN "
+            "UPDATE integrity_roots SET leaf_sum = leaf_sum + " + noteLeaf("NEW") + " "
+            "WHERE user_id = (SELECT user_id FROM passwords WHERE id = NEW.password_id); "
+            "END",
+            "CREATE TRIGGER IF NOT EXISTS integrity_note_delete AFTER DELETE ON entry_notes BEGIN "
+            "UPDATE integrity_roots SET leaf_sum = leaf_sum - " + noteLeaf("OLD") + " "
+            "WHERE user_id = (SELECT user_id FROM passwords WHERE id = OLD.password_id); "
+            "END",
+            "CREATE TRIGGER IF NOT EXISTS integrity_note_update AFTER UPDATE ON entry_notes BEGIN "
+            "UPDATE integrity_roots SET leaf_sum = leaf_sum - " + noteLeaf("OLD") + " "
+            "WHERE user_id = (SELECT user_id FROM passwords WHERE id = OLD.password_id); "
+            "UPDATE integrity_roots SET leaf_sum = leaf_sum + " + noteLeaf("NEW") + " "
+            "WHERE user_id = (SELECT user_id FROM passwords WHERE id = NEW.password_id); "
+            "END"
+        })) {
+        db.rollback();
+        return false;
+    }
+    
+    return db.commit();
+}
+
+bool SchemaMigrations::indexUnboundEntries(QSqlDatabase db)
+{
+    // Step 5 used to index rows WHERE encrypted_fields = 0, which no query has asked for
+    // since field binding: the login conversion selects encrypted_fields < 2, and a partial
+    // index is only used for the predicate it was built with. Name, url and username are
+    // ciphertext, so (user_id, name) or (user_id, url, username) indexes would order and
+    // match random bytes; listing sorts after decryption and lookups go through tokens.
+    return execAll(db, {
+        "DROP INDEX IF EXISTS idx_passwords_plaintext",
+        "CREATE INDEX IF NOT EXISTS idx_passwords_unbound ON passwords(user_id) WHERE encrypted_fields < 2"
+    });
+}
+
+bool SchemaMigrations::hasTable(QSqlDatabase db, const QString &table)
+{
+    QSqlQuery query(db);
+    query.prepare("SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?");
+    query.addBindValue(table);
+    return query.exec() && query.next();
+}
+
+bool SchemaMigrations::hasColumn(QSqlDatabase db, const QString &table, const QString &column)
+{
+    QSqlQuery query(db);
+    if (!query.exec(QStringLiteral("PRAGMA table_info(%1)").arg(table))) {
+        return false;
+    }
+    
+    while (query.next()) {
+        if (query.value(1).toString() == column) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SchemaMigrations::execAll(QSqlDatabase db, const QStringList &statements)
+{
+    QSqlQuery query(db);
+    for (const QString &statement : statements) {
+        if (!query.exec(statement)) {
+            qWarning() << "Migration statement failed:" << query.lastError().text() << statement;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool SchemaMigrations::updateInChunks(QSqlDatabase db, const QString &table, const QString &assignments, const QString &where)
+{
+    const QString sql = QStringLiteral("UPDATE %1 SET %2 WHERE rowid IN (SELECT rowid FROM %1 WHERE %3 LIMIT %4)")
+                            .arg(table, assignments, where).arg(CHUNK_SIZE);
+    qint64 updated = 0;
+    
+    // Each chunk commits on its own, so progress survives an interrupted upgrade
+    while (true) {
+        if (!db.transaction()) {
+            qWarning() << "Failed to start migration transaction:" << db.lastError().text();
+            return false;
+        }
+        
+        QSqlQuery query(db);
+        if (!query.exec(sql)) {
+            qWarning() << "Chunked migration update failed:" << query.lastError().text();
+            db.rollback();
+            return false;
+        }
+        
+        int affected = query.numRowsAffected();
+        query.finish();
+        
+        if (!db.commit()) {
+            qWarning() << "Failed to commit migration chunk:" << db.lastError().text();
+            db.rollback();
+            return false;
+        }
+        
+        updated += affected;
+        if (affected < CHUNK_SIZE) {
+            break;
+        }
+    }
+    
+    if (updated > 0) {
+        qDebug() << "Migrated" << updated << "rows of" << table;
+    }
+    return true;
+}
+
+bool SchemaMigrations::hashEntriesInChunks(QSqlDatabase db)
+{
+    qint64 updated = 0;
+    
+    // The hash covers the stored ciphertext, so no key is needed here
+    while (true) {
+        if (!db.transaction()) {
+            qWarning() << "Failed to start migration transaction:" << db.lastError().text();
+            return false;
+        }
+        
+        QSqlQuery select(db);
+        if (!select.exec(QStringLiteral("SELECT rowid, uuid, name, url, username, password, note FROM passwords "
+                                        "WHERE sync_hash IS NULL LIMIT %1").arg(CHUNK_SIZE))) {
+            qWarning() << "Failed to read entries to hash:" << select.lastError().text();
+            db.rollback();
+            return false;
+        }
+        
+        QSqlQuery update(db);
+        update.prepare("UPDATE passwords SET sync_bucket = ?, sync_hash = ? WHERE rowid = ?");
+        
+        int affected = 0;
+        while (select.next()) {
+            QByteArray uuid = select.value(1).toByteArray();
+            update.addBindValue(VaultSync::bucketOf(uuid));
+            update.addBindValue(VaultSync::entryHash(select.value(2).toByteArray(), select.value(3).toByteArray(),
+                                                     select.value(4).toByteArray(), select.value(5).toByteArray(),
+                                                     select.value(6).toByteArray()));
+            update.addBindValue(select.value(0));
+            
+            if (!update.exec()) {
+                qWarning() << "Failed to store entry hash:" << update.lastError().text();
+                db.rollback();
+                return false;
+            }
+            affected++;
+        }
+        select.finish();
+        
+        if (!db.commit()) {
+            qWarning() << "Failed to commit migration chunk:" << db.lastError().text();
+            db.rollback();
+            return false;
+        }
+        
+        updated += affected;
+        if (affected < CHUNK_SIZE) {
+            break;
+        }
+    }
+    
+    if (updated > 0) {
+        qDebug() << "Hashed" << updated << "entries for sync";
+    }
+    return true;
+}
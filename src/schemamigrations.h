@@ -0,0 +1,58 @@
+#ifndef SCHEMAMIGRATIONS_H
+#define SCHEMAMIGRATIONS_H
+
+#include <QSqlDatabase>
+#include <QString>
+#include <QStringList>
+
+// Forward-only schema migrations. The applied version lives in PRAGMA
+// user_version, so an up-to-date database costs one integer read at startup.
+// Each migration is idempotent and long row rewrites are committed in chunks,
+// so an interrupted upgrade simply resumes on the next start.
+class SchemaMigrations
+{
+public:
+    static const int LATEST_VERSION = 15;
+    static const int CHUNK_SIZE = 500;
+    
+    // Must run on the writer connection, with VaultIntegrity::installFunctions() done
+    static bool migrate(QSqlDatabase db);
+    static int version(QSqlDatabase db);
+    
+    // Stops at targetVersion; builds databases of older versions for the migration check
+    static bool migrate(QSqlDatabase db, int targetVersion);
+
+private:
+    static bool migrateTo(QSqlDatabase db, int version);
+    static bool setVersion(QSqlDatabase db, int version);
+    
+    // Numbered steps; version N brings the schema from N - 1 to N
+    static bool createBaseSchema(QSqlDatabase db);     // 1
+    static bool addMetadataEncryption(QSqlDatabase db); // 2
+    static bool addKdfParameters(QSqlDatabase db);      // 3
+    static bool addSearchTokens(QSqlDatabase db);       // 4
+    static bool clusterSearchTokens(QSqlDatabase db);   // 5
+    static bool addChangeJournal(QSqlDatabase db);      // 6
+    static bool addSyncMetadata(QSqlDatabase db);       // 7
+    static bool addIntegrityRoots(QSqlDatabase db);     // 8
+    static bool moveNotesOut(QSqlDatabase db);          // 9
+    static bool addAttachments(QSqlDatabase db);        // 10
+    static bool addCustomFields(QSqlDatabase db);       // 11
+    static bool addEntryHistory(QSqlDatabase db);       // 12
+    static bool addExtraBinding(QSqlDatabase db);       // 13
+    static bool hashCiphertextLeaves(QSqlDatabase db);  // 14
+    static bool indexUnboundEntries(QSqlDatabase db);   // 15
+    
+    static bool hasColumn(QSqlDatabase db, const QString &table, const QString &column);
+    static bool hasTable(QSqlDatabase db, const QString &table);
+    static bool execAll(QSqlDatabase db, const QStringList &statements);
+    
+    // Repeats an UPDATE limited to CHUNK_SIZE rows per transaction until no row changes;
+    // where must select exactly the rows that still need the update
+    static bool updateInChunks(QSqlDatabase db, const QString &table, const QString &assignments, const QString &where);
+    
+    // Fills sync_bucket and sync_hash of existing entries, CHUNK_SIZE rows per transaction
+    static bool hashEntriesInChunks(QSqlDatabase db);
+};
+
+#endif // SCHEMAMIGRATIONS_H
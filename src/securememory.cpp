@@ -0,0 +1,231 @@
+#include "securememory.h"
+#include <QDebug>
+#include <QMutexLocker>
+#include <openssl/crypto.h>
+#include <utility>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+SecureArena &SecureArena::instance()
+{
+    static SecureArena arena;
+    return arena;
+}
+
+SecureArena::SecureArena()
+    : locked(true)
+{
+}
+
+SecureArena::~SecureArena()
+{
+    for (const Region &region : regions) {
+        OPENSSL_cleanse(region.base, region.size);
+        unmap(region.base, region.size);
+    }
+}
+
+void *SecureArena::allocate(size_t size, size_t *capacity)
+{
+    if (size == 0) {
+        size = 1;
+    }
+    
+    QMutexLocker locker(&mutex);
+    
+    // Large secrets (attachments, big notes) bypass the pools
+    if (size > MAX_BLOCK_SIZE) {
+#ifdef Q_OS_WIN
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        size_t pageSize = info.dwPageSize;
+#else
+        size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+#endif
+        size_t mapped = (size + pageSize - 1) / pageSize * pageSize;
+        char *ptr = mapLocked(mapped);
+        if (!ptr) {
+            return nullptr;
+        }
+        *capacity = mapped;
+        return ptr;
+    }
+    
+    int index = sizeClass(size);
+    size_t blockSize = classSize(index);
+    
+    // Recycled blocks were wiped on release
+    if (!freeLists[index].isEmpty()) {
+        *capacity = blockSize;
+        return freeLists[index].takeLast();
+    }
+    
+    if (regions.isEmpty() || regions.last().used + blockSize > regions.last().size) {
+        Region region;
+        region.base = mapLocked(REGION_SIZE);
+        if (!region.base) {
+            return nullptr;
+        }
+        region.size = REGION_SIZE;
+        regions.append(region);
+    }
+    
+    Region &region = regions.last();
+    void *ptr = region.base + region.used;
+    region.used += blockSize;
+    
+    *capacity = blockSize;
+    return ptr;
+}
+
+void SecureArena::release(void *ptr, size_t capacity)
+{
+    if (!ptr) {
+        return;
+    }
+    
+    OPENSSL_cleanse(ptr, capacity);
+    
+    if (capacity > MAX_BLOCK_SIZE) {
+        unmap(static_cast<char*>(ptr), capacity);
+        return;
+    }
+    
+    QMutexLocker locker(&mutex);
+    freeLists[sizeClass(capacity)].append(ptr);
+}
+
+int SecureArena::sizeClass(size_t size)
+{
+    int index = 0;
+    size_t blockSize = MIN_BLOCK_SIZE;
+    while (blockSize < size && index < SIZE_CLASSES - 1) {
+        blockSize <<= 1;
+        index++;
+    }
+    return index;
+}
+
+size_t SecureArena::classSize(int sizeClass)
+{
+    return MIN_BLOCK_SIZE << sizeClass;
+}
+
+char *SecureArena::mapLocked(size_t size)
+{
+#ifdef Q_OS_WIN
+    char *ptr = static_cast<char*>(VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+    if (!ptr) {
+        qWarning() << "Failed to allocate secure memory";
+        return nullptr;
+    }
+    
+    if (!VirtualLock(ptr, size) && locked) {
+        qWarning() << "Could not lock secure memory, secrets may be swapped out";
+        locked = false;
+    }
+#else
+    void *mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) {
+        qWarning() << "Failed to allocate secure memory";
+        return nullptr;
+    }
+    char *ptr = static_cast<char*>(mapped);
+    
+    // Usually RLIMIT_MEMLOCK; keep going without the guarantee rather than failing decrypts
+    if (mlock(ptr, size) != 0 && locked) {
+        qWarning() << "Could not lock secure memory, secrets may be swapped out";
+        locked = false;
+    }
+
+#ifdef MADV_DONTDUMP
+    madvise(ptr, size, MADV_DONTDUMP);
+#endif
+#endif
+    
+    return ptr;
+}
+
+void SecureArena::unmap(char *ptr, size_t size)
+{
+#ifdef Q_OS_WIN
+    VirtualUnlock(ptr, size);
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munlock(ptr, size);
+    munmap(ptr, size);
+#endif
+}
+
+SecretBuffer::SecretBuffer(int size)
+{
+    if (size <= 0) {
+        return;
+    }
+    
+    buffer = static_cast<char*>(SecureArena::instance().allocate(size_t(size), &capacity));
+    if (buffer) {
+        length = size;
+    }
+}
+
+SecretBuffer::~SecretBuffer()
+{
+    clear();
+}
+
+SecretBuffer::SecretBuffer(SecretBuffer &&other) noexcept
+    : buffer(std::exchange(other.buffer, nullptr))
+    , length(std::exchange(other.length, 0))
+    , capacity(std::exchange(other.capacity, 0))
+{
+}
+
+SecretBuffer &SecretBuffer::operator=(SecretBuffer &&other) noexcept
+{
+    if (this != &other) {
+        clear();
+        buffer = std::exchange(other.buffer, nullptr);
+        length = std::exchange(other.length, 0);
+        capacity = std::exchange(other.capacity, 0);
+    }
+    return *this;
+}
+
+void SecretBuffer::truncate(int size)
+{
+    if (size < 0 || size >= length) {
+        return;
+    }
+    
+    OPENSSL_cleanse(buffer + size, size_t(length - size));
+    length = size;
+}
+
+void SecretBuffer::clear()
+{
+    // release() wipes the whole block, including any truncated tail
+    SecureArena::instance().release(buffer, capacity);
+    buffer = nullptr;
+    length = 0;
+    capacity = 0;
+}
+
+QString SecretBuffer::toString() const
+{
+    return QString::fromUtf8(buffer, length);
+}
+
+void SecretBuffer::wipe(QString &copy)
+{
+    // data() would detach a shared string and wipe the fresh copy instead
+    if (copy.isDetached() && !copy.isEmpty()) {
+        OPENSSL_cleanse(copy.data(), size_t(copy.size()) * sizeof(QChar));
+    }
+    copy.clear();
+}
@@ -0,0 +1,88 @@
+#ifndef SECUREMEMORY_H
+#define SECUREMEMORY_H
+
+#include <QString>
+#include <QMutex>
+#include <QList>
+#include <cstddef>
+
+// Page-locked memory for decrypted secrets. Small buffers are bump-allocated
+// from locked regions and recycled through per-size free lists; everything is
+// wiped before it is reused or returned to the system.
+class SecureArena
+{
+public:
+    static SecureArena &instance();
+    
+    // Returns a zeroed block of at least size bytes; capacity receives the real size
+    void *allocate(size_t size, size_t *capacity);
+    void release(void *ptr, size_t capacity);
+    
+    bool isLocked() const { return locked; }
+
+private:
+    SecureArena();
+    ~SecureArena();
+    SecureArena(const SecureArena &) = delete;
+    SecureArena &operator=(const SecureArena &) = delete;
+    
+    struct Region
+    {
+        char *base = nullptr;
+        size_t size = 0;
+        size_t used = 0;
+    };
+    
+    static const size_t REGION_SIZE = 64 * 1024;
+    static const size_t MIN_BLOCK_SIZE = 32;
+    static const size_t MAX_BLOCK_SIZE = 4096; // larger secrets get their own locked mapping
+    static const int SIZE_CLASSES = 8;         // 32, 64, ..., 4096
+    
+    static int sizeClass(size_t size);
+    static size_t classSize(int sizeClass);
+    char *mapLocked(size_t size);
+    void unmap(char *ptr, size_t size);
+    
+    QMutex mutex;
+    QList<Region> regions;
+    QList<void*> freeLists[SIZE_CLASSES];
+    bool locked;
+};
+
+// Move-only holder of a decrypted secret living in the SecureArena.
+// The memory is zeroed when the buffer is cleared, shrunk or destroyed.
+class SecretBuffer
+{
+public:
+    SecretBuffer() = default;
+    explicit SecretBuffer(int size);
+    ~SecretBuffer();
+    
+    SecretBuffer(SecretBuffer &&other) noexcept;
+    SecretBuffer &operator=(SecretBuffer &&other) noexcept;
+    SecretBuffer(const SecretBuffer &) = delete;
+    SecretBuffer &operator=(const SecretBuffer &) = delete;
+    
+    char *data() { return buffer; }
+    const char *constData() const { return buffer; }
+    int size() const { return length; }
+    bool isEmpty() const { return length == 0; }
+    
+    // Only shrinks; the released tail is wiped
+    void truncate(int size);
+    void clear();
+    
+    // Copies into a QString for widgets and the clipboard; keep its lifetime short
+    QString toString() const;
+    
+    // Overwrites and clears such a copy once it is no longer needed. Data still shared
+    // with another QString (a widget, the clipboard) is left to that owner.
+    static void wipe(QString &copy);
+
+private:
+    char *buffer = nullptr;
+    int length = 0;
+    size_t capacity = 0;
+};
+
+#endif // SECUREMEMORY_H
@@ -0,0 +1,173 @@
+#include "sessioncache.h"
+#include "securememory.h"
+#include <QSettings>
+#include <QCryptographicHash>
+#include <QDebug>
+#include <openssl/crypto.h>
+
+#ifdef Q_OS_LINUX
+#include <linux/keyctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace {
+const char *ENABLED_SETTING = "security/sessionCache";
+const char *TIMEOUT_SETTING = "security/sessionCacheTimeout";
+
+// Payload layout: key size (1 byte), master key, verifier size (1 byte), verifier, username
+const int MAX_PAYLOAD_SIZE = 4096;
+
+#ifdef Q_OS_LINUX
+// Permission bits from keyutils.h: everything for the possessor and the owning user
+const unsigned long KEY_PERMISSIONS = 0x3f000000 | 0x003f0000;
+
+// Raw syscalls so there is no dependency on libkeyutils
+long addKey(const char *type, const char *description, const void *payload, size_t size, int keyring)
+{
+    return syscall(SYS_add_key, type, description, payload, size, keyring);
+}
+
+long keyctl(int operation, unsigned long arg2, unsigned long arg3 = 0, unsigned long arg4 = 0, unsigned long arg5 = 0)
+{
+    return syscall(SYS_keyctl, operation, arg2, arg3, arg4, arg5);
+}
+
+long findKey(const QByteArray &description)
+{
+    return keyctl(KEYCTL_SEARCH, (unsigned long)KEY_SPEC_SESSION_KEYRING,
+                  (unsigned long)"user", (unsigned long)description.constData(), 0);
+}
+#endif
+}
+
+bool SessionCache::isAvailable()
+{
+#ifdef Q_OS_LINUX
+    // Fails when the kernel lacks keyrings or a seccomp profile blocks keyctl
+    return keyctl(KEYCTL_GET_KEYRING_ID, (unsigned long)KEY_SPEC_SESSION_KEYRING, 0) >= 0;
+#else
+    return false;
+#endif
+}
+
+bool SessionCache::isEnabled()
+{
+    return QSettings().value(ENABLED_SETTING, false).toBool() && isAvailable();
+}
+
+void SessionCache::setEnabled(bool enabled)
+{
+    QSettings().setValue(ENABLED_SETTING, enabled);
+}
+
+int SessionCache::timeoutSeconds()
+{
+    int timeout = QSettings().value(TIMEOUT_SETTING, DEFAULT_TIMEOUT_SECONDS).toInt();
+    return timeout > 0 ? timeout : DEFAULT_TIMEOUT_SECONDS;
+}
+
+bool SessionCache::store(const QString &databasePath, const QString &username, const DerivedKeys &keys)
+{
+#ifdef Q_OS_LINUX
+    QByteArray verifier = keys.verifier.toLatin1();
+    QByteArray name = username.toUtf8();
+    if (!keys.isValid() || keys.masterKey.size() > 255 || verifier.size() > 255) {
+        return false;
+    }
+    
+    QByteArray payload;
+    payload.reserve(2 + keys.masterKey.size() + verifier.size() + name.size());
+    payload.append(char(keys.masterKey.size()));
+    payload.append(keys.masterKey);
+    payload.append(char(verifier.size()));
+    payload.append(verifier);
+    payload.append(name);
+    
+    QByteArray desc = description(databasePath);
+    long id = addKey("user", desc.constData(), payload.constData(), size_t(payload.size()), KEY_SPEC_SESSION_KEYRING);
+    OPENSSL_cleanse(payload.data(), payload.size());
+    
+    if (id < 0) {
+        qWarning() << "Failed to add key to session keyring, errno:" << errno;
+        return false;
+    }
+    
+    // Only this user may read it, and the kernel drops it once the timeout passes
+    keyctl(KEYCTL_SETPERM, (unsigned long)id, KEY_PERMISSIONS);
+    if (keyctl(KEYCTL_SET_TIMEOUT, (unsigned long)id, (unsigned long)timeoutSeconds()) < 0) {
+        qWarning() << "Failed to set session key timeout, discarding it";
+        keyctl(KEYCTL_INVALIDATE, (unsigned long)id);
+        return false;
+    }
+    
+    qDebug() << "Vault key cached in session keyring for" << timeoutSeconds() << "seconds";
+    return true;
+#else
+    Q_UNUSED(databasePath);
+    Q_UNUSED(username);
+    Q_UNUSED(keys);
+    return false;
+#endif
+}
+
+bool SessionCache::lookup(const QString &databasePath, QString &username, DerivedKeys &keys)
+{
+#ifdef Q_OS_LINUX
+    long id = findKey(description(databasePath));
+    if (id < 0) {
+        return false;
+    }
+    
+    SecretBuffer payload(MAX_PAYLOAD_SIZE);
+    if (payload.isEmpty()) {
+        return false;
+    }
+    
+    long size = keyctl(KEYCTL_READ, (unsigned long)id, (unsigned long)payload.data(), (unsigned long)payload.size());
+    if (size < 2 || size > payload.size()) {
+        return false;
+    }
+    
+    const unsigned char *data = reinterpret_cast<const unsigned char*>(payload.constData());
+    int keySize = data[0];
+    if (1 + keySize + 1 > size) {
+        return false;
+    }
+    int verifierSize = data[1 + keySize];
+    int nameOffset = 2 + keySize + verifierSize;
+    if (nameOffset > size) {
+        return false;
+    }
+    
+    keys.masterKey = QByteArray(payload.constData() + 1, keySize);
+    keys.verifier = QString::fromLatin1(payload.constData() + 2 + keySize, verifierSize);
+    username = QString::fromUtf8(payload.constData() + nameOffset, int(size) - nameOffset);
+    return keys.isValid() && !username.isEmpty();
+#else
+    Q_UNUSED(databasePath);
+    Q_UNUSED(username);
+    Q_UNUSED(keys);
+    return false;
+#endif
+}
+
+void SessionCache::remove(const QString &databasePath)
+{
+#ifdef Q_OS_LINUX
+    long id = findKey(description(databasePath));
+    if (id >= 0) {
+        keyctl(KEYCTL_INVALIDATE, (unsigned long)id);
+    }
+#else
+    Q_UNUSED(databasePath);
+#endif
+}
+
+QByteArray SessionCache::description(const QString &databasePath)
+{
+    // Keyed by database file so separate vaults never share an entry
+    QByteArray pathHash = QCryptographicHash::hash(databasePath.toUtf8(), QCryptographicHash::Sha256).toHex().left(16);
+    return QByteArrayLiteral("PasswordManager:") + pathHash;
+}
@@ -0,0 +1,31 @@
+#ifndef SESSIONCACHE_H
+#define SESSIONCACHE_H
+
+#include <QString>
+#include "keyderivation.h"
+
+// Optional cache of the derived vault key in the Linux kernel session keyring,
+// so relaunching within a login session skips the KDF. The key expires after a
+// timeout and never touches disk. Other platforms report the cache as unavailable.
+class SessionCache
+{
+public:
+    static const int DEFAULT_TIMEOUT_SECONDS = 15 * 60;
+    
+    static bool isAvailable();
+    
+    // Opt-in, persisted in QSettings; disabling also drops any cached key
+    static bool isEnabled();
+    static void setEnabled(bool enabled);
+    static int timeoutSeconds();
+    
+    // One entry per database file; storing replaces the previous one
+    static bool store(const QString &databasePath, const QString &username, const DerivedKeys &keys);
+    static bool lookup(const QString &databasePath, QString &username, DerivedKeys &keys);
+    static void remove(const QString &databasePath);
+
+private:
+    static QByteArray description(const QString &databasePath);
+};
+
+#endif // SESSIONCACHE_H
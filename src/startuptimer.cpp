@@ -0,0 +1,60 @@
+#include "startuptimer.h"
+#include <QMutexLocker>
+#include <QDebug>
+
+StartupTimer &StartupTimer::instance()
+{
+    static StartupTimer timer;
+    return timer;
+}
+
+void StartupTimer::start()
+{
+    StartupTimer &self = instance();
+    self.enabled = qEnvironmentVariableIntValue("PASSWORDMANAGER_STARTUP_TRACE") != 0;
+    self.timer.start();
+}
+
+bool StartupTimer::isEnabled()
+{
+    return instance().enabled;
+}
+
+void StartupTimer::mark(const QString &stage)
+{
+    StartupTimer &self = instance();
+    if (!self.enabled) {
+        return;
+    }
+    
+    QMutexLocker locker(&self.mutex);
+    if (!self.finished) {
+        self.stages.append({stage, self.timer.nsecsElapsed()});
+    }
+}
+
+void StartupTimer::finish(const QString &stage)
+{
+    StartupTimer &self = instance();
+    if (!self.enabled) {
+        return;
+    }
+    
+    mark(stage);
+    
+    QMutexLocker locker(&self.mutex);
+    if (self.finished) {
+        return;
+    }
+    self.finished = true;
+    
+    qDebug() << "Startup timing (ms since main):";
+    qint64 previous = 0;
+    for (const auto &stage : std::as_const(self.stages)) {
+        qDebug().noquote() << QStringLiteral("  %1 %2 (+%3)")
+                                  .arg(stage.second / 1e6, 8, 'f', 2)
+                                  .arg(stage.first)
+                                  .arg((stage.second - previous) / 1e6, 0, 'f', 2);
+        previous = stage.second;
+    }
+}
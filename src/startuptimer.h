@@ -0,0 +1,31 @@
+#ifndef STARTUPTIMER_H
+#define STARTUPTIMER_H
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QList>
+#include <QPair>
+#include <QString>
+
+// Startup timing report, enabled with PASSWORDMANAGER_STARTUP_TRACE=1.
+// Stages are recorded from any thread; the breakdown is logged once the
+// login dialog has painted (or the vault opened straight from the session cache).
+class StartupTimer
+{
+public:
+    static void start();
+    static void mark(const QString &stage);
+    static void finish(const QString &stage);
+    static bool isEnabled();
+
+private:
+    static StartupTimer &instance();
+    
+    QElapsedTimer timer;
+    QMutex mutex;
+    QList<QPair<QString, qint64>> stages;
+    bool enabled = false;
+    bool finished = false;
+};
+
+#endif // STARTUPTIMER_H
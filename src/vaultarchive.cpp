@@ -0,0 +1,578 @@
+#include "vaultarchive.h"
+#include <QDataStream>
+#include <QtEndian>
+#include <QSaveFile>
+#include <QQueue>
+#include <QThread>
+#include <QtConcurrent>
+#include <QDebug>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <limits>
+
+namespace {
+const char ARCHIVE_MAGIC[] = "PMVAULT1";
+const char INDEX_MAGIC[] = "PMVINDEX";
+const char END_MAGIC[] = "PMVAEND1";
+const int MAGIC_SIZE = 8;
+const quint16 FORMAT_VERSION = 1;
+const int HEADER_SIZE = 56;
+const int TRAILER_SIZE = 16; // index offset + end magic
+const quint64 INDEX_CHUNK = std::numeric_limits<quint64>::max();
+
+// Fixed so archives stay readable whatever Qt version opens them
+const QDataStream::Version STREAM_VERSION = QDataStream::Qt_6_0;
+
+const unsigned char *bytes(const QByteArray &data)
+{
+    return reinterpret_cast<const unsigned char *>(data.constData());
+}
+
+// output receives the ciphertext followed by the tag
+bool gcmSeal(const QByteArray &key, const QByteArray &iv, const QByteArray &aad,
+             const QByteArray &plaintext, char *output, int tagSize)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        return false;
+    }
+    
+    unsigned char *out = reinterpret_cast<unsigned char *>(output);
+    int len = 0;
+    int finalLen = 0;
+    bool ok = EVP_EncryptInit_ex(ctx, Database::gcmCipher(), nullptr, nullptr, nullptr) == 1 &&
+              EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, iv.size(), nullptr) == 1 &&
+              EVP_EncryptInit_ex(ctx, nullptr, nullptr, bytes(key), bytes(iv)) == 1 &&
+              EVP_EncryptUpdate(ctx, nullptr, &len, bytes(aad), aad.size()) == 1 &&
+              EVP_EncryptUpdate(ctx, out, &len, bytes(plaintext), plaintext.size()) == 1 &&
+              EVP_EncryptFinal_ex(ctx, out + len, &finalLen) == 1 &&
+              EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, tagSize, out + len + finalLen) == 1;
+    
+    EVP_CIPHER_CTX_free(ctx);
+    return ok;
+}
+
+bool gcmOpen(const QByteArray &key, const QByteArray &iv, const QByteArray &aad,
+             const QByteArray &sealed, QByteArray &plaintext, int tagSize)
+{
+    if (sealed.size() < tagSize) {
+        return false;
+    }
+    
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        return false;
+    }
+    
+    int ciphertextSize = sealed.size() - tagSize;
+    plaintext.resize(ciphertextSize);
+    unsigned char *out = reinterpret_cast<unsigned char *>(plaintext.data());
+    QByteArray tag = sealed.right(tagSize);
+    
+    int len = 0;
+    int finalLen = 0;
+    bool ok = EVP_DecryptInit_ex(ctx, Database::gcmCipher(), nullptr, nullptr, nullptr) == 1 &&
+              EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, iv.size(), nullptr) == 1 &&
+              EVP_DecryptInit_ex(ctx, nullptr, nullptr, bytes(key), bytes(iv)) == 1 &&
+              EVP_DecryptUpdate(ctx, nullptr, &len, bytes(aad), aad.size()) == 1 &&
+              EVP_DecryptUpdate(ctx, out, &len, bytes(sealed), ciphertextSize) == 1 &&
+              EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, tagSize, tag.data()) == 1 &&
+              EVP_DecryptFinal_ex(ctx, out + len, &finalLen) == 1;
+    
+    EVP_CIPHER_CTX_free(ctx);
+    
+    if (!ok) {
+        OPENSSL_cleanse(plaintext.data(), plaintext.size());
+        plaintext.clear();
+    }
+    return ok;
+}
+}
+
+bool VaultArchive::exportVault(Database *db, const QString &path, const QString &passphrase, qint64 *exported)
+{
+    if (exported) {
+        *exported = 0;
+    }
+    
+    // Calibrated like an account key; the archive is meant to leave this machine
+    Header header;
+    header.kdf = KeyDerivation::calibrate();
+    header.salt = KeyDerivation::generateSalt(SALT_SIZE);
+    header.noncePrefix = KeyDerivation::generateSalt(NONCE_PREFIX_SIZE);
+    header.bytes = headerBytes(header.kdf, header.salt, header.noncePrefix);
+    
+    DerivedKeys keys = KeyDerivation::derive(passphrase, header.salt, header.kdf);
+    if (!keys.isValid()) {
+        qWarning() << "Failed to derive archive key";
+        return false;
+    }
+    const QByteArray key = keys.masterKey;
+    
+    // Written under a temporary name and only moved over path once complete
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Failed to create archive:" << path;
+        return false;
+    }
+    file.write(header.bytes);
+    
+    QList<ChunkLocation> chunks;
+    QQueue<QFuture<QByteArray>> pending;
+    const int window = qMax(2, QThread::idealThreadCount());
+    int written = 0;
+    
+    // Chunks are sealed out of order on the pool but written in order
+    auto writeNext = [&]() -> bool {
+        QByteArray frame = pending.dequeue().result();
+        if (frame.isEmpty()) {
+            qWarning() << "Failed to encrypt archive chunk" << written;
+            return false;
+        }
+        chunks[written++].offset = file.pos();
+        return file.write(frame) == frame.size();
+    };
+    
+    QList<PasswordEntry> page;
+    bool ok = db->getPasswordEntriesPage(0, CHUNK_ENTRIES, page, true);
+    qint64 total = 0;
+    
+    while (ok) {
+        // One page of lookahead tells whether this chunk is the last
+        QList<PasswordEntry> next;
+        if (page.size() == CHUNK_ENTRIES && !db->getPasswordEntriesPage(page.last().id, CHUNK_ENTRIES, next, true)) {
+            ok = false;
+            break;
+        }
+        bool lastChunk = next.isEmpty();
+        
+        quint64 chunk = quint64(chunks.size());
+        ChunkLocation location;
+        location.firstEntry = total;
+        chunks.append(location);
+        total += page.size();
+        
+        pending.enqueue(QtConcurrent::run([db, key, header, chunk, lastChunk, page]() {
+            return sealChunk(db, key, header, chunk, lastChunk, page);
+        }));
+        
+        if (pending.size() >= window) {
+            ok = writeNext();
+        }
+        
+        if (lastChunk) {
+            break;
+        }
+        page = next;
+    }
+    
+    while (ok && !pending.isEmpty()) {
+        ok = writeNext();
+    }
+    for (QFuture<QByteArray> &future : pending) {
+        future.waitForFinished();
+    }
+    
+    // The chunk index is sealed too, so a partial restore cannot be pointed at the wrong entries
+    if (ok) {
+        QByteArray index;
+        QDataStream out(&index, QIODevice::WriteOnly);
+        out << quint64(chunks.size());
+        for (const ChunkLocation &location : std::as_const(chunks)) {
+            out << quint64(location.offset) << quint64(location.firstEntry);
+        }
+        
+        QByteArray sealed(index.size() + TAG_SIZE, Qt::Uninitialized);
+        QByteArray aad = header.bytes + QByteArray(INDEX_MAGIC, MAGIC_SIZE);
+        ok = gcmSeal(key, nonce(header.noncePrefix, INDEX_CHUNK), aad, index, sealed.data(), TAG_SIZE);
+        
+        QByteArray footer;
+        QDataStream footerOut(&footer, QIODevice::WriteOnly);
+        qint64 indexOffset = file.pos();
+        footerOut << quint32(sealed.size());
+        footerOut.writeRawData(sealed.constData(), sealed.size());
+        footerOut << quint64(indexOffset);
+        footerOut.writeRawData(END_MAGIC, MAGIC_SIZE);
+        
+        ok = ok && file.write(footer) == footer.size();
+    }
+    
+    if (!ok) {
+        file.cancelWriting();
+        return false;
+    }
+    
+    if (!file.commit()) {
+        qWarning() << "Failed to write archive:" << file.errorString();
+        return false;
+    }
+    
+    qDebug() << "Exported" << total << "entries in" << chunks.size() << "chunks to" << path;
+    if (exported) {
+        *exported = total;
+    }
+    return true;
+}
+
+bool VaultArchive::importVault(Database *db, const QString &path, const QString &passphrase, qint64 *imported)
+{
+    return restore(db, path, passphrase, 0, -1, imported);
+}
+
+bool VaultArchive::restoreRange(Database *db, const QString &path, const QString &passphrase,
+                                qint64 firstEntry, qint64 count, qint64 *imported)
+{
+    if (firstEntry < 0 || count < 0) {
+        return false;
+    }
+    return restore(db, path, passphrase, firstEntry, count, imported);
+}
+
+bool VaultArchive::restore(Database *db, const QString &path, const QString &passphrase,
+                           qint64 firstEntry, qint64 count, qint64 *imported)
+{
+    if (imported) {
+        *imported = 0;
+    }
+    
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "Failed to open archive:" << path;
+        return false;
+    }
+    
+    Header header;
+    if (!readHeader(file, header)) {
+        return false;
+    }
+    
+    DerivedKeys keys = KeyDerivation::derive(passphrase, header.salt, header.kdf);
+    if (!keys.isValid()) {
+        qWarning() << "Failed to derive archive key";
+        return false;
+    }
+    const QByteArray key = keys.masterKey;
+    
+    // Partial restores jump straight to the chunk holding firstEntry
+    quint64 chunk = 0;
+    qint64 chunkFirst = 0;
+    if (firstEntry > 0) {
+        QList<ChunkLocation> chunks;
+        if (!readIndex(file, key, header, chunks)) {
+            return false;
+        }
+        
+        qint64 offset = header.bytes.size();
+        for (int i = 0; i < chunks.size() && chunks[i].firstEntry <= firstEntry; ++i) {
+            chunk = quint64(i);
+            chunkFirst = chunks[i].firstEntry;
+            offset = chunks[i].offset;
+        }
+        
+        if (!file.seek(offset)) {
+            qWarning() << "Archive index points outside the file";
+            return false;
+        }
+    }
+    
+    const qint64 endEntry = count < 0 ? std::numeric_limits<qint64>::max() : firstEntry + count;
+    
+    struct PendingChunk
+    {
+        QFuture<OpenedChunk> future;
+        quint64 chunk;
+        qint64 firstEntry;
+    };
+    
+    QQueue<PendingChunk> pending;
+    const int window = qMax(2, QThread::idealThreadCount());
+    qint64 total = 0;
+    
+    // Chunks are opened in parallel; entries are added in archive order, one transaction per chunk
+    auto applyNext = [&]() -> bool {
+        PendingChunk next = pending.dequeue();
+        OpenedChunk opened = next.future.result();
+        if (!opened.ok) {
+            qWarning() << "Archive chunk" << next.chunk << "failed to authenticate (wrong passphrase or corrupted file)";
+            return false;
+        }
+        
+        qint64 from = qMax<qint64>(0, firstEntry - next.firstEntry);
+        qint64 to = qMin<qint64>(opened.entries.size(), endEntry - next.firstEntry);
+        if (from >= to) {
+            return true;
+        }
+        
+        QList<PlainEntry> entries = opened.entries.mid(from, to - from);
+        bool imported = db->importEntries(entries);
+        qint64 importedCount = entries.size();
+        
+        // Release the shared copies first so the wipe reaches the decrypted data itself
+        entries.clear();
+        for (PlainEntry &entry : opened.entries) {
+            SecretBuffer::wipe(entry.password);
+        }
+        
+        if (!imported) {
+            qWarning() << "Failed to import archive chunk" << next.chunk;
+            return false;
+        }
+        total += importedCount;
+        return true;
+    };
+    
+    bool ok = true;
+    bool finalSeen = false;
+    while (ok && !finalSeen && chunkFirst < endEntry) {
+        QByteArray frame = file.read(FRAME_HEADER_SIZE);
+        if (frame.size() != FRAME_HEADER_SIZE) {
+            qWarning() << "Archive is truncated before chunk" << chunk;
+            ok = false;
+            break;
+        }
+        
+        QDataStream in(frame);
+        quint32 length = 0;
+        quint32 entryCount = 0;
+        quint64 index = 0;
+        quint8 lastChunk = 0;
+        in >> length >> entryCount >> index >> lastChunk;
+        
+        if (index != chunk || length < quint32(TAG_SIZE) || length > quint32(MAX_CHUNK_SIZE)) {
+            qWarning() << "Archive chunk" << chunk << "has an invalid frame";
+            ok = false;
+            break;
+        }
+        
+        QByteArray ciphertext = file.read(length);
+        if (ciphertext.size() != int(length)) {
+            qWarning() << "Archive is truncated in chunk" << chunk;
+            ok = false;
+            break;
+        }
+        
+        PendingChunk next;
+        next.chunk = chunk;
+        next.firstEntry = chunkFirst;
+        next.future = QtConcurrent::run([key, header, chunk, frame, ciphertext]() {
+            return openChunk(key, header, chunk, frame, ciphertext);
+        });
+        pending.enqueue(next);
+        
+        // Counts are checked when the frame authenticates
+        finalSeen = lastChunk != 0;
+        chunkFirst += entryCount;
+        chunk++;
+        
+        if (pending.size() >= window) {
+            ok = applyNext();
+        }
+    }
+    
+    while (ok && !pending.isEmpty()) {
+        ok = applyNext();
+    }
+    for (PendingChunk &next : pending) {
+        next.future.waitForFinished();
+    }
+    
+    if (imported) {
+        *imported = total;
+    }
+    
+    if (ok) {
+        qDebug() << "Imported" << total << "entries from" << path;
+    }
+    return ok;
+}
+
+QByteArray VaultArchive::headerBytes(const KdfParams &kdf, const QByteArray &salt, const QByteArray &noncePrefix)
+{
+    QByteArray header;
+    QDataStream out(&header, QIODevice::WriteOnly);
+    out.writeRawData(ARCHIVE_MAGIC, MAGIC_SIZE);
+    out << FORMAT_VERSION << quint16(0)
+        << quint8(kdf.cost) << quint8(kdf.blockSize) << quint8(kdf.parallelism) << quint8(0);
+    out.writeRawData(salt.constData(), salt.size());
+    out.writeRawData(noncePrefix.constData(), noncePrefix.size());
+    out << quint32(CHUNK_ENTRIES);
+    return header;
+}
+
+bool VaultArchive::readHeader(QFile &file, Header &header)
+{
+    header.bytes = file.read(HEADER_SIZE);
+    if (header.bytes.size() != HEADER_SIZE || !header.bytes.startsWith(QByteArray(ARCHIVE_MAGIC, MAGIC_SIZE))) {
+        qWarning() << "Not a vault archive:" << file.fileName();
+        return false;
+    }
+    
+    QDataStream in(header.bytes);
+    in.skipRawData(MAGIC_SIZE);
+    
+    quint16 version = 0;
+    quint16 flags = 0;
+    quint8 cost = 0;
+    quint8 blockSize = 0;
+    quint8 parallelism = 0;
+    quint8 reserved = 0;
+    in >> version >> flags >> cost >> blockSize >> parallelism >> reserved;
+    
+    if (version != FORMAT_VERSION) {
+        qWarning() << "Unsupported vault archive version:" << version;
+        return false;
+    }
+    
+    // Bounded like account parameters, so a crafted header cannot demand gigabytes of scrypt memory
+    if (cost < KeyDerivation::MIN_COST || cost > KeyDerivation::MAX_COST ||
+        blockSize < 1 || blockSize > 32 || parallelism < 1 || parallelism > 16) {
+        qWarning() << "Vault archive has invalid key derivation parameters";
+        return false;
+    }
+    
+    header.kdf.algorithm = QStringLiteral("scrypt");
+    header.kdf.cost = cost;
+    header.kdf.blockSize = blockSize;
+    header.kdf.parallelism = parallelism;
+    header.salt = header.bytes.mid(MAGIC_SIZE + 8, SALT_SIZE);
+    header.noncePrefix = header.bytes.mid(MAGIC_SIZE + 8 + SALT_SIZE, NONCE_PREFIX_SIZE);
+    return true;
+}
+
+bool VaultArchive::readIndex(QFile &file, const QByteArray &key, const Header &header, QList<ChunkLocation> &chunks)
+{
+    chunks.clear();
+    
+    qint64 size = file.size();
+    if (size < HEADER_SIZE + TRAILER_SIZE || !file.seek(size - TRAILER_SIZE)) {
+        qWarning() << "Vault archive has no index";
+        return false;
+    }
+    
+    QByteArray trailer = file.read(TRAILER_SIZE);
+    QDataStream trailerIn(trailer);
+    quint64 indexOffset = 0;
+    trailerIn >> indexOffset;
+    
+    if (trailer.mid(8) != QByteArray(END_MAGIC, MAGIC_SIZE) ||
+        indexOffset < quint64(HEADER_SIZE) || indexOffset + 4 > quint64(size - TRAILER_SIZE) ||
+        !file.seek(qint64(indexOffset))) {
+        qWarning() << "Vault archive has no index";
+        return false;
+    }
+    
+    QByteArray lengthBytes = file.read(4);
+    QDataStream lengthIn(lengthBytes);
+    quint32 length = 0;
+    lengthIn >> length;
+    
+    if (quint64(length) > quint64(size - TRAILER_SIZE) - indexOffset - 4) {
+        qWarning() << "Vault archive index is corrupted";
+        return false;
+    }
+    
+    QByteArray index;
+    QByteArray aad = header.bytes + QByteArray(INDEX_MAGIC, MAGIC_SIZE);
+    if (!gcmOpen(key, nonce(header.noncePrefix, INDEX_CHUNK), aad, file.read(length), index, TAG_SIZE)) {
+        qWarning() << "Vault archive index failed to authenticate (wrong passphrase or corrupted file)";
+        return false;
+    }
+    
+    QDataStream in(index);
+    quint64 count = 0;
+    in >> count;
+    if (quint64(index.size()) != 8 + count * 16) {
+        qWarning() << "Vault archive index is corrupted";
+        return false;
+    }
+    
+    for (quint64 i = 0; i < count; ++i) {
+        quint64 offset = 0;
+        quint64 first = 0;
+        in >> offset >> first;
+        
+        ChunkLocation location;
+        location.offset = qint64(offset);
+        location.firstEntry = qint64(first);
+        chunks.append(location);
+    }
+    
+    return true;
+}
+
+QByteArray VaultArchive::frameHeader(quint32 length, quint32 entryCount, quint64 chunk, bool lastChunk)
+{
+    QByteArray frame;
+    QDataStream out(&frame, QIODevice::WriteOnly);
+    out << length << entryCount << chunk << quint8(lastChunk ? 1 : 0);
+    return frame;
+}
+
+QByteArray VaultArchive::nonce(const QByteArray &prefix, quint64 chunk)
+{
+    // Unique per chunk under a key that is unique per archive
+    QByteArray iv = prefix;
+    iv.resize(prefix.size() + 8);
+    qToBigEndian(chunk, iv.data() + prefix.size());
+    return iv;
+}
+
+QByteArray VaultArchive::sealChunk(Database *db, const QByteArray &key, const Header &header,
+                                   quint64 chunk, bool lastChunk, const QList<PasswordEntry> &entries)
+{
+    QByteArray plaintext;
+    {
+        QDataStream out(&plaintext, QIODevice::WriteOnly);
+        out.setVersion(STREAM_VERSION);
+        for (const PasswordEntry &entry : entries) {
+            SecretBuffer password = db->decryptSecret(entry.encryptedPassword, entry.passwordContext);
+            QString plainPassword = password.toString();
+            out << entry.name << entry.url << entry.username << plainPassword << entry.note;
+            SecretBuffer::wipe(plainPassword);
+        }
+    }
+    
+    QByteArray frame = frameHeader(quint32(plaintext.size() + TAG_SIZE), quint32(entries.size()), chunk, lastChunk);
+    int frameSize = frame.size();
+    frame.resize(frameSize + plaintext.size() + TAG_SIZE);
+    
+    bool ok = gcmSeal(key, nonce(header.noncePrefix, chunk), header.bytes + frame.left(frameSize),
+                      plaintext, frame.data() + frameSize, TAG_SIZE);
+    OPENSSL_cleanse(plaintext.data(), plaintext.size());
+    
+    return ok ? frame : QByteArray();
+}
+
+VaultArchive::OpenedChunk VaultArchive::openChunk(const QByteArray &key, const Header &header, quint64 chunk,
+                                                  const QByteArray &frame, const QByteArray &ciphertext)
+{
+    OpenedChunk opened;
+    
+    QByteArray plaintext;
+    if (!gcmOpen(key, nonce(header.noncePrefix, chunk), header.bytes + frame, ciphertext, plaintext, TAG_SIZE)) {
+        return opened;
+    }
+    
+    QDataStream frameIn(frame);
+    quint32 length = 0;
+    quint32 entryCount = 0;
+    frameIn >> length >> entryCount;
+    
+    QDataStream in(plaintext);
+    in.setVersion(STREAM_VERSION);
+    for (quint32 i = 0; i < entryCount; ++i) {
+        PlainEntry entry;
+        in >> entry.name >> entry.url >> entry.username >> entry.password >> entry.note;
+        if (in.status() != QDataStream::Ok) {
+            break;
+        }
+        opened.entries.append(entry);
+    }
+    
+    opened.ok = in.status() == QDataStream::Ok && in.atEnd() && opened.entries.size() == int(entryCount);
+    if (!opened.ok) {
+        opened.entries.clear();
+    }
+    OPENSSL_cleanse(plaintext.data(), plaintext.size());
+    return opened;
+}
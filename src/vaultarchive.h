@@ -0,0 +1,79 @@
+#ifndef VAULTARCHIVE_H
+#define VAULTARCHIVE_H
+
+#include <QString>
+#include <QByteArray>
+#include <QList>
+#include <QFile>
+#include "database.h"
+#include "keyderivation.h"
+
+// Portable, passphrase-protected vault export.
+//
+// Layout: a plaintext header (magic, version, scrypt parameters, salt, nonce
+// prefix), then a sequence of chunks of up to CHUNK_ENTRIES entries, each sealed
+// independently with AES-256-GCM, then a sealed index of chunk offsets. Every chunk
+// authenticates the header and its own frame (index, entry count, final flag),
+// so chunks cannot be reordered, swapped between archives or dropped from the
+// end. Chunks are sealed and opened in parallel while the file streams, which
+// keeps memory bounded by a few chunks regardless of vault size.
+//
+// All calls block and derive a key with scrypt; run them off the GUI thread.
+class VaultArchive
+{
+public:
+    static const int CHUNK_ENTRIES = 1024;
+    
+    static bool exportVault(Database *db, const QString &path, const QString &passphrase, qint64 *exported = nullptr);
+    
+    // Adds every archived entry to the current user's vault, committing per chunk
+    static bool importVault(Database *db, const QString &path, const QString &passphrase, qint64 *imported = nullptr);
+    
+    // Adds archived entries [firstEntry, firstEntry + count); only the chunks covering the range are read
+    static bool restoreRange(Database *db, const QString &path, const QString &passphrase,
+                             qint64 firstEntry, qint64 count, qint64 *imported = nullptr);
+
+private:
+    struct Header
+    {
+        KdfParams kdf;
+        QByteArray salt;
+        QByteArray noncePrefix;
+        QByteArray bytes; // as written, authenticated by every chunk
+    };
+    
+    struct ChunkLocation
+    {
+        qint64 offset = 0;
+        qint64 firstEntry = 0;
+    };
+    
+    struct OpenedChunk
+    {
+        bool ok = false;
+        QList<PlainEntry> entries;
+    };
+    
+    static const int SALT_SIZE = 32;
+    static const int NONCE_PREFIX_SIZE = 4;
+    static const int TAG_SIZE = 16;
+    static const int FRAME_HEADER_SIZE = 17;             // length, entry count, chunk index, final flag
+    static const int MAX_CHUNK_SIZE = 64 * 1024 * 1024;  // rejects corrupt lengths before allocating
+    
+    static bool restore(Database *db, const QString &path, const QString &passphrase,
+                        qint64 firstEntry, qint64 count, qint64 *imported);
+    
+    static QByteArray headerBytes(const KdfParams &kdf, const QByteArray &salt, const QByteArray &noncePrefix);
+    static bool readHeader(QFile &file, Header &header);
+    static bool readIndex(QFile &file, const QByteArray &key, const Header &header, QList<ChunkLocation> &chunks);
+    static QByteArray frameHeader(quint32 length, quint32 entryCount, quint64 chunk, bool lastChunk);
+    static QByteArray nonce(const QByteArray &prefix, quint64 chunk);
+    
+    // Run on pool threads
+    static QByteArray sealChunk(Database *db, const QByteArray &key, const Header &header,
+                                quint64 chunk, bool lastChunk, const QList<PasswordEntry> &entries);
+    static OpenedChunk openChunk(const QByteArray &key, const Header &header, quint64 chunk,
+                                 const QByteArray &frame, const QByteArray &ciphertext);
+};
+
+#endif // VAULTARCHIVE_H
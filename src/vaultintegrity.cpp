@@ -0,0 +1,116 @@
+#include "vaultintegrity.h"
+#include "connectionpool.h"
+#include <QMessageAuthenticationCode>
+#include <QCryptographicHash>
+#include <QtEndian>
+#include <QDebug>
+#include <openssl/crypto.h>
+#include <sqlite3.h>
+
+namespace {
+void integrityLeaf(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    QVariantList values;
+    values.reserve(argc);
+    for (int i = 0; i < argc; ++i) {
+        switch (sqlite3_value_type(argv[i])) {
+        case SQLITE_INTEGER:
+            values.append(qint64(sqlite3_value_int64(argv[i])));
+            break;
+        case SQLITE_NULL:
+            values.append(QByteArray());
+            break;
+        default: {
+            // Text and blobs both hash their bytes, as Qt reads them back
+            const char *data = static_cast<const char *>(sqlite3_value_blob(argv[i]));
+            values.append(QByteArray(data, sqlite3_value_bytes(argv[i])));
+            break;
+        }
+        }
+    }
+    sqlite3_result_int64(context, VaultIntegrity::leaf(values));
+}
+}
+
+QByteArray VaultIntegrity::deriveKey(const QByteArray &masterKey)
+{
+    // Separate from the encryption and index keys, like BlindIndex::deriveKey
+    return QMessageAuthenticationCode::hash(QByteArrayLiteral("PasswordManager integrity root v1"),
+                                            masterKey, QCryptographicHash::Sha256);
+}
+
+QByteArray VaultIntegrity::seal(const QByteArray &key, int userId, qint64 leafSum, qint64 leafCount)
+{
+    // Fixed-width fields, so no two roots share a message
+    QByteArray message(4 + 8 + 8, 0);
+    qToBigEndian<qint32>(userId, message.data());
+    qToBigEndian<qint64>(leafSum, message.data() + 4);
+    qToBigEndian<qint64>(leafCount, message.data() + 12);
+    
+    return QMessageAuthenticationCode::hash(message, key, QCryptographicHash::Sha256);
+}
+
+bool VaultIntegrity::verifySeal(const QByteArray &key, int userId, qint64 leafSum, qint64 leafCount, const QByteArray &stored)
+{
+    QByteArray expected = seal(key, userId, leafSum, leafCount);
+    return stored.size() == expected.size() &&
+           CRYPTO_memcmp(stored.constData(), expected.constData(), size_t(expected.size())) == 0;
+}
+
+QByteArray VaultIntegrity::fieldContext(int userId, const QByteArray &uuid, const char *field)
+{
+    // Length-prefixed uuid, so the field name cannot run into it
+    QByteArray context(4 + 2, 0);
+    qToBigEndian<qint32>(userId, context.data());
+    qToBigEndian<quint16>(quint16(uuid.size()), context.data() + 4);
+    context.append(uuid);
+    context.append(field);
+    return context;
+}
+
+qint64 VaultIntegrity::leaf(const QVariantList &values)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    for (const QVariant &value : values) {
+        const int type = value.typeId();
+        if (!value.isNull() && (type == QMetaType::LongLong || type == QMetaType::Int)) {
+            char encoded[1 + 8];
+            encoded[0] = 'i';
+            qToBigEndian<qint64>(value.toLongLong(), encoded + 1);
+            hash.addData(QByteArrayView(encoded, sizeof(encoded)));
+        } else {
+            const QByteArray bytes = value.isNull() ? QByteArray() : value.toByteArray();
+            char prefix[1 + 4];
+            prefix[0] = 'b';
+            qToBigEndian<quint32>(quint32(bytes.size()), prefix + 1);
+            hash.addData(QByteArrayView(prefix, sizeof(prefix)));
+            hash.addData(bytes);
+        }
+    }
+    
+    // 40 bits keep the sum of any realistic number of leaves within an SQLite integer
+    QByteArray digest = hash.result();
+    return qint64(qFromBigEndian<quint64>(digest.constData()) >> 24);
+}
+
+bool VaultIntegrity::installFunctions(const QSqlDatabase &db)
+{
+    sqlite3 *handle = ConnectionPool::nativeHandle(db);
+    if (!handle) {
+        qWarning() << "Integrity triggers need the raw SQLite handle";
+        return false;
+    }
+    
+    // Triggers may only call innocuous functions when the schema is not trusted
+    int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+#ifdef SQLITE_INNOCUOUS
+    flags |= SQLITE_INNOCUOUS;
+#endif
+    
+    if (sqlite3_create_function_v2(handle, "integrity_leaf", -1, flags, nullptr, integrityLeaf,
+                                   nullptr, nullptr, nullptr) != SQLITE_OK) {
+        qWarning() << "Failed to register integrity_leaf:" << sqlite3_errmsg(handle);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,70 @@
+#ifndef VAULTINTEGRITY_H
+#define VAULTINTEGRITY_H
+
+#include <QByteArray>
+#include <QString>
+#include <QList>
+#include <QVariantList>
+#include <QSqlDatabase>
+
+// One row that failed verification
+struct IntegrityProblem
+{
+    int id = -1; // -1 for problems with the root rather than a row
+    QString reason;
+};
+
+// Result of an integrity check of one account
+struct IntegrityReport
+{
+    enum RootStatus {
+        RootIntact = 0,   // seal matches the stored root
+        RootUnsealed = 1, // no seal yet (new vault, or written before integrity roots)
+        RootMismatch = 2  // the root changed without the vault key, or the seal was damaged
+    };
+    
+    RootStatus rootStatus = RootUnsealed;
+    bool completed = false;
+    qint64 rowsChecked = 0;
+    qint64 elapsedMs = 0;
+    QList<IntegrityProblem> problems;
+    
+    bool isClean() const { return completed && rootStatus == RootIntact && problems.isEmpty(); }
+};
+
+// Sealed root over the stored ciphertext of an account.
+//
+// The root is a sum of leaves and the entry count: one leaf per entry, hashed by
+// the triggers from the row's ciphertext columns, and one per note. This is an
+// additive digest rather than a hash tree, so it locates nothing by itself; the
+// full check does that by authenticating every row. Triggers keep it up to date
+// on every insert, update and delete, so it costs O(1) per write, and
+// every commit made by the application reseals it with an HMAC under a key
+// derived from the vault key, provided the seal still matched when the commit's
+// transaction began. A row changed through any other path (another tool, a
+// damaged page, a restored file) leaves a root whose seal no longer matches,
+// which a single row read detects, and that stays so until the user accepts
+// the current rows after a full check.
+class VaultIntegrity
+{
+public:
+    static const int SEAL_SIZE = 32;
+    
+    static QByteArray deriveKey(const QByteArray &masterKey);
+    static QByteArray seal(const QByteArray &key, int userId, qint64 leafSum, qint64 leafCount);
+    static bool verifySeal(const QByteArray &key, int userId, qint64 leafSum, qint64 leafCount, const QByteArray &seal);
+    
+    // GCM additional data of one encrypted field of an entry. The root only proves
+    // that the set of rows is unchanged; this keeps a field's ciphertext from being
+    // moved to another field, entry or account without failing authentication.
+    static QByteArray fieldContext(int userId, const QByteArray &uuid, const char *field);
+    
+    // Leaf of one row: integers and byte strings (NULL as empty) are tagged and
+    // length-prefixed, hashed with SHA-256 and truncated to 40 bits like the sync hashes
+    static qint64 leaf(const QVariantList &values);
+    
+    // Registers integrity_leaf(), which the root triggers call, on a connection that writes
+    static bool installFunctions(const QSqlDatabase &db);
+};
+
+#endif // VAULTINTEGRITY_H
@@ -0,0 +1,143 @@
+#include "vaultset.h"
+#include <QFileInfo>
+#include <QtConcurrent>
+#include <QDebug>
+#include <algorithm>
+
+VaultSet::~VaultSet()
+{
+    // Owned vaults wait for their queued writes as they are destroyed
+    vaults.clear();
+}
+
+void VaultSet::addVault(const QString &label, Database *db)
+{
+    Vault vault;
+    vault.label = label;
+    vault.db = db;
+    vaults.push_back(std::move(vault));
+}
+
+bool VaultSet::open(const QString &label, const QString &path, const QString &username, const QString &password)
+{
+    if (vault(label) || containsPath(path)) {
+        qWarning() << "Vault is already open:" << label << path;
+        return false;
+    }
+    
+    // Database creates missing files; an additional vault has to exist already
+    if (!QFileInfo::exists(path)) {
+        qWarning() << "Vault file does not exist:" << path;
+        return false;
+    }
+    
+    auto db = std::make_unique<Database>(path);
+    if (!db->waitUntilReady() || !db->validateUser(username, password)) {
+        qWarning() << "Failed to unlock vault:" << path;
+        return false;
+    }
+    
+    Vault vault;
+    vault.label = label;
+    vault.db = db.get();
+    vault.owned = std::move(db);
+    vaults.push_back(std::move(vault));
+    
+    qDebug() << "Opened vault" << label << "from" << path;
+    return true;
+}
+
+void VaultSet::close(const QString &label)
+{
+    vaults.erase(std::remove_if(vaults.begin(), vaults.end(), [&label](const Vault &vault) {
+        return vault.label == label;
+    }), vaults.end());
+}
+
+QStringList VaultSet::labels() const
+{
+    QStringList result;
+    for (const Vault &vault : vaults) {
+        result.append(vault.label);
+    }
+    return result;
+}
+
+Database *VaultSet::vault(const QString &label) const
+{
+    for (const Vault &vault : vaults) {
+        if (vault.label == label) {
+            return vault.db;
+        }
+    }
+    return nullptr;
+}
+
+bool VaultSet::containsPath(const QString &path) const
+{
+    const QString canonical = QFileInfo(path).canonicalFilePath();
+    for (const Vault &vault : vaults) {
+        if (QFileInfo(vault.db->databasePath()).canonicalFilePath() == canonical) {
+            return true;
+        }
+    }
+    return false;
+}
+
+QFuture<QList<VaultMatch>> VaultSet::search(const QString &text)
+{
+    // Every vault searches on its own read connections at the same time
+    QList<QPair<QString, QFuture<QList<PasswordEntry>>>> searches;
+    for (const Vault &vault : vaults) {
+        searches.append(qMakePair(vault.label, vault.db->getPasswordEntriesAsync(text)));
+    }
+    
+    return QtConcurrent::run([searches, text]() {
+        QList<VaultMatch> matches;
+        for (const auto &search : searches) {
+            const QList<PasswordEntry> entries = search.second.result();
+            for (const PasswordEntry &entry : entries) {
+                VaultMatch match;
+                match.vault = search.first;
+                match.entry = entry;
+                match.score = rank(text, entry);
+                matches.append(match);
+            }
+        }
+        
+        // Stable, so equally good matches keep vault order after the name order
+        std::stable_sort(matches.begin(), matches.end(), [](const VaultMatch &a, const VaultMatch &b) {
+            if (a.score != b.score) {
+                return a.score > b.score;
+            }
+            return a.entry.name.compare(b.entry.name, Qt::CaseInsensitive) < 0;
+        });
+        return matches;
+    });
+}
+
+int VaultSet::rank(const QString &search, const PasswordEntry &entry)
+{
+    const QString query = search.trimmed().toCaseFolded();
+    if (query.isEmpty()) {
+        return 0;
+    }
+    
+    const QString name = entry.name.toCaseFolded();
+    if (name == query) {
+        return 5;
+    }
+    if (name.startsWith(query)) {
+        return 4;
+    }
+    if (name.contains(query)) {
+        return 3;
+    }
+    if (entry.url.toCaseFolded().contains(query)) {
+        return 2;
+    }
+    if (entry.username.toCaseFolded().contains(query)) {
+        return 1;
+    }
+    return 0;
+}
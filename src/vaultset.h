@@ -0,0 +1,57 @@
+#ifndef VAULTSET_H
+#define VAULTSET_H
+
+#include <QString>
+#include <QStringList>
+#include <QFuture>
+#include <memory>
+#include <vector>
+#include "database.h"
+
+// One result of a search across vaults
+struct VaultMatch
+{
+    QString vault;
+    PasswordEntry entry;
+    int score = 0;
+};
+
+// Several vault files open side by side (personal, team, archive...). Every
+// vault is its own Database with its own connections, writer thread and key.
+// Searches query all of them in parallel and merge the results by rank.
+class VaultSet
+{
+public:
+    VaultSet() = default;
+    ~VaultSet();
+    
+    // A vault that is already unlocked and owned elsewhere, like the main window's
+    void addVault(const QString &label, Database *db);
+    
+    // Opens and unlocks an existing vault file; blocks for the key derivation
+    bool open(const QString &label, const QString &path, const QString &username, const QString &password);
+    void close(const QString &label);
+    
+    QStringList labels() const;
+    Database *vault(const QString &label) const;
+    bool containsPath(const QString &path) const;
+    
+    // Results of all vaults, best match first; entries keep their vault's ids
+    QFuture<QList<VaultMatch>> search(const QString &text);
+    
+    // How well an entry matches the search text: exact name, name prefix, name,
+    // url, username; 0 for entries that only matched through search tokens
+    static int rank(const QString &search, const PasswordEntry &entry);
+
+private:
+    struct Vault
+    {
+        QString label;
+        Database *db = nullptr;
+        std::unique_ptr<Database> owned;
+    };
+    
+    std::vector<Vault> vaults;
+};
+
+#endif // VAULTSET_H
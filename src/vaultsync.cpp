@@ -0,0 +1,564 @@
+#include "vaultsync.h"
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QSet>
+#include <QtEndian>
+#include <QDebug>
+#include <openssl/rand.h>
+#include <atomic>
+#include "database.h"
+#include "schemamigrations.h"
+#include "vaultintegrity.h"
+
+namespace {
+const int UUID_SIZE = 16;
+
+std::atomic<int> connectionCounter(0);
+
+// Top 40 bits of the digest
+qint64 truncatedHash(QCryptographicHash &hash)
+{
+    QByteArray digest = hash.result();
+    return qint64(qFromBigEndian<quint64>(digest.constData()) >> 24);
+}
+}
+
+int VaultSync::bucketOf(const QByteArray &uuid)
+{
+    if (uuid.size() < 2) {
+        return 0;
+    }
+    
+    // uuids are random, so their leading bits spread entries evenly
+    quint16 prefix = qFromBigEndian<quint16>(uuid.constData());
+    return prefix >> (16 - BUCKET_BITS);
+}
+
+qint64 VaultSync::entryHash(const QByteArray &name, const QByteArray &url, const QByteArray &username,
+                            const QByteArray &password, const QByteArray &note, const QByteArray &fields)
+{
+    // Length-prefixed so field boundaries cannot shift between two different rows
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    for (const QByteArray *field : {&name, &url, &username, &password, &note}) {
+        quint32 length = qToBigEndian<quint32>(quint32(field->size()));
+        hash.addData(QByteArrayView(reinterpret_cast<const char *>(&length), sizeof(length)));
+        hash.addData(*field);
+    }
+    
+    // Only hashed when present, so rows without custom fields keep the hashes they had
+    if (!fields.isEmpty()) {
+        quint32 length = qToBigEndian<quint32>(quint32(fields.size()));
+        hash.addData(QByteArrayView(reinterpret_cast<const char *>(&length), sizeof(length)));
+        hash.addData(fields);
+    }
+    return truncatedHash(hash);
+}
+
+qint64 VaultSync::tombstoneHash(const QByteArray &uuid)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    hash.addData(QByteArrayLiteral("deleted:"));
+    hash.addData(uuid);
+    return truncatedHash(hash);
+}
+
+QByteArray VaultSync::generateUuid()
+{
+    QByteArray uuid(UUID_SIZE, 0);
+    RAND_bytes(reinterpret_cast<unsigned char *>(uuid.data()), UUID_SIZE);
+    return uuid;
+}
+
+bool VaultSync::sync(QSqlDatabase local, QSqlDatabase remote, const QString &username, SyncStats *stats)
+{
+    QElapsedTimer timer;
+    timer.start();
+    
+    SyncStats result;
+    
+    QString localVerifier;
+    QString remoteVerifier;
+    int localUserId = findUser(local, username, &localVerifier);
+    int remoteUserId = findUser(remote, username, &remoteVerifier);
+    
+    if (localUserId <= 0 || remoteUserId <= 0) {
+        qWarning() << "Account" << username << "does not exist in both vaults";
+        return false;
+    }
+    
+    // Same verifier means same salt, KDF and password, hence the same vault key
+    if (localVerifier != remoteVerifier) {
+        qWarning() << "Vaults are protected by different credentials and cannot be merged";
+        return false;
+    }
+    
+    // Entry ciphertext is bound to the account id, so it only authenticates under the same id
+    if (localUserId != remoteUserId) {
+        qWarning() << "Account" << username << "has a different id in the other vault; its entries cannot be merged";
+        return false;
+    }
+    
+    QList<BucketDigest> localBuckets;
+    QList<BucketDigest> remoteBuckets;
+    if (!readBuckets(local, localUserId, localBuckets) || !readBuckets(remote, remoteUserId, remoteBuckets)) {
+        return false;
+    }
+    
+    const QList<int> buckets = differingBuckets(buildTree(localBuckets), buildTree(remoteBuckets), &result.nodesCompared);
+    result.bucketsDiffering = buckets.size();
+    
+    QList<QByteArray> pull;
+    QList<QByteArray> push;
+    for (int bucket : buckets) {
+        QHash<QByteArray, Leaf> localLeaves;
+        QHash<QByteArray, Leaf> remoteLeaves;
+        if (!readLeaves(local, localUserId, bucket, localLeaves) ||
+            !readLeaves(remote, remoteUserId, bucket, remoteLeaves)) {
+            return false;
+        }
+        
+        for (auto it = localLeaves.constBegin(); it != localLeaves.constEnd(); ++it) {
+            auto other = remoteLeaves.constFind(it.key());
+            if (other == remoteLeaves.constEnd()) {
+                push.append(it.key());
+            } else if (other->hash != it->hash) {
+                if (newer(*it, *other)) {
+                    push.append(it.key());
+                } else {
+                    pull.append(it.key());
+                }
+            }
+        }
+        
+        for (auto it = remoteLeaves.constBegin(); it != remoteLeaves.constEnd(); ++it) {
+            if (!localLeaves.contains(it.key())) {
+                pull.append(it.key());
+            }
+        }
+    }
+    
+    if (!apply(remote, remoteUserId, local, localUserId, pull) ||
+        !apply(local, localUserId, remote, remoteUserId, push)) {
+        return false;
+    }
+    
+    result.pulled = pull.size();
+    result.pushed = push.size();
+    result.elapsedMs = timer.elapsed();
+    
+    qDebug() << "Sync compared" << result.nodesCompared << "tree nodes," << result.bucketsDiffering
+             << "buckets differed; pulled" << result.pulled << "pushed" << result.pushed
+             << "in" << result.elapsedMs << "ms";
+    
+    if (stats) {
+        *stats = result;
+    }
+    return true;
+}
+
+bool VaultSync::syncWithFile(QSqlDatabase local, const QString &remotePath, const QString &username, SyncStats *stats)
+{
+    QString connectionName = QStringLiteral("PasswordManager-sync-%1").arg(connectionCounter.fetch_add(1));
+    bool success = false;
+    {
+        QSqlDatabase remote;
+        if (openVault(remote, connectionName, remotePath)) {
+            success = sync(local, remote, username, stats);
+        }
+        remote.close();
+    }
+    QSqlDatabase::removeDatabase(connectionName);
+    return success;
+}
+
+bool VaultSync::syncFiles(const QString &localPath, const QString &remotePath, const QString &username, SyncStats *stats)
+{
+    QString connectionName = QStringLiteral("PasswordManager-sync-%1").arg(connectionCounter.fetch_add(1));
+    bool success = false;
+    {
+        QSqlDatabase local;
+        if (openVault(local, connectionName, localPath)) {
+            success = syncWithFile(local, remotePath, username, stats);
+        }
+        local.close();
+    }
+    QSqlDatabase::removeDatabase(connectionName);
+    return success;
+}
+
+bool VaultSync::openVault(QSqlDatabase &db, const QString &connectionName, const QString &path)
+{
+    db = QSqlDatabase::addDatabase("QSQLITE", connectionName);
+    db.setDatabaseName(path);
+    db.setConnectOptions("QSQLITE_BUSY_TIMEOUT=5000");
+    
+    if (!db.open()) {
+        qWarning() << "Failed to open vault" << path << ":" << db.lastError().text();
+        return false;
+    }
+    
+    QSqlQuery pragma(db);
+    pragma.exec("PRAGMA foreign_keys = ON");
+    
+    // The other copy may come from an older build
+    return VaultIntegrity::installFunctions(db) && SchemaMigrations::migrate(db);
+}
+
+int VaultSync::findUser(QSqlDatabase db, const QString &username, QString *verifier)
+{
+    QSqlQuery query(db);
+    query.prepare("SELECT id, password FROM users WHERE username = ?");
+    query.addBindValue(username);
+    
+    if (!query.exec() || !query.next()) {
+        return -1;
+    }
+    
+    *verifier = query.value(1).toString();
+    return query.value(0).toInt();
+}
+
+bool VaultSync::readBuckets(QSqlDatabase db, int userId, QList<BucketDigest> &buckets)
+{
+    buckets = QList<BucketDigest>(BUCKET_COUNT);
+    
+    // Both sums come straight from the covering indexes; only BUCKET_COUNT rows reach Qt
+    const QStringList sources = {"passwords", "tombstones"};
+    for (const QString &table : sources) {
+        QSqlQuery query(db);
+        query.prepare(QStringLiteral("SELECT sync_bucket, SUM(sync_hash), COUNT(*) FROM %1 "
+                                     "WHERE user_id = ? GROUP BY sync_bucket").arg(table));
+        query.addBindValue(userId);
+        
+        if (!query.exec()) {
+            qWarning() << "Failed to read sync buckets:" << query.lastError().text();
+            return false;
+        }
+        
+        while (query.next()) {
+            int bucket = query.value(0).toInt();
+            if (bucket < 0 || bucket >= BUCKET_COUNT) {
+                continue;
+            }
+            buckets[bucket].sum += query.value(1).toLongLong();
+            buckets[bucket].count += query.value(2).toLongLong();
+        }
+    }
+    
+    return true;
+}
+
+VaultSync::MerkleTree VaultSync::buildTree(const QList<BucketDigest> &buckets)
+{
+    MerkleTree tree;
+    
+    QList<QByteArray> level;
+    level.reserve(buckets.size());
+    for (const BucketDigest &bucket : buckets) {
+        QByteArray digest(16, 0);
+        qToBigEndian(bucket.sum, digest.data());
+        qToBigEndian(bucket.count, digest.data() + 8);
+        level.append(digest);
+    }
+    tree.append(level);
+    
+    while (tree.last().size() > 1) {
+        const QList<QByteArray> &children = tree.last();
+        QList<QByteArray> parents;
+        for (int i = 0; i < children.size(); i += FAN_OUT) {
+            QCryptographicHash hash(QCryptographicHash::Sha256);
+            for (int j = i; j < qMin(i + FAN_OUT, int(children.size())); ++j) {
+                hash.addData(children[j]);
+            }
+            parents.append(hash.result());
+        }
+        tree.append(parents);
+    }
+    
+    return tree;
+}
+
+QList<int> VaultSync::differingBuckets(const MerkleTree &local, const MerkleTree &remote, int *nodesCompared)
+{
+    // Walk down from the root, expanding only nodes whose hashes differ
+    QList<int> nodes = {0};
+    for (int level = local.size() - 1; level >= 0 && !nodes.isEmpty(); --level) {
+        QList<int> differing;
+        for (int node : std::as_const(nodes)) {
+            (*nodesCompared)++;
+            if (local[level][node] != remote[level][node]) {
+                differing.append(node);
+            }
+        }
+        
+        if (level == 0) {
+            return differing;
+        }
+        
+        nodes.clear();
+        for (int node : std::as_const(differing)) {
+            for (int child = node * FAN_OUT; child < qMin((node + 1) * FAN_OUT, int(local[level - 1].size())); ++child) {
+                nodes.append(child);
+            }
+        }
+    }
+    
+    return QList<int>();
+}
+
+bool VaultSync::readLeaves(QSqlDatabase db, int userId, int bucket, QHash<QByteArray, Leaf> &leaves)
+{
+    QSqlQuery query(db);
+    query.prepare("SELECT uuid, sync_hash, updated_at, 0 FROM passwords WHERE user_id = ? AND sync_bucket = ? "
+                  "UNION ALL "
+                  "SELECT uuid, sync_hash, deleted_at, 1 FROM tombstones WHERE user_id = ? AND sync_bucket = ?");
+    query.addBindValue(userId);
+    query.addBindValue(bucket);
+    query.addBindValue(userId);
+    query.addBindValue(bucket);
+    
+    if (!query.exec()) {
+        qWarning() << "Failed to read sync leaves:" << query.lastError().text();
+        return false;
+    }
+    
+    while (query.next()) {
+        Leaf leaf;
+        leaf.hash = query.value(1).toLongLong();
+        leaf.changedAt = query.value(2).toString();
+        leaf.deleted = query.value(3).toBool();
+        leaves.insert(query.value(0).toByteArray(), leaf);
+    }
+    
+    return true;
+}
+
+bool VaultSync::newer(const Leaf &a, const Leaf &b)
+{
+    if (a.changedAt != b.changedAt) {
+        return a.changedAt > b.changedAt;
+    }
+    
+    if (a.deleted != b.deleted) {
+        return a.deleted;
+    }
+    
+    // Same second on both sides: any rule both sides agree on will do
+    return a.hash > b.hash;
+}
+
+bool VaultSync::apply(QSqlDatabase source, int sourceUserId, QSqlDatabase target, int targetUserId,
+                      const QList<QByteArray> &uuids)
+{
+    if (uuids.isEmpty()) {
+        return true;
+    }
+    
+    QSqlQuery selectEntry(source);
+    selectEntry.prepare("SELECT p.id, p.name, p.url, p.username, p.password, p.note_size, p.encrypted_fields, "
+                        "p.created_at, p.updated_at, p.sync_bucket, p.sync_hash, n.note, n.dictionary_id, p.fields "
+                        "FROM passwords p LEFT JOIN entry_notes n ON n.password_id = p.id "
+                        "WHERE p.uuid = ? AND p.user_id = ?");
+    QSqlQuery selectDictionary(source);
+    selectDictionary.prepare("SELECT dictionary, bound FROM note_dictionaries WHERE id = ?");
+    QSqlQuery selectTokens(source);
+    selectTokens.prepare("SELECT token FROM search_tokens WHERE password_id = ?");
+    QSqlQuery selectTombstone(source);
+    selectTombstone.prepare("SELECT sync_bucket, sync_hash, deleted_at FROM tombstones WHERE uuid = ? AND user_id = ?");
+    
+    QSqlQuery findEntry(target);
+    findEntry.prepare("SELECT id FROM passwords WHERE uuid = ?");
+    QSqlQuery insertEntry(target);
+    insertEntry.prepare("INSERT INTO passwords (user_id, uuid, name, url, username, password, note_size, encrypted_fields, "
+                        "created_at, updated_at, sync_bucket, sync_hash, fields) "
+                        "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+    QSqlQuery updateEntry(target);
+    updateEntry.prepare("UPDATE passwords SET name = ?, url = ?, username = ?, password = ?, note_size = ?, encrypted_fields = ?, "
+                        "updated_at = ?, sync_hash = ?, fields = ? WHERE id = ?");
+    QSqlQuery storeNote(target);
+    storeNote.prepare("INSERT INTO entry_notes (password_id, dictionary_id, note) VALUES (?, ?, ?) "
+                      "ON CONFLICT(password_id) DO UPDATE SET dictionary_id = excluded.dictionary_id, note = excluded.note");
+    QSqlQuery deleteNote(target);
+    deleteNote.prepare("DELETE FROM entry_notes WHERE password_id = ?");
+    QSqlQuery insertDictionary(target);
+    insertDictionary.prepare("INSERT OR IGNORE INTO note_dictionaries (id, user_id, dictionary, bound) VALUES (?, ?, ?, ?)");
+    QSqlQuery deleteEntry(target);
+    deleteEntry.prepare("DELETE FROM passwords WHERE id = ?");
+    QSqlQuery clearTokens(target);
+    clearTokens.prepare("DELETE FROM search_tokens WHERE password_id = ?");
+    QSqlQuery insertToken(target);
+    insertToken.prepare("INSERT INTO search_tokens (user_id, token, password_id) VALUES (?, ?, ?)");
+    QSqlQuery deleteTombstone(target);
+    deleteTombstone.prepare("DELETE FROM tombstones WHERE uuid = ?");
+    QSqlQuery insertTombstone(target);
+    insertTombstone.prepare("INSERT OR REPLACE INTO tombstones (uuid, user_id, sync_bucket, sync_hash, deleted_at) "
+                            "VALUES (?, ?, ?, ?, ?)");
+    QSqlQuery insertChange(target);
+    insertChange.prepare("INSERT INTO changes (user_id, password_id, change_type) VALUES (?, ?, ?)");
+    
+    // Compressed notes need their dictionary; it is encrypted with the key both copies share
+    QSet<qint64> copiedDictionaries;
+    auto copyDictionary = [&](qint64 id) {
+        if (id <= 0 || copiedDictionaries.contains(id)) {
+            return true;
+        }
+        
+        selectDictionary.addBindValue(id);
+        if (!selectDictionary.exec() || !selectDictionary.next()) {
+            return false;
+        }
+        
+        insertDictionary.addBindValue(id);
+        insertDictionary.addBindValue(targetUserId);
+        insertDictionary.addBindValue(selectDictionary.value(0));
+        insertDictionary.addBindValue(selectDictionary.value(1));
+        selectDictionary.finish();
+        if (!insertDictionary.exec()) {
+            return false;
+        }
+        
+        copiedDictionaries.insert(id);
+        return true;
+    };
+    
+    auto recordChange = [&](int passwordId, EntryChange::Type type) {
+        insertChange.addBindValue(targetUserId);
+        insertChange.addBindValue(passwordId);
+        insertChange.addBindValue(int(type));
+        return insertChange.exec();
+    };
+    
+    // Copies one entry or tombstone from source over whatever target holds for the uuid
+    auto applyOne = [&](const QByteArray &uuid) -> bool {
+        findEntry.addBindValue(uuid);
+        if (!findEntry.exec()) {
+            return false;
+        }
+        int targetId = findEntry.next() ? findEntry.value(0).toInt() : -1;
+        findEntry.finish();
+        
+        selectEntry.addBindValue(uuid);
+        selectEntry.addBindValue(sourceUserId);
+        if (!selectEntry.exec()) {
+            return false;
+        }
+        
+        if (!selectEntry.next()) {
+            selectEntry.finish();
+            
+            selectTombstone.addBindValue(uuid);
+            selectTombstone.addBindValue(sourceUserId);
+            if (!selectTombstone.exec() || !selectTombstone.next()) {
+                return false;
+            }
+            
+            insertTombstone.addBindValue(uuid);
+            insertTombstone.addBindValue(targetUserId);
+            insertTombstone.addBindValue(selectTombstone.value(0));
+            insertTombstone.addBindValue(selectTombstone.value(1));
+            insertTombstone.addBindValue(selectTombstone.value(2));
+            selectTombstone.finish();
+            if (!insertTombstone.exec()) {
+                return false;
+            }
+            
+            if (targetId < 0) {
+                return true;
+            }
+            
+            clearTokens.addBindValue(targetId);
+            deleteEntry.addBindValue(targetId);
+            return clearTokens.exec() && deleteEntry.exec() && recordChange(targetId, EntryChange::Deleted);
+        }
+        
+        int sourceId = selectEntry.value(0).toInt();
+        QVariant note = selectEntry.value(11);
+        QVariant dictionaryId = selectEntry.value(12);
+        EntryChange::Type type = EntryChange::Updated;
+        
+        if (targetId >= 0) {
+            for (int column = 1; column <= 6; ++column) {
+                updateEntry.addBindValue(selectEntry.value(column));
+            }
+            updateEntry.addBindValue(selectEntry.value(8));
+            updateEntry.addBindValue(selectEntry.value(10));
+            updateEntry.addBindValue(selectEntry.value(13));
+            updateEntry.addBindValue(targetId);
+            if (!updateEntry.exec()) {
+                return false;
+            }
+        } else {
+            insertEntry.addBindValue(targetUserId);
+            insertEntry.addBindValue(uuid);
+            for (int column = 1; column <= 10; ++column) {
+                insertEntry.addBindValue(selectEntry.value(column));
+            }
+            insertEntry.addBindValue(selectEntry.value(13));
+            if (!insertEntry.exec()) {
+                return false;
+            }
+            targetId = insertEntry.lastInsertId().toInt();
+            type = EntryChange::Added;
+        }
+        selectEntry.finish();
+        
+        if (note.isNull()) {
+            deleteNote.addBindValue(targetId);
+            if (!deleteNote.exec()) {
+                return false;
+            }
+        } else {
+            storeNote.addBindValue(targetId);
+            storeNote.addBindValue(dictionaryId);
+            storeNote.addBindValue(note);
+            if (!copyDictionary(dictionaryId.isNull() ? 0 : dictionaryId.toLongLong()) || !storeNote.exec()) {
+                return false;
+            }
+        }
+        
+        // Tokens are keyed by the vault key both copies share, so they carry over unchanged
+        clearTokens.addBindValue(targetId);
+        deleteTombstone.addBindValue(uuid);
+        selectTokens.addBindValue(sourceId);
+        if (!clearTokens.exec() || !deleteTombstone.exec() || !selectTokens.exec()) {
+            return false;
+        }
+        
+        while (selectTokens.next()) {
+            insertToken.addBindValue(targetUserId);
+            insertToken.addBindValue(selectTokens.value(0));
+            insertToken.addBindValue(targetId);
+            if (!insertToken.exec()) {
+                return false;
+            }
+        }
+        selectTokens.finish();
+        
+        return recordChange(targetId, type);
+    };
+    
+    for (int start = 0; start < uuids.size(); start += BATCH_SIZE) {
+        if (!target.transaction()) {
+            qWarning() << "Failed to start sync transaction:" << target.lastError().text();
+            return false;
+        }
+        
+        for (int i = start; i < qMin(start + BATCH_SIZE, int(uuids.size())); ++i) {
+            if (!applyOne(uuids[i])) {
+                qWarning() << "Failed to merge entry:" << target.lastError().text();
+                target.rollback();
+                return false;
+            }
+        }
+        
+        if (!target.commit()) {
+            qWarning() << "Failed to commit sync batch:" << target.lastError().text();
+            target.rollback();
+            return false;
+        }
+    }
+    
+    return true;
+}
@@ -0,0 +1,95 @@
+#ifndef VAULTSYNC_H
+#define VAULTSYNC_H
+
+#include <QSqlDatabase>
+#include <QString>
+#include <QByteArray>
+#include <QList>
+#include <QHash>
+
+// Counters of one sync run, for the status bar and the command line
+struct SyncStats
+{
+    int nodesCompared = 0;
+    int bucketsDiffering = 0;
+    int pulled = 0; // changes applied to the local vault
+    int pushed = 0; // changes applied to the other vault
+    qint64 elapsedMs = 0;
+};
+
+// Two-way merge of two copies of the same vault.
+//
+// Every entry carries a random uuid and a leaf hash of its stored ciphertext;
+// deleted entries leave a tombstone with its own leaf hash. Leaves fall into
+// BUCKET_COUNT buckets by uuid, and each bucket's digest (sum and count of its
+// leaf hashes) is computed by SQLite from a covering index. A Merkle tree with
+// fan-out 16 is built over the bucket digests of each side, and only buckets
+// under differing subtrees are read leaf by leaf. Conflicts go to the newer
+// change; a deletion wins a tie.
+//
+// Rows are copied as ciphertext together with their search tokens, notes and
+// note dictionaries, so both vaults must be unlocked by the same credentials and
+// hold the account under the same id (entry ciphertext is bound to it), which
+// holds for copies of one vault file.
+class VaultSync
+{
+public:
+    static const int BUCKET_BITS = 12;
+    static const int BUCKET_COUNT = 1 << BUCKET_BITS;
+    static const int BATCH_SIZE = 500;
+    
+    // Leaf values stored in the passwords and tombstones tables. Hashes are
+    // 40 bits so SQLite can sum a bucket of millions without overflowing.
+    static int bucketOf(const QByteArray &uuid);
+    static qint64 entryHash(const QByteArray &name, const QByteArray &url, const QByteArray &username,
+                            const QByteArray &password, const QByteArray &note, const QByteArray &fields = QByteArray());
+    static qint64 tombstoneHash(const QByteArray &uuid);
+    static QByteArray generateUuid();
+    
+    // Merges the account username of both databases; both must be at the latest schema
+    static bool sync(QSqlDatabase local, QSqlDatabase remote, const QString &username, SyncStats *stats = nullptr);
+    
+    // Opens and migrates the other vault file, then merges it with local
+    static bool syncWithFile(QSqlDatabase local, const QString &remotePath, const QString &username,
+                             SyncStats *stats = nullptr);
+    
+    // Same for two vault files, neither of them open; for tools and scripted checks
+    static bool syncFiles(const QString &localPath, const QString &remotePath, const QString &username,
+                          SyncStats *stats = nullptr);
+
+private:
+    struct BucketDigest
+    {
+        qint64 sum = 0;
+        qint64 count = 0;
+        
+        bool operator==(const BucketDigest &other) const { return sum == other.sum && count == other.count; }
+        bool operator!=(const BucketDigest &other) const { return !(*this == other); }
+    };
+    
+    struct Leaf
+    {
+        qint64 hash = 0;
+        QString changedAt;
+        bool deleted = false;
+    };
+    
+    // Node hashes level by level, leaves (bucket digests) first, root last
+    typedef QList<QList<QByteArray>> MerkleTree;
+    
+    static const int FAN_OUT = 16;
+    
+    static int findUser(QSqlDatabase db, const QString &username, QString *verifier);
+    static bool openVault(QSqlDatabase &db, const QString &connectionName, const QString &path);
+    static bool readBuckets(QSqlDatabase db, int userId, QList<BucketDigest> &buckets);
+    static MerkleTree buildTree(const QList<BucketDigest> &buckets);
+    static QList<int> differingBuckets(const MerkleTree &local, const MerkleTree &remote, int *nodesCompared);
+    static bool readLeaves(QSqlDatabase db, int userId, int bucket, QHash<QByteArray, Leaf> &leaves);
+    static bool newer(const Leaf &a, const Leaf &b);
+    
+    // Copies the listed uuids from source to target in BATCH_SIZE transactions
+    static bool apply(QSqlDatabase source, int sourceUserId, QSqlDatabase target, int targetUserId,
+                      const QList<QByteArray> &uuids);
+};
+
+#endif // VAULTSYNC_H